@@ -0,0 +1,371 @@
+/*
+	benchmark of the file system on a RAM-backed partition (RamPartition), so that the results measure the file system rather than
+	the disk: sequential and random reads/writes with several I/O sizes, small-file create/delete, doesExist/open latency versus
+	the number of files in the root directory, and how reads/writes and open/append/close cycles scale with the number of threads;
+	usage: benchmark [format options [number of clusters [results.csv]]] - every result is printed as a row of a table, and also
+	written as a line of the CSV file, if one is given
+*/
+#include "fs.h"
+#include "file.h"
+#include "rampartition.h"
+#include <Windows.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+const BytesCnt IO_SIZES[] = { 512, 4 * 1024, 64 * 1024, 1024 * 1024 };
+const unsigned int NUM_OF_IO_SIZES = sizeof(IO_SIZES) / sizeof(IO_SIZES[0]);
+const BytesCnt SEQUENTIAL_FILE_SIZE = 32 * 1024 * 1024;
+const BytesCnt RANDOM_FILE_SIZE = 16 * 1024 * 1024;
+const unsigned long RANDOM_OPS = 4000; // per I/O size
+const unsigned long SMALL_FILES = 2000;
+const BytesCnt SMALL_FILE_SIZE = 1024;
+const unsigned long DIRECTORY_SIZES[] = { 16, 256, 4096 };
+const unsigned int NUM_OF_DIRECTORY_SIZES = sizeof(DIRECTORY_SIZES) / sizeof(DIRECTORY_SIZES[0]);
+const unsigned long LOOKUPS = 2000; // per directory size
+const unsigned int THREAD_COUNTS[] = { 1, 2, 4, 8 };
+const unsigned int NUM_OF_THREAD_COUNTS = sizeof(THREAD_COUNTS) / sizeof(THREAD_COUNTS[0]);
+const BytesCnt THREAD_FILE_SIZE = 8 * 1024 * 1024; // written and then read by every thread
+const BytesCnt THREAD_IO_SIZE = 64 * 1024;
+const unsigned long THREAD_CYCLES = 2000; // open/append/close (and open/close) cycles of every thread
+const BytesCnt APPEND_SIZE = 4 * 1024; // appended by every cycle, so that the appends keep allocating clusters
+const ClusterNo DEFAULT_NUM_OF_CLUSTERS = 128 * 1024; // 256MB
+
+// results of a single benchmark
+struct Result {
+	const char* name;
+	unsigned int threads;
+	BytesCnt ioSize; // bytes per operation (0 - the operations transfer no data)
+	BytesCnt bytes; // bytes transferred by all of the operations
+	double seconds; // wall-clock time of the whole benchmark
+	std::vector<double> latencies; // of every operation, in microseconds
+};
+
+static LARGE_INTEGER frequency;
+static unsigned int formatOptions;
+static FILE* csv = nullptr;
+
+// current time in microseconds
+static double now() {
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart * 1000000.0 / frequency.QuadPart;
+}
+
+// xorshift generator - the same sequence on every platform, unlike rand()
+static unsigned long long nextRandom(unsigned long long& state) {
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+// latency below which the given fraction of the (sorted) latencies falls
+static double percentile(const std::vector<double>& latencies, double fraction) {
+	if (latencies.empty()) return 0;
+	size_t index = (size_t)(fraction * latencies.size());
+	return latencies[std::min(index, latencies.size() - 1)];
+}
+
+static void report(Result& result) {
+	std::sort(result.latencies.begin(), result.latencies.end());
+	double opsPerSecond = result.latencies.size() / result.seconds;
+	double megabytesPerSecond = result.bytes / (1024.0 * 1024.0) / result.seconds;
+	double p50 = percentile(result.latencies, 0.50), p90 = percentile(result.latencies, 0.90), p99 = percentile(result.latencies, 0.99),
+		p999 = percentile(result.latencies, 0.999), max = result.latencies.empty() ? 0 : result.latencies.back();
+	printf("%-14s %3u %8lu %10.1f %11.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n", result.name, result.threads, result.ioSize,
+		megabytesPerSecond, opsPerSecond, p50, p90, p99, p999, max);
+	if (csv != nullptr)
+		fprintf(csv, "%s,%u,%u,%lu,%lu,%lu,%.6f,%.3f,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f\n", result.name, formatOptions, result.threads,
+			result.ioSize, (unsigned long)result.latencies.size(), result.bytes, result.seconds, megabytesPerSecond, opsPerSecond,
+			p50, p90, p99, p999, max);
+}
+
+// a failed open or write would leave the benchmark timing operations that do nothing, so either of them aborts the run
+static File* openFile(char* fname, char mode) {
+	File* file = FS::open(fname, mode);
+	if (file == nullptr) {
+		printf("cannot open %s (mode %c)\n", fname, mode);
+		exit(1);
+	}
+	return file;
+}
+
+static void writeTo(File* file, char* fname, BytesCnt size, char* buffer) {
+	if (file->write(size, buffer) == 0) {
+		printf("cannot write %lu bytes to %s\n", size, fname);
+		exit(1);
+	}
+}
+
+// writes the whole file (through a fresh 'w' open) ioSize bytes at a time, and then syncs it - closing a file leaves its dirty clusters
+// to the flusher thread, so the time of the benchmark includes writing them back only through File::sync
+static void writeFile(char* fname, BytesCnt fileSize, BytesCnt ioSize, Result& result) {
+	std::vector<char> buffer(ioSize, 'b');
+	File* file = openFile(fname, 'w');
+	for (BytesCnt written = 0; written < fileSize; written += ioSize) {
+		double start = now();
+		writeTo(file, fname, ioSize, buffer.data());
+		result.latencies.push_back(now() - start);
+	}
+	file->sync();
+	delete file;
+	result.bytes += fileSize;
+}
+
+static void readFile(char* fname, BytesCnt ioSize, Result& result) {
+	std::vector<char> buffer(ioSize);
+	File* file = openFile(fname, 'r');
+	while (true) {
+		double start = now();
+		BytesCnt read = file->read(ioSize, buffer.data());
+		if (read == 0) break;
+		result.latencies.push_back(now() - start);
+		result.bytes += read;
+	}
+	delete file;
+}
+
+static void sequential() {
+	char fname[] = "/seq.b";
+	for (unsigned int i = 0; i < NUM_OF_IO_SIZES; i++) {
+		Result write = { "seq-write", 1, IO_SIZES[i], 0, 0 };
+		double start = now();
+		writeFile(fname, SEQUENTIAL_FILE_SIZE, IO_SIZES[i], write);
+		write.seconds = (now() - start) / 1000000;
+		report(write);
+		Result read = { "seq-read", 1, IO_SIZES[i], 0, 0 };
+		start = now();
+		readFile(fname, IO_SIZES[i], read);
+		read.seconds = (now() - start) / 1000000;
+		report(read);
+		FS::deleteFile(fname);
+	}
+}
+
+static void randomAccess() {
+	char fname[] = "/rand.b";
+	Result fill = { "rand-fill", 1, 1024 * 1024, 0, 0 };
+	writeFile(fname, RANDOM_FILE_SIZE, 1024 * 1024, fill);
+	unsigned long long state = 0x9E3779B97F4A7C15ULL;
+	for (unsigned int i = 0; i < NUM_OF_IO_SIZES; i++) {
+		BytesCnt ioSize = IO_SIZES[i];
+		std::vector<char> buffer(ioSize, 'r');
+		for (int pass = 0; pass < 2; pass++) { // reads, then writes (in place, through an 'm' open)
+			Result result = { pass == 0 ? "rand-read" : "rand-write", 1, ioSize, 0, 0 };
+			File* file = openFile(fname, pass == 0 ? 'r' : 'm');
+			double start = now();
+			for (unsigned long op = 0; op < RANDOM_OPS; op++) {
+				BytesCnt position = (nextRandom(state) % (RANDOM_FILE_SIZE / ioSize)) * ioSize;
+				double opStart = now();
+				file->seek(position);
+				if (pass == 0)
+					file->read(ioSize, buffer.data());
+				else
+					writeTo(file, fname, ioSize, buffer.data());
+				result.latencies.push_back(now() - opStart);
+				result.bytes += ioSize;
+			}
+			if (pass == 1)
+				file->sync(); // the clusters written are on the partition before the clock stops
+			delete file;
+			result.seconds = (now() - start) / 1000000;
+			report(result);
+		}
+	}
+	FS::deleteFile(fname);
+}
+
+static void smallFiles() {
+	std::vector<char> buffer(SMALL_FILE_SIZE, 's');
+	char fname[16];
+	Result create = { "small-create", 1, SMALL_FILE_SIZE, 0, 0 };
+	double start = now();
+	for (unsigned long fileNo = 0; fileNo < SMALL_FILES; fileNo++) {
+		sprintf(fname, "/s%lu.b", fileNo);
+		double opStart = now();
+		File* file = openFile(fname, 'w');
+		writeTo(file, fname, SMALL_FILE_SIZE, buffer.data());
+		delete file;
+		create.latencies.push_back(now() - opStart);
+		create.bytes += SMALL_FILE_SIZE;
+	}
+	create.seconds = (now() - start) / 1000000;
+	report(create);
+	Result deletion = { "small-delete", 1, 0, 0, 0 };
+	start = now();
+	for (unsigned long fileNo = 0; fileNo < SMALL_FILES; fileNo++) {
+		sprintf(fname, "/s%lu.b", fileNo);
+		double opStart = now();
+		FS::deleteFile(fname);
+		deletion.latencies.push_back(now() - opStart);
+	}
+	deletion.seconds = (now() - start) / 1000000;
+	report(deletion);
+}
+
+// doesExist (of existing and of missing files) and open+close latency, as the root directory grows
+static void lookups() {
+	char fname[16];
+	unsigned long numOfFiles = 0;
+	unsigned long long state = 0x2545F4914F6CDD1DULL;
+	for (unsigned int i = 0; i < NUM_OF_DIRECTORY_SIZES; i++) {
+		for (; numOfFiles < DIRECTORY_SIZES[i]; numOfFiles++) {
+			sprintf(fname, "/d%lu.b", numOfFiles);
+			delete openFile(fname, 'w');
+		}
+		printf("directory of %lu files:\n", numOfFiles);
+		Result hit = { "exists-hit", 1, 0, 0, 0 }, miss = { "exists-miss", 1, 0, 0, 0 }, openClose = { "open-close", 1, 0, 0, 0 };
+		Result* results[] = { &hit, &miss, &openClose };
+		for (int kind = 0; kind < 3; kind++) {
+			Result& result = *results[kind];
+			double start = now();
+			for (unsigned long lookup = 0; lookup < LOOKUPS; lookup++) {
+				unsigned long fileNo = nextRandom(state) % numOfFiles;
+				sprintf(fname, (kind == 1) ? "/m%lu.b" : "/d%lu.b", fileNo);
+				double opStart = now();
+				if (kind == 2)
+					delete openFile(fname, 'r');
+				else
+					FS::doesExist(fname);
+				result.latencies.push_back(now() - opStart);
+			}
+			result.seconds = (now() - start) / 1000000;
+			report(result);
+		}
+	}
+	for (unsigned long fileNo = 0; fileNo < numOfFiles; fileNo++) {
+		sprintf(fname, "/d%lu.b", fileNo);
+		FS::deleteFile(fname);
+	}
+}
+
+// work of a single thread of a scaling benchmark - on a file of its own, so the threads contend only for the file system's shared state
+struct ThreadWork {
+	unsigned int threadNo;
+	bool write;
+	Result result;
+};
+
+static DWORD WINAPI transfer(LPVOID param) {
+	ThreadWork* work = (ThreadWork*)param;
+	char fname[16];
+	sprintf(fname, "/t%u.b", work->threadNo);
+	if (work->write)
+		writeFile(fname, THREAD_FILE_SIZE, THREAD_IO_SIZE, work->result);
+	else
+		readFile(fname, THREAD_IO_SIZE, work->result);
+	return 0;
+}
+
+// open/append/close cycles (write), or open/close cycles of the file appended to (read)
+static DWORD WINAPI cycle(LPVOID param) {
+	ThreadWork* work = (ThreadWork*)param;
+	char fname[16];
+	sprintf(fname, "/c%u.b", work->threadNo);
+	std::vector<char> buffer(APPEND_SIZE, 'c');
+	for (unsigned long cycleNo = 0; cycleNo < THREAD_CYCLES; cycleNo++) {
+		double start = now();
+		File* file = FS::open(fname, work->write ? 'a' : 'r');
+		if (file == nullptr) // the first append creates the file
+			file = openFile(fname, 'w');
+		if (work->write) {
+			writeTo(file, fname, APPEND_SIZE, buffer.data());
+			work->result.bytes += APPEND_SIZE;
+		}
+		delete file;
+		work->result.latencies.push_back(now() - start);
+	}
+	return 0;
+}
+
+// runs body on numOfThreads threads at once, and reports all of their operations as one result
+static void runThreads(const char* name, unsigned int numOfThreads, BytesCnt ioSize, LPTHREAD_START_ROUTINE body, bool write) {
+	std::vector<ThreadWork> works(numOfThreads);
+	std::vector<HANDLE> threads(numOfThreads);
+	double start = now();
+	for (unsigned int threadNo = 0; threadNo < numOfThreads; threadNo++) {
+		works[threadNo].threadNo = threadNo;
+		works[threadNo].write = write;
+		threads[threadNo] = CreateThread(NULL, 0, body, &works[threadNo], 0, NULL);
+	}
+	for (unsigned int threadNo = 0; threadNo < numOfThreads; threadNo++) {
+		WaitForSingleObject(threads[threadNo], INFINITE);
+		CloseHandle(threads[threadNo]);
+	}
+	Result result = { name, numOfThreads, ioSize, 0, (now() - start) / 1000000 };
+	for (unsigned int threadNo = 0; threadNo < numOfThreads; threadNo++) {
+		result.bytes += works[threadNo].result.bytes;
+		result.latencies.insert(result.latencies.end(), works[threadNo].result.latencies.begin(), works[threadNo].result.latencies.end());
+	}
+	report(result);
+}
+
+static void scaling() {
+	char fname[16];
+	for (unsigned int i = 0; i < NUM_OF_THREAD_COUNTS; i++) {
+		unsigned int numOfThreads = THREAD_COUNTS[i];
+		runThreads("mt-write", numOfThreads, THREAD_IO_SIZE, transfer, true);
+		runThreads("mt-read", numOfThreads, THREAD_IO_SIZE, transfer, false); // of the files just written
+		for (unsigned int threadNo = 0; threadNo < numOfThreads; threadNo++) {
+			sprintf(fname, "/t%u.b", threadNo);
+			FS::deleteFile(fname);
+		}
+	}
+	for (unsigned int i = 0; i < NUM_OF_THREAD_COUNTS; i++) {
+		unsigned int numOfThreads = THREAD_COUNTS[i];
+		runThreads("mt-append", numOfThreads, APPEND_SIZE, cycle, true);
+		runThreads("mt-open-close", numOfThreads, 0, cycle, false);
+		for (unsigned int threadNo = 0; threadNo < numOfThreads; threadNo++) {
+			sprintf(fname, "/c%u.b", threadNo);
+			FS::deleteFile(fname);
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	formatOptions = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 0;
+	ClusterNo numOfClusters = (argc > 2) ? strtoul(argv[2], nullptr, 0) : DEFAULT_NUM_OF_CLUSTERS;
+	if (argc > 3) {
+		csv = fopen(argv[3], "w");
+		if (csv == nullptr) {
+			printf("cannot open %s\n", argv[3]);
+			return 1;
+		}
+		fprintf(csv, "benchmark,format_options,threads,io_size,ops,bytes,seconds,mb_per_s,ops_per_s,p50_us,p90_us,p99_us,p999_us,max_us\n");
+	}
+	QueryPerformanceFrequency(&frequency);
+	// Partition's constructor still wants an ini file - one describing an empty partition, since the data is kept in memory;
+	// it is kept in the temporary directory, along with the partition file it names, and both are removed on exit
+	char tempPath[MAX_PATH], ini[MAX_PATH], data[MAX_PATH];
+	GetTempPathA(MAX_PATH, tempPath);
+	sprintf(ini, "%sbenchmark.ini", tempPath);
+	sprintf(data, "%sbenchmark.dat", tempPath);
+	FILE* iniFile = fopen(ini, "w");
+	fprintf(iniFile, "%s\n0\n", data);
+	fclose(iniFile);
+	RamPartition* partition = new RamPartition(ini, numOfClusters);
+	if (FS::mount(partition) == 0 || FS::format(formatOptions) == 0) {
+		printf("cannot mount/format the partition\n");
+		delete partition;
+		DeleteFileA(data);
+		DeleteFileA(ini);
+		return 1;
+	}
+	printf("format options %u, %lu clusters\n", formatOptions, numOfClusters);
+	printf("%-14s %3s %8s %10s %11s %10s %10s %10s %10s %10s\n", "benchmark", "thr", "io size", "MB/s", "ops/s",
+		"p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+	sequential();
+	randomAccess();
+	smallFiles();
+	lookups();
+	scaling();
+	FS::unmount();
+	delete partition;
+	DeleteFileA(data);
+	DeleteFileA(ini);
+	if (csv != nullptr)
+		fclose(csv);
+	return 0;
+}
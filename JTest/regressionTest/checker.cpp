@@ -0,0 +1,124 @@
+/*
+	the consistency check finds damage done to the partition behind the file system's back, counting every kind of it, and its repair
+	leaves the partition consistent: a partition gets a taken bit of a free cluster (a leaked cluster), a free bit of a file's data
+	cluster (a lost one) and an index entry past the end of the partition (whose data cluster leaks) while it is not mounted, and,
+	once it is repaired, a cluster shared with a clone gets a reference dropped while it is mounted (a wrong reference count)
+*/
+#include"regressiontest.h"
+#include<cstring>
+#include<vector>
+
+static char damagedFile[] = "/damaged.dat", cloneFile[] = "/clone.dat";
+const unsigned long DAMAGED_CLUSTERS = 10; // the file's data clusters (mapped through a single level 2 index cluster)
+const BytesCnt DAMAGED_SIZE = DAMAGED_CLUSTERS * ClusterSize;
+const ClusterNo BIT_VECTOR_CLUSTER = 1; // the bit vector follows the superblock, a set bit evidenting a free cluster
+const ClusterNo LEAKED_CLUSTER = PARTITION_SIZE - 1; // free, as the files are far smaller than the partition
+const ClusterNo BAD_CLUSTER = PARTITION_SIZE + 100; // what the file's last index entry gets changed to
+
+static ClusterNo getEntry(const char* cluster, unsigned int entryNo) {
+	const unsigned char* entry = (const unsigned char*)cluster + entryNo * 4;
+	return entry[0] | (entry[1] << 8) | (entry[2] << 16) | ((ClusterNo)entry[3] << 24);
+}
+
+static void setEntry(char* cluster, unsigned int entryNo, ClusterNo clusterNo) {
+	for (int i = 0; i < 4; i++)
+		cluster[entryNo * 4 + i] = (char)((clusterNo >> (8 * i)) & 0xff);
+}
+
+// returns the number of the first cluster past after whose first two index entries are the given ones (0 - there is none)
+static ClusterNo findIndexCluster(Partition* partition, ClusterNo first, ClusterNo second, ClusterNo after) {
+	char buffer[ClusterSize];
+	for (ClusterNo clusterNo = after + 1; clusterNo < partition->getNumOfClusters(); clusterNo++)
+		if (partition->readCluster(clusterNo, buffer) == 1 && getEntry(buffer, 0) == first && getEntry(buffer, 1) == second)
+			return clusterNo;
+	return 0;
+}
+
+// returns the partition's cluster which holds the given data cluster of the damaged file (0 - none does)
+static ClusterNo findDataCluster(Partition* partition, unsigned long clusterIndex) {
+	char cluster[ClusterSize];
+	fillBuffer(cluster, clusterIndex * ClusterSize, ClusterSize, 13);
+	return findCluster(partition, cluster);
+}
+
+static void flipBit(char* bitVectorCluster, ClusterNo clusterNo) {
+	bitVectorCluster[clusterNo / 8] ^= (1 << (clusterNo % 8));
+}
+
+static bool reportMatches(const CheckReport& report, unsigned long leaked, unsigned long lost, unsigned long badReferences,
+	unsigned long wrongReferenceCounts) {
+	CHECK(report.leakedClusters == leaked);
+	CHECK(report.lostClusters == lost);
+	CHECK(report.badReferences == badReferences);
+	CHECK(report.wrongReferenceCounts == wrongReferenceCounts);
+	CHECK(report.crossLinkedClusters == 0);
+	CHECK(report.badFiles == 0);
+	return true;
+}
+
+bool damage(unsigned int formatOptions) {
+	Partition* partition = createPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(FS::format(formatOptions) == 1);
+	CHECK(writeFile(damagedFile, DAMAGED_SIZE, 13));
+	CHECK(FS::unmount() == 1);
+	ClusterNo firstDataCluster = findDataCluster(partition, 0), secondDataCluster = findDataCluster(partition, 1);
+	CHECK(firstDataCluster != 0 && secondDataCluster != 0);
+	ClusterNo indexClusterNo = findIndexCluster(partition, firstDataCluster, secondDataCluster, 0);
+	CHECK(indexClusterNo != 0);
+	char bitVectorCluster[ClusterSize], indexCluster[ClusterSize];
+	CHECK(partition->readCluster(BIT_VECTOR_CLUSTER, bitVectorCluster) == 1);
+	CHECK((bitVectorCluster[LEAKED_CLUSTER / 8] & (1 << (LEAKED_CLUSTER % 8))) != 0);
+	flipBit(bitVectorCluster, LEAKED_CLUSTER); // taken, with nothing referring to it
+	flipBit(bitVectorCluster, firstDataCluster); // free, while the file refers to it
+	CHECK(partition->writeCluster(BIT_VECTOR_CLUSTER, bitVectorCluster) == 1);
+	CHECK(partition->readCluster(indexClusterNo, indexCluster) == 1);
+	setEntry(indexCluster, DAMAGED_CLUSTERS - 1, BAD_CLUSTER); // the last data cluster is no longer referred to
+	CHECK(partition->writeCluster(indexClusterNo, indexCluster) == 1);
+	delete partition;
+	CHECK(runInNewProcess("damage-check", formatOptions));
+	return true;
+}
+
+bool damageCheck(unsigned int formatOptions) {
+	Partition* partition = openPartition();
+	CHECK(FS::mount(partition) == 1); // cleanly unmounted - nothing gets recounted
+	CheckReport report;
+	CHECK(FS::check(report) == FS_INCONSISTENT);
+	CHECK(reportMatches(report, 2, 1, 1, 0));
+	CHECK(FS::check(report, CHECK_REPAIR) == 1);
+	CHECK(reportMatches(report, 2, 1, 1, 0)); // as found before the repair
+	CHECK(FS::check(report) == 1);
+	CHECK(reportMatches(report, 0, 0, 0, 0));
+	// the bad entry has been cleared, leaving a hole in place of the file's last cluster
+	std::vector<char> expected(DAMAGED_SIZE), buffer(DAMAGED_SIZE);
+	fillBuffer(expected.data(), 0, DAMAGED_SIZE, 13);
+	memset(expected.data() + DAMAGED_SIZE - ClusterSize, 0, ClusterSize);
+	File* file = FS::open(damagedFile, 'r');
+	CHECK(file != nullptr);
+	BytesCnt read = file->read(DAMAGED_SIZE, buffer.data());
+	delete file;
+	CHECK(read == DAMAGED_SIZE);
+	CHECK(memcmp(buffer.data(), expected.data(), DAMAGED_SIZE) == 0);
+	// the clone shares the file's data clusters, whose reference counts are kept in memory only - a reference of one of the two
+	// files gets dropped while the partition is mounted
+	CHECK(FS::copyFile(damagedFile, cloneFile, COPY_CLONE) == 1);
+	CHECK(FS::sync() == 1);
+	ClusterNo firstDataCluster = findDataCluster(partition, 0), secondDataCluster = findDataCluster(partition, 1);
+	CHECK(firstDataCluster != 0 && secondDataCluster != 0);
+	ClusterNo indexClusterNo = findIndexCluster(partition, firstDataCluster, secondDataCluster, 0);
+	CHECK(indexClusterNo != 0);
+	CHECK(findIndexCluster(partition, firstDataCluster, secondDataCluster, indexClusterNo) != 0); // the other file's
+	char indexCluster[ClusterSize];
+	CHECK(partition->readCluster(indexClusterNo, indexCluster) == 1);
+	setEntry(indexCluster, 0, 0);
+	CHECK(partition->writeCluster(indexClusterNo, indexCluster) == 1);
+	CHECK(FS::check(report) == FS_INCONSISTENT);
+	CHECK(reportMatches(report, 0, 0, 0, 1));
+	CHECK(FS::check(report, CHECK_REPAIR) == 1);
+	CHECK(FS::check(report) == 1);
+	CHECK(reportMatches(report, 0, 0, 0, 0));
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	return true;
+}
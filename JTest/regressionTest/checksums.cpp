@@ -0,0 +1,73 @@
+/*
+	a data cluster changed on the partition behind the file system's back gets caught by its checksum (on a partition formatted with
+	FORMAT_CHECKSUMS): a new process fails to read it, while the clusters around it read fine, and one which mounts the partition
+	with MOUNT_NO_VERIFY reads the changed contents as they are
+*/
+#include"regressiontest.h"
+#include<cstring>
+#include<vector>
+
+static char corruptedFile[] = "/corrupt.dat";
+const BytesCnt CORRUPTED_SIZE = 40 * 1024;
+const unsigned long CORRUPTED_CLUSTER = 3; // the file's logical cluster which gets changed
+const BytesCnt CORRUPTED_BYTE = CORRUPTED_CLUSTER * ClusterSize + 100;
+
+bool corruption(unsigned int formatOptions) {
+	Partition* partition = createPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(FS::format(formatOptions) == 1);
+	CHECK(writeFile(corruptedFile, CORRUPTED_SIZE, 12));
+	CHECK(FS::unmount() == 1);
+	// a byte of the cluster gets flipped straight on the partition
+	char cluster[ClusterSize];
+	fillBuffer(cluster, CORRUPTED_CLUSTER * ClusterSize, ClusterSize, 12);
+	ClusterNo clusterNo = findCluster(partition, cluster);
+	CHECK(clusterNo != 0);
+	cluster[CORRUPTED_BYTE % ClusterSize] ^= 0xff;
+	CHECK(partition->writeCluster(clusterNo, cluster) == 1);
+	delete partition;
+	CHECK(runInNewProcess("corruption-read", formatOptions));
+	return true;
+}
+
+bool corruptionRead(unsigned int formatOptions) {
+	Partition* partition = openPartition();
+	CHECK(FS::mount(partition) == 1);
+	std::vector<char> expected(CORRUPTED_SIZE), buffer(CORRUPTED_SIZE);
+	fillBuffer(expected.data(), 0, CORRUPTED_SIZE, 12);
+	File* file = FS::open(corruptedFile, 'r');
+	CHECK(file != nullptr);
+	BytesCnt readAll = file->read(CORRUPTED_SIZE, buffer.data());
+	BytesCnt readBefore = (file->seek(0) == 1) ? file->read(CORRUPTED_CLUSTER * ClusterSize, buffer.data()) : 0;
+	bool beforeMatches = memcmp(buffer.data(), expected.data(), CORRUPTED_CLUSTER * ClusterSize) == 0;
+	BytesCnt afterPosition = (CORRUPTED_CLUSTER + 1) * ClusterSize;
+	BytesCnt readAfter = (file->seek(afterPosition) == 1) ? file->read(CORRUPTED_SIZE, buffer.data()) : 0;
+	bool afterMatches = memcmp(buffer.data(), expected.data() + afterPosition, CORRUPTED_SIZE - afterPosition) == 0;
+	delete file;
+	CHECK(readAll == 0);
+	CHECK(readBefore == CORRUPTED_CLUSTER * ClusterSize);
+	CHECK(beforeMatches);
+	CHECK(readAfter == CORRUPTED_SIZE - afterPosition);
+	CHECK(afterMatches);
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	CHECK(runInNewProcess("corruption-noverify", formatOptions));
+	return true;
+}
+
+bool corruptionNoVerify(unsigned int formatOptions) {
+	Partition* partition = openPartition();
+	CHECK(FS::mount(partition, DEFAULT_DRIVE, MOUNT_NO_VERIFY) == 1);
+	std::vector<char> expected(CORRUPTED_SIZE), buffer(CORRUPTED_SIZE);
+	fillBuffer(expected.data(), 0, CORRUPTED_SIZE, 12);
+	expected[CORRUPTED_BYTE] ^= 0xff;
+	File* file = FS::open(corruptedFile, 'r');
+	CHECK(file != nullptr);
+	BytesCnt read = file->read(CORRUPTED_SIZE, buffer.data());
+	delete file;
+	CHECK(read == CORRUPTED_SIZE);
+	CHECK(memcmp(buffer.data(), expected.data(), CORRUPTED_SIZE) == 0);
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	return true;
+}
@@ -0,0 +1,149 @@
+/*
+	compressed files keep their contents across mounts in different processes: a file opened with OPEN_COMPRESSED gets a compressible,
+	an incompressible, an all-zero and a partial group written, takes up fewer clusters than the same contents written uncompressed,
+	gets partial groups overwritten and gets truncated in the middle of a group, and a new process reads it back
+*/
+#include"regressiontest.h"
+#include<cstring>
+#include<vector>
+
+static char compressedFile[] = "/packed.dat", plainFile[] = "/plain.dat";
+const BytesCnt GROUP_SIZE = 8 * ClusterSize; // the compression group (COMPRESSION_GROUP_SIZE clusters)
+const BytesCnt WRITTEN_SIZE = 3 * GROUP_SIZE + 10000; // a compressible, an incompressible and an all-zero group, and a partial one
+const BytesCnt OVERWRITE_POSITION = GROUP_SIZE + 5000, OVERWRITE_SIZE = 3000; // inside of the incompressible group
+const BytesCnt HOLE_POSITION = 2 * GROUP_SIZE + 100, HOLE_SIZE = 50; // inside of the all-zero group
+const BytesCnt TRUNCATE_POSITION = 3 * GROUP_SIZE + 4000, APPENDED_SIZE = 2000; // in the middle of the last group
+
+// runs of 64 equal letters, which compress well
+static void fillCompressible(char* buffer, BytesCnt position, BytesCnt size) {
+	for (BytesCnt i = 0; i < size; i++)
+		buffer[i] = (char)('a' + ((position + i) / 64) % 26);
+}
+
+// bytes which look random, so they do not compress at all
+static void fillIncompressible(char* buffer, BytesCnt position, BytesCnt size) {
+	for (BytesCnt i = 0; i < size; i++) {
+		unsigned int x = (unsigned int)(position + i) * 2654435761u;
+		x ^= x >> 15;
+		x *= 2246822519u;
+		x ^= x >> 13;
+		buffer[i] = (char)x;
+	}
+}
+
+// the file's contents as first written
+static std::vector<char> writtenContents() {
+	std::vector<char> contents(WRITTEN_SIZE, 0);
+	fillCompressible(contents.data(), 0, GROUP_SIZE);
+	fillIncompressible(contents.data() + GROUP_SIZE, GROUP_SIZE, GROUP_SIZE);
+	// the third group stays all zeros
+	fillCompressible(contents.data() + 3 * GROUP_SIZE, 3 * GROUP_SIZE, WRITTEN_SIZE - 3 * GROUP_SIZE);
+	return contents;
+}
+
+// the file's contents once compressionChange has overwritten, truncated and appended to it
+static std::vector<char> changedContents() {
+	std::vector<char> contents = writtenContents();
+	fillCompressible(contents.data() + OVERWRITE_POSITION, OVERWRITE_POSITION, OVERWRITE_SIZE);
+	fillIncompressible(contents.data() + HOLE_POSITION, HOLE_POSITION, HOLE_SIZE);
+	contents.resize(TRUNCATE_POSITION + APPENDED_SIZE);
+	fillIncompressible(contents.data() + TRUNCATE_POSITION, 0, APPENDED_SIZE);
+	return contents;
+}
+
+// writes size bytes of buffer into the file at position
+static bool writeAt(File* file, BytesCnt position, BytesCnt size, char* buffer) {
+	CHECK(file->seek(position) == 1);
+	CHECK(file->write(size, buffer) == 1);
+	return true;
+}
+
+// whether or not the file holds exactly the given contents, read both at once and from the middle of a group on
+static bool fileHolds(char* fname, const std::vector<char>& contents) {
+	BytesCnt size = contents.size();
+	std::vector<char> buffer(size + 1), middle(GROUP_SIZE);
+	File* file = FS::open(fname, 'r');
+	CHECK(file != nullptr);
+	BytesCnt fileSize = file->getFileSize(), read = file->read(size + 1, buffer.data());
+	bool sought = file->seek(GROUP_SIZE + 1000) == 1;
+	BytesCnt readFromMiddle = file->read(GROUP_SIZE, middle.data()); // reaches into the next group
+	bool middleMatches = memcmp(middle.data(), contents.data() + GROUP_SIZE + 1000, GROUP_SIZE) == 0;
+	delete file;
+	CHECK(fileSize == size);
+	CHECK(read == size);
+	CHECK(memcmp(buffer.data(), contents.data(), size) == 0);
+	CHECK(sought);
+	CHECK(readFromMiddle == GROUP_SIZE);
+	CHECK(middleMatches);
+	return true;
+}
+
+bool compression(unsigned int formatOptions) {
+	Partition* partition = createPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(FS::format(formatOptions) == 1);
+	std::vector<char> contents = writtenContents();
+	CheckReport report;
+	CHECK(FS::check(report) == 1);
+	unsigned long formattedClusters = report.referencedClusters;
+	File* file = FS::open(plainFile, 'w');
+	CHECK(file != nullptr);
+	bool written = file->write(WRITTEN_SIZE, contents.data()) == 1;
+	delete file;
+	CHECK(written);
+	CHECK(FS::check(report) == 1);
+	unsigned long plainClusters = report.referencedClusters - formattedClusters;
+	file = FS::open(compressedFile, 'w', OPEN_COMPRESSED);
+	CHECK(file != nullptr);
+	written = file->write(WRITTEN_SIZE, contents.data()) == 1;
+	delete file;
+	CHECK(written);
+	CHECK(FS::check(report) == 1);
+	// the compressible groups shrink and the all-zero one becomes a hole, while the incompressible one is kept as it is
+	unsigned long compressedClusters = report.referencedClusters - formattedClusters - plainClusters;
+	CHECK(compressedClusters >= 8);
+	CHECK(compressedClusters < plainClusters / 2);
+	CHECK(fileHolds(compressedFile, contents));
+	CHECK(FS::deleteFile(plainFile) == 1);
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	CHECK(runInNewProcess("compression-change", formatOptions));
+	return true;
+}
+
+bool compressionChange(unsigned int formatOptions) {
+	Partition* partition = openPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(fileHolds(compressedFile, writtenContents()));
+	std::vector<char> contents = changedContents();
+	File* file = FS::open(compressedFile, 'a');
+	CHECK(file != nullptr);
+	bool changed = writeAt(file, OVERWRITE_POSITION, OVERWRITE_SIZE, contents.data() + OVERWRITE_POSITION)
+		&& writeAt(file, HOLE_POSITION, HOLE_SIZE, contents.data() + HOLE_POSITION)
+		&& file->seek(TRUNCATE_POSITION) == 1 && file->truncate() == 1
+		&& writeAt(file, TRUNCATE_POSITION, APPENDED_SIZE, contents.data() + TRUNCATE_POSITION)
+		&& file->sync() == 1;
+	delete file;
+	CHECK(changed);
+	CHECK(fileHolds(compressedFile, contents));
+	CheckReport report;
+	CHECK(FS::check(report) == 1);
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	CHECK(runInNewProcess("compression-verify", formatOptions));
+	return true;
+}
+
+bool compressionVerify(unsigned int formatOptions) {
+	Partition* partition = openPartition();
+	CHECK(FS::mount(partition) == 1);
+	CheckReport report;
+	CHECK(FS::check(report) == 1);
+	CHECK(fileHolds(compressedFile, changedContents()));
+	// deleting the file frees all of its clusters
+	CHECK(FS::deleteFile(compressedFile) == 1);
+	CHECK(FS::check(report) == 1);
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	return true;
+}
@@ -0,0 +1,103 @@
+/*
+	data clusters shared by several files stay copy-on-write across mounts in different processes: a process which has not made the
+	copy (or has not written the duplicate file, on a partition formatted with FORMAT_DEDUP) writes to (and deletes) one of the
+	files, without changing the other one
+*/
+#include"regressiontest.h"
+#include<cstring>
+
+static char originalFile[] = "/original.dat", copyFile[] = "/copy.dat", duplicateFile[] = "/dup.dat";
+const BytesCnt SHARED_SIZE = 40 * 1024;
+const unsigned long SHARED_CLUSTERS = SHARED_SIZE / ClusterSize;
+const BytesCnt PATCH_POSITION = 100, PATCH_SIZE = 10;
+
+// changes PATCH_SIZE bytes of the file at PATCH_POSITION, and makes sure the data is on the partition
+static bool patchFile(char* fname) {
+	File* file = FS::open(fname, 'a');
+	CHECK(file != nullptr);
+	bool patched = file->seek(PATCH_POSITION) == 1 && file->write(PATCH_SIZE, (char*)"0123456789") == 1;
+	delete file;
+	CHECK(patched);
+	CHECK(FS::sync() == 1);
+	return true;
+}
+
+// whether or not the file holds the SHARED_SIZE bytes filled by fillBuffer, changed by patchFile
+static bool patchedFileMatches(char* fname, unsigned int seed) {
+	char expected[SHARED_SIZE], buffer[SHARED_SIZE];
+	fillBuffer(expected, 0, SHARED_SIZE, seed);
+	memcpy(expected + PATCH_POSITION, "0123456789", PATCH_SIZE);
+	File* file = FS::open(fname, 'r');
+	CHECK(file != nullptr);
+	BytesCnt read = file->read(SHARED_SIZE, buffer);
+	delete file;
+	CHECK(read == SHARED_SIZE);
+	CHECK(memcmp(buffer, expected, SHARED_SIZE) == 0);
+	return true;
+}
+
+bool clone(unsigned int formatOptions) {
+	Partition* partition = createPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(FS::format(formatOptions) == 1);
+	CHECK(writeFile(originalFile, SHARED_SIZE, 5));
+	CHECK(FS::copyFile(originalFile, copyFile, COPY_CLONE) == 1);
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	CHECK(runInNewProcess("clone-write", formatOptions));
+	return true;
+}
+
+bool cloneWrite(unsigned int formatOptions) {
+	Partition* partition = openPartition();
+	CHECK(FS::mount(partition) == 1);
+	CheckReport report;
+	CHECK(FS::check(report) == 1); // the reference counts of the shared clusters have been rebuilt by the mount
+	CHECK(patchFile(originalFile));
+	CHECK(patchedFileMatches(originalFile, 5));
+	CHECK(fileMatches(copyFile, SHARED_SIZE, 5));
+	// deleting the original frees just the clusters it no longer shares with the copy
+	CHECK(FS::deleteFile(originalFile) == 1);
+	CHECK(FS::check(report) == 1);
+	CHECK(fileMatches(copyFile, SHARED_SIZE, 5));
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	return true;
+}
+
+bool dedup(unsigned int formatOptions) {
+	Partition* partition = createPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(FS::format(formatOptions | FORMAT_DEDUP) == 1);
+	CHECK(writeFile(originalFile, SHARED_SIZE, 6));
+	CHECK(writeFile(copyFile, SHARED_SIZE, 6)); // shares all of the original's clusters
+	CHECK(FS::dedupStats().duplicateClusters == SHARED_CLUSTERS);
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	CHECK(runInNewProcess("dedup-write", formatOptions));
+	return true;
+}
+
+bool dedupWrite(unsigned int formatOptions) {
+	Partition* partition = openPartition();
+	CHECK(FS::mount(partition) == 1);
+	CheckReport report;
+	CHECK(FS::check(report) == 1); // the deduplication index and the reference counts have been rebuilt by the mount
+	DedupStats stats = FS::dedupStats();
+	CHECK(stats.indexedClusters == SHARED_CLUSTERS);
+	CHECK(stats.references == 2 * SHARED_CLUSTERS);
+	CHECK(stats.duplicateClusters == SHARED_CLUSTERS); // kept in the superblock
+	// a file written after the mount finds its clusters in the rebuilt index
+	CHECK(writeFile(duplicateFile, SHARED_SIZE, 6));
+	CHECK(FS::dedupStats().duplicateClusters == 2 * SHARED_CLUSTERS);
+	CHECK(patchFile(originalFile));
+	CHECK(patchedFileMatches(originalFile, 6));
+	CHECK(fileMatches(copyFile, SHARED_SIZE, 6));
+	CHECK(FS::deleteFile(originalFile) == 1);
+	CHECK(FS::check(report) == 1);
+	CHECK(fileMatches(copyFile, SHARED_SIZE, 6));
+	CHECK(fileMatches(duplicateFile, SHARED_SIZE, 6));
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	return true;
+}
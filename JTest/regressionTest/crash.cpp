@@ -0,0 +1,59 @@
+/*
+	a process which goes down without unmounting the partition loses nothing it has synced: the next process replays the journal (if
+	there is one) and recounts the partition at mount, finding the synced files intact and the partition consistent, while a file
+	written after the last sync may or may not be there
+*/
+#include"regressiontest.h"
+
+static char keptFile[] = "/kept.dat", changedFile[] = "/changed.dat", deletedFile[] = "/deleted.dat", lateFile[] = "/late.dat";
+const BytesCnt KEPT_SIZE = 200 * 1024;
+const BytesCnt CHANGED_SIZE = 30 * 1024;
+const BytesCnt LATE_SIZE = 50 * 1024;
+
+bool crash(unsigned int formatOptions) {
+	Partition* partition = createPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(FS::format(formatOptions) == 1);
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	CHECK(runInNewProcess("crash-write", formatOptions));
+	CHECK(runInNewProcess("crash-recover", formatOptions));
+	return true;
+}
+
+bool crashWrite(unsigned int formatOptions) {
+	Partition* partition = openPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(writeFile(keptFile, KEPT_SIZE, 7));
+	CHECK(writeFile(changedFile, CHANGED_SIZE, 8));
+	CHECK(writeFile(deletedFile, KEPT_SIZE, 9));
+	CHECK(FS::sync() == 1);
+	CHECK(writeFile(changedFile, CHANGED_SIZE, 10));
+	CHECK(FS::deleteFile(deletedFile) == 1);
+	CHECK(FS::sync() == 1);
+	CHECK(writeFile(lateFile, LATE_SIZE, 11));
+	fflush(stdout);
+	TerminateProcess(GetCurrentProcess(), 0); // neither the file system nor the partition get to clean up
+	return false;
+}
+
+bool crashRecover(unsigned int formatOptions) {
+	Partition* partition = openPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(fileMatches(keptFile, KEPT_SIZE, 7));
+	CHECK(fileMatches(changedFile, CHANGED_SIZE, 10));
+	CHECK(FS::doesExist(deletedFile) == 0);
+	FileCnt files = FS::readRootDir();
+	CHECK(files == 2 || (files == 3 && FS::doesExist(lateFile) == 1));
+	CheckReport report;
+	CHECK(FS::check(report) == 1);
+	CHECK(report.files == files);
+	// the partition takes new files once it has been recovered
+	CHECK(FS::deleteFile(keptFile) == 1);
+	CHECK(writeFile(lateFile, LATE_SIZE, 12));
+	CHECK(fileMatches(lateFile, LATE_SIZE, 12));
+	CHECK(FS::check(report) == 1);
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	return true;
+}
@@ -0,0 +1,57 @@
+/*
+	a formatted partition can be formatted again (here with FORMAT_LAZY) by a process other than the one which has formatted it,
+	as well as by the process which has just written to it: the old files are gone, while the files written after the formatting
+	are all the next process finds on the partition
+*/
+#include"regressiontest.h"
+
+static char oldFile[] = "/old.dat", unsyncedFile[] = "/unsynced.dat", newFile[] = "/new.dat";
+const BytesCnt OLD_SIZE = 300 * 1024;
+const BytesCnt NEW_SIZE = 90 * 1024;
+
+bool reformat(unsigned int formatOptions) {
+	Partition* partition = createPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(FS::format(formatOptions) == 1);
+	CHECK(writeFile(oldFile, OLD_SIZE, 1));
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	CHECK(runInNewProcess("reformat-lazy", formatOptions));
+	CHECK(runInNewProcess("reformat-verify", formatOptions));
+	return true;
+}
+
+bool reformatLazy(unsigned int formatOptions) {
+	Partition* partition = openPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(FS::readRootDir() == 1);
+	CHECK(FS::format(formatOptions | FORMAT_LAZY) == 1);
+	CHECK(FS::readRootDir() == 0);
+	CHECK(FS::doesExist(oldFile) == 0);
+	// the clusters of a closed file may still be waiting in its cache - formatting once again must drop them, not write them back
+	CHECK(writeFile(unsyncedFile, OLD_SIZE, 2));
+	CHECK(FS::format(formatOptions | FORMAT_LAZY) == 1);
+	CHECK(FS::readRootDir() == 0);
+	CHECK(writeFile(newFile, NEW_SIZE, 3));
+	CHECK(fileMatches(newFile, NEW_SIZE, 3));
+	CheckReport report;
+	CHECK(FS::check(report) == 1);
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	return true;
+}
+
+bool reformatVerify(unsigned int formatOptions) {
+	Partition* partition = openPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(FS::readRootDir() == 1);
+	CHECK(FS::doesExist(oldFile) == 0);
+	CHECK(FS::doesExist(unsyncedFile) == 0);
+	CHECK(fileMatches(newFile, NEW_SIZE, 3));
+	CheckReport report;
+	CHECK(FS::check(report) == 1);
+	CHECK(report.files == 1);
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	return true;
+}
@@ -0,0 +1,184 @@
+/*
+	regression test of the file system's on-disk state: every test writes a partition file and then checks, in new processes, what
+	they find on the partition; usage: regressionTest - runs all of the tests (each one in a process of its own), and returns
+	the number of the failed ones
+*/
+#include"regressiontest.h"
+#include<cstring>
+#include<cstdlib>
+#include<vector>
+
+struct NamedStep {
+	const char* name;
+	bool (*run)(unsigned int formatOptions);
+};
+
+static const NamedStep STEPS[] = {
+	{ "remount", remount },
+	{ "remount-change", remountChange },
+	{ "remount-verify", remountVerify },
+	{ "clone", clone },
+	{ "clone-write", cloneWrite },
+	{ "dedup", dedup },
+	{ "dedup-write", dedupWrite },
+	{ "damage", damage },
+	{ "damage-check", damageCheck },
+	{ "corruption", corruption },
+	{ "corruption-read", corruptionRead },
+	{ "corruption-noverify", corruptionNoVerify },
+	{ "compression", compression },
+	{ "compression-change", compressionChange },
+	{ "compression-verify", compressionVerify },
+	{ "crash", crash },
+	{ "crash-write", crashWrite },
+	{ "crash-recover", crashRecover },
+	{ "reformat", reformat },
+	{ "reformat-lazy", reformatLazy },
+	{ "reformat-verify", reformatVerify },
+};
+static const unsigned int NUM_OF_STEPS = sizeof(STEPS) / sizeof(STEPS[0]);
+
+// the first step of every test, with the format options it is run with
+struct Test {
+	const char* stepName;
+	unsigned int formatOptions;
+};
+
+static const Test TESTS[] = {
+	{ "remount", 0 },
+	{ "remount", FORMAT_EXTENTS },
+	{ "remount", FORMAT_JOURNAL | FORMAT_CHECKSUMS },
+	{ "remount", FORMAT_LAZY },
+	{ "clone", 0 },
+	{ "clone", FORMAT_EXTENTS },
+	{ "clone", FORMAT_JOURNAL | FORMAT_CHECKSUMS },
+	{ "dedup", 0 },
+	{ "dedup", FORMAT_JOURNAL | FORMAT_CHECKSUMS },
+	{ "damage", 0 },
+	{ "damage", FORMAT_CHECKSUMS },
+	{ "corruption", FORMAT_CHECKSUMS },
+	{ "corruption", FORMAT_EXTENTS | FORMAT_CHECKSUMS },
+	{ "corruption", FORMAT_JOURNAL | FORMAT_CHECKSUMS },
+	{ "compression", 0 },
+	{ "compression", FORMAT_EXTENTS },
+	{ "compression", FORMAT_JOURNAL | FORMAT_CHECKSUMS },
+	{ "crash", 0 },
+	{ "crash", FORMAT_JOURNAL },
+	{ "crash", FORMAT_JOURNAL | FORMAT_CHECKSUMS },
+	{ "reformat", 0 },
+	{ "reformat", FORMAT_EXTENTS },
+	{ "reformat", FORMAT_JOURNAL | FORMAT_CHECKSUMS },
+};
+static const unsigned int NUM_OF_TESTS = sizeof(TESTS) / sizeof(TESTS[0]);
+
+static char iniPath[MAX_PATH], dataPath[MAX_PATH];
+
+static void initPaths() {
+	if (iniPath[0] != '\0') return;
+	char tempPath[MAX_PATH];
+	GetTempPathA(MAX_PATH, tempPath);
+	sprintf(iniPath, "%sfsregression.ini", tempPath);
+	sprintf(dataPath, "%sfsregression.dat", tempPath);
+}
+
+bool runInNewProcess(const char* stepName, unsigned int formatOptions) {
+	char path[MAX_PATH], commandLine[2 * MAX_PATH];
+	GetModuleFileNameA(NULL, path, MAX_PATH);
+	sprintf(commandLine, "\"%s\" %s %u", path, stepName, formatOptions);
+	STARTUPINFOA startupInfo;
+	PROCESS_INFORMATION processInfo;
+	ZeroMemory(&startupInfo, sizeof(startupInfo));
+	startupInfo.cb = sizeof(startupInfo);
+	fflush(stdout); // the new process writes to the same console
+	if (!CreateProcessA(NULL, commandLine, NULL, NULL, FALSE, 0, NULL, NULL, &startupInfo, &processInfo)) {
+		printf("    cannot start %s\n", commandLine);
+		return false;
+	}
+	WaitForSingleObject(processInfo.hProcess, INFINITE);
+	DWORD exitCode = 1;
+	GetExitCodeProcess(processInfo.hProcess, &exitCode);
+	CloseHandle(processInfo.hProcess);
+	CloseHandle(processInfo.hThread);
+	return exitCode == 0;
+}
+
+Partition* createPartition() {
+	initPaths();
+	FILE* ini = fopen(iniPath, "w");
+	fprintf(ini, "%s\n%lu\n", dataPath, PARTITION_SIZE);
+	fclose(ini);
+	FILE* data = fopen(dataPath, "wb"); // Partition extends the file, but does not create it
+	fclose(data);
+	return new Partition(iniPath);
+}
+
+Partition* openPartition() {
+	initPaths();
+	return new Partition(iniPath);
+}
+
+void removePartition() {
+	initPaths();
+	DeleteFileA(dataPath);
+	DeleteFileA(iniPath);
+}
+
+ClusterNo findCluster(Partition* partition, const char* contents) {
+	char buffer[ClusterSize];
+	for (ClusterNo clusterNo = 1; clusterNo < partition->getNumOfClusters(); clusterNo++) // the superblock is not looked at
+		if (partition->readCluster(clusterNo, buffer) == 1 && memcmp(buffer, contents, ClusterSize) == 0)
+			return clusterNo;
+	return 0;
+}
+
+void fillBuffer(char* buffer, BytesCnt position, BytesCnt size, unsigned int seed) {
+	for (BytesCnt i = 0; i < size; i++) {
+		BytesCnt byteNo = position + i;
+		buffer[i] = (char)(seed * 31 + byteNo * 7 + byteNo / ClusterSize); // every cluster of a file differs from the others
+	}
+}
+
+bool writeFile(char* fname, BytesCnt size, unsigned int seed) {
+	std::vector<char> buffer(size);
+	fillBuffer(buffer.data(), 0, size, seed);
+	File* file = FS::open(fname, 'w');
+	CHECK(file != nullptr);
+	bool written = file->write(size, buffer.data()) == 1;
+	delete file;
+	CHECK(written);
+	return true;
+}
+
+bool fileMatches(char* fname, BytesCnt size, unsigned int seed) {
+	std::vector<char> expected(size), buffer(size + 1);
+	fillBuffer(expected.data(), 0, size, seed);
+	File* file = FS::open(fname, 'r');
+	CHECK(file != nullptr);
+	BytesCnt fileSize = file->getFileSize(), read = file->read(size + 1, buffer.data());
+	delete file;
+	CHECK(fileSize == size);
+	CHECK(read == size);
+	CHECK(memcmp(buffer.data(), expected.data(), size) == 0);
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc == 3) { // a step, run by runInNewProcess
+		for (unsigned int i = 0; i < NUM_OF_STEPS; i++)
+			if (strcmp(argv[1], STEPS[i].name) == 0)
+				return STEPS[i].run(strtoul(argv[2], nullptr, 0)) ? 0 : 1;
+		printf("unknown step %s\n", argv[1]);
+		return 1;
+	}
+	unsigned int numOfFailed = 0;
+	for (unsigned int i = 0; i < NUM_OF_TESTS; i++) {
+		printf("%s, format options %u\n", TESTS[i].stepName, TESTS[i].formatOptions);
+		bool passed = runInNewProcess(TESTS[i].stepName, TESTS[i].formatOptions);
+		removePartition();
+		printf("    %s\n", passed ? "OK" : "FAILED");
+		if (!passed)
+			numOfFailed++;
+	}
+	printf("%u of %u tests failed\n", numOfFailed, NUM_OF_TESTS);
+	return numOfFailed;
+}
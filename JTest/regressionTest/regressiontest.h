@@ -0,0 +1,73 @@
+#pragma once
+
+#include"fs.h"
+#include"file.h"
+#include"part.h"
+
+#include<windows.h>
+#include<cstdio>
+
+// fails the running step (every step returns whether or not it has passed), telling which check has failed
+#define CHECK(condition) do { if (!(condition)) { printf("    check failed at %s:%d: %s\n", __FILE__, __LINE__, #condition); return false; } } while (0)
+
+const ClusterNo PARTITION_SIZE = 4096; // in clusters (8MB)
+
+/*
+	runs the step with the given name in a new process (the regression test started again with the step's name and the format options),
+	which shares just the partition file with this one, and waits for it to finish
+	Return value(s): true, if the step has passed
+*/
+bool runInNewProcess(const char* stepName, unsigned int formatOptions);
+
+// creates an empty partition file (in the temporary directory) and returns a partition kept in it
+Partition* createPartition();
+// returns a partition kept in the partition file created earlier (possibly by another process)
+Partition* openPartition();
+// removes the partition file
+void removePartition();
+// returns the number of the partition's cluster which holds the given ClusterSize bytes (0 - none does), read while it is not mounted
+ClusterNo findCluster(Partition* partition, const char* contents);
+
+// fills the buffer with bytes which depend on the seed and on their position in the file
+void fillBuffer(char* buffer, BytesCnt position, BytesCnt size, unsigned int seed);
+// creates (or overwrites) the file, writing size bytes filled by fillBuffer into it
+bool writeFile(char* fname, BytesCnt size, unsigned int seed);
+// whether or not the file holds exactly the size bytes filled by fillBuffer
+bool fileMatches(char* fname, BytesCnt size, unsigned int seed);
+
+// steps of the tests - each one is run in a process of its own (the first one of a test by main, the rest by the previous step)
+
+// remount.cpp
+bool remount(unsigned int formatOptions);
+bool remountChange(unsigned int formatOptions);
+bool remountVerify(unsigned int formatOptions);
+
+// copyonwrite.cpp
+bool clone(unsigned int formatOptions);
+bool cloneWrite(unsigned int formatOptions);
+bool dedup(unsigned int formatOptions);
+bool dedupWrite(unsigned int formatOptions);
+
+// checker.cpp
+bool damage(unsigned int formatOptions);
+bool damageCheck(unsigned int formatOptions);
+
+// checksums.cpp
+bool corruption(unsigned int formatOptions);
+bool corruptionRead(unsigned int formatOptions);
+bool corruptionNoVerify(unsigned int formatOptions);
+
+// compression.cpp
+bool compression(unsigned int formatOptions);
+bool compressionChange(unsigned int formatOptions);
+bool compressionVerify(unsigned int formatOptions);
+
+// crash.cpp
+bool crash(unsigned int formatOptions);
+bool crashWrite(unsigned int formatOptions);
+bool crashRecover(unsigned int formatOptions);
+
+// format.cpp
+bool reformat(unsigned int formatOptions);
+bool reformatLazy(unsigned int formatOptions);
+bool reformatVerify(unsigned int formatOptions);
@@ -0,0 +1,56 @@
+/*
+	a partition keeps its files across mounts in different processes: the files written by the first process are read and changed
+	by the second one, whose changes are then read by the third one
+*/
+#include"regressiontest.h"
+
+static char smallFile[] = "/small.txt", bigFile[] = "/big.dat", deletedFile[] = "/deleted.dat", addedFile[] = "/added.dat";
+const BytesCnt SMALL_SIZE = 100; // kept inline in its index cluster
+const BytesCnt BIG_SIZE = 600 * 1024; // needs more than one level 2 index cluster
+const BytesCnt ADDED_SIZE = 70 * 1024;
+
+bool remount(unsigned int formatOptions) {
+	Partition* partition = createPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(FS::format(formatOptions) == 1);
+	CHECK(writeFile(smallFile, SMALL_SIZE, 1));
+	CHECK(writeFile(bigFile, BIG_SIZE, 2));
+	CHECK(writeFile(deletedFile, ADDED_SIZE, 3));
+	CHECK(FS::deleteFile(deletedFile) == 1);
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	CHECK(runInNewProcess("remount-change", formatOptions));
+	CHECK(runInNewProcess("remount-verify", formatOptions));
+	return true;
+}
+
+bool remountChange(unsigned int formatOptions) {
+	Partition* partition = openPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(FS::readRootDir() == 2);
+	CHECK(FS::doesExist(deletedFile) == 0);
+	CHECK(fileMatches(smallFile, SMALL_SIZE, 1));
+	CHECK(fileMatches(bigFile, BIG_SIZE, 2));
+	CheckReport report;
+	CHECK(FS::check(report) == 1);
+	CHECK(writeFile(addedFile, ADDED_SIZE, 4));
+	CHECK(FS::deleteFile(smallFile) == 1);
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	return true;
+}
+
+bool remountVerify(unsigned int formatOptions) {
+	Partition* partition = openPartition();
+	CHECK(FS::mount(partition) == 1);
+	CHECK(FS::readRootDir() == 2);
+	CHECK(FS::doesExist(smallFile) == 0);
+	CHECK(fileMatches(bigFile, BIG_SIZE, 2));
+	CHECK(fileMatches(addedFile, ADDED_SIZE, 4));
+	CheckReport report;
+	CHECK(FS::check(report) == 1);
+	CHECK(report.files == 2);
+	CHECK(FS::unmount() == 1);
+	delete partition;
+	return true;
+}
@@ -3,32 +3,120 @@
 
 #include "fs.h"
 #include "part.h"
+#include "filetable.h"
+#include "readpool.h"
 #include <windows.h>
 #include <iostream>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <vector>
 #include <synchapi.h>
 
 const unsigned CHAR_SIZE_IN_BITS = 8;
+const unsigned int NUM_OF_DRIVES = 26; // drives 'A' to 'Z'
+const DWORD DEFRAG_IDLE_INTERVAL = 5000; // how long the background defragmenter sleeps once a pass over the files has moved nothing
+const unsigned int COPY_BATCH_SIZE = 512; // data clusters copyFile reads/writes in one batch (as many as a level 2 index cluster maps)
+const unsigned int DESCRIPTOR_LOCK_STRIPES = 64; // locks the file size updates are spread over, by their file descriptor cluster
 
 class File;
 class FileDesc;
 class ClusterCache;
+class StripedPartition;
+class Journal;
+class ChecksumTable;
+struct FileSnapshot;
 
+/*
+	file system of a single drive: every drive ('A' to 'Z') has its own KernelFS object, which the partition gets mounted on,
+	with its own state and locks - operations on different drives never wait for each other
+*/
 class KernelFS {
 public:
 
-	static char mount(Partition* partition);
-	static char unmount();
+	/*
+	Description:
+		returns the file system of the given drive, creating it on first use
+	Return value(s):
+		- nullptr, if the drive letter is not valid
+	*/
+	static KernelFS* getDrive(char drive);
+	/*
+	Description:
+		returns the file system of the drive the given path belongs to ("X:/name.ext", or DEFAULT_DRIVE for "/name.ext"),
+		moving fname past the drive prefix
+	Return value(s):
+		- nullptr, if the drive letter is not valid
+	*/
+	static KernelFS* getDrive(char*& fname);
 
-	static char format();
+	/*
+		mount/unmount/format/open wait for at most timeout milliseconds (INFINITE - for as long as it takes) for the drive to be free,
+		for the files on it to get closed, or for the file to be free, respectively; on time-out, mount/unmount/format return FS_BUSY,
+		while open returns nullptr with busy (if given) set to true; options of mount are the MOUNT_* options, those of open the OPEN_* ones (from fs.h)
+	*/
+	char mount(Partition* partition, DWORD timeout = INFINITE, unsigned int options = 0);
+	char unmount(DWORD timeout = INFINITE);
+
+	char format(unsigned int options, DWORD timeout = INFINITE);
 
-	static FileCnt readRootDir();
+	FileCnt readRootDir();
 
-	static char doesExist(char* fname);
+	char doesExist(char* fname);
 
-	static File* open(char* fname, char mode);
-	static char deleteFile(char* fname);
+	File* open(char* fname, char mode, DWORD timeout = INFINITE, bool* busy = nullptr, unsigned int options = 0);
+	char deleteFile(char* fname);
+
+	char copyFile(char* srcFname, char* dstFname, unsigned int options);
+
+	/*
+	Description:
+		writes back the dirty clusters of all of the drive's files and commits the metadata updates done so far
+	Return value(s):
+		- 0, if no partition is mounted on the drive
+		- 1, otherwise
+	*/
+	char sync();
+
+	/*
+	Description:
+		checks (and, with CHECK_REPAIR, repairs) the consistency of the mounted partition, with no files open
+	Return value(s):
+		- 0, if no formatted partition is mounted on the drive
+		- FS_INCONSISTENT, if inconsistencies are left (found while not repairing, or cross-linked clusters)
+		- FS_BUSY, if any of the drive's files is open
+		- 1, otherwise
+	*/
+	char check(CheckReport& report, unsigned int options);
+
+	/*
+	Description:
+		returns the number of fragments the file's data is split into (see FS::fragmentation)
+	Return value(s):
+		- -1, if the file cannot be opened
+	*/
+	long fragmentation(char* fname);
+	/*
+	Description:
+		defragments the file through an internal handle opened in 'r' mode; the background defragmenter does not wait for a file
+		open in 'w'/'a' mode, and moves only the clusters of a file which is split into more than one fragment, within its I/O budget
+	Return value(s):
+		- number of clusters moved
+		- -1, if the file cannot be opened (or is busy), if no run of free clusters is long enough, or if a data cluster does not match its checksum
+	*/
+	long defragmentFile(char* fname, bool background);
+	/*
+	Description:
+		starts the background defragmenter (or changes its I/O budget), stopping it if clustersPerSecond is 0
+	Return value(s):
+		- 0, if no partition is mounted on the drive (and the defragmenter is being started)
+		- 1, otherwise
+	*/
+	char startDefragmenter(unsigned long clustersPerSecond);
+
+	FileTableStats fileTableStats();
+	DedupStats dedupStats();
 
 	static const unsigned int
 		LVL1_ENTRY_SIZE_IN_BYTES,
@@ -39,44 +127,261 @@ public:
 		FILE_EXTENSION_OFFSET,
 		LVL1_INDEX_CLUSTER_NUMBER_OFFSET,
 		NOT_IN_USE_BYTE_OFFSET,
-		FILE_SIZE_OFFSET;
+		FILE_SIZE_OFFSET,
+		FILE_FLAGS_OFFSET;
+	static const unsigned int
+		EXTENT_ENTRY_SIZE_IN_BYTES,
+		EXTENT_START_OFFSET,
+		EXTENT_LENGTH_OFFSET;
+	// flags kept in the file descriptor's FILE_FLAGS_OFFSET byte
+	static const unsigned char
+		FILE_FLAG_EXTENTS, // file's index cluster holds a table of extents instead of level 1 index entries
+		FILE_FLAG_INLINE, // file fits into one cluster and its data is kept directly inside of its index cluster
+		FILE_FLAG_COMPRESSED; // file's data is kept in compressed groups of COMPRESSION_GROUP_SIZE clusters (mapped through the two-level index)
+	// the superblock is the partition's first cluster, followed by the bit vector and the root directory's level 1 index cluster
+	static const ClusterNo
+		SUPERBLOCK_CLUSTER_NO,
+		BIT_VECTOR_START;
+	static const unsigned int SUPERBLOCK_VERSION;
+	static const unsigned int
+		SUPERBLOCK_MAGIC_OFFSET,
+		SUPERBLOCK_VERSION_OFFSET,
+		SUPERBLOCK_NUM_OF_CLUSTERS_OFFSET,
+		SUPERBLOCK_BIT_VECTOR_SIZE_OFFSET,
+		SUPERBLOCK_ROOT_DIR_OFFSET,
+		SUPERBLOCK_FORMAT_OPTIONS_OFFSET,
+		SUPERBLOCK_FREE_CLUSTERS_OFFSET,
+		SUPERBLOCK_NUM_OF_FILES_OFFSET,
+		SUPERBLOCK_CLEAN_OFFSET, // 1 - the partition has been cleanly unmounted, so its counters are up to date
+		SUPERBLOCK_WRITTEN_BIT_VECTOR_OFFSET, // number of bit vector clusters written so far - the ones past them evident only free clusters
+		SUPERBLOCK_SHARED_CLUSTERS_OFFSET, // 1 - some data clusters are shared by several files (their reference counts get rebuilt at mount)
+		SUPERBLOCK_DEDUP_CLUSTERS_WRITTEN_OFFSET, SUPERBLOCK_DEDUP_DUPLICATE_CLUSTERS_OFFSET; // DedupStats counters
 
 private:
 
 	friend class KernelFile;
 	friend class FS;
 	friend class ClusterCache;
+	friend class ChecksumTable;
+	friend class FSChecker;
 
 	KernelFS();
 
-	// used to block the running thread if it tries to mount/unmount/format when it cannot do so (type: SemaphoreObject(s) from win32 API)
-	static HANDLE ok_to_mount, ok_to_unmount, ok_to_format; 
-	// used for mutual exclusion when accessing the attributes, but allows reader parallelism (type: Slim Reader/Writer Lock from synchapi.h)
-	static SRWLOCK srwLock;
+	// file systems of the drives, created on first use and never destroyed (guarded by drivesSRWLock)
+	static KernelFS* drives[NUM_OF_DRIVES];
+	static SRWLOCK drivesSRWLock;
+
+	// state of a partition which outlives its mounts
+	struct PartitionState {
+		bool formatted;
+		unsigned int formatOptions; // FORMAT_* options (from fs.h) the partition has been formatted with
+		// reference counts of the partition's data clusters which are shared by several files (cloned by copyFile);
+		// a cluster which is not in the map belongs to a single file; kept only in memory - rebuilt from the index trees at mount
+		std::unordered_map<ClusterNo, unsigned int> sharedClusters;
+		// deduplication index (FORMAT_DEDUP): fingerprint of a stored data cluster's contents -> the cluster, and back; the index holds
+		// a reference to each of its clusters (they are kept in sharedClusters), so that files copy them instead of writing to them in place;
+		// kept only in memory - rebuilt from the data clusters of the files at mount
+		std::unordered_map<unsigned long, ClusterNo> dedupIndex;
+		std::unordered_map<ClusterNo, unsigned long> dedupFingerprints;
+		unsigned long dedupClustersWritten, dedupDuplicateClusters; // DedupStats counters
+		KernelFS* mountedOn; // file system of the drive the partition is mounted on (nullptr - not mounted)
+	};
+	// mapping a partition pointer into its state (guarded by partitionsSRWLock; a mounted partition's state by its drive's locks)
+	static std::unordered_map<Partition*, PartitionState> partitions;
+	static SRWLOCK partitionsSRWLock;
 
+	// used to block the running thread if it tries to mount/unmount/format when it cannot do so (type: SemaphoreObject(s) from win32 API)
+	HANDLE ok_to_mount, ok_to_unmount, ok_to_format; 
+	/* locks used for mutual exclusion when accessing the attributes, but allow reader parallelism (type: Slim Reader/Writer Lock from synchapi.h):
+			- srwLock - mounted partition's state (mountedPartition, mountedPartitionState, numOfClusters, ...);
+				exclusive for mount/unmount/format, shared for the rest of the operations on the file system
+			- filesSRWLock - open-file table as a whole: numberOfOpenedFiles, waitingToUnMount/waitingToFormat; operations on a single file
+				acquire it in shared mode plus the file's stripe of the table (which guards FileDesc::timesOpened), while the operations
+				which need the whole table (unmount/format/copyFile) acquire it exclusively
+			- directorySRWLock - root directory's index clusters and file descriptor clusters on the mounted partition
+			- descriptorSRWLocks - a file descriptor cluster (the one of clusterNo % DESCRIPTOR_LOCK_STRIPES), while the size and flags of
+				a file in it are updated with directorySRWLock held in shared mode, so the files which get closed/synced do not wait for each other
+			- allocatorSRWLock - bit vector, mountedPartitionState->sharedClusters (and the deduplication index) and reclaimQueue; the functions which allocate/deallocate clusters (unless they
+				are atomic) expect it to be held exclusively
+		locks are always acquired in the order: FileDesc::fileSRWLock, FileDesc::snapshotSRWLock, FileDesc cluster-range locks, FileDesc::metadataSRWLock,
+			srwLock, filesSRWLock, directorySRWLock, descriptorSRWLocks, allocatorSRWLock, dirtyCachesSRWLock, ClusterCache's lock (and the checksum table's own lock,
+			followed by the journal's own lock, inside of any of them);
+		no thread waits for a FileDesc::fileSRWLock while holding any of the other locks (file locks are held for as long as the file is open)
+	*/
+	SRWLOCK srwLock, filesSRWLock, directorySRWLock, allocatorSRWLock;
+	SRWLOCK descriptorSRWLocks[DESCRIPTOR_LOCK_STRIPES];
 
-	static int waitingToUnMount, waitingToFormat;
-	static long numberOfOpenedFiles;
-	static int numOfClusters;
-	static int bitVectorSizeInClusters;
-	static int rootLvl1IndexClusterNo;
+	int waitingToUnMount, waitingToFormat;
+	long numberOfOpenedFiles;
+	int numOfClusters;
+	int bitVectorSizeInClusters;
+	int rootLvl1IndexClusterNo;
+	ClusterNo numOfFreeClusters; // guarded by allocatorSRWLock
+	int numOfWrittenBitVectorClusters; // the bit vector clusters past these have never been written (guarded by allocatorSRWLock)
+	FileCnt numOfFiles; // guarded by directorySRWLock
 
 	// nullptr - no partition is yet mounted; != nullptr - pointer towards the mounted partition
-	static Partition* mountedPartition;
-	// mapping a partition pointer into a bool value that tells whether or not the partition has been formatted
-	static std::unordered_map<Partition*, bool> formattedPartitions;
-	/* mapping a file name into an FileDesc object which stores general information about the file:
+	Partition* mountedPartition;
+	// the mounted partition's entry in partitions
+	PartitionState* mountedPartitionState;
+	// the mounted partition, if it is a StripedPartition (nullptr otherwise) - lets a batch of clusters be transferred by its members in parallel
+	StripedPartition* mountedStripedPartition;
+	// reader threads which large reads (of at least PARALLEL_READ_THRESHOLD bytes) on the drive are split across
+	ReadPool readPool;
+	// journal of the mounted partition's metadata, if it has been formatted with FORMAT_JOURNAL (nullptr otherwise)
+	Journal* journal;
+	// checksums of the mounted partition's data clusters, if it has been formatted with FORMAT_CHECKSUMS (nullptr otherwise)
+	ChecksumTable* checksums;
+	// the data clusters read from the partition get verified against their checksums (false - mounted with MOUNT_NO_VERIFY)
+	bool verifyChecksums;
+	/* open-file table, mapping a file name into an FileDesc object which stores general information about the file:
 			- file descriptor, which is an entry into the root directory corresponding to the file
 			- ClusterNo and entryStart which define the location of the file descriptor above on the mounted partition
 			- number of threads who currently have the file opened
 	*/
-	static std::unordered_map<std::string, FileDesc*> files;
+	FileTable files;
+
+	// clusters of a file's previous contents (dropped by opening the file in 'w' mode), waiting to be deallocated
+	struct ReclaimRequest {
+		ClusterNo fileLvl1IndexClusterNo;
+		unsigned char fileFlags;
+	};
+	std::deque<ReclaimRequest> reclaimQueue;
+	// released once for every request put into the reclaimQueue, the reaper thread waits on it (type: SemaphoreObject from win32 API)
+	HANDLE ok_to_reclaim;
+	// started when the first request is queued (type: Thread from win32 API)
+	HANDLE reaperThread;
+
+	// caches of the drive's files which may hold dirty clusters, for the flusher thread to go through (guarded by dirtyCachesSRWLock)
+	std::unordered_set<ClusterCache*> dirtyCaches;
+	SRWLOCK dirtyCachesSRWLock;
+	// released to wake the flusher thread up before its interval expires (type: SemaphoreObject from win32 API)
+	HANDLE ok_to_flush;
+	// started when the first cache gets dirty (type: Thread from win32 API)
+	HANDLE flusherThread;
+
+	/*
+	Description:
+		body of the drive's (given through the argument) flusher thread: every FLUSH_INTERVAL milliseconds (or once woken up by a writer)
+		it writes back the expired dirty clusters of the caches, and the oldest ones of the caches which are too dirty
+	*/
+	static DWORD WINAPI flusher(LPVOID fs);
+	// hands a cache which has just got dirty over to the flusher thread (starting it on first use); called without holding the cache
+	void trackDirtyCache(ClusterCache* cache);
+	// stops the flusher thread from going through a cache which is being destroyed
+	void forgetCache(ClusterCache* cache);
+	// wakes the flusher thread up - a cache is running out of clean entries
+	void wakeFlusher();
+	// writes back all of the dirty clusters of the drive's files right away - used by sync and before the mounted partition is unmounted
+	void writeBackDirtyCaches();
 
+	// clusters per second the background defragmenter may move (0 - it is not running; accessed through Interlocked* functions)
+	LONG defragmenterRate;
+	// released to wake the defragmenter up when its budget changes or it gets stopped (type: SemaphoreObject from win32 API)
+	HANDLE ok_to_defragment;
+	// running while defragmenterRate is not 0 (type: Thread from win32 API)
+	HANDLE defragmenterThread;
+	// serializes starting/stopping the defragmenter (guards defragmenterThread); never held together with any of the other locks
+	SRWLOCK defragmenterSRWLock;
+
+	/*
+	Description:
+		body of the drive's (given through the argument) defragmenter thread: goes through the drive's files over and over, defragmenting
+		them one at a time, and sleeps for DEFRAG_IDLE_INTERVAL milliseconds once a pass has moved nothing
+	*/
+	static DWORD WINAPI defragmenter(LPVOID fs);
+	/*
+	Description:
+		stops the defragmenter thread and waits for it to finish - before the mounted partition is unmounted, formatted or checked,
+		as the defragmenter keeps opening the drive's files
+	Return value(s): the defragmenter's I/O budget (clusters per second) before it has been stopped (0 - it has not been running)
+	*/
+	LONG stopDefragmenter();
+	// format/check with the defragmenter stopped (the public ones stop it, and start a running one again afterwards)
+	char formatPartition(unsigned int options, DWORD timeout);
+	char checkPartition(CheckReport& report, unsigned int options);
 	/*
 	Description:
-		properly initializes bit vector: allocates the amount of clusters needed for the bit vector and initializes them as not free in it
+		keeps the defragmenter within its budget, once it has moved the given number of clusters
+	Return value(s):
+		- true, if the defragmenter goes on
+		- false, if it has been stopped in the meantime
 	*/
-	static void initializeBitVector();
+	bool throttleDefragmenter(unsigned long numOfMovedClusters);
+	// returns the names ("/name.ext") of all of the files in the root directory (none, if no partition is mounted)
+	std::vector<std::string> listFiles();
+
+	/*
+	Description:
+		body of the drive's (given through the argument) reaper thread: deallocates the clusters of the queued requests,
+		one request at a time, in the background
+	*/
+	static DWORD WINAPI reaper(LPVOID fs);
+	/*
+	Description:
+		deallocates the clusters of all of the queued requests right away - used before the mounted partition is unmounted
+	*/
+	void reclaimPendingClusters();
+	/*
+	Description:
+		empties the file (opened in 'w' mode) in constant time: the file gets a new, empty index cluster and its old clusters are queued
+		for the reaper thread; inline files are simply cleared; the emptied file gets the layout of a new (compressed) file
+	*/
+	void replaceFileContents(FileDesc* fd, bool compressed);
+
+	/*
+	Description:
+		properly initializes bit vector: the first numOfTakenClusters clusters (the superblock, the bit vector's own clusters, the root
+		directory's level 1 index cluster, the journal's region and the checksum region) are evidented as taken, the rest as free; a lazy initialization
+		writes only the bit vector clusters which evident the taken clusters, the rest get written on first use
+	*/
+	void initializeBitVector(ClusterNo numOfTakenClusters, bool lazy);
+	// fills the buffer with the freshly formatted contents of a bit vector cluster (the clusters past the end of the partition are taken, too)
+	void initialBitVectorCluster(int clusterNo, ClusterNo numOfTakenClusters, char* buffer);
+	/*
+	Description:
+		reads/writes a cluster of the bit vector (0 - its first cluster); a cluster which has never been written reads as freshly formatted,
+		and writing to it first writes it (along with the unwritten clusters before it) out and evidents it in the superblock
+		(called with allocatorSRWLock held exclusively, or with srwLock held exclusively)
+	*/
+	void readBitVectorCluster(int clusterNo, char* buffer);
+	void writeBitVectorCluster(int clusterNo, const char* buffer);
+	// computes where the bit vector, the root directory and the journal are on the mounted partition
+	void computeLayout();
+	/*
+	Description:
+		reads the layout and the counters of the mounted partition from its superblock
+	Return value(s):
+		- true, if the partition has been formatted (formatOptions, clean and shared - whether or not it has shared data clusters -
+			are returned through the arguments)
+		- false, if the superblock is missing or does not describe the partition (the layout is left as is)
+	*/
+	bool readSuperblock(unsigned int& formatOptions, bool& clean, bool& shared);
+	// writes the layout and the counters of the mounted partition into its superblock, straight to the partition
+	void writeSuperblock(bool clean);
+	/*
+	Description:
+		checks the partition being mounted, if it has not been unmounted cleanly or if it has shared data clusters: the check rebuilds
+		the reference counts (and the deduplication index) kept only in memory, repairs the bit vector and recounts the free clusters
+		and the files
+	*/
+	void recount();
+	// first cluster of the journal's region (right after the root directory's level 1 index cluster)
+	ClusterNo journalStart();
+	// first cluster of the checksum region (right after the journal's region, or in its place if there is no journal)
+	ClusterNo checksumStart();
+	// first cluster past the reserved ones (the checksum region's end) - where the clusters allocated to the files start
+	ClusterNo dataStart();
+
+	/*
+	Description:
+		reads/writes a metadata cluster (bit vector, root directory, file descriptor or index cluster) of the mounted partition - through
+		the journal, if there is one; data clusters are transferred through readClusters/writeClusters instead
+	*/
+	void readMetadataCluster(ClusterNo clusterNo, char* buffer);
+	void writeMetadataCluster(ClusterNo clusterNo, const char* buffer);
+	// makes the metadata updates done so far durable (commits the journal, if there is one) - called once an operation is done
+	void commitMetadata();
 
 	/*
 	Description: 
@@ -84,8 +389,9 @@ private:
 	Return value(s): 
 		- nullptr, if the file is not found
 		- FileDesc* (!= nullptr), if the file is found
+		(called with the file's stripe of the open-file table locked exclusively, or with filesSRWLock acquired exclusively)
 	*/
-	static FileDesc* getFileDescriptor(char* fname);
+	FileDesc* getFileDescriptor(char* fname);
 	/*
 	Description: 
 		formats the given file name (through 1st argument) into a file name (returns through 2nd argument) and a file extension
@@ -100,31 +406,143 @@ private:
 
 	/*
 	Description:
-		allocates a new cluster, evidenting it inside of the bit vector
+		allocates a new cluster, evidenting it inside of the bit vector;
+		if the goal cluster is given (!= 0) and is free it gets allocated, otherwise the first free cluster is allocated;
+		if there are no free clusters, the ones waiting for the reaper thread are deallocated first
 	Return value(s):
 		- cluster number of the allocated cluster, if allocation has been successfull
 		- 0 otherwise
 	Potential errors:
 		- no free clusters left
 	*/
-	static ClusterNo allocateCluster();
+	ClusterNo allocateCluster(ClusterNo goal = 0);
+	// allocates cluster atomically (call of KernelFS::allocateCluster() is surrounded by acquiring/releasing allocatorSRWLock)
+	ClusterNo allocateClusterAtomic(ClusterNo goal = 0);
+	// does the work of KernelFS::allocateCluster(), which measures how long it takes (OP_ALLOCATE)
+	ClusterNo takeFreeCluster(ClusterNo goal);
+	/*
+	Description:
+		allocates a run of the given number of contiguous clusters - the first free run which is long enough (acquires allocatorSRWLock)
+	Return value(s):
+		- number of the run's first cluster
+		- 0, if no run of free clusters is long enough
+	*/
+	ClusterNo allocateRun(ClusterNo length);
 
 	/*
 	Description:
 		allocates a new file descriptor and inserts informations about the new file into it
 	Return value(s):
-		- 0, if the descriptor has been allocated successfully
-		- 1, otherwise
+		- FileDesc* of the new file (inserted into the open-file table), if the descriptor has been allocated successfully
+		- nullptr, otherwise
 	Potential errors: 
 		- no file descriptors available left / no clusters for file's lvl 1 index cluster left / ...
 	*/
-	static char allocateFileDescriptor(std::string fnameUnformatted, char* fileName, char* fileExtension);
+	FileDesc* allocateFileDescriptor(std::string fnameUnformatted, char* fileName, char* fileExtension, bool compressed = false);
+	// returns the flags of a new file: the layout the partition has been formatted with, with the data kept inline - unless it is compressed
+	unsigned char newFileFlags(bool compressed);
 
 	/*
 	Description:
 		deallocates a cluster which number is given through the parameter, evidenting it as free inside of the bit vector
 	*/
-	static void deallocateCluster(ClusterNo clusterNo);
+	void deallocateCluster(ClusterNo clusterNo);
+	// deallocates given cluster atomically (call of KernelFS::deallocateCluster() is surrounded by acquiring/releasing allocatorSRWLock)
+	void deallocateClusterAtomic(ClusterNo clusterNo);
+
+	// adds a reference to the given data cluster, which is from now on shared by one more file
+	void shareCluster(ClusterNo clusterNo);
+	// checks whether or not the given data cluster is shared by several files (allocatorSRWLock held at least in shared mode)
+	bool isSharedCluster(ClusterNo clusterNo);
+
+	/*
+	Description:
+		looks up a stored data cluster with the given contents in the deduplication index (comparing the contents, not just the
+		fingerprints); the found cluster gets a reference for the caller, which maps it in place of writing the contents
+	Return value(s):
+		- the number of the found cluster
+		- 0, if no identical cluster is stored
+	*/
+	ClusterNo findDuplicateCluster(const char* data);
+	// enters the data cluster, just written to the partition with the given contents, into the deduplication index (unless it already
+	// has a cluster with the same fingerprint), which then holds a reference to it
+	void indexCluster(ClusterNo clusterNo, const char* data);
+
+	/*
+	Description:
+		deallocates all of the clusters of a file: its data clusters and its index cluster(s), depending on the file's layout (fileFlags)
+	*/
+	void deallocateFileClusters(ClusterNo fileLvl1IndexClusterNo, unsigned char fileFlags);
+
+	/*
+	Description:
+		deallocates all of the clusters of a file which is not open, frees its file descriptor spot and removes it from the open-file table
+		(called with the file's stripe of the open-file table locked exclusively, or with filesSRWLock acquired exclusively)
+	*/
+	void removeFile(std::string fname, FileDesc* fd);
+
+	/*
+	Description:
+		evidents that a thread has stopped using the file (closed it), unblocking the threads waiting to unmount/format the mounted partition
+		once no files are open
+	*/
+	void releaseFile(FileDesc* fd);
+
+	/*
+	Description:
+		evidents that a handle has started/stopped writing to the file (opened it in 'w'/'a'/'m' mode, or copyFile into it);
+		once the file has been opened in 's' mode, the first writer keeps the file's last closed version pinned as its snapshot,
+		until the last writer stops writing (called with the file's SRWLock held)
+	*/
+	void startWriting(FileDesc* fd);
+	void stopWriting(FileDesc* fd);
+	/*
+	Description:
+		returns the snapshot of the file's last closed version to a handle which opens the file in 's' mode, pinning it if needed;
+		waits only while the file is being written to by handles which have opened it before the file was first opened in 's' mode
+	*/
+	FileSnapshot* openSnapshot(FileDesc* fd);
+	// releases the snapshot of a handle opened in 's' mode, unpinning it once it is not used anymore
+	void closeSnapshot(FileDesc* fd, FileSnapshot* snapshot);
+	// maps the file's logical clusters (its current layout) and shares its data clusters with the new snapshot (no writer may be active)
+	FileSnapshot* pinSnapshot(FileDesc* fd);
+	// drops the snapshot's references to its data clusters, deallocating the ones which no file uses anymore, and deletes the snapshot
+	void unpinSnapshot(FileSnapshot* snapshot);
+
+	/*
+	Description:
+		fills the (empty) index cluster of the destination file with the layout of the source file (described by fileFlags):
+		data clusters are copied into newly allocated ones, or - if clone is true - shared with the source file;
+		holes are kept as holes and inline data is always copied
+	Return value(s):
+		- 1, if the whole file has been copied
+		- 0, if no free clusters are left (the index cluster is still consistent, so the destination file can be deallocated)
+	*/
+	char copyFileClusters(ClusterNo srcLvl1IndexClusterNo, ClusterNo dstLvl1IndexClusterNo, unsigned char fileFlags, bool clone);
+	/*
+	Description: copies the given data clusters into the (allocated) destination ones - reading all of them in one batch, then writing them in another
+	Return value(s): 0, if a source cluster does not match its checksum (nothing is written)
+	*/
+	char copyDataClusters(const std::vector<ClusterNo>& srcClusterNos, const std::vector<ClusterNo>& dstClusterNos);
+
+	/*
+	Description:
+		reads/writes count clusters of the mounted partition (clusterNos[i] from/into buffers[i]); a striped partition transfers them
+		from/to all of its members in parallel, any other partition one cluster at a time; clusters the journal still tracks as metadata
+		(an inline file's index cluster) are read from the journal, and stop being tracked once written to as data;
+		with checksums, the written clusters get their checksums updated, while the ones read from the partition are verified
+		(a cluster which does not match is read once more, in case just the transfer has failed)
+	Return value(s) (readClusters):
+		- 1, if all of the clusters have been read
+		- 0, if a cluster does not match its checksum (the buffers are filled in anyway)
+	*/
+	char readClusters(const ClusterNo* clusterNos, unsigned int count, char** buffers);
+	void writeClusters(const ClusterNo* clusterNos, unsigned int count, char** buffers);
+
+	// reads a 4 byte (little-endian) cluster number stored at the given offset inside of the buffered cluster
+	static ClusterNo getEntry(char* cluster, unsigned int offset);
+	// stores a 4 byte (little-endian) cluster number at the given offset inside of the buffered cluster
+	static void setEntry(char* cluster, unsigned int offset, ClusterNo value);
 
 };
 
@@ -0,0 +1,66 @@
+#ifndef _CHECKSUMTABLE_H_
+#define _CHECKSUMTABLE_H_
+
+#include "part.h"
+#include <Windows.h>
+#include <synchapi.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class KernelFS;
+
+// a cluster of the checksum region holds the checksums of CHECKSUMS_PER_CLUSTER clusters, followed by the checksum of its own contents
+const unsigned int CHECKSUMS_PER_CLUSTER = 511;
+
+/*
+	CRC32C checksums of a drive's data clusters, kept in a region of the partition (4 bytes for every cluster of the partition):
+	a data cluster's checksum is updated whenever the cluster gets written back, and verified whenever it is read from the partition;
+	the region's clusters are read on first use and kept in memory - the updated ones are written out through the metadata path
+	(the journal, if there is one) once the metadata gets committed, or by the flusher thread;
+	a region cluster whose own checksum does not match (it has never been written) holds no checksums, so the region never has to be
+	cleared; a cluster with no checksum (0) is not verified - a cluster written to as metadata has its checksum dropped
+*/
+class ChecksumTable {
+public:
+
+	// the region starts with the start cluster and holds the checksums of the partition's numOfClusters clusters
+	ChecksumTable(KernelFS* fs, ClusterNo start, ClusterNo numOfClusters);
+
+	// number of clusters the region of a partition with the given number of clusters takes up
+	static ClusterNo sizeInClusters(ClusterNo numOfClusters);
+	// checks whether or not the given cluster belongs to the region itself
+	bool contains(ClusterNo clusterNo) const;
+
+	// computes and stores the checksums of count clusters (clusterNos[i] holding buffers[i]) which are being written
+	void update(const ClusterNo* clusterNos, unsigned int count, char** buffers);
+	// drops the checksum of a cluster which is being written to as metadata
+	void drop(ClusterNo clusterNo);
+	/*
+	Description:
+		verifies the contents of a cluster which has been read from the partition against its checksum
+	Return value(s):
+		- true, if the checksum matches, or the cluster has no checksum
+		- false, otherwise
+	*/
+	bool verify(ClusterNo clusterNo, const char* buffer);
+	// writes out the region clusters updated since the last flush (through KernelFS::writeMetadataCluster)
+	void flush();
+
+private:
+
+	// checksum of a cluster's contents, as stored in the region (never 0, which stands for no checksum)
+	static unsigned long checksumOf(const char* cluster);
+	// in-memory copy of the region cluster (given by its number inside of the region), read on first use (srwLock held exclusively)
+	char* regionCluster(ClusterNo regionClusterNo);
+
+	KernelFS* fs;
+	ClusterNo start, numOfClusters;
+	std::unordered_map<ClusterNo, std::vector<char>> clusters; // region clusters read so far
+	std::unordered_set<ClusterNo> dirty; // region clusters updated since the last flush
+	// guards all of the above; it is taken after all of the file system's locks, but before the journal's own lock
+	SRWLOCK srwLock;
+
+};
+
+#endif // _CHECKSUMTABLE_H_
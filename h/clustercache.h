@@ -6,19 +6,40 @@
 #include <synchapi.h>
 
 const unsigned int CACHE_SIZE = 128;
+// the drive's flusher thread writes back the clusters which have been dirty for DIRTY_EXPIRE milliseconds, and the oldest dirty
+// clusters of a cache which has more than DIRTY_BACKGROUND_RATIO percent of its entries dirty; a writer which makes DIRTY_RATIO
+// percent of the entries dirty wakes the flusher up right away, so that the cache always has clean entries to evict
+const DWORD FLUSH_INTERVAL = 500;
+const ULONGLONG DIRTY_EXPIRE = 2000;
+const unsigned int DIRTY_BACKGROUND_RATIO = 25;
+const unsigned int DIRTY_RATIO = 50;
 
 class KernelFile;
+class KernelFS;
 
 class ClusterCache {
 public:
 
-	ClusterCache();
-	void readCluster(ClusterNo clusterNo, char* buffer);
+	ClusterCache(KernelFS* fs);
+	// dirty clusters are dropped - they get written back before the file's descriptor is evicted or the partition unmounted
+	~ClusterCache();
+	// reads/writes a cluster through the cache; readCluster returns 0 if the cluster is read from the partition and does not match its checksum
+	char readCluster(ClusterNo clusterNo, char* buffer);
 	void writeCluster(ClusterNo clusterNo, char* buffer);
+	/*
+	Description:
+		reads count clusters (clusterNos[i] into buffers[i]) - the ones which are not cached are read from the partition as a single batch
+	Return value(s):
+		- 1, if all of the clusters have been read
+		- 0, if a cluster read from the partition does not match its checksum (none of the batch gets cached)
+	*/
+	char readClusters(const ClusterNo* clusterNos, unsigned int count, char** buffers);
 
 private:
 
 	friend class KernelFile;
+	friend class KernelFS;
+	friend class FileTable;
 
 	/*
 	Description:
@@ -36,13 +57,30 @@ private:
 	int getNextEntry();
 	// invalidates an entry which holds a cached cluster with the given cluster number
 	void invalidate(ClusterNo);
-	// writes back all of the clusters modified by a thread who opened the file in 'w' mode - used for threads when closing files opened in 'w'/'a' mode
+	// invalidates all of the entries - used when the file's contents are replaced as a whole
+	void invalidateAll();
+	// writes back all of the dirty clusters (as a single batch) - used by File::sync/FS::sync, and before the clusters are read
+	// from the partition directly (the file's snapshot gets pinned, the file gets copied or its descriptor evicted, ...)
 	void writeBack();
+	/*
+	Description:
+		writes back (as a single batch) the clusters which have been dirty since before expiry, plus the oldest other dirty clusters
+		while more than DIRTY_BACKGROUND_RATIO percent of the entries are dirty - used by the flusher thread
+	Return value(s):
+		- number of clusters which are still dirty
+	*/
+	unsigned int flush(ULONGLONG expiry);
+	// marks an entry as dirty, noting when it has become dirty
+	void markDirty(int entryNo);
+	void markClean(int entryNo);
 
 	bool valid[CACHE_SIZE], dirty[CACHE_SIZE];
 	ClusterNo tag[CACHE_SIZE];
+	ULONGLONG dirtySince[CACHE_SIZE]; // GetTickCount64() at the time the entry has become dirty
+	unsigned int numOfDirty;
 	char data[CACHE_SIZE][ClusterSize];
 	SRWLOCK cacheSRWLock;
+	KernelFS* fs; // file system of the drive the cached clusters belong to
 
 
 };
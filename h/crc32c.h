@@ -0,0 +1,22 @@
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+/*
+	CRC32C (Castagnoli polynomial) of a buffer: computed by the processor's crc32 instructions (SSE4.2 on x86, the CRC32 extension
+	on ARMv8), if it has them - several bytes per cycle - and through a lookup table otherwise
+*/
+class CRC32C {
+public:
+
+	static unsigned long checksum(const char* data, unsigned int length);
+
+private:
+
+	static unsigned long hardwareChecksum(const char* data, unsigned int length);
+	static unsigned long tableChecksum(const char* data, unsigned int length);
+	// checks (once) whether or not the processor has the crc32 instructions
+	static bool hasHardwareSupport();
+
+};
+
+#endif // _CRC32C_H_
@@ -4,6 +4,8 @@
 #include "fs.h"
 #include <string>
 class KernelFile;
+class KernelFS;
+class FileDesc;
 
 class File {
 public:
@@ -25,6 +27,7 @@ public:
 	Potential errors:
 		- file was opened in 'r' mode
 		- allocating new data clusters failed whilst expanding file
+		- a data cluster which is only partially overwritten does not match its checksum (partition formatted with FORMAT_CHECKSUMS)
 	*/
 	char write(BytesCnt bytesCnt, char* buffer);
 
@@ -40,17 +43,17 @@ public:
 		- >0 - number of read bytes
 	Potential errors:
 		- cursor was at the eof before the read(BytesCnt, char*) was called
+		- a data cluster being read does not match its checksum (partition formatted with FORMAT_CHECKSUMS) - the cursor is left as is
 	*/
 	BytesCnt read(BytesCnt bytesCnt, char* buffer);
 	
 	/*
 	Description:
-		sets the cursor position to the BytesCnt byte
+		sets the cursor position to the BytesCnt byte; the position may be past the eof - writing there leaves a hole
+		(never allocated clusters) between the eof and the cursor, which reads as zeros
 	Return value(s):
 		- 0, in case of an error
 		- 1, if seeking was successfull
-	Potential errors:
-		- BytesCnt byte is out of bounds (<0 || >fileSize)
 	*/
 	char seek(BytesCnt);
 
@@ -62,7 +65,7 @@ public:
 
 	/*
 	Description: 
-		checks whether or not the current position of the cursor equals eof
+		checks whether or not the current position of the cursor equals (or is past) eof
 	Return value(s):
 		- 0, if no
 		- 1, in case of an error (?)
@@ -85,11 +88,22 @@ public:
 	*/
 	char truncate();
 
+	/*
+	Description:
+		makes the file durable: writes back the file's dirty clusters and commits its size (along with the rest of the metadata
+		updates done so far); closing the file does neither - the drive's flusher thread writes the clusters back in the background;
+		a compressed file's last written group is compressed and stored first
+	Return value(s):
+		- 1, if the file is durable (nothing has to be done for a file opened in 'r'/'s' mode)
+		- 0, if no free clusters are left for the last written group of a compressed file (the rest is still made durable)
+	*/
+	char sync();
+
 private:
 
 	friend class FS;
 	friend class KernelFS;
-	File(std::string fname, char mode, BytesCnt fileSize); // file object can only be created by opening a file
+	File(KernelFS* fs, FileDesc* fileDesc, char mode, BytesCnt fileSize); // file object can only be created by opening a file
 	KernelFile* myImpl;
 
 };
@@ -2,27 +2,91 @@
 #define _FILEDESC_H_
 
 #include "part.h"
+#include "fs.h"
 #include <Windows.h>
 #include <synchapi.h>
+#include <vector>
+#include <string>
 
 class ClusterCache;
+class KernelFS;
+
+// version of a file's contents pinned for the handles which read the file in 's' mode - its data clusters are shared with the file
+// (copy-on-write), so they stay intact while the file is being written to
+struct FileSnapshot {
+	BytesCnt fileSize;
+	std::vector<ClusterNo> dataClusterNos; // data cluster of every logical cluster of the file (0 - a hole)
+	bool compressed; // dataClusterNos hold the level 2 index entries of the file's compressed groups (whole groups)
+	std::vector<char> inlineData; // data of an inline file (kept inside of its index cluster, which is not shared)
+	unsigned int references; // handles reading the snapshot, plus one while the file is being written to
+};
 
 class FileDesc {
 public:
 
-	FileDesc(ClusterNo clusterNo, unsigned int entryStart);
+	FileDesc(KernelFS* fs, std::string fname, ClusterNo clusterNo, unsigned int entryStart);
 	~FileDesc();
 
+	/*
+	Description:
+		locks the file's logical clusters first..last (inclusive) - in shared mode for reading, in exclusive mode for writing;
+		waits until no other handle of the file holds a conflicting lock on any of those clusters
+	*/
+	void lockRange(unsigned long first, unsigned long last, bool exclusive);
+	// unlocks the range locked by FileDesc::lockRange() with the very same arguments
+	void unlockRange(unsigned long first, unsigned long last, bool exclusive);
+
+	/*
+	Description:
+		locks the file (fileSRWLock) in shared or exclusive mode, waiting for at most timeout milliseconds (INFINITE - for as long as it takes)
+	Return value(s):
+		- true, if the file has been locked
+		- false, if the timeout has expired first
+	*/
+	bool lockFile(bool exclusive, DWORD timeout);
+	// unlocks the file locked by FileDesc::lockFile(), waking up the threads which wait for it with a timeout
+	void unlockFile(bool exclusive);
+
 	friend class KernelFS;
 	friend class KernelFile;
+	friend class FileTable;
 
 private:
 
+	std::string fname; // the file's name - its key inside of the open-file table
 	ClusterNo clusterNo; // a cluster number in which the file descriptor is stored
 	unsigned int entryStart; // the entry's starting byte inside of the file descriptor cluster
 	unsigned int timesOpened; // how many times is the file opened at any given moment
+	LONG lastUsed; // when the file has last been looked up in the open-file table (by FileTable's clock)
 	ClusterCache* cache;
 	SRWLOCK fileSRWLock; // an SRWLock for the file
+	// SRWLocks cannot be waited for with a timeout - such waiters try to lock the file whenever it gets unlocked
+	LONG timedWaiters; // number of threads waiting for the file with a timeout
+	unsigned long fileUnlocks; // number of times the file has been unlocked while there were timed waiters (guarded by unlockSRWLock)
+	SRWLOCK unlockSRWLock;
+	CONDITION_VARIABLE fileUnlocked; // signaled whenever the file gets unlocked while there are timed waiters
+
+	// a range of the file's logical clusters locked by one of the handles which share the file (opened in 'r'/'m' mode)
+	struct RangeLock {
+		unsigned long first, last;
+		bool exclusive;
+	};
+	std::vector<RangeLock> lockedRanges;
+	SRWLOCK rangeSRWLock; // guards lockedRanges
+	CONDITION_VARIABLE rangeUnlocked; // signaled whenever a range gets unlocked
+
+	// file's size and flags, shared by the handles which have the file opened in 'r'/'m' mode (valid while metadataUsers > 0)
+	BytesCnt fileSize;
+	unsigned char fileFlags;
+	unsigned int metadataUsers;
+	SRWLOCK metadataSRWLock; // guards fileSize, fileFlags, metadataUsers and the file's index clusters
+
+	// snapshot of the file's last closed version, read by the handles which have the file opened in 's' mode (nullptr - not pinned)
+	FileSnapshot* snapshot;
+	unsigned int writers; // handles which have the file opened in 'w'/'a'/'m' mode (or copyFile writing into it)
+	bool snapshotted; // the file has been opened in 's' mode - from then on, the first writer pins the file's last closed version
+	SRWLOCK snapshotSRWLock; // guards snapshot, writers and snapshotted
+	CONDITION_VARIABLE writersDone; // signaled when the last writer stops writing to the file
 
 };
 
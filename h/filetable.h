@@ -0,0 +1,67 @@
+#ifndef _FILETABLE_H_
+#define _FILETABLE_H_
+
+#include <Windows.h>
+#include <synchapi.h>
+#include "fs.h"
+#include <string>
+#include <unordered_map>
+
+const unsigned int FILE_TABLE_STRIPES = 64;
+const unsigned int FILE_TABLE_CAPACITY = 512; // each stripe keeps up to FILE_TABLE_CAPACITY / FILE_TABLE_STRIPES descriptors
+
+class FileDesc;
+
+/*
+	open-file table: maps a file name into its FileDesc object; the names are spread over stripes, each one with its own map and SRWLock,
+	so that the threads which open/delete different files rarely meet on the same lock;
+	the table is bounded: once a stripe is full, inserting into it evicts the least recently used FileDesc of a closed file
+	(and with it the file's cluster cache); a stripe whose files are all open grows past its share of the capacity
+*/
+class FileTable {
+public:
+
+	FileTable();
+	~FileTable();
+
+	// acquires the SRWLock of the stripe the given file name falls into (in exclusive mode, if the stripe's map is to be modified)
+	void lock(const std::string& fname, bool exclusive);
+	// releases the SRWLock acquired by FileTable::lock() with the very same arguments
+	void unlock(const std::string& fname, bool exclusive);
+
+	/*
+	the following functions expect the stripe of the given file name to be locked - in shared mode for find, in exclusive mode for insert/erase -
+	or no other thread to access the table at the same time (KernelFS::filesSRWLock acquired exclusively)
+	*/
+	// returns the FileDesc object of the given file (marking it as recently used), or nullptr if there is none
+	FileDesc* find(const std::string& fname);
+	// inserts the FileDesc object of the given file, first evicting one from the stripe if it is full
+	void insert(const std::string& fname, FileDesc* fd);
+	void erase(const std::string& fname);
+
+	// removes and deletes all of the FileDesc objects - used once none of the files is open
+	void clear();
+
+	FileTableStats stats();
+
+private:
+
+	struct Stripe {
+		SRWLOCK srwLock;
+		std::unordered_map<std::string, FileDesc*> files;
+	};
+
+	// returns the stripe the given file name falls into
+	Stripe& stripeOf(const std::string& fname);
+	// removes and deletes the least recently used FileDesc object of a closed file from the (exclusively locked) stripe, if there is one
+	void evict(Stripe& stripe);
+
+	Stripe stripes[FILE_TABLE_STRIPES];
+
+	// changed with Interlocked* functions, since lookups happen while the stripes are locked in shared mode
+	LONG clock; // stamps FileDesc::lastUsed
+	LONG resident, hits, misses, evictions;
+
+};
+
+#endif // _FILETABLE_H_
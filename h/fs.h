@@ -6,6 +6,121 @@ typedef unsigned long BytesCnt;
 const unsigned int FNAMELEN = 8; // maximum file name length (in characters)
 const unsigned int FEXTLEN = 3; // maximum file extension length (in characters)
 
+// drives the partitions get mounted on ('A' to 'Z'); a file on a drive other than DEFAULT_DRIVE is named with its drive's prefix - "X:/name.ext"
+const char DEFAULT_DRIVE = 'A';
+
+// returned by the try* operations (FS::tryMount, ...) when they could not complete before their time-out expired
+const char FS_BUSY = 2;
+// returned by FS::check when the partition has inconsistencies left (counted in its CheckReport)
+const char FS_INCONSISTENT = 3;
+
+// format options (passed to FS::format, may be combined using |)
+const unsigned int FORMAT_EXTENTS = 0x01; // files are mapped through (start cluster, length) extents instead of the two-level index
+// metadata updates are logged into a journal on the partition and written in place in the background (ignored for very small partitions)
+const unsigned int FORMAT_JOURNAL = 0x02;
+// only the superblock and the first cluster(s) of the bit vector are written - the rest of the bit vector gets written on first use,
+// so formatting takes the same time no matter how large the partition is
+const unsigned int FORMAT_LAZY = 0x04;
+// every data cluster gets a CRC32C checksum (kept in a region of the partition), verified whenever the cluster is read from the partition -
+// reading a corrupted cluster fails instead of returning its contents
+const unsigned int FORMAT_CHECKSUMS = 0x08;
+// whole data clusters written to files are looked up by the fingerprint of their contents: a cluster identical to one which is already
+// stored is shared (reference counted, just as a COPY_CLONE copy's clusters are) instead of being written again; applies to the files
+// mapped through the two-level index which are neither inline nor compressed
+const unsigned int FORMAT_DEDUP = 0x10;
+
+// mount options (passed to FS::mount, may be combined using |)
+// the data clusters of a partition formatted with FORMAT_CHECKSUMS are not verified when read (their checksums are still kept up to date)
+const unsigned int MOUNT_NO_VERIFY = 0x01;
+
+// open options (passed to FS::open, may be combined using |)
+// the file opened in 'w' mode is (re)created compressed: its data is kept in groups of clusters compressed by a fast LZ codec,
+// which are decompressed on the fly when read
+const unsigned int OPEN_COMPRESSED = 0x01;
+
+// copy options (passed to FS::copyFile)
+const unsigned int COPY_CLONE = 0x01; // the copy shares the source's data clusters, which get copied only once either file writes to them
+
+// check options (passed to FS::check)
+const unsigned int CHECK_REPAIR = 0x01; // the inconsistencies found get repaired (all but the cross-linked clusters)
+
+// statistics of the open-file table, which keeps the descriptors of the recently used files (returned by FS::fileTableStats)
+struct FileTableStats {
+	FileCnt resident; // number of file descriptors currently kept in the table
+	FileCnt capacity; // number of file descriptors kept before the ones of closed files start being evicted
+	unsigned long hits; // lookups served by the table
+	unsigned long misses; // lookups which had to search the root directory
+	unsigned long evictions; // descriptors of closed files evicted (least recently used first) to keep the table within its capacity
+};
+
+// deduplication statistics of a partition formatted with FORMAT_DEDUP (returned by FS::dedupStats)
+struct DedupStats {
+	unsigned long clustersWritten; // whole data clusters written to files since the partition has been formatted
+	unsigned long duplicateClusters; // of those, the ones which have been shared with an identical stored cluster instead of being written
+	unsigned long indexedClusters; // stored data clusters currently kept in the deduplication index
+	unsigned long references; // references of the files (and snapshots) to the indexed clusters
+	double ratio; // how many times the indexed clusters' data would take up more space without deduplication (references / indexedClusters)
+};
+
+// result of a consistency check of a partition (returned through FS::check); the counts are of the inconsistencies found, before any repair
+struct CheckReport {
+	FileCnt files; // files found in the root directory (the bad ones not included)
+	unsigned long referencedClusters; // clusters in use - the reserved ones, the index clusters and the files' data clusters
+	unsigned long freeClusters; // clusters evidented as free by the bit vector (after the repair, with CHECK_REPAIR)
+	unsigned long leakedClusters; // clusters taken in the bit vector which nothing refers to
+	unsigned long lostClusters; // clusters in use which the bit vector evidents as free
+	unsigned long crossLinkedClusters; // index clusters referenced more than once, or by a file's data as well
+	unsigned long badReferences; // index entries (and extents) which point past the end of the partition or into its reserved clusters
+	unsigned long badFiles; // file descriptors whose index cluster is not on the partition (the descriptors get cleared on repair)
+	unsigned long wrongReferenceCounts; // shared data clusters whose reference counts do not match the references found
+};
+
+// operations measured by FS::stats (indexes of FSStats::ops)
+const unsigned int
+	OP_OPEN = 0, // FS::open/FS::tryOpen
+	OP_READ = 1, // File::read
+	OP_WRITE = 2, // File::write
+	OP_CLOSE = 3, // deleting the File object (which updates the file's size and releases the handle - its dirty clusters are left
+		// in its cache, for the flusher thread, File::sync/FS::sync or the unmount to write them back)
+	OP_DELETE = 4, // FS::deleteFile
+	OP_ALLOCATE = 5, // allocation of a single cluster (searching the bit vector)
+	OP_WRITE_BACK = 6, // a batch of data clusters written to the partition (dirty clusters written back, copies, write-through clusters)
+	NUM_OF_OPS = 7;
+
+// latency statistics of one kind of operation, the latencies in microseconds (see FSStats)
+struct OperationStats {
+	unsigned long long count; // operations measured
+	unsigned long long bytes; // bytes transferred by them (OP_READ/OP_WRITE - read/written by the caller, OP_WRITE_BACK - written to the partition)
+	double mean, p50, p90, p99, p999, max; // the percentiles are accurate to within about 3%
+};
+
+// locks whose waits are measured by FS::stats (indexes of FSStats::locks)
+const unsigned int
+	LOCK_FILE = 0, // a file's lock, held by its handles while the file is open
+	LOCK_RANGE = 1, // a file's cluster-range locks, held by File::read/File::write for the clusters they transfer
+	LOCK_PARTITION = 2, // a drive's mounted partition (exclusive for mount/unmount/format/check, shared for the rest of the operations)
+	LOCK_FILES = 3, // a drive's open-file table
+	LOCK_DIRECTORY = 4, // a drive's root directory
+	LOCK_ALLOCATOR = 5, // a drive's bit vector and the reference counts of its shared data clusters
+	NUM_OF_LOCKS = 6;
+
+// wait statistics of one kind of lock, the waits in microseconds (see FSStats)
+struct LockStats {
+	unsigned long long acquisitions; // times the lock has been acquired (or has timed out, for a file's lock)
+	unsigned long long waits; // of those, the ones which have found it held by another thread and have had to wait
+	double waitTotal, waitMax; // time spent waiting by all of the waits, and by the longest one
+};
+
+// statistics of the operations on all of the drives since the program has started, while the statistics have been enabled (returned by FS::stats)
+struct FSStats {
+	bool enabled; // whether or not the operations are being measured (false - FS::enableStats(false) was called, or FS_NO_STATS was defined)
+	OperationStats ops[NUM_OF_OPS]; // indexed by the OP_* constants above
+	LockStats locks[NUM_OF_LOCKS]; // indexed by the LOCK_* constants above
+	unsigned long long dataClustersRead, dataClustersWritten; // data clusters transferred from/to the partitions
+	unsigned long long metadataClustersRead, metadataClustersWritten; // metadata clusters read/written (through the journal, if there is one)
+	unsigned long long cacheHits, cacheMisses; // clusters read by the files which have (not) been found in their caches
+};
+
 class KernelFS;
 class Partition;
 class File;
@@ -16,49 +131,57 @@ public:
 	~FS();
 
 	/*
-	Description: mounts the partition; the file system allows only one mounted partition at a time;
-		therefore, whoever tries mounting a partition when there already is a mounted one will get blocked
+	Description: mounts the partition on the given drive; every drive allows only one mounted partition at a time;
+		therefore, whoever tries mounting a partition on a drive which already has a mounted one will get blocked;
+		partitions mounted on different drives are used independently of each other; options are the MOUNT_* options above
 	Return value(s): 
 		- 1 if mounting was successfull, 
 		- 0 otherwise
 	Potential errors:
 		- partition is a null pointer
+		- drive is not a valid drive letter
+		- the partition is already mounted on another drive
 	*/
-	static char mount(Partition* partition);
+	static char mount(Partition* partition, char drive = DEFAULT_DRIVE, unsigned int options = 0);
 	/*
-	Description: unmounts the partition; whoever calls unmount will get blocked untill all files from the mounted partition are closed
+	Description: unmounts the partition from the given drive; whoever calls unmount will get blocked untill all files from the mounted partition are closed
 	Reutrn value(s): 
 		- 1 if unmounting was successfull, 
 		- 0 otherwise
 	Potential errors:
 		- there is no mounted partition yet
+		- drive is not a valid drive letter
 	*/
-	static char unmount();
+	static char unmount(char drive = DEFAULT_DRIVE);
 
 	/*
-	Desription: formats the MOUNTED partition by initializing all of the data structures required for the file system to work
+	Desription: formats the partition MOUNTED on the given drive by initializing all of the data structures required for the file system to work;
+		options select the on-disk layout of the files created on the partition (see the FORMAT_* constants above); a partition which
+		has already been formatted (by this or by any other program) gets formatted again, erasing all of its files, once the files
+		open on the drive get closed (no files can get opened on the drive in the meantime)
 	Return value(s):
 		- 1 if formatting was successfull,
 		- 0 otherwise
 	Potential errors:
 		- there is no mounted partition yet
-		- the mounted partition is already formatted???
+		- drive is not a valid drive letter
 		- out of memory exception (when forming a buffer to initialize the bit-vector and the root directory)
 	*/
-	static char format();
+	static char format(unsigned int options = 0, char drive = DEFAULT_DRIVE);
 
 	/*
-	Description: returns the number of files on the mounted partition
+	Description: returns the number of files on the partition mounted on the given drive
 	Return value(s): 
 		- -1 in case of an error,
 		- the number of files on the mounted partition otherwise
 	Potential errors:
 		- there is no mounted partition yet
+		- drive is not a valid drive letter
 		- the mounted partition is not formatted yet
 		- out of memory exception (when forming a buffer to read entries inside of the root directory)
 		- readCluster method from part.h returning error
 	*/
-	static FileCnt readRootDir();
+	static FileCnt readRootDir(char drive = DEFAULT_DRIVE);
 
 	/*
 	Description: checks whether or not the file, with the given fname (ABSOLUTE PATH) as an argument, exists inside of the root directory
@@ -74,19 +197,28 @@ public:
 
 	/*
 	Description: opens a file with the given fname (ABSOLUTE PATH) as an argument in the given mode;
-		if the file has already been opened exclusively (write mode), the running thread is blocked untill it is safe to open the file in the given mode
+		if the file has already been opened exclusively (write mode), the running thread is blocked untill it is safe to open the file in the given mode;
+		options (the OPEN_* constants above) apply to the file a 'w' open creates - the file stays compressed (or not) until it is opened in 'w' mode again
 	Return value(s):
 		- a pointer towards a File object which represents the open file
 		- null in case of an error
 	Potential errors:
 		- fname is a null pointer
-		- opening a non-existing file in 'r'/'a' mode 
+		- opening a non-existing file in 'r'/'a'/'m'/'s' mode 
+		- the partition is waiting for its open files to get closed, to be formatted
 	Other: Modes:
 				- 'r' - file is open in read-only mode; if the file does not exist an error is returned
 				- 'w' - file is open in both read and write mode; if the file exists, its content is DELETED, otherwise - creates new file
 				- 'a' - file is open either in read or write mode; cursor is set to the end of file; file has to exist, otherwise - an error is returned 
+				- 'm' - file is open in both read and write mode, shared with other threads which open it in 'r'/'m' mode; cursor is set to the
+					beginning of file; each read/write/truncate locks only the clusters it touches, so that the threads can access the file's
+					non-overlapping parts in parallel; file has to exist, otherwise - an error is returned
+				- 's' - file is open in read-only mode, reading a snapshot of the file's last closed version: the handle never waits for
+					the handles writing to the file (nor they for it) and does not see their changes, which are made to copies of the snapshot's
+					clusters (copy-on-write); only the very first 's' open of a file which is already being written to waits for the writers
+					to close it; file has to exist, otherwise - an error is returned
 	*/
-	static File* open(char* fname, char mode);
+	static File* open(char* fname, char mode, unsigned int options = 0);
 	/*
 	Description: deletes a file with the given fname (ABSOLUTE PATH) as an argument, ONLY if the file is not open
 	Return value(s):
@@ -99,6 +231,130 @@ public:
 	*/
 	static char deleteFile(char* fname);
 
+	/*
+	Description: copies a file with the given srcFname (ABSOLUTE PATH) into a file with the given dstFname (ABSOLUTE PATH), inside of the
+		file system - cluster by cluster, without passing the data through the caller's memory; if the destination file exists, it is overwritten;
+		with COPY_CLONE, the copy only shares the source's data clusters (copy-on-write), which makes copying a large file nearly free
+	Return value(s):
+		- 0 in case of an error
+		- 1, otherwise
+	Potential errors:
+		- srcFname/dstFname is a null pointer, or srcFname and dstFname are the same file
+		- srcFname and dstFname are on different drives
+		- file with the given srcFname does not exist
+		- either of the files is open
+		- no free clusters left for the copy (the destination file is left empty)
+		- a data cluster of the source file does not match its checksum (the destination file is left empty)
+	*/
+	static char copyFile(char* srcFname, char* dstFname, unsigned int options = 0);
+
+	/*
+	Description: returns the statistics of the given drive's open-file table since the program has started (see FileTableStats above);
+		all zeros for an invalid drive letter
+	*/
+	static FileTableStats fileTableStats(char drive = DEFAULT_DRIVE);
+
+	/*
+	Description: returns the deduplication statistics of the partition mounted on the given drive (see DedupStats above); all zeros
+		(with a ratio of 1) for a partition formatted without FORMAT_DEDUP, an invalid drive letter, or a drive with no partition mounted
+	*/
+	static DedupStats dedupStats(char drive = DEFAULT_DRIVE);
+
+	/*
+	Description: makes the given drive durable: writes back the dirty clusters of all of its files and commits the metadata updates done
+		so far; the sizes of the files which are still open are committed by File::sync or once they get closed
+	Return value(s):
+		- 0 in case of an error
+		- 1, otherwise
+	Potential errors:
+		- invalid drive letter, or no partition is mounted on the drive
+	*/
+	static char sync(char drive = DEFAULT_DRIVE);
+
+	/*
+	Description: checks the consistency of the partition mounted on the given drive (see CheckReport above): walks the index trees of
+		the root directory and of all of the files (several files at a time), and compares the clusters they refer to with the bit vector
+		and with the reference counts of the shared data clusters; with CHECK_REPAIR, the bit vector and the reference counts are rebuilt
+		from the index trees, and the bad index entries get cleared; the same check (with the repair) is done when mounting a partition
+		which has not been unmounted cleanly, or which has shared data clusters (their reference counts are kept only in memory)
+	Return value(s):
+		- 1 if the partition is consistent (after the repair, with CHECK_REPAIR),
+		- FS_INCONSISTENT if inconsistencies have been found (without CHECK_REPAIR), or cross-linked clusters, which are not repaired
+			(the report tells which ones),
+		- FS_BUSY if any of the drive's files is open,
+		- 0 otherwise
+	Potential errors:
+		- invalid drive letter, or no partition is mounted on the drive, or the partition is not formatted
+	*/
+	static char check(CheckReport& report, unsigned int options = 0, char drive = DEFAULT_DRIVE);
+
+	/*
+	Description: returns a snapshot of the operation statistics (see FSStats above); every thread counts its own operations into
+		a histogram of its own, so measuring costs no contention between the threads, and the snapshot adds them all up
+	*/
+	static FSStats stats();
+	/*
+	Description: starts/stops measuring the operations (they are measured from the start of the program by default); the statistics
+		gathered so far are kept; building with FS_NO_STATS defined leaves the measuring out of the code altogether
+	*/
+	static void enableStats(bool enable);
+
+	/*
+	Description: returns the fragmentation score of a file with the given fname (ABSOLUTE PATH): the number of fragments (runs of
+		contiguous data clusters, in the file's logical order, holes skipped) its data is split into - 1 for a contiguous file, 0 for
+		an empty or inline file; waits for the file to be closed if it is open in 'w'/'a' mode
+	Return value(s):
+		- -1 in case of an error
+		- the number of fragments, otherwise
+	Potential errors:
+		- fname is a null pointer
+		- file with the given fname does not exist
+	*/
+	static long fragmentation(char* fname);
+
+	/*
+	Description: defragments a file with the given fname (ABSOLUTE PATH): its data clusters (and level 2 index clusters) are moved
+		into a single run of free clusters, a batch of clusters at a time, while the file stays open for reading - a handle which reads
+		(or writes in 'm' mode) the batch being moved waits just for that batch; waits for the file to be closed if it is open
+		in 'w'/'a' mode; data clusters which the file shares with its clones or snapshots are left where they are
+	Return value(s):
+		- 0 in case of an error
+		- 1, otherwise
+	Potential errors:
+		- fname is a null pointer
+		- file with the given fname does not exist
+		- no run of free clusters is long enough to hold the whole file (the file is left as it was)
+		- a data cluster of the file does not match its checksum (the clusters moved so far stay moved)
+	*/
+	static char defragment(char* fname);
+
+	/*
+	Description: starts the given drive's background defragmenter, or changes its I/O budget if it is already running: it goes through
+		the drive's files over and over, defragmenting the ones which are split into more than one fragment (skipping the ones open
+		in 'w'/'a' mode), moving at most clustersPerSecond clusters per second; 0 stops it, and so does unmounting the partition (formatting or checking it
+		pauses it until they are done)
+	Return value(s):
+		- 0 in case of an error
+		- 1, otherwise
+	Potential errors:
+		- invalid drive letter, or no partition is mounted on the drive (when starting it)
+	*/
+	static char startDefragmenter(unsigned long clustersPerSecond, char drive = DEFAULT_DRIVE);
+
+	/*
+	Description: variants of mount/unmount/format/open which, instead of blocking indefinitely, wait for at most timeout milliseconds
+		(0 - not at all) for the drive to be free, for the files on the drive to get closed, or for the file to be free (not open
+		in a conflicting mode), respectively; tryOpen returns the opened file through its file argument (nullptr, unless 1 is returned)
+	Return value(s):
+		- 1 if the operation was successfull,
+		- FS_BUSY if the time-out has expired,
+		- 0 in case of any other error (same as for the blocking variants)
+	*/
+	static char tryMount(Partition* partition, unsigned long timeout = 0, char drive = DEFAULT_DRIVE, unsigned int options = 0);
+	static char tryUnmount(unsigned long timeout = 0, char drive = DEFAULT_DRIVE);
+	static char tryFormat(unsigned int options = 0, unsigned long timeout = 0, char drive = DEFAULT_DRIVE);
+	static char tryOpen(char* fname, char mode, File*& file, unsigned long timeout = 0, unsigned int options = 0);
+
 protected:
 	FS();
 	static KernelFS *myImpl;
@@ -0,0 +1,95 @@
+#ifndef _FSCHECKER_H_
+#define _FSCHECKER_H_
+
+#include "part.h"
+#include "fs.h"
+#include <Windows.h>
+#include <vector>
+
+class KernelFS;
+
+const unsigned int CHECKER_MAX_THREADS = 8;
+// number of data clusters read in one batch while the deduplication index is being rebuilt
+const unsigned int CHECKER_REINDEX_BATCH = 64;
+
+/*
+	consistency checker of a mounted partition: the root directory is read a level of its index at a time (each level in one batch),
+	then the files are split across several threads, each walking a file's index tree (reading all of its level 2 index clusters in
+	one batch) and counting the references to every cluster; the counts are then compared with the bit vector and with the reference
+	counts of the shared data clusters, and, if asked to, the bit vector, the reference counts and the bad index entries get repaired
+*/
+class FSChecker {
+public:
+
+	FSChecker(KernelFS* fs);
+
+	/*
+	Description:
+		checks the mounted partition - the caller holds the drive's srwLock exclusively, with no files open (and nothing else using
+		the partition); repairing it also recounts the free clusters and the files; reindex (for a partition formatted with
+		FORMAT_DEDUP, whose deduplication index is empty) also rebuilds the index from the data clusters of the files
+	Return value(s):
+		- true, if the partition is consistent (after the repair, if repair is true)
+		- false, if inconsistencies are left (found while not repairing, or cross-linked clusters, which cannot be repaired)
+	*/
+	bool run(bool repair, CheckReport& report, bool reindex = false);
+
+private:
+
+	// file descriptor found in the root directory
+	struct FileEntry {
+		ClusterNo fileDescClusterNo; // cluster which holds the descriptor
+		unsigned int entryStart; // where the descriptor starts inside of the cluster
+		ClusterNo fileLvl1IndexClusterNo;
+		unsigned char fileFlags;
+	};
+
+	// body of a checker thread - checks the files (taking them one by one) until there are none left
+	static DWORD WINAPI worker(LPVOID checker);
+	// walks the file's index tree, counting the references to its clusters (and clearing its bad entries, if repairing)
+	void checkFile(const FileEntry& file);
+	// walks the root directory's index tree, counting the references to its clusters and collecting the files' descriptors
+	void checkRootDirectory();
+	// compares the bit vector with the clusters in use (rewriting its clusters which do not match, if repairing)
+	void checkBitVector();
+	// enters the data clusters found in the files written through the deduplication index into the index, reading them in batches
+	// (the first cluster found with each fingerprint gets in; a batch which cannot be read is left out)
+	void reindexClusters();
+	// compares the reference counts of the shared data clusters with the references found (rebuilding them, if repairing)
+	void checkReferenceCounts();
+	/*
+	Description:
+		counts a reference to the given cluster from an index (metadata) or from a file's data
+	Return value(s):
+		- true, if the cluster is one of the partition's data clusters
+		- false, if the reference is bad (past the end of the partition, or into the reserved clusters before the data clusters)
+	*/
+	bool reference(ClusterNo clusterNo, bool metadata);
+	/*
+	Description:
+		counts the references from the index cluster's entries (to metadata or to data clusters), adding the referenced clusters to
+		clusterNos (unless it is nullptr); a bad entry is left out (and cleared, if repairing)
+	Return value(s):
+		- true, if a bad entry has been cleared (the index cluster has to be written back)
+		- false, otherwise
+	*/
+	bool collectEntries(char* indexCluster, bool metadata, std::vector<ClusterNo>* clusterNos);
+	/*
+	Description: reads the given clusters into the buffer (resized to hold them), all in one batch
+	Return value(s): false, if a cluster read does not match its checksum
+	*/
+	bool readClusters(const std::vector<ClusterNo>& clusterNos, std::vector<char>& buffer);
+
+	KernelFS* fs;
+	bool repair, reindex;
+	ClusterNo firstDataClusterNo; // clusters before it are reserved (superblock, bit vector, root directory, journal, checksums)
+	std::vector<LONG> metadataReferences, dataReferences; // references found to every cluster of the partition
+	std::vector<LONG> indexable; // 1 - the data cluster belongs to a file written through the deduplication index (when reindexing)
+	std::vector<FileEntry> files;
+	LONG nextFileNo; // next file to be checked by a thread
+	LONG badReferences; // counted by the threads
+	unsigned long badFiles, leakedClusters, lostClusters, crossLinkedClusters, wrongReferenceCounts, freeClusters;
+
+};
+
+#endif // _FSCHECKER_H_
@@ -0,0 +1,118 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "part.h"
+#include <Windows.h>
+#include <synchapi.h>
+#include <unordered_map>
+#include <vector>
+
+const ClusterNo JOURNAL_SIZE_IN_CLUSTERS = 64; // the journal's header cluster, followed by its log clusters
+const DWORD JOURNAL_CHECKPOINT_INTERVAL = 1000; // milliseconds between the background checkpoints of a journal which has been written to
+
+/*
+	write-ahead journal of a drive's metadata clusters (bit vector, root directory, file descriptors and index clusters), kept in a region
+	of the partition: the clusters are updated in memory and every update is logged as a compact record - just the changed bytes of
+	the cluster; the records become durable at commit, which writes the records of all of the threads committing at the same time as
+	a single batch of log clusters (group commit); a background thread checkpoints the journal - writes the updated clusters in place
+	and empties the log - while mounting the partition replays the committed records the last checkpoint has not covered
+*/
+class Journal {
+public:
+
+	// the journal takes up numOfClusters clusters of the partition, starting with the start cluster (its header)
+	Journal(Partition* partition, ClusterNo start, ClusterNo numOfClusters);
+	// stops the checkpointer thread and checkpoints the journal, so that the partition is left up to date
+	~Journal();
+
+	// starts an empty log - used when the partition gets formatted
+	void initialize();
+	/*
+	Description:
+		replays the committed records which the last checkpoint has not covered (the records of a batch which has not been written
+		out as a whole are dropped), writing the replayed clusters in place, and starts an empty log
+	Return value(s):
+		- number of records replayed
+	*/
+	unsigned long recover();
+
+	// reads a metadata cluster - its in-memory version, if it has been updated since the last checkpoint
+	void readCluster(ClusterNo clusterNo, char* buffer);
+	// updates a metadata cluster, logging its changed bytes (the whole cluster, on its first update since the last checkpoint)
+	void writeCluster(ClusterNo clusterNo, const char* buffer);
+	/*
+	Description:
+		copies the in-memory version of the cluster into the buffer
+	Return value(s):
+		- true, if the cluster has been updated since the last checkpoint
+		- false, otherwise (the buffer is left as is)
+	*/
+	bool lookup(ClusterNo clusterNo, char* buffer);
+	// stops tracking a cluster which is not metadata anymore (it has been deallocated, or written to as data), so that neither
+	// a checkpoint nor a replay write its old contents over the new ones
+	void revoke(ClusterNo clusterNo);
+
+	// waits until all of the records logged so far are durable, writing them out itself if no other thread is already doing so
+	void commit();
+	// writes all of the updated clusters in place and empties the log
+	void checkpoint();
+
+private:
+
+	static const unsigned int
+		BLOCK_HEADER_SIZE, // magic, generation, block number, payload size, last block of its batch
+		BLOCK_PAYLOAD_SIZE,
+		RECORD_HEADER_SIZE; // type, cluster number, offset and length of the changed bytes
+	static const char
+		RECORD_WRITE,
+		RECORD_REVOKE;
+
+	// body of the journal's (given through the argument) checkpointer thread
+	static DWORD WINAPI checkpointer(LPVOID journal);
+
+	// appends a record to the ones not yet written out (called with srwLock held exclusively)
+	void logRecord(char type, ClusterNo clusterNo, unsigned int offset, unsigned int length, const char* bytes);
+	// writes out the logged records as one batch (called with srwLock held exclusively and busy false, returns the same way)
+	void flush();
+	// writes the updated clusters in place and empties the log (called with srwLock held exclusively and busy false, returns the same way)
+	void writeInPlace();
+	// writes the records into the log clusters starting with the given one, the last of them marked as the end of the batch
+	void writeBlocks(const std::vector<char>& batch, ClusterNo firstBlockNo, unsigned long blockGeneration);
+	void writeHeader(unsigned long headerGeneration);
+	// applies a batch of records onto the replayed clusters, returning the number of records applied
+	unsigned long replay(const std::vector<char>& batch, std::unordered_map<ClusterNo, std::vector<char>>& replayed);
+	// number of log clusters the given number of bytes of records take up
+	static ClusterNo numOfBlocks(size_t size);
+	static bool hasMagic(const char* cluster);
+	// little-endian fields of size bytes
+	static unsigned long getField(const char* field, unsigned int size);
+	static void setField(char* field, unsigned int size, unsigned long value);
+
+	Partition* partition;
+	ClusterNo start, numOfClusters;
+	// changed by every checkpoint, so that the log clusters of the previous generation stop being valid without having to be cleared
+	unsigned long generation;
+	ClusterNo nextBlockNo; // next log cluster to be written (0 - the one right after the header)
+
+	// in-memory versions of the clusters updated since the last checkpoint
+	std::unordered_map<ClusterNo, std::vector<char>> clusters;
+	// clusters a running checkpoint is writing in place - they are read from here until they are written
+	std::unordered_map<ClusterNo, std::vector<char>> checkpointed;
+	std::vector<char> records; // logged, but not yet written out
+	unsigned long long logged, durable; // number of bytes of records logged / written out so far
+	bool busy; // a flush or a checkpoint is writing to the partition (without holding srwLock)
+	bool checkpointRequested; // the log is more than half full - the checkpointer thread has been woken up
+	bool stopping;
+	/*
+		srwLock guards all of the above; it is taken after all of the file system's locks, and never held while waiting for the partition,
+		except that a thread which revokes a cluster being checkpointed waits for the checkpoint to write it first
+	*/
+	SRWLOCK srwLock;
+	CONDITION_VARIABLE idle; // busy has been set to false
+	// released to wake the checkpointer thread up before its interval expires (type: SemaphoreObject from win32 API)
+	HANDLE ok_to_checkpoint;
+	HANDLE checkpointerThread;
+
+};
+
+#endif // _JOURNAL_H_
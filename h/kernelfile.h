@@ -3,13 +3,20 @@
 
 #include "file.h"
 #include "part.h"
+#include <vector>
 
 class FileDesc;
+class KernelFS;
+struct FileSnapshot;
+
+const unsigned int CLUSTERS_PER_MAPPING = 64; // how many logical clusters read/write map onto data clusters while holding the file's metadata lock
+const unsigned int COMPRESSION_GROUP_SIZE = 8; // how many logical clusters of a compressed file get compressed together (as a group)
+const BytesCnt COMPRESSION_GROUP_SIZE_IN_BYTES = COMPRESSION_GROUP_SIZE * ClusterSize;
 
 class KernelFile {
 public:
 
-	KernelFile(std::string fname, char mode, BytesCnt fileSize);
+	KernelFile(KernelFS* fs, FileDesc* fileDesc, char mode, BytesCnt fileSize);
 	~KernelFile();
 	char write(BytesCnt, char* buffer);
 	BytesCnt read(BytesCnt, char* buffer);
@@ -18,27 +25,194 @@ public:
 	char eof();
 	BytesCnt getFileSize();
 	char truncate();
+	char sync();
+
+	// returns the number of fragments (runs of contiguous data clusters, holes skipped) the file's data is split into
+	long fragmentation();
+	/*
+	Description:
+		moves the file's level 2 index clusters and data clusters (in their logical order) into a newly allocated run of contiguous clusters;
+		data clusters are moved CLUSTERS_PER_MAPPING logical clusters at a time, while their range is locked exclusively, so that the file stays
+		open for the other handles; the background defragmenter leaves a file with at most one fragment as it is, and gets throttled after
+		every batch (called through a handle opened in 'r' mode)
+	Return value(s):
+		- number of data clusters moved
+		- -1, if no run of free clusters is long enough, or if a data cluster does not match its checksum
+	*/
+	long defragment(bool background);
 
 private:
 
-	// allocates cluster atomically (call of KernelFS::allocateCluster() is surrounded by acquiring/releasing KernelFS::srwLock)
-	ClusterNo allocateClusterAtomic();
-	// deallocates given cluster atomically (call of KernelFS::deallocateCluster() is surrounded by acquiring/releasing KernelFS::srwLock)
-	void deallocateClusterAtomic(ClusterNo);
-	
+	/*
+	Description:
+		locks the file's metadata (FileDesc::metadataSRWLock) shared by the handles which have the file opened in 'r'/'m' mode,
+		and brings fileSize and fileFlags of the handle up to date with it; a handle opened in 'w'/'a' mode has the file to itself,
+		so nothing is done for it
+	*/
+	void lockMetadata(bool exclusive);
+	// unlocks the file's metadata locked by KernelFile::lockMetadata(), publishing fileSize and fileFlags of the handle if it was locked exclusively
+	void unlockMetadata(bool exclusive);
+
+	// KernelFile::read(BytesCnt, char*) for handles opened in 's' mode - reads the pinned snapshot, without locking anything
+	BytesCnt readSnapshot(BytesCnt bytesCnt, char* buffer);
+
+	/*
+		write/read/truncate of a compressed file (KernelFS::FILE_FLAG_COMPRESSED), done a group of COMPRESSION_GROUP_SIZE logical clusters
+		at a time: a group is decompressed into the group buffer, modified there and compressed into newly allocated clusters; a handle
+		opened in 'w'/'a' mode keeps the last group it has written to buffered, until it moves on to another group (or syncs, or gets closed)
+	*/
+	char writeCompressed(BytesCnt bytesCnt, char* buffer);
+	BytesCnt readCompressed(BytesCnt bytesCnt, char* buffer);
+	char truncateCompressed();
+	/*
+	Description:
+		decompresses the given group of the file into the group buffer (a hole, or a group past the eof, reads as zeros)
+	Return value(s):
+		- 1, if the group has been loaded
+		- 0, if a cluster of the group does not match its checksum, or the group cannot be decompressed (nothing is buffered)
+	*/
+	char loadGroup(unsigned long groupNo);
+	/*
+	Description:
+		compresses the buffered group into newly allocated clusters, which get mapped through the group's level 2 index entries
+		in place of its old clusters (those are deallocated, so clones and snapshots keep their own): the compressed group, preceded
+		by its length, takes up the first entries, while a group which does not compress into fewer clusters is kept as it is in all
+		COMPRESSION_GROUP_SIZE of them; a group of zeros becomes a hole
+	Return value(s):
+		- 1, if the group has been stored
+		- 0, if no free clusters are left (the group stays buffered)
+	*/
+	char storeGroup();
+	/*
+	Description:
+		decodes a group kept in the given clusters (the group's level 2 index entries) into data, reading the clusters through the file's
+		cache or straight from the partition (for a snapshot, which never gets written to)
+	Return value(s):
+		- 1, if the group has been decoded
+		- 0, if a cluster does not match its checksum or the group cannot be decompressed
+	*/
+	char decodeGroup(const ClusterNo* clusterNos, char* data, bool throughCache);
+
+	/*
+	Description:
+		counts the fragments of the file's data (called with the metadata locked), returning the logical clusters which have data clusters
+		through the argument (if given)
+	*/
+	unsigned long countFragments(std::vector<unsigned long>* clusterIndexes);
+
 	// checks whether or not the given file's level 2 index cluster can be deallocated
 	bool okToDeallocate(char* fileLvl2IndexCluster);
 
-	// updates file size 
-	void updateFileSize(FileDesc* fileDesc);
+	// updates file size (and file flags, which change when file's data is moved out of/back into its index cluster)
+	void updateFileSize();
 
+	/*
+	Description:
+		moves the data of an inline file out of its index cluster into a newly allocated data cluster, turning the index cluster
+		into an (empty) index of the file's layout - done when the file grows beyond one cluster
+	Return value(s):
+		- true, if the data has been moved
+		- false, if no free cluster was found (file stays inline)
+	*/
+	bool promoteInlineData();
 
-	std::string fname;
+	/*
+	Description:
+		maps the file's logical cluster (byte position / ClusterSize) onto the data cluster which holds it, depending on the file's layout;
+		if allocate is true and the logical cluster has no data cluster yet, a new (zero-filled) data cluster is allocated for it
+	Return value(s):
+		- number of the data cluster
+		- 0, if the logical cluster has no data cluster (and allocate is false) or if the allocation failed
+	*/
+	ClusterNo getDataCluster(unsigned long clusterIndex, bool allocate);
+	/*
+	Description:
+		buffers the level 2 index cluster which maps the logical cluster into lvl2Buffer (allocating an empty one, if allocate is true)
+	Return value(s):
+		- true, if the level 2 index cluster is buffered
+		- false, if the logical cluster has no level 2 index cluster (and allocate is false) or if the allocation failed
+	*/
+	bool loadLvl2IndexCluster(unsigned long clusterIndex, bool allocate);
+	/*
+	Description:
+		writes a whole logical cluster of a file on a partition formatted with FORMAT_DEDUP: the logical cluster gets mapped onto a stored
+		cluster with the same contents, if there is one, or onto a newly allocated cluster (written straight to the partition and entered
+		into the deduplication index); its previous data cluster is deallocated
+	Return value(s):
+		- true, if the logical cluster has been written
+		- false, if no free cluster is left
+	*/
+	bool writeDedupCluster(unsigned long clusterIndex, const char* data);
+	// getDataCluster(unsigned long, bool) for files which have their data clusters mapped through a table of extents
+	ClusterNo getExtentDataCluster(unsigned long clusterIndex, bool allocate);
+	/*
+	Description:
+		gives the file its own copy of a data cluster which it shares with its clones (copy-on-write) and maps the logical cluster onto the copy;
+		a data cluster which is not shared is returned as it is
+	Return value(s):
+		- number of the data cluster which can be written to
+		- 0, if no free cluster was found (or the extent table is full)
+	*/
+	ClusterNo unshareDataCluster(unsigned long clusterIndex, ClusterNo dataClusterNo);
+	// returns the number of the last extent which starts at or before the logical cluster (-1, if there is none)
+	int findExtent(unsigned long clusterIndex);
+	/*
+	Description:
+		maps the logical cluster, covered by the extent with the given number, onto the given data cluster by splitting the extent around it
+	Return value(s):
+		- true, if the extent table has been updated
+		- false, if the extent table would overflow its cluster (extents are left in an unspecified state)
+	*/
+	bool mapExtentCluster(unsigned int extentNo, unsigned long clusterIndex, ClusterNo dataClusterNo);
+	// merges neighbouring extents (contiguous data clusters or two holes) and recomputes their logical starts
+	void mergeExtents();
+	// writes the decoded extent table back into lvl1Buffer
+	void encodeExtents();
+	// deallocates all of the data clusters starting from the given logical cluster, and the index clusters left empty
+	void deallocateDataClusters(unsigned long firstClusterIndex);
+	// deallocateDataClusters(unsigned long) for files which have their data clusters mapped through a table of extents
+	void deallocateExtentDataClusters(unsigned long firstClusterIndex);
+
+	// reads file's level 1 index cluster (or extent table) into lvl1Buffer, if it isn't already buffered
+	void loadLvl1IndexCluster();
+	// writes back the buffered index clusters which have been modified and empties the buffers - called at the end of every operation
+	void flushIndexClusters();
+
+	// index cluster buffered while a single operation walks the file, so it does not get reread for every data cluster
+	struct IndexBuffer {
+		ClusterNo clusterNo; // 0 - nothing is buffered
+		bool dirty;
+		char data[ClusterSize];
+	};
+
+	// one entry of the extent table, kept in the file's index cluster as a (start, length) pair
+	struct Extent {
+		unsigned long logicalStart; // first logical cluster of the file mapped by the extent (not stored, sum of the preceding lengths)
+		ClusterNo start; // first data cluster of the extent; 0 - the extent is a hole (its clusters are not allocated)
+		unsigned long length; // number of contiguous data clusters in the extent
+	};
+
+	KernelFS* fs; // file system of the drive the file is on
+	FileDesc* fileDesc; // stays in the open-file table for as long as the file is open
+	FileSnapshot* snapshot; // version of the file read by a handle opened in 's' mode (nullptr for the other modes)
 	char mode;
 	ClusterNo fileLvl1IndexClusterNo;
+	unsigned char fileFlags;
 	BytesCnt fileSize;
 	BytesCnt cursor;
 
+	IndexBuffer lvl1Buffer, lvl2Buffer;
+	std::vector<Extent> extents; // decoded extent table, valid while lvl1Buffer is (only for files with the extents layout)
+
+	// decompressed group of a compressed file
+	struct GroupBuffer {
+		unsigned long groupNo; // ULONG_MAX - nothing is buffered
+		bool dirty; // written to (through a 'w'/'a' handle), but not stored yet
+		unsigned int length; // number of the file's bytes inside of the group
+		std::vector<char> data; // COMPRESSION_GROUP_SIZE clusters, allocated on first use
+	};
+	GroupBuffer group;
+
 };
 
 #endif // _KERNELFILE_H_
@@ -0,0 +1,45 @@
+#ifndef _LZCODEC_H_
+#define _LZCODEC_H_
+
+/*
+	fast LZ77 codec (the LZ4 block format): the input is split into sequences of literal bytes followed by a match - a copy
+	of at least LZ_MIN_MATCH bytes from up to 64KB back; matches are found through a hash table of the positions of 4-byte prefixes,
+	so compressing takes a single pass and decompressing is little more than copying
+*/
+class LZCodec {
+public:
+
+	/*
+	Description:
+		compresses length bytes of data into output, which can hold capacity bytes
+	Return value(s):
+		- number of bytes of the compressed data
+		- 0, if the compressed data does not fit into capacity bytes
+	*/
+	static unsigned int compress(const char* data, unsigned int length, char* output, unsigned int capacity);
+	/*
+	Description:
+		decompresses length bytes of compressed data into output, which can hold capacity bytes
+	Return value(s):
+		- number of bytes of the decompressed data
+		- 0, if the compressed data is malformed, or does not fit into capacity bytes once decompressed
+	*/
+	static unsigned int decompress(const char* data, unsigned int length, char* output, unsigned int capacity);
+
+private:
+
+	static const unsigned int
+		LZ_MIN_MATCH, // shortest match worth encoding
+		LZ_LAST_LITERALS, // the last bytes of the input are always literals
+		LZ_MATCH_GUARD, // a match cannot start this close to the end of the input
+		LZ_MAX_OFFSET, // matches are looked for at most this far back
+		LZ_HASH_BITS; // the hash table has 2^LZ_HASH_BITS entries
+
+	// hash of the 4 bytes at the given position, used to index the hash table
+	static unsigned int hash(const unsigned char* position);
+	// writes a length in the format of the sequence's token nibble (15 and more - continued in bytes of up to 255)
+	static bool writeLength(unsigned int length, unsigned char*& output, const unsigned char* outputEnd);
+
+};
+
+#endif // _LZCODEC_H_
@@ -0,0 +1,33 @@
+#ifndef _RAMPARTITION_H_
+#define _RAMPARTITION_H_
+
+#include "part.h"
+#include <vector>
+
+/*
+	partition kept entirely in memory: its clusters are transferred by copying them, which makes it a stand-in for a disk that costs
+	next to nothing to access (used to measure the file system itself); several threads may transfer different clusters at once
+*/
+class RamPartition : public Partition {
+public:
+
+	/*
+	Description:
+		creates a partition of numOfClusters zero-filled clusters; ini is only passed on to Partition's constructor - the partition
+		keeps none of its data there, so it may describe a partition of 0 clusters
+	*/
+	RamPartition(char* ini, ClusterNo numOfClusters);
+
+	ClusterNo getNumOfClusters() const override;
+
+	int readCluster(ClusterNo clusterNo, char* buffer) override;
+	int writeCluster(ClusterNo clusterNo, const char* buffer) override;
+
+private:
+
+	std::vector<char> clusters;
+	ClusterNo numOfClusters;
+
+};
+
+#endif // _RAMPARTITION_H_
@@ -0,0 +1,79 @@
+#ifndef _READPOOL_H_
+#define _READPOOL_H_
+
+#include "part.h"
+#include "fs.h"
+#include <Windows.h>
+#include <synchapi.h>
+#include <vector>
+#include <deque>
+
+class ClusterCache;
+
+const unsigned int READ_POOL_MAX_THREADS = 8;
+const BytesCnt PARALLEL_READ_THRESHOLD = 128 * ClusterSize; // reads of at least this many bytes get split across the reader threads
+
+/*
+	pool of reader threads of a drive: a large read is split into batches of data clusters (as they get mapped), which the threads
+	fetch and copy into the caller's buffer concurrently, while the caller goes on mapping the next batches
+*/
+class ReadPool {
+public:
+
+	// data clusters of a read's batch, along with the part of the caller's buffer they are copied into
+	struct Task {
+		ClusterCache* cache; // cache of the file being read
+		std::vector<ClusterNo> dataClusterNos; // data cluster of every logical cluster of the batch (0 - a hole)
+		unsigned int startingByteNo; // first byte to be copied, inside of the batch's first cluster
+		BytesCnt numOfBytes; // number of bytes to be copied
+		char* buffer; // where the bytes are copied to
+	};
+
+	// tasks of a single read, which the reading thread waits for
+	class Batch {
+	public:
+		Batch();
+		// waits until all of the submitted tasks are done, returning 0 if any of them has failed (1 otherwise)
+		char wait();
+	private:
+		friend class ReadPool;
+		LONG pending;
+		bool failed; // a task's data clusters did not match their checksums
+		SRWLOCK srwLock;
+		CONDITION_VARIABLE done;
+	};
+
+	ReadPool();
+
+	// queues the task for the reader threads (starting them on first use); the task is deleted once it is done
+	void submit(Task* task, Batch& batch);
+
+	/*
+	Description:
+		fetches the task's data clusters (through the file's cache, holes read as zeros) and copies the task's bytes into the caller's buffer;
+		clusterBuffer has to hold task.dataClusterNos.size() clusters
+	Return value(s):
+		- 1, if the bytes have been copied
+		- 0, if a data cluster does not match its checksum (nothing is copied)
+	*/
+	static char execute(Task& task, char* clusterBuffer);
+
+private:
+
+	struct Request {
+		Task* task;
+		Batch* batch;
+	};
+
+	// body of a reader thread of the pool (given through the argument)
+	static DWORD WINAPI serve(LPVOID pool);
+
+	std::deque<Request> queue;
+	SRWLOCK queueSRWLock;
+	// released once for every task put into the queue, the reader threads wait on it (type: SemaphoreObject from win32 API)
+	HANDLE ok_to_read;
+	unsigned int numOfThreads; // 0 - the threads have not been started yet (guarded by queueSRWLock)
+
+};
+
+#endif // _READPOOL_H_
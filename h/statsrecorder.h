@@ -0,0 +1,106 @@
+#ifndef _STATSRECORDER_H_
+#define _STATSRECORDER_H_
+
+#include "fs.h"
+#include <Windows.h>
+#include <synchapi.h>
+#include <vector>
+
+const unsigned int STATS_SUB_BUCKET_BITS = 5; // the latencies below 2^STATS_SUB_BUCKET_BITS ticks get a bucket each
+const unsigned int STATS_MAX_BITS = 40; // latencies of 2^STATS_MAX_BITS ticks and more all fall into the last bucket
+const unsigned int STATS_NUM_OF_BUCKETS = (1 << STATS_SUB_BUCKET_BITS) + (STATS_MAX_BITS - STATS_SUB_BUCKET_BITS) * (1 << (STATS_SUB_BUCKET_BITS - 1));
+
+/*
+	operation statistics behind FS::stats: every thread records its operations into counters of its own (allocated on its first
+	operation, and added into the retired counters and freed once the thread ends), so the threads do not contend with each other
+	while measuring; the latencies go into
+	HDR-style histograms - exact below 2^STATS_SUB_BUCKET_BITS ticks, and above it 2^(STATS_SUB_BUCKET_BITS - 1) buckets for every
+	power of 2, which keeps every bucket within about 3% of the latencies it holds; the waits for the file and drive locks (the LOCK_*
+	constants from fs.h) are only counted and added up; a snapshot adds up the retired counters and the ones of all of the running threads;
+	with FS_NO_STATS defined, the recording functions are empty inline ones, which the compiler drops altogether
+*/
+class StatsRecorder {
+public:
+
+	// counters of the clusters transferred (see FSStats)
+	static const unsigned int
+		DATA_CLUSTERS_READ = 0,
+		DATA_CLUSTERS_WRITTEN = 1,
+		METADATA_CLUSTERS_READ = 2,
+		METADATA_CLUSTERS_WRITTEN = 3,
+		CACHE_HITS = 4,
+		CACHE_MISSES = 5,
+		NUM_OF_CLUSTER_COUNTERS = 6;
+
+#ifndef FS_NO_STATS
+	// returns the starting time of an operation (0 - the operation is not measured, the statistics being disabled)
+	static LONGLONG start();
+	// records the operation (one of the OP_* constants from fs.h) which has started at start (unless it is 0), along with the bytes it has transferred
+	static void stop(unsigned int op, LONGLONG start, BytesCnt bytes);
+	// adds numOfClusters to the given counter (unless the statistics are disabled)
+	static void countClusters(unsigned int counter, unsigned long numOfClusters);
+	/*
+	Description:
+		acquires the SRW lock (of the kind given by one of the LOCK_* constants from fs.h) exclusively/shared, recording the acquisition;
+		the wait is timed only if the lock is held by another thread, so an uncontended acquisition costs just a try and a count
+	*/
+	static void acquireExclusive(unsigned int lock, SRWLOCK* srwLock);
+	static void acquireShared(unsigned int lock, SRWLOCK* srwLock);
+	// records an acquisition of the given lock, which has waited for it since waitStart (0 - it has not waited), returned by start()
+	static void countAcquisition(unsigned int lock, LONGLONG waitStart);
+#else
+	static LONGLONG start() { return 0; }
+	static void stop(unsigned int op, LONGLONG start, BytesCnt bytes) {}
+	static void countClusters(unsigned int counter, unsigned long numOfClusters) {}
+	static void acquireExclusive(unsigned int lock, SRWLOCK* srwLock) { AcquireSRWLockExclusive(srwLock); }
+	static void acquireShared(unsigned int lock, SRWLOCK* srwLock) { AcquireSRWLockShared(srwLock); }
+	static void countAcquisition(unsigned int lock, LONGLONG waitStart) {}
+#endif
+
+	// adds up the counters of all of the threads
+	static FSStats snapshot();
+	static void enable(bool enable);
+
+private:
+
+	// counters of a single thread - changed only by the thread itself (with Interlocked* functions, since snapshots read them meanwhile)
+	struct Counters {
+		LONG64 count[NUM_OF_OPS];
+		LONG64 bytes[NUM_OF_OPS];
+		LONG64 totalTicks[NUM_OF_OPS];
+		LONG64 maxTicks[NUM_OF_OPS];
+		LONG64 histogram[NUM_OF_OPS][STATS_NUM_OF_BUCKETS];
+		LONG64 clusters[NUM_OF_CLUSTER_COUNTERS];
+		LONG64 acquisitions[NUM_OF_LOCKS];
+		LONG64 waits[NUM_OF_LOCKS];
+		LONG64 waitTicks[NUM_OF_LOCKS];
+		LONG64 maxWaitTicks[NUM_OF_LOCKS];
+	};
+
+	// owner of a thread's counters, which retires them when the thread ends
+	struct CountersOwner {
+		Counters* counters = nullptr; // nullptr - the thread has not recorded anything yet
+		~CountersOwner();
+	};
+
+	// bucket of the given latency (in ticks), and the highest latency which falls into the given bucket
+	static unsigned int bucketOf(LONGLONG ticks);
+	static LONGLONG highestTicksOf(unsigned int bucket);
+	// counters of the running thread (created on its first call)
+	static Counters* threadCounters();
+	// adds the given counters (read with Interlocked* functions, as their thread may be changing them) into total
+	static void addCounters(Counters* total, Counters* counters);
+	// the latency (in microseconds) below which the given fraction of the latencies in the (added up) histogram of an operation falls
+	static double percentile(const LONG64* histogram, double fraction, double ticksPerMicrosecond);
+
+	// counters of all of the running threads which have recorded anything, and the added up ones of the threads which have ended
+	// (both guarded by countersSRWLock); the vector is never destroyed, as threads may still end while the program exits
+	static std::vector<Counters*>* allCounters;
+	static Counters retiredCounters;
+	static SRWLOCK countersSRWLock;
+	static thread_local CountersOwner ownCounters; // of the running thread
+	static LONG enabled; // 0 - the operations are not measured (changed and read with Interlocked* functions)
+
+};
+
+#endif // _STATSRECORDER_H_
@@ -0,0 +1,86 @@
+#ifndef _STRIPEDPARTITION_H_
+#define _STRIPEDPARTITION_H_
+
+#include "part.h"
+#include <Windows.h>
+#include <synchapi.h>
+#include <deque>
+
+/*
+	partition which stripes its clusters across several member partitions (RAID-0): clusters are dealt out to the members
+	stripeWidth at a time, so that consecutive stripes land on different members; every member has its own worker thread,
+	which lets a batch of clusters (StripedPartition::readClusters/writeClusters) be transferred by all of the members in parallel
+*/
+class StripedPartition : public Partition {
+public:
+
+	/*
+	Description:
+		creates a striped partition over the given member partitions (which stay owned by the caller, and must not be used on their own
+		while the striped partition exists); ini is only passed on to Partition's constructor - the striped partition keeps no data of its own,
+		so it may describe a partition of 0 clusters
+	*/
+	StripedPartition(char* ini, Partition** members, unsigned int numOfMembers, ClusterNo stripeWidth = 1);
+	// stops the members' worker threads
+	~StripedPartition();
+
+	// number of clusters of the smallest member (rounded down to whole stripes), times the number of members
+	ClusterNo getNumOfClusters() const override;
+
+	int readCluster(ClusterNo clusterNo, char* buffer) override;
+	int writeCluster(ClusterNo clusterNo, const char* buffer) override;
+
+	/*
+	Description:
+		reads/writes count clusters (clusterNos[i] from/into buffers[i]), each member transferring its share of the clusters
+		on its own worker thread, all of the members at once; returns when the whole batch has been transferred
+	Return value(s):
+		- 1, if all of the clusters have been transferred successfully
+		- 0, otherwise
+	*/
+	int readClusters(const ClusterNo* clusterNos, unsigned int count, char** buffers);
+	int writeClusters(const ClusterNo* clusterNos, unsigned int count, char** buffers);
+
+private:
+
+	// batch of transfers the issuing thread waits on, until all of them are done
+	struct Batch {
+		LONG pending; // number of transfers not yet done
+		int result;
+		SRWLOCK srwLock;
+		CONDITION_VARIABLE done;
+	};
+	// one cluster's transfer, queued for a member's worker thread
+	struct Request {
+		ClusterNo clusterNo; // cluster number on the member
+		char* buffer;
+		bool write;
+		Batch* batch;
+	};
+	struct Member {
+		Partition* partition;
+		std::deque<Request> queue;
+		SRWLOCK queueSRWLock;
+		// released once for every request put into the queue (and once more to stop the worker) (type: SemaphoreObject from win32 API)
+		HANDLE ok_to_serve;
+		HANDLE worker;
+		bool stopping; // the worker thread exits once its queue is empty (guarded by queueSRWLock)
+	};
+
+	// body of a member's (given through the argument) worker thread: serves the queued requests one at a time
+	static DWORD WINAPI serve(LPVOID member);
+
+	// maps a cluster of the striped partition onto the member which holds it and the cluster's number on that member
+	void locate(ClusterNo clusterNo, unsigned int& memberNo, ClusterNo& memberClusterNo) const;
+
+	// queues the transfers of the batch for the members' worker threads and waits for all of them to be done
+	int transfer(const ClusterNo* clusterNos, unsigned int count, char** buffers, bool write);
+
+	Member* members;
+	unsigned int numOfMembers;
+	ClusterNo stripeWidth;
+	ClusterNo numOfClusters;
+
+};
+
+#endif // _STRIPEDPARTITION_H_
@@ -1,6 +1,15 @@
 #include "KernelFS.h"
 #include "file.h"
+#include "kernelfile.h"
 #include "filedesc.h"
+#include "clustercache.h"
+#include "stripedpartition.h"
+#include "journal.h"
+#include "checksumtable.h"
+#include "crc32c.h"
+#include "fschecker.h"
+#include "statsrecorder.h"
+#include <cstring>
 
 const unsigned int KernelFS::LVL1_ENTRY_SIZE_IN_BYTES = 4;
 const unsigned int KernelFS::LVL2_ENTRY_SIZE_IN_BYTES = 4;
@@ -11,61 +20,219 @@ const unsigned int KernelFS::FILE_EXTENSION_OFFSET = 8;
 const unsigned int KernelFS::NOT_IN_USE_BYTE_OFFSET = 11;
 const unsigned int KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET = 12;
 const unsigned int KernelFS::FILE_SIZE_OFFSET = 16;
+const unsigned int KernelFS::FILE_FLAGS_OFFSET = 20;
 
-HANDLE KernelFS::ok_to_mount = CreateSemaphore(NULL, 1, 32, NULL);
-HANDLE KernelFS::ok_to_unmount = CreateSemaphore(NULL, 0, 32, NULL);
-HANDLE KernelFS::ok_to_format = CreateSemaphore(NULL, 0, 32, NULL);
-SRWLOCK KernelFS::srwLock = SRWLOCK_INIT;
-int KernelFS::waitingToUnMount = 0;
-int KernelFS::waitingToFormat = 0;
-long KernelFS::numberOfOpenedFiles = 0;
-int KernelFS::numOfClusters = 0;
-int KernelFS::bitVectorSizeInClusters = 0;
-int KernelFS::rootLvl1IndexClusterNo = 0;
-Partition* KernelFS::mountedPartition = nullptr;
-std::unordered_map<Partition*, bool> KernelFS::formattedPartitions = std::unordered_map<Partition*, bool>();
-std::unordered_map<std::string, FileDesc*> KernelFS::files = std::unordered_map<std::string, FileDesc*>();
-
-char KernelFS::mount(Partition* partition) {
+const unsigned int KernelFS::EXTENT_ENTRY_SIZE_IN_BYTES = 8;
+const unsigned int KernelFS::EXTENT_START_OFFSET = 0;
+const unsigned int KernelFS::EXTENT_LENGTH_OFFSET = 4;
+
+const unsigned char KernelFS::FILE_FLAG_EXTENTS = 0x01;
+const unsigned char KernelFS::FILE_FLAG_INLINE = 0x02;
+const unsigned char KernelFS::FILE_FLAG_COMPRESSED = 0x04;
+
+const ClusterNo KernelFS::SUPERBLOCK_CLUSTER_NO = 0;
+const ClusterNo KernelFS::BIT_VECTOR_START = 1;
+const unsigned int KernelFS::SUPERBLOCK_VERSION = 1;
+
+const unsigned int KernelFS::SUPERBLOCK_MAGIC_OFFSET = 0;
+const unsigned int KernelFS::SUPERBLOCK_VERSION_OFFSET = 4;
+const unsigned int KernelFS::SUPERBLOCK_NUM_OF_CLUSTERS_OFFSET = 8;
+const unsigned int KernelFS::SUPERBLOCK_BIT_VECTOR_SIZE_OFFSET = 12;
+const unsigned int KernelFS::SUPERBLOCK_ROOT_DIR_OFFSET = 16;
+const unsigned int KernelFS::SUPERBLOCK_FORMAT_OPTIONS_OFFSET = 20;
+const unsigned int KernelFS::SUPERBLOCK_FREE_CLUSTERS_OFFSET = 24;
+const unsigned int KernelFS::SUPERBLOCK_NUM_OF_FILES_OFFSET = 28;
+const unsigned int KernelFS::SUPERBLOCK_CLEAN_OFFSET = 32;
+const unsigned int KernelFS::SUPERBLOCK_WRITTEN_BIT_VECTOR_OFFSET = 36;
+const unsigned int KernelFS::SUPERBLOCK_SHARED_CLUSTERS_OFFSET = 40;
+const unsigned int KernelFS::SUPERBLOCK_DEDUP_CLUSTERS_WRITTEN_OFFSET = 44;
+const unsigned int KernelFS::SUPERBLOCK_DEDUP_DUPLICATE_CLUSTERS_OFFSET = 48;
+
+static const char SUPERBLOCK_MAGIC[4] = { 'K', 'F', 'S', 'B' };
+
+KernelFS* KernelFS::drives[NUM_OF_DRIVES] = { nullptr };
+SRWLOCK KernelFS::drivesSRWLock = SRWLOCK_INIT;
+std::unordered_map<Partition*, KernelFS::PartitionState> KernelFS::partitions = std::unordered_map<Partition*, KernelFS::PartitionState>();
+SRWLOCK KernelFS::partitionsSRWLock = SRWLOCK_INIT;
+
+KernelFS::KernelFS() {
+	ok_to_mount = CreateSemaphore(NULL, 1, 32, NULL);
+	ok_to_unmount = CreateSemaphore(NULL, 0, 32, NULL);
+	ok_to_format = CreateSemaphore(NULL, 0, 32, NULL);
+	InitializeSRWLock(&srwLock);
+	InitializeSRWLock(&filesSRWLock);
+	InitializeSRWLock(&directorySRWLock);
+	InitializeSRWLock(&allocatorSRWLock);
+	for (unsigned int stripe = 0; stripe < DESCRIPTOR_LOCK_STRIPES; stripe++)
+		InitializeSRWLock(&descriptorSRWLocks[stripe]);
+	waitingToUnMount = 0;
+	waitingToFormat = 0;
+	numberOfOpenedFiles = 0;
+	numOfClusters = 0;
+	bitVectorSizeInClusters = 0;
+	rootLvl1IndexClusterNo = 0;
+	numOfFreeClusters = 0;
+	numOfFiles = 0;
+	numOfWrittenBitVectorClusters = 0;
+	mountedPartition = nullptr;
+	mountedPartitionState = nullptr;
+	mountedStripedPartition = nullptr;
+	journal = nullptr;
+	checksums = nullptr;
+	verifyChecksums = false;
+	ok_to_reclaim = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	reaperThread = NULL;
+	InitializeSRWLock(&dirtyCachesSRWLock);
+	ok_to_flush = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	flusherThread = NULL;
+	defragmenterRate = 0;
+	ok_to_defragment = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	defragmenterThread = NULL;
+	InitializeSRWLock(&defragmenterSRWLock);
+}
+
+KernelFS* KernelFS::getDrive(char drive) {
+	if (drive >= 'a' && drive <= 'z')
+		drive = drive - 'a' + 'A';
+	if (drive < 'A' || drive > 'Z') return nullptr;
+	AcquireSRWLockShared(&drivesSRWLock);
+	KernelFS* fs = KernelFS::drives[drive - 'A'];
+	ReleaseSRWLockShared(&drivesSRWLock);
+	if (fs != nullptr) return fs;
+	AcquireSRWLockExclusive(&drivesSRWLock);
+	if (KernelFS::drives[drive - 'A'] == nullptr) // another thread may have created it in the meantime
+		KernelFS::drives[drive - 'A'] = new KernelFS();
+	fs = KernelFS::drives[drive - 'A'];
+	ReleaseSRWLockExclusive(&drivesSRWLock);
+	return fs;
+}
+
+KernelFS* KernelFS::getDrive(char*& fname) {
+	if (fname == nullptr || fname[0] == '\0' || fname[1] != ':') return KernelFS::getDrive(DEFAULT_DRIVE);
+	char drive = fname[0];
+	fname += 2; // "X:/name.ext" -> "/name.ext"
+	return KernelFS::getDrive(drive);
+}
+
+char KernelFS::mount(Partition* partition, DWORD timeout, unsigned int options) {
 	if (partition == nullptr) return 0;
-	WaitForSingleObject(
+	if (WaitForSingleObject(
 		ok_to_mount, // handle to semaphore
-		INFINITE // infinite time-out interval
-	);
-	AcquireSRWLockExclusive(&srwLock);
+		timeout // time-out interval (INFINITE - no time-out)
+	) != WAIT_OBJECT_0)
+		return FS_BUSY; // another partition is still mounted on the drive
+	StatsRecorder::acquireExclusive(LOCK_PARTITION, &srwLock);
+	AcquireSRWLockExclusive(&partitionsSRWLock);
+	std::unordered_map<Partition*, PartitionState>::iterator state = KernelFS::partitions.find(partition);
+	if (state == KernelFS::partitions.end()) {
+		PartitionState newState;
+		newState.formatted = false;
+		newState.formatOptions = 0;
+		newState.dedupClustersWritten = newState.dedupDuplicateClusters = 0;
+		newState.mountedOn = nullptr;
+		state = KernelFS::partitions.insert(std::make_pair(partition, newState)).first;
+	}
+	if (state->second.mountedOn != nullptr) { // the partition is already mounted on another drive
+		ReleaseSRWLockExclusive(&partitionsSRWLock);
+		ReleaseSRWLockExclusive(&srwLock);
+		ReleaseSemaphore(
+			ok_to_mount, // handle to semaphore
+			1, // increase count by 1
+			NULL // not interested in previous count
+		);
+		return 0;
+	}
+	state->second.mountedOn = this;
+	ReleaseSRWLockExclusive(&partitionsSRWLock);
 	KernelFS::mountedPartition = partition;
-	if (KernelFS::formattedPartitions.find(partition) == KernelFS::formattedPartitions.end())
-		KernelFS::formattedPartitions.insert(std::make_pair(partition, false));
+	KernelFS::mountedPartitionState = &state->second;
+	KernelFS::mountedStripedPartition = dynamic_cast<StripedPartition*>(partition);
+	KernelFS::verifyChecksums = (options & MOUNT_NO_VERIFY) == 0;
+	// a formatted partition comes up from its superblock alone; only one which has not been unmounted cleanly, or whose shared
+	// data clusters need their reference counts, gets scanned
+	// the reference counts kept from an earlier mount may no longer match the partition, which another program may have used since
+	state->second.sharedClusters.clear();
+	state->second.dedupIndex.clear();
+	state->second.dedupFingerprints.clear();
+	state->second.dedupClustersWritten = state->second.dedupDuplicateClusters = 0;
+	bool clean = false, shared = false;
+	state->second.formatted = KernelFS::readSuperblock(state->second.formatOptions, clean, shared);
+	if (state->second.formatted) {
+		if ((state->second.formatOptions & FORMAT_JOURNAL) != 0) {
+			// the metadata updates the partition's previous mount has not written in place yet are replayed from its journal
+			KernelFS::journal = new Journal(partition, KernelFS::journalStart(), JOURNAL_SIZE_IN_CLUSTERS);
+			KernelFS::journal->recover();
+		}
+		if ((state->second.formatOptions & FORMAT_CHECKSUMS) != 0)
+			KernelFS::checksums = new ChecksumTable(this, KernelFS::checksumStart(), KernelFS::numOfClusters);
+		if (!clean || shared)
+			KernelFS::recount();
+		KernelFS::writeSuperblock(false); // until the partition gets unmounted
+	}
 	ReleaseSRWLockExclusive(&srwLock);
 	return 1;
 }
 
-char KernelFS::unmount() {
-	AcquireSRWLockExclusive(&srwLock);
+char KernelFS::unmount(DWORD timeout) {
+	KernelFS::stopDefragmenter(); // it keeps opening the drive's files
+	StatsRecorder::acquireExclusive(LOCK_PARTITION, &srwLock);
 	if (KernelFS::mountedPartition == nullptr) {
 		ReleaseSRWLockExclusive(&srwLock);
 		return 0;
 	}
+	StatsRecorder::acquireExclusive(LOCK_FILES, &filesSRWLock);
 	if (KernelFS::numberOfOpenedFiles > 0) {
 		KernelFS::waitingToUnMount++;
+		ReleaseSRWLockExclusive(&filesSRWLock);
 		ReleaseSRWLockExclusive(&srwLock);
-		WaitForSingleObject(
+		DWORD waitResult = WaitForSingleObject(
 			ok_to_unmount, // handle to semaphore
-			INFINITE // infinite time-out interval
+			timeout // time-out interval (INFINITE - no time-out)
 		);
-		AcquireSRWLockExclusive(&srwLock);
+		StatsRecorder::acquireExclusive(LOCK_PARTITION, &srwLock);
+		StatsRecorder::acquireExclusive(LOCK_FILES, &filesSRWLock);
 		KernelFS::waitingToUnMount--;
+		if (waitResult != WAIT_OBJECT_0) // the files may have got closed right after the time-out, releasing the semaphore for this thread too
+			WaitForSingleObject(ok_to_unmount, 0);
 		if (KernelFS::mountedPartition == nullptr) {// someone already unmounted the partition
+			ReleaseSRWLockExclusive(&filesSRWLock);
 			ReleaseSRWLockExclusive(&srwLock);
 			return 1;
 		}
+		if (waitResult != WAIT_OBJECT_0 && KernelFS::numberOfOpenedFiles > 0) { // timed out while the files are still open
+			ReleaseSRWLockExclusive(&filesSRWLock);
+			ReleaseSRWLockExclusive(&srwLock);
+			return FS_BUSY;
+		}
 	}
+	// the files' dirty clusters, as well as the clusters dropped by 'w' opens, must be taken care of while the partition is still mounted
+	KernelFS::writeBackDirtyCaches();
+	StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+	KernelFS::reclaimPendingClusters();
+	ReleaseSRWLockExclusive(&allocatorSRWLock);
+	// the checksums updated since the last commit go to the journal before it writes the metadata clusters it still holds in place
+	if (KernelFS::checksums != nullptr)
+		KernelFS::checksums->flush();
+	delete KernelFS::checksums;
+	KernelFS::checksums = nullptr;
+	delete KernelFS::journal;
+	KernelFS::journal = nullptr;
+	if (KernelFS::mountedPartitionState->formatted)
+		KernelFS::writeSuperblock(true);
+	AcquireSRWLockExclusive(&partitionsSRWLock);
+	KernelFS::mountedPartitionState->mountedOn = nullptr;
+	ReleaseSRWLockExclusive(&partitionsSRWLock);
 	KernelFS::mountedPartition = nullptr;
+	KernelFS::mountedPartitionState = nullptr;
+	KernelFS::mountedStripedPartition = nullptr;
 	KernelFS::numberOfOpenedFiles = 0; // reset the number of opened files on the mounted partition (is this necessary?)
 	KernelFS::numOfClusters = 0;
 	KernelFS::bitVectorSizeInClusters = 0;
 	KernelFS::rootLvl1IndexClusterNo = 0;
-	// invalidate the files map
+	KernelFS::numOfFreeClusters = 0;
+	KernelFS::numOfFiles = 0;
+	KernelFS::numOfWrittenBitVectorClusters = 0;
+	// invalidate the open-file table
 	KernelFS::files.clear();
 	// potentially unblock the threads that are waiting to format the partition, to prevent deadlock
 	ReleaseSemaphore(
@@ -73,6 +240,7 @@ char KernelFS::unmount() {
 		KernelFS::waitingToFormat, // increase count by 1
 		NULL // not interested in previous count
 	);
+	ReleaseSRWLockExclusive(&filesSRWLock);
 	ReleaseSRWLockExclusive(&srwLock);
 	// potentially unblock the thread that is waiting to mount a partition / allow upcoming threads to mount a partition
 	ReleaseSemaphore(
@@ -83,153 +251,332 @@ char KernelFS::unmount() {
 	return 1;
 }
 
-void KernelFS::initializeBitVector() {
-	// how much clusters does evidenting bit vector's clusters take up in the bit vector
-	int numOfBitVectorClusters = KernelFS::bitVectorSizeInClusters / (ClusterSize * CHAR_SIZE_IN_BITS)
-		+ (((KernelFS::bitVectorSizeInClusters % (ClusterSize * CHAR_SIZE_IN_BITS)) > 0) ? 1 : 0);
-	if (numOfBitVectorClusters > 1) {
-		char emptyCluster[2048];
-		for (int i = 0; i < 2048; i++)
-			emptyCluster[i] = 0x00;
-		for (int clusterNo = 0; clusterNo < numOfBitVectorClusters - 1; clusterNo++)
-			KernelFS::mountedPartition->writeCluster(clusterNo, emptyCluster);
-	}
+void KernelFS::initializeBitVector(ClusterNo numOfTakenClusters, bool lazy) {
+	// a lazy format writes just the bit vector clusters which evident the taken clusters - the rest of them are all free
+	int numOfWrittenClusters = lazy ? ((numOfTakenClusters - 1) / (ClusterSize * CHAR_SIZE_IN_BITS) + 1) : KernelFS::bitVectorSizeInClusters;
 	char bitVectorCluster[2048];
-	// how much bits are left for evidenting bit vector's clusters in the last of the clusters used to evident bit vector's clusters
-	int bitsLeft = KernelFS::bitVectorSizeInClusters % (ClusterSize * CHAR_SIZE_IN_BITS);
-	// number of the last of the clusters used to evident bit vector's clusters
-	int nextClusterNo = (numOfBitVectorClusters == 1) ? 0 : (numOfBitVectorClusters - 1);
-	// fill the whole bytes first
-	int byteNo;
-	for (byteNo = 0; byteNo < (bitsLeft / CHAR_SIZE_IN_BITS); byteNo++)
-		bitVectorCluster[byteNo] = 0x00;
-	if (byteNo < 2048) {
-		// fill the remaining bits
-		int bitsNo = bitsLeft % CHAR_SIZE_IN_BITS;
-		char tmp = 0xff;
-		for (int bitNo = 0; bitNo < bitsNo; bitNo++)
-			tmp &= ~(1 << bitNo);
-		bitVectorCluster[byteNo++] = tmp;
-	}
-	// remaining bytes - free clusters
-	for (; byteNo < 2048; byteNo++)
-		bitVectorCluster[byteNo] = 0xff;
-	// write the last of the clusters used to evident bit vector's clusters
-	KernelFS::mountedPartition->writeCluster(nextClusterNo, bitVectorCluster);
-	// how much more clusters are needed to be written
-	int remaining = KernelFS::bitVectorSizeInClusters - numOfBitVectorClusters;
-	if (remaining > 0) {
-		char allFreeCluster[2048];
-		int i;
-		for (int i = 0; i < 2048; i++)
-			allFreeCluster[i] = 0xff;
-		for (i = 0; i < remaining; i++)
-			KernelFS::mountedPartition->writeCluster(numOfBitVectorClusters + i, allFreeCluster);
-	}
-	// evidenting root directory's level 1 index in the bit vector;
-	int clustNo = KernelFS::rootLvl1IndexClusterNo / (ClusterSize * CHAR_SIZE_IN_BITS);
-	int bytNo = (KernelFS::rootLvl1IndexClusterNo % (ClusterSize * CHAR_SIZE_IN_BITS)) / CHAR_SIZE_IN_BITS;
-	int bitNo = (KernelFS::rootLvl1IndexClusterNo % (ClusterSize * CHAR_SIZE_IN_BITS)) % CHAR_SIZE_IN_BITS;
-	char cluster[2048];
-	KernelFS::mountedPartition->readCluster(clustNo, cluster);
-	cluster[bytNo] &= ~(1 << bitNo);
-	KernelFS::mountedPartition->writeCluster(clustNo, cluster);
-}
-
-char KernelFS::format() {
-	AcquireSRWLockExclusive(&srwLock);
+	for (int clusterNo = 0; clusterNo < numOfWrittenClusters; clusterNo++) {
+		KernelFS::initialBitVectorCluster(clusterNo, numOfTakenClusters, bitVectorCluster);
+		KernelFS::mountedPartition->writeCluster(KernelFS::BIT_VECTOR_START + clusterNo, bitVectorCluster);
+	}
+	KernelFS::numOfWrittenBitVectorClusters = numOfWrittenClusters;
+	KernelFS::numOfFreeClusters = KernelFS::numOfClusters - numOfTakenClusters;
+}
+
+void KernelFS::initialBitVectorCluster(int clusterNo, ClusterNo numOfTakenClusters, char* buffer) {
+	ClusterNo firstClusterNo = clusterNo * ClusterSize * CHAR_SIZE_IN_BITS; // first cluster evidented by this bit vector cluster
+	for (int byteNo = 0; byteNo < 2048; byteNo++) {
+		char bits = 0x00;
+		for (int bitNo = 0; bitNo < 8; bitNo++) {
+			ClusterNo evidentedClusterNo = firstClusterNo + (byteNo << 3) + bitNo;
+			// the bits past the end of the partition stay taken, so that they never get allocated
+			if (evidentedClusterNo >= numOfTakenClusters && evidentedClusterNo < (ClusterNo)KernelFS::numOfClusters)
+				bits |= (1 << bitNo);
+		}
+		buffer[byteNo] = bits;
+	}
+}
+
+void KernelFS::readBitVectorCluster(int clusterNo, char* buffer) {
+	if (clusterNo >= KernelFS::numOfWrittenBitVectorClusters)
+		KernelFS::initialBitVectorCluster(clusterNo, 0, buffer); // not written yet - all of its clusters are free
+	else
+		KernelFS::readMetadataCluster(KernelFS::BIT_VECTOR_START + clusterNo, buffer);
+}
+
+void KernelFS::writeBitVectorCluster(int clusterNo, const char* buffer) {
+	if (clusterNo >= KernelFS::numOfWrittenBitVectorClusters) {
+		// the clusters up to this one are written as all free straight to the partition before the superblock evidents them as written,
+		// so that the superblock never points past the bit vector clusters which are on the partition (or in the journal)
+		char bitVectorCluster[2048];
+		for (int writtenClusterNo = KernelFS::numOfWrittenBitVectorClusters; writtenClusterNo <= clusterNo; writtenClusterNo++) {
+			KernelFS::initialBitVectorCluster(writtenClusterNo, 0, bitVectorCluster);
+			KernelFS::mountedPartition->writeCluster(KernelFS::BIT_VECTOR_START + writtenClusterNo, bitVectorCluster);
+		}
+		KernelFS::numOfWrittenBitVectorClusters = clusterNo + 1;
+		KernelFS::writeSuperblock(false);
+	}
+	KernelFS::writeMetadataCluster(KernelFS::BIT_VECTOR_START + clusterNo, buffer);
+}
+
+void KernelFS::computeLayout() {
+	KernelFS::numOfClusters = KernelFS::mountedPartition->getNumOfClusters();
+	KernelFS::bitVectorSizeInClusters = KernelFS::numOfClusters / (ClusterSize * CHAR_SIZE_IN_BITS) 
+		+ ((KernelFS::numOfClusters % (ClusterSize * CHAR_SIZE_IN_BITS) > 0) ? 1 : 0);
+	KernelFS::rootLvl1IndexClusterNo = KernelFS::BIT_VECTOR_START + KernelFS::bitVectorSizeInClusters;
+}
+
+bool KernelFS::readSuperblock(unsigned int& formatOptions, bool& clean, bool& shared) {
+	char superblock[2048];
+	KernelFS::mountedPartition->readCluster(KernelFS::SUPERBLOCK_CLUSTER_NO, superblock);
+	for (int i = 0; i < 4; i++)
+		if (superblock[KernelFS::SUPERBLOCK_MAGIC_OFFSET + i] != SUPERBLOCK_MAGIC[i]) return false; // never formatted
+	if (KernelFS::getEntry(superblock, KernelFS::SUPERBLOCK_VERSION_OFFSET) != KernelFS::SUPERBLOCK_VERSION) return false;
+	if (KernelFS::getEntry(superblock, KernelFS::SUPERBLOCK_NUM_OF_CLUSTERS_OFFSET) != KernelFS::mountedPartition->getNumOfClusters())
+		return false; // formatted as a partition of another size
+	KernelFS::numOfClusters = KernelFS::getEntry(superblock, KernelFS::SUPERBLOCK_NUM_OF_CLUSTERS_OFFSET);
+	KernelFS::bitVectorSizeInClusters = KernelFS::getEntry(superblock, KernelFS::SUPERBLOCK_BIT_VECTOR_SIZE_OFFSET);
+	KernelFS::rootLvl1IndexClusterNo = KernelFS::getEntry(superblock, KernelFS::SUPERBLOCK_ROOT_DIR_OFFSET);
+	KernelFS::numOfWrittenBitVectorClusters = KernelFS::getEntry(superblock, KernelFS::SUPERBLOCK_WRITTEN_BIT_VECTOR_OFFSET);
+	KernelFS::numOfFreeClusters = KernelFS::getEntry(superblock, KernelFS::SUPERBLOCK_FREE_CLUSTERS_OFFSET);
+	KernelFS::numOfFiles = KernelFS::getEntry(superblock, KernelFS::SUPERBLOCK_NUM_OF_FILES_OFFSET);
+	formatOptions = KernelFS::getEntry(superblock, KernelFS::SUPERBLOCK_FORMAT_OPTIONS_OFFSET);
+	clean = superblock[KernelFS::SUPERBLOCK_CLEAN_OFFSET] == 1;
+	shared = superblock[KernelFS::SUPERBLOCK_SHARED_CLUSTERS_OFFSET] == 1;
+	KernelFS::mountedPartitionState->dedupClustersWritten = KernelFS::getEntry(superblock, KernelFS::SUPERBLOCK_DEDUP_CLUSTERS_WRITTEN_OFFSET);
+	KernelFS::mountedPartitionState->dedupDuplicateClusters = KernelFS::getEntry(superblock, KernelFS::SUPERBLOCK_DEDUP_DUPLICATE_CLUSTERS_OFFSET);
+	return true;
+}
+
+void KernelFS::writeSuperblock(bool clean) {
+	char superblock[2048];
+	for (int i = 0; i < 2048; i++)
+		superblock[i] = 0x00;
+	for (int i = 0; i < 4; i++)
+		superblock[KernelFS::SUPERBLOCK_MAGIC_OFFSET + i] = SUPERBLOCK_MAGIC[i];
+	KernelFS::setEntry(superblock, KernelFS::SUPERBLOCK_VERSION_OFFSET, KernelFS::SUPERBLOCK_VERSION);
+	KernelFS::setEntry(superblock, KernelFS::SUPERBLOCK_NUM_OF_CLUSTERS_OFFSET, KernelFS::numOfClusters);
+	KernelFS::setEntry(superblock, KernelFS::SUPERBLOCK_BIT_VECTOR_SIZE_OFFSET, KernelFS::bitVectorSizeInClusters);
+	KernelFS::setEntry(superblock, KernelFS::SUPERBLOCK_ROOT_DIR_OFFSET, KernelFS::rootLvl1IndexClusterNo);
+	KernelFS::setEntry(superblock, KernelFS::SUPERBLOCK_FORMAT_OPTIONS_OFFSET, KernelFS::mountedPartitionState->formatOptions);
+	KernelFS::setEntry(superblock, KernelFS::SUPERBLOCK_WRITTEN_BIT_VECTOR_OFFSET, KernelFS::numOfWrittenBitVectorClusters);
+	// the deduplication counters cannot be recounted, so the ones last written are kept even if the partition goes down
+	KernelFS::setEntry(superblock, KernelFS::SUPERBLOCK_DEDUP_CLUSTERS_WRITTEN_OFFSET, KernelFS::mountedPartitionState->dedupClustersWritten);
+	KernelFS::setEntry(superblock, KernelFS::SUPERBLOCK_DEDUP_DUPLICATE_CLUSTERS_OFFSET, KernelFS::mountedPartitionState->dedupDuplicateClusters);
+	if (clean) { // the counters of a partition which is mounted change all the time - they get recounted if it is not unmounted cleanly
+		KernelFS::setEntry(superblock, KernelFS::SUPERBLOCK_FREE_CLUSTERS_OFFSET, KernelFS::numOfFreeClusters);
+		KernelFS::setEntry(superblock, KernelFS::SUPERBLOCK_NUM_OF_FILES_OFFSET, KernelFS::numOfFiles);
+		superblock[KernelFS::SUPERBLOCK_SHARED_CLUSTERS_OFFSET] = KernelFS::mountedPartitionState->sharedClusters.empty() ? 0 : 1;
+	}
+	superblock[KernelFS::SUPERBLOCK_CLEAN_OFFSET] = clean ? 1 : 0;
+	KernelFS::mountedPartition->writeCluster(KernelFS::SUPERBLOCK_CLUSTER_NO, superblock);
+}
+
+void KernelFS::recount() {
+	// the allocations and deallocations in flight when the partition went down have left the bit vector out of step with the index trees,
+	// while the reference counts of the shared data clusters have never been on the partition
+	CheckReport report;
+	// (as has the deduplication index, rebuilt from the data clusters of the files)
+	FSChecker checker(this);
+	checker.run(true, report, (KernelFS::mountedPartitionState->formatOptions & FORMAT_DEDUP) != 0);
+	KernelFS::commitMetadata();
+}
+
+ClusterNo KernelFS::journalStart() {
+	return KernelFS::rootLvl1IndexClusterNo + 1;
+}
+
+ClusterNo KernelFS::checksumStart() {
+	if ((KernelFS::mountedPartitionState->formatOptions & FORMAT_JOURNAL) != 0)
+		return KernelFS::journalStart() + JOURNAL_SIZE_IN_CLUSTERS;
+	return KernelFS::journalStart();
+}
+
+ClusterNo KernelFS::dataStart() {
+	if ((KernelFS::mountedPartitionState->formatOptions & FORMAT_CHECKSUMS) != 0)
+		return KernelFS::checksumStart() + ChecksumTable::sizeInClusters(KernelFS::numOfClusters);
+	return KernelFS::checksumStart();
+}
+
+void KernelFS::readMetadataCluster(ClusterNo clusterNo, char* buffer) {
+	StatsRecorder::countClusters(StatsRecorder::METADATA_CLUSTERS_READ, 1);
+	if (KernelFS::journal != nullptr)
+		KernelFS::journal->readCluster(clusterNo, buffer);
+	else
+		KernelFS::mountedPartition->readCluster(clusterNo, buffer);
+}
+
+void KernelFS::writeMetadataCluster(ClusterNo clusterNo, const char* buffer) {
+	StatsRecorder::countClusters(StatsRecorder::METADATA_CLUSTERS_WRITTEN, 1);
+	// a cluster which has held data (an inline file's index cluster, a deallocated data cluster) loses its checksum
+	if (KernelFS::checksums != nullptr && !KernelFS::checksums->contains(clusterNo))
+		KernelFS::checksums->drop(clusterNo);
+	if (KernelFS::journal != nullptr)
+		KernelFS::journal->writeCluster(clusterNo, buffer);
+	else
+		KernelFS::mountedPartition->writeCluster(clusterNo, buffer);
+}
+
+void KernelFS::commitMetadata() {
+	if (KernelFS::checksums != nullptr)
+		KernelFS::checksums->flush();
+	if (KernelFS::journal != nullptr)
+		KernelFS::journal->commit();
+}
+
+char KernelFS::format(unsigned int options, DWORD timeout) {
+	LONG defragmenterRate = KernelFS::stopDefragmenter(); // its handles would keep the format waiting
+	char result = KernelFS::formatPartition(options, timeout);
+	if (defragmenterRate != 0)
+		KernelFS::startDefragmenter(defragmenterRate);
+	return result;
+}
+
+char KernelFS::formatPartition(unsigned int options, DWORD timeout) {
+	StatsRecorder::acquireExclusive(LOCK_PARTITION, &srwLock);
 	if (KernelFS::mountedPartition == nullptr) {
 		ReleaseSRWLockExclusive(&srwLock);
 		return 0;
 	}
-	if (KernelFS::numberOfOpenedFiles > 0) {
+	StatsRecorder::acquireExclusive(LOCK_FILES, &filesSRWLock);
+	// the files' descriptors get deleted below, so the wait is repeated until there are no open files while filesSRWLock is held
+	// exclusively; the opens fail while a format waits, so that the files which are open cannot keep it waiting forever
+	ULONGLONG deadline = GetTickCount64() + timeout;
+	while (KernelFS::numberOfOpenedFiles > 0) {
+		DWORD remaining = timeout;
+		if (timeout != INFINITE) {
+			ULONGLONG now = GetTickCount64();
+			remaining = (now >= deadline) ? 0 : (DWORD)(deadline - now);
+		}
 		KernelFS::waitingToFormat++;
+		ReleaseSRWLockExclusive(&filesSRWLock);
 		ReleaseSRWLockExclusive(&srwLock);
-		WaitForSingleObject(
+		DWORD waitResult = WaitForSingleObject(
 			ok_to_format, // handle to semaphore
-			INFINITE // infinite time-out interval
+			remaining // time-out interval (INFINITE - no time-out)
 		);
-		AcquireSRWLockExclusive(&srwLock);
+		StatsRecorder::acquireExclusive(LOCK_PARTITION, &srwLock);
+		StatsRecorder::acquireExclusive(LOCK_FILES, &filesSRWLock);
 		KernelFS::waitingToFormat--;
+		if (waitResult != WAIT_OBJECT_0) // the files may have got closed right after the time-out, releasing the semaphore for this thread too
+			WaitForSingleObject(ok_to_format, 0);
 		if (KernelFS::mountedPartition == nullptr) {// someone already unmounted the partition
+			ReleaseSRWLockExclusive(&filesSRWLock);
 			ReleaseSRWLockExclusive(&srwLock);
 			return 0;
 		}
+		if (waitResult != WAIT_OBJECT_0 && KernelFS::numberOfOpenedFiles > 0) { // timed out while the files are still open
+			ReleaseSRWLockExclusive(&filesSRWLock);
+			ReleaseSRWLockExclusive(&srwLock);
+			return FS_BUSY;
+		}
 	}
-	KernelFS::numOfClusters = KernelFS::mountedPartition->getNumOfClusters();
-	KernelFS::bitVectorSizeInClusters = KernelFS::numOfClusters / (ClusterSize * CHAR_SIZE_IN_BITS) 
-		+ ((KernelFS::numOfClusters % (ClusterSize * CHAR_SIZE_IN_BITS) > 0) ? 1 : 0);
-	KernelFS::rootLvl1IndexClusterNo = KernelFS::bitVectorSizeInClusters;
-	if (KernelFS::formattedPartitions[KernelFS::mountedPartition] == true) {
-		ReleaseSRWLockExclusive(&srwLock);
-		return 0;
+	// a formatted partition (no matter which program has formatted it) gets formatted once again: the descriptors and the dirty clusters
+	// of its closed files, kept in memory, belong to the files being erased - they are dropped rather than written to the partition
+	AcquireSRWLockExclusive(&dirtyCachesSRWLock);
+	KernelFS::dirtyCaches.clear();
+	ReleaseSRWLockExclusive(&dirtyCachesSRWLock);
+	KernelFS::files.clear();
+	ReleaseSRWLockExclusive(&filesSRWLock);
+	StatsRecorder::acquireExclusive(LOCK_DIRECTORY, &directorySRWLock);
+	StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+	KernelFS::reclaimQueue.clear();
+	delete KernelFS::checksums;
+	KernelFS::checksums = nullptr;
+	delete KernelFS::journal; // writes the metadata it still holds in place, before any of the new metadata gets written
+	KernelFS::journal = nullptr;
+	KernelFS::computeLayout();
+	// a journal is kept only if it takes up a small part of the partition
+	if (KernelFS::journalStart() + JOURNAL_SIZE_IN_CLUSTERS * 4 > (ClusterNo)KernelFS::numOfClusters)
+		options &= ~FORMAT_JOURNAL;
+	KernelFS::mountedPartitionState->formatOptions = options; // the checksum region's place depends on whether or not there is a journal
+	// so is the checksum region
+	ClusterNo checksumSize = ChecksumTable::sizeInClusters(KernelFS::numOfClusters);
+	if (KernelFS::checksumStart() + checksumSize * 4 > (ClusterNo)KernelFS::numOfClusters) {
+		options &= ~FORMAT_CHECKSUMS;
+		KernelFS::mountedPartitionState->formatOptions = options;
 	}
-	KernelFS::initializeBitVector();
+	// the journal's region and the checksum region are evidented as taken right away, along with the clusters before them
+	KernelFS::initializeBitVector(KernelFS::dataStart(), (options & FORMAT_LAZY) != 0);
 	// initialization of the first-level index cluster of the root directory
 	char emptyBuffer[2048];
 	for (int i = 0; i < 2048; i++)
 		emptyBuffer[i] = 0x00;
-	KernelFS::mountedPartition->writeCluster(KernelFS::rootLvl1IndexClusterNo, emptyBuffer);
+	KernelFS::writeMetadataCluster(KernelFS::rootLvl1IndexClusterNo, emptyBuffer);
 	// evidenting of the root directory's level 1 index cluster inside of the bit vector was done in KernelFS::initializeBitVector()...
 	// end of initialization of the first-level index cluster of the root directory
-	KernelFS::formattedPartitions[KernelFS::mountedPartition] = true;
+	if ((options & FORMAT_JOURNAL) != 0) {
+		KernelFS::journal = new Journal(KernelFS::mountedPartition, KernelFS::journalStart(), JOURNAL_SIZE_IN_CLUSTERS);
+		KernelFS::journal->initialize();
+	}
+	if ((options & FORMAT_CHECKSUMS) != 0)
+		KernelFS::checksums = new ChecksumTable(this, KernelFS::checksumStart(), KernelFS::numOfClusters);
+	KernelFS::mountedPartitionState->formatted = true;
+	KernelFS::mountedPartitionState->sharedClusters.clear();
+	KernelFS::mountedPartitionState->dedupIndex.clear();
+	KernelFS::mountedPartitionState->dedupFingerprints.clear();
+	KernelFS::mountedPartitionState->dedupClustersWritten = KernelFS::mountedPartitionState->dedupDuplicateClusters = 0;
+	KernelFS::numOfFiles = 0;
+	KernelFS::writeSuperblock(false); // until the partition gets unmounted
+	ReleaseSRWLockExclusive(&allocatorSRWLock);
+	ReleaseSRWLockExclusive(&directorySRWLock);
 	ReleaseSRWLockExclusive(&srwLock);
 	return 1;
 }
 
 FileCnt KernelFS::readRootDir() {
-	AcquireSRWLockShared(&srwLock);
-	if (KernelFS::mountedPartition == nullptr || KernelFS::formattedPartitions[mountedPartition] == false) {
+	StatsRecorder::acquireShared(LOCK_PARTITION, &srwLock);
+	if (KernelFS::mountedPartition == nullptr || KernelFS::mountedPartitionState->formatted == false) {
 		ReleaseSRWLockShared(&srwLock);
 		return -1;
 	}
+	StatsRecorder::acquireShared(LOCK_DIRECTORY, &directorySRWLock);
+	FileCnt fileCount = KernelFS::numOfFiles;
+	ReleaseSRWLockShared(&directorySRWLock);
+	ReleaseSRWLockShared(&srwLock);
+	return fileCount;
+}
+
+std::vector<std::string> KernelFS::listFiles() {
+	std::vector<std::string> fnames;
+	StatsRecorder::acquireShared(LOCK_PARTITION, &srwLock);
+	if (KernelFS::mountedPartition == nullptr || KernelFS::mountedPartitionState->formatted == false) {
+		ReleaseSRWLockShared(&srwLock);
+		return fnames;
+	}
+	StatsRecorder::acquireShared(LOCK_DIRECTORY, &directorySRWLock);
 	char bufferedRootDir[2048];
 	char bufferedLvl2IndexCluster[2048];
 	char bufferedFileDescCluster[2048];
-	ClusterNo clusterNo;
-	FileCnt fileCount = 0;
-	KernelFS::mountedPartition->readCluster(KernelFS::rootLvl1IndexClusterNo, bufferedRootDir);
+	KernelFS::readMetadataCluster(KernelFS::rootLvl1IndexClusterNo, bufferedRootDir);
 	for (int lvl1Entry = 0; lvl1Entry < 2048; lvl1Entry += KernelFS::LVL1_ENTRY_SIZE_IN_BYTES) {
-		clusterNo = 0;
-		clusterNo |= bufferedRootDir[lvl1Entry + 0];
-		clusterNo |= bufferedRootDir[lvl1Entry + 1] << 8;
-		clusterNo |= bufferedRootDir[lvl1Entry + 2] << 16;
-		clusterNo |= bufferedRootDir[lvl1Entry + 3] << 24;
+		ClusterNo clusterNo = KernelFS::getEntry(bufferedRootDir, lvl1Entry);
 		if (clusterNo == 0) continue; // no level 2 index cluster
-		KernelFS::mountedPartition->readCluster(clusterNo, bufferedLvl2IndexCluster);
+		KernelFS::readMetadataCluster(clusterNo, bufferedLvl2IndexCluster);
 		for (int lvl2Entry = 0; lvl2Entry < 2048; lvl2Entry += KernelFS::LVL2_ENTRY_SIZE_IN_BYTES) {
-			clusterNo = 0;
-			clusterNo |= bufferedLvl2IndexCluster[lvl2Entry + 0];
-			clusterNo |= bufferedLvl2IndexCluster[lvl2Entry + 1] << 8;
-			clusterNo |= bufferedLvl2IndexCluster[lvl2Entry + 2] << 16;
-			clusterNo |= bufferedLvl2IndexCluster[lvl2Entry + 3] << 24;
-			if (clusterNo == 0) continue; // no file descriptor cluster 
-			KernelFS::mountedPartition->readCluster(clusterNo, bufferedFileDescCluster);
-			for (int fileDescEntry = 0; fileDescEntry < 2048; fileDescEntry += KernelFS::FILEDESC_ENTRY_SIZE_IN_BYTES)
-				if (bufferedFileDescCluster[fileDescEntry + KernelFS::FILE_NAME_OFFSET] != 0x00)
-					fileCount++;
+			clusterNo = KernelFS::getEntry(bufferedLvl2IndexCluster, lvl2Entry);
+			if (clusterNo == 0) continue; // no file descriptor cluster
+			KernelFS::readMetadataCluster(clusterNo, bufferedFileDescCluster);
+			for (int fileDescEntry = 0; fileDescEntry < 2048; fileDescEntry += KernelFS::FILEDESC_ENTRY_SIZE_IN_BYTES) {
+				if (bufferedFileDescCluster[fileDescEntry + KernelFS::FILE_NAME_OFFSET + 0] == 0x00) continue; // no file descriptor
+				std::string fullFileName = "/";
+				int offset;
+				for (offset = 0; offset < 8 && bufferedFileDescCluster[fileDescEntry + KernelFS::FILE_NAME_OFFSET + offset] != ' '; offset++)
+					fullFileName += bufferedFileDescCluster[fileDescEntry + KernelFS::FILE_NAME_OFFSET + offset];
+				fullFileName += ".";
+				for (offset = 0; offset < 3 && bufferedFileDescCluster[fileDescEntry + KernelFS::FILE_EXTENSION_OFFSET + offset] != ' '; offset++)
+					fullFileName += bufferedFileDescCluster[fileDescEntry + KernelFS::FILE_EXTENSION_OFFSET + offset];
+				fnames.push_back(fullFileName);
+			}
 		}
 	}
+	ReleaseSRWLockShared(&directorySRWLock);
 	ReleaseSRWLockShared(&srwLock);
-	return fileCount;
+	return fnames;
 }
 
 char KernelFS::doesExist(char* fname) {
 	if (fname == nullptr) return -1;
-	AcquireSRWLockShared(&srwLock);
-	if (KernelFS::mountedPartition == nullptr || KernelFS::formattedPartitions[KernelFS::mountedPartition] == false) {
+	StatsRecorder::acquireShared(LOCK_PARTITION, &srwLock);
+	if (KernelFS::mountedPartition == nullptr || KernelFS::mountedPartitionState->formatted == false) {
 		ReleaseSRWLockShared(&srwLock);
 		return -1;
 	}
-	if (KernelFS::files.find((std::string)fname) != KernelFS::files.end()) {
-		ReleaseSRWLockExclusive(&srwLock);
+	StatsRecorder::acquireShared(LOCK_FILES, &filesSRWLock);
+	KernelFS::files.lock((std::string)fname, false);
+	bool cached = KernelFS::files.find((std::string)fname) != nullptr;
+	KernelFS::files.unlock((std::string)fname, false);
+	ReleaseSRWLockShared(&filesSRWLock);
+	if (cached) {
+		ReleaseSRWLockShared(&srwLock);
 		return 1; // file found in the files map; that means the file's descriptor has been cached - file exists
 	}
+	StatsRecorder::acquireShared(LOCK_DIRECTORY, &directorySRWLock);
 	char bufferedRootDir[2048];
 	char bufferedLvl2IndexCluster[2048];
 	char bufferedFileDescCluster[2048];
 	ClusterNo clusterNo;
-	KernelFS::mountedPartition->readCluster(KernelFS::rootLvl1IndexClusterNo, bufferedRootDir);
+	KernelFS::readMetadataCluster(KernelFS::rootLvl1IndexClusterNo, bufferedRootDir);
 	for (int lvl1Entry = 0; lvl1Entry < 2048; lvl1Entry += KernelFS::LVL1_ENTRY_SIZE_IN_BYTES) {
 		clusterNo = 0;
 		clusterNo |= ((unsigned char)bufferedRootDir[lvl1Entry + 0]);
@@ -237,15 +584,15 @@ char KernelFS::doesExist(char* fname) {
 		clusterNo |= ((unsigned char)bufferedRootDir[lvl1Entry + 2]) << 16;
 		clusterNo |= ((unsigned char)bufferedRootDir[lvl1Entry + 3]) << 24;
 		if (clusterNo == 0) continue; // no level 2 index cluster
-		KernelFS::mountedPartition->readCluster(clusterNo, bufferedLvl2IndexCluster);
+		KernelFS::readMetadataCluster(clusterNo, bufferedLvl2IndexCluster);
 		for (int lvl2Entry = 0; lvl2Entry < 2048; lvl2Entry += KernelFS::LVL2_ENTRY_SIZE_IN_BYTES) {
 			clusterNo = 0;
-			clusterNo |= bufferedLvl2IndexCluster[lvl2Entry + 0];
-			clusterNo |= bufferedLvl2IndexCluster[lvl2Entry + 1] << 8;
-			clusterNo |= bufferedLvl2IndexCluster[lvl2Entry + 2] << 16;
-			clusterNo |= bufferedLvl2IndexCluster[lvl2Entry + 3] << 24;
+			clusterNo |= ((unsigned char)bufferedLvl2IndexCluster[lvl2Entry + 0]);
+			clusterNo |= ((unsigned char)bufferedLvl2IndexCluster[lvl2Entry + 1]) << 8;
+			clusterNo |= ((unsigned char)bufferedLvl2IndexCluster[lvl2Entry + 2]) << 16;
+			clusterNo |= ((unsigned char)bufferedLvl2IndexCluster[lvl2Entry + 3]) << 24;
 			if (clusterNo == 0) continue; // no file descriptor cluster 
-			KernelFS::mountedPartition->readCluster(clusterNo, bufferedFileDescCluster);
+			KernelFS::readMetadataCluster(clusterNo, bufferedFileDescCluster);
 			for (int fileDescEntry = 0; fileDescEntry < 2048; fileDescEntry += KernelFS::FILEDESC_ENTRY_SIZE_IN_BYTES) {
 				// if the first byte in file name's 8 bytes equals 0x00, it means that the entry does not hold information about a file
 				if (bufferedFileDescCluster[fileDescEntry + KernelFS::FILE_NAME_OFFSET + 0] == 0x00) continue; // no file descriptor
@@ -262,24 +609,28 @@ char KernelFS::doesExist(char* fname) {
 					char fileDesc[KernelFS::LVL2_ENTRY_SIZE_IN_BYTES];
 					for (offset = 0; offset < KernelFS::LVL2_ENTRY_SIZE_IN_BYTES; offset++)
 						fileDesc[offset] = bufferedFileDescCluster[fileDescEntry + offset];
+					ReleaseSRWLockShared(&directorySRWLock);
 					ReleaseSRWLockShared(&srwLock);
 					return 1; // file found - matching file name and file extension
 				}
 			}
 		}	
 	}
+	ReleaseSRWLockShared(&directorySRWLock);
 	ReleaseSRWLockShared(&srwLock);
 	return 0; // file not found
 }
 
 FileDesc* KernelFS::getFileDescriptor(char* fname) {
-	if (KernelFS::files.find((std::string)fname) != KernelFS::files.end())
-		return KernelFS::files[(std::string)fname];
+	FileDesc* cachedFd = KernelFS::files.find((std::string)fname);
+	if (cachedFd != nullptr)
+		return cachedFd;
+	StatsRecorder::acquireShared(LOCK_DIRECTORY, &directorySRWLock);
 	char bufferedRootDir[2048];
 	char bufferedLvl2IndexCluster[2048];
 	char bufferedFileDescCluster[2048];
 	ClusterNo clusterNo;
-	KernelFS::mountedPartition->readCluster(KernelFS::rootLvl1IndexClusterNo, bufferedRootDir);
+	KernelFS::readMetadataCluster(KernelFS::rootLvl1IndexClusterNo, bufferedRootDir);
 	for (int lvl1Entry = 0; lvl1Entry < 2048; lvl1Entry += KernelFS::LVL1_ENTRY_SIZE_IN_BYTES) {
 		clusterNo = 0;
 		clusterNo |= ((unsigned char)bufferedRootDir[lvl1Entry + 0]);
@@ -287,15 +638,15 @@ FileDesc* KernelFS::getFileDescriptor(char* fname) {
 		clusterNo |= ((unsigned char)bufferedRootDir[lvl1Entry + 2]) << 16;
 		clusterNo |= ((unsigned char)bufferedRootDir[lvl1Entry + 3]) << 24;
 		if (clusterNo == 0) continue; // no level 2 index cluster
-		KernelFS::mountedPartition->readCluster(clusterNo, bufferedLvl2IndexCluster);
+		KernelFS::readMetadataCluster(clusterNo, bufferedLvl2IndexCluster);
 		for (int lvl2Entry = 0; lvl2Entry < 2048; lvl2Entry += KernelFS::LVL2_ENTRY_SIZE_IN_BYTES) {
 			clusterNo = 0;
-			clusterNo |= bufferedLvl2IndexCluster[lvl2Entry + 0];
-			clusterNo |= bufferedLvl2IndexCluster[lvl2Entry + 1] << 8;
-			clusterNo |= bufferedLvl2IndexCluster[lvl2Entry + 2] << 16;
-			clusterNo |= bufferedLvl2IndexCluster[lvl2Entry + 3] << 24;
+			clusterNo |= ((unsigned char)bufferedLvl2IndexCluster[lvl2Entry + 0]);
+			clusterNo |= ((unsigned char)bufferedLvl2IndexCluster[lvl2Entry + 1]) << 8;
+			clusterNo |= ((unsigned char)bufferedLvl2IndexCluster[lvl2Entry + 2]) << 16;
+			clusterNo |= ((unsigned char)bufferedLvl2IndexCluster[lvl2Entry + 3]) << 24;
 			if (clusterNo == 0) continue; // no file descriptor cluster 
-			KernelFS::mountedPartition->readCluster(clusterNo, bufferedFileDescCluster);
+			KernelFS::readMetadataCluster(clusterNo, bufferedFileDescCluster);
 			for (int fileDescEntry = 0; fileDescEntry < 2048; fileDescEntry += KernelFS::FILEDESC_ENTRY_SIZE_IN_BYTES) {
 				// if the first byte in file name's 8 bytes equals 0x00, it means that the entry does not hold information about a file
 				if (bufferedFileDescCluster[fileDescEntry + KernelFS::FILE_NAME_OFFSET + 0] == 0x00) continue; // no file descriptor
@@ -309,13 +660,15 @@ FileDesc* KernelFS::getFileDescriptor(char* fname) {
 				for (offset = 0; offset < 3 && bufferedFileDescCluster[fileDescEntry + KernelFS::FILE_EXTENSION_OFFSET + offset] != ' '; offset++)
 					fullFileName += bufferedFileDescCluster[fileDescEntry + KernelFS::FILE_EXTENSION_OFFSET + offset];
 				if (fullFileName == (std::string)fname) {
-					FileDesc* fd = new FileDesc(clusterNo, fileDescEntry);
-					KernelFS::files.insert(std::make_pair(fullFileName, fd));
+					FileDesc* fd = new FileDesc(this, fullFileName, clusterNo, fileDescEntry);
+					KernelFS::files.insert(fullFileName, fd);
+					ReleaseSRWLockShared(&directorySRWLock);
 					return fd;
 				}
 			}
 		}
 	}
+	ReleaseSRWLockShared(&directorySRWLock);
 	return 0; // file not found
 }
 
@@ -349,24 +702,113 @@ char KernelFS::format(char* fname, char* fileName, char* fileExtension) {
 		return 0; // file name longer than 8 characters
 }
 
-ClusterNo KernelFS::allocateCluster() {
+ClusterNo KernelFS::allocateClusterAtomic(ClusterNo goal) {
+	StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+	ClusterNo allocatedClusterNo = KernelFS::allocateCluster(goal);
+	ReleaseSRWLockExclusive(&allocatorSRWLock);
+	return allocatedClusterNo;
+}
+
+ClusterNo KernelFS::allocateCluster(ClusterNo goal) {
+	LONGLONG start = StatsRecorder::start();
+	ClusterNo allocatedClusterNo = KernelFS::takeFreeCluster(goal);
+	StatsRecorder::stop(OP_ALLOCATE, start, 0);
+	return allocatedClusterNo;
+}
+
+ClusterNo KernelFS::takeFreeCluster(ClusterNo goal) {
 	char bitVectorCluster[2048];
-	for (int clusterNo = 0; clusterNo < KernelFS::bitVectorSizeInClusters; clusterNo++) {
-		KernelFS::mountedPartition->readCluster(0 + clusterNo, bitVectorCluster);
+	if (goal != 0 && goal < KernelFS::numOfClusters) { // try the goal cluster first
+		int clustNo = goal / (ClusterSize * CHAR_SIZE_IN_BITS);
+		int bytNo = (goal % (ClusterSize * CHAR_SIZE_IN_BITS)) / CHAR_SIZE_IN_BITS;
+		int bitNo = (goal % (ClusterSize * CHAR_SIZE_IN_BITS)) % CHAR_SIZE_IN_BITS;
+		KernelFS::readBitVectorCluster(clustNo, bitVectorCluster);
+		if ((bitVectorCluster[bytNo] & (1 << bitNo)) != 0) { // goal cluster is free
+			bitVectorCluster[bytNo] &= ~(1 << bitNo);
+			KernelFS::writeBitVectorCluster(clustNo, bitVectorCluster);
+			KernelFS::numOfFreeClusters--;
+			return goal;
+		}
+	}
+	// the bit vector is searched only if it has a free cluster to be found
+	for (int clusterNo = 0; KernelFS::numOfFreeClusters > 0 && clusterNo < KernelFS::bitVectorSizeInClusters; clusterNo++) {
+		KernelFS::readBitVectorCluster(clusterNo, bitVectorCluster);
 		for (int i = 0; i < 2048; i++) 
 			for (int bitNo = 0; bitNo < 8; bitNo++)
 				if ((bitVectorCluster[i] & (1 << bitNo)) != 0) { // cluster is free
 					bitVectorCluster[i] &= ~(1 << bitNo);
-					KernelFS::mountedPartition->writeCluster(0 + clusterNo, bitVectorCluster);
+					KernelFS::writeBitVectorCluster(clusterNo, bitVectorCluster);
+					KernelFS::numOfFreeClusters--;
 					return clusterNo * ClusterSize * CHAR_SIZE_IN_BITS + (i << 3) + bitNo;
 				}
 	}
+	if (!KernelFS::reclaimQueue.empty()) { // clusters dropped by 'w' opens are still waiting for the reaper thread - reclaim them now
+		KernelFS::reclaimPendingClusters();
+		return KernelFS::takeFreeCluster(goal);
+	}
 	return 0; // no free cluster found
 }
 
-char KernelFS::allocateFileDescriptor(std::string fname, char* fileName, char* fileExtension) {
+ClusterNo KernelFS::allocateRun(ClusterNo length) {
+	if (length == 0) return 0;
+	StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+	char bitVectorCluster[2048];
+	ClusterNo runStart = 0, runLength = 0;
+	// the first run of free clusters which is long enough is looked for (the clusters past the end of the partition are taken)
+	for (int clusterNo = 0; runLength < length && clusterNo < KernelFS::bitVectorSizeInClusters; clusterNo++) {
+		KernelFS::readBitVectorCluster(clusterNo, bitVectorCluster);
+		for (int i = 0; runLength < length && i < 2048; i++) {
+			if (bitVectorCluster[i] == 0x00) { // eight taken clusters
+				runLength = 0;
+				continue;
+			}
+			for (int bitNo = 0; runLength < length && bitNo < 8; bitNo++) {
+				if ((bitVectorCluster[i] & (1 << bitNo)) == 0) { // cluster is taken
+					runLength = 0;
+					continue;
+				}
+				if (runLength++ == 0)
+					runStart = clusterNo * ClusterSize * CHAR_SIZE_IN_BITS + (i << 3) + bitNo;
+			}
+		}
+	}
+	if (runLength < length) {
+		if (!KernelFS::reclaimQueue.empty()) { // clusters dropped by 'w' opens may complete a run - reclaim them and look once more
+			KernelFS::reclaimPendingClusters();
+			ReleaseSRWLockExclusive(&allocatorSRWLock);
+			return KernelFS::allocateRun(length);
+		}
+		ReleaseSRWLockExclusive(&allocatorSRWLock);
+		return 0; // no run is long enough
+	}
+	// the run's bits are cleared one bit vector cluster at a time
+	for (ClusterNo runClusterNo = runStart; runClusterNo < runStart + length; ) {
+		int clustNo = runClusterNo / (ClusterSize * CHAR_SIZE_IN_BITS);
+		KernelFS::readBitVectorCluster(clustNo, bitVectorCluster);
+		for (; runClusterNo < runStart + length && runClusterNo / (ClusterSize * CHAR_SIZE_IN_BITS) == clustNo; runClusterNo++) {
+			int bytNo = (runClusterNo % (ClusterSize * CHAR_SIZE_IN_BITS)) / CHAR_SIZE_IN_BITS;
+			int bitNo = (runClusterNo % (ClusterSize * CHAR_SIZE_IN_BITS)) % CHAR_SIZE_IN_BITS;
+			bitVectorCluster[bytNo] &= ~(1 << bitNo);
+		}
+		KernelFS::writeBitVectorCluster(clustNo, bitVectorCluster);
+	}
+	KernelFS::numOfFreeClusters -= length;
+	ReleaseSRWLockExclusive(&allocatorSRWLock);
+	return runStart;
+}
+
+unsigned char KernelFS::newFileFlags(bool compressed) {
+	// compressed groups are addressed through the two-level index, so a compressed file is never inline and never mapped through extents
+	if (compressed) return KernelFS::FILE_FLAG_COMPRESSED;
+	// new files get the layout the mounted partition has been formatted with, and start with their data inside of the index cluster
+	unsigned char fileFlags = ((KernelFS::mountedPartitionState->formatOptions & FORMAT_EXTENTS) != 0) ? KernelFS::FILE_FLAG_EXTENTS : 0x00;
+	return fileFlags | KernelFS::FILE_FLAG_INLINE;
+}
+
+FileDesc* KernelFS::allocateFileDescriptor(std::string fname, char* fileName, char* fileExtension, bool compressed) {
+	unsigned char fileFlags = KernelFS::newFileFlags(compressed);
 	char bufferedRootDir[2048];
-	KernelFS::mountedPartition->readCluster(KernelFS::rootLvl1IndexClusterNo, bufferedRootDir);
+	KernelFS::readMetadataCluster(KernelFS::rootLvl1IndexClusterNo, bufferedRootDir);
 	char bufferedLvl2IndexCluster[2048];
 	char bufferedFileDescCluster[2048];
 	char emptyCluster[2048];
@@ -379,7 +821,7 @@ char KernelFS::allocateFileDescriptor(std::string fname, char* fileName, char* f
 		lvl2IndexClusterNo |= ((unsigned char)bufferedRootDir[lvl1Entry + 2]) << 16;
 		lvl2IndexClusterNo |= ((unsigned char)bufferedRootDir[lvl1Entry + 3]) << 24;
 		if (lvl2IndexClusterNo == 0) continue; // no level 2 index cluster
-		KernelFS::mountedPartition->readCluster(lvl2IndexClusterNo, bufferedLvl2IndexCluster);
+		KernelFS::readMetadataCluster(lvl2IndexClusterNo, bufferedLvl2IndexCluster);
 		for (int lvl2Entry = 0; lvl2Entry < 2048; lvl2Entry += KernelFS::LVL2_ENTRY_SIZE_IN_BYTES) {
 			ClusterNo fileDescClusterNo = 0;
 			fileDescClusterNo |= ((unsigned char)bufferedLvl2IndexCluster[lvl2Entry + 0]);
@@ -387,7 +829,7 @@ char KernelFS::allocateFileDescriptor(std::string fname, char* fileName, char* f
 			fileDescClusterNo |= ((unsigned char)bufferedLvl2IndexCluster[lvl2Entry + 2]) << 16;
 			fileDescClusterNo |= ((unsigned char)bufferedLvl2IndexCluster[lvl2Entry + 3]) << 24;
 			if (fileDescClusterNo == 0) continue; // no file descriptor cluster
-			KernelFS::mountedPartition->readCluster(fileDescClusterNo, bufferedFileDescCluster);
+			KernelFS::readMetadataCluster(fileDescClusterNo, bufferedFileDescCluster);
 			for (int fileDescEntry = 0; fileDescEntry < 2048; fileDescEntry += KernelFS::FILEDESC_ENTRY_SIZE_IN_BYTES)
 				if (bufferedFileDescCluster[fileDescEntry + KernelFS::FILE_NAME_OFFSET + 0] == 0x00) { // found a free file descriptor entry
 					int offset;
@@ -396,20 +838,23 @@ char KernelFS::allocateFileDescriptor(std::string fname, char* fileName, char* f
 					for (offset = 0; offset < 3; offset++)
 						bufferedFileDescCluster[fileDescEntry + KernelFS::FILE_EXTENSION_OFFSET + offset] = fileExtension[offset];
 					bufferedFileDescCluster[fileDescEntry + KernelFS::NOT_IN_USE_BYTE_OFFSET] = 0x00;
-					ClusterNo fileLvl1IndexClusterNo = KernelFS::allocateCluster();
-					if (fileLvl1IndexClusterNo == 0 || (fileLvl1IndexClusterNo > KernelFS::numOfClusters - 1)) return 0; // no free cluster found
+					ClusterNo fileLvl1IndexClusterNo = KernelFS::allocateClusterAtomic();
+					if (fileLvl1IndexClusterNo == 0 || (fileLvl1IndexClusterNo > KernelFS::numOfClusters - 1)) return nullptr; // no free cluster found
 					bufferedFileDescCluster[fileDescEntry + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 0] = fileLvl1IndexClusterNo & 0xffUL;
 					bufferedFileDescCluster[fileDescEntry + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 1] = (fileLvl1IndexClusterNo >> 8) & 0xffUL;
 					bufferedFileDescCluster[fileDescEntry + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 2] = (fileLvl1IndexClusterNo >> 16) & 0xffUL;
 					bufferedFileDescCluster[fileDescEntry + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 3] = (fileLvl1IndexClusterNo >> 24) & 0xffUL;
 					for (offset = 0; offset < 4; offset++) // file size takes 4 bytes
 						bufferedFileDescCluster[fileDescEntry + KernelFS::FILE_SIZE_OFFSET + offset] = 0x00;
+					bufferedFileDescCluster[fileDescEntry + KernelFS::FILE_FLAGS_OFFSET] = fileFlags;
 					// writing all clusters back
-					KernelFS::mountedPartition->writeCluster(fileLvl1IndexClusterNo, emptyCluster); // initialize file's level 1 index cluster
-					KernelFS::mountedPartition->writeCluster(fileDescClusterNo, bufferedFileDescCluster); // write back the updated file descriptor cluster
+					KernelFS::writeMetadataCluster(fileLvl1IndexClusterNo, emptyCluster); // initialize file's level 1 index cluster
+					KernelFS::writeMetadataCluster(fileDescClusterNo, bufferedFileDescCluster); // write back the updated file descriptor cluster
 					// all clusters written back
-					KernelFS::files.insert(std::make_pair(fname, new FileDesc(fileDescClusterNo, fileDescEntry)));
-					return 1;
+					FileDesc* fd = new FileDesc(this, fname, fileDescClusterNo, fileDescEntry);
+					KernelFS::files.insert(fname, fd);
+					KernelFS::numOfFiles++;
+					return fd;
 				}
 		}
 		// no free file descriptor entries found in already allocated file descriptor clusters (for this level 2 index cluster)
@@ -427,8 +872,8 @@ char KernelFS::allocateFileDescriptor(std::string fname, char* fileName, char* f
 			}
 		}
 		if (freeLvl2IndexClusterEntryNo != -1) {
-			ClusterNo fileDescClusterNo = KernelFS::allocateCluster();
-			if (fileDescClusterNo == 0 || (fileDescClusterNo > KernelFS::numOfClusters - 1)) return 0; // no free cluster found
+			ClusterNo fileDescClusterNo = KernelFS::allocateClusterAtomic();
+			if (fileDescClusterNo == 0 || (fileDescClusterNo > KernelFS::numOfClusters - 1)) return nullptr; // no free cluster found
 			// form the file descriptor
 			char fileDescCluster[2048];
 			for (int i = 0; i < 2048; i++)
@@ -439,14 +884,15 @@ char KernelFS::allocateFileDescriptor(std::string fname, char* fileName, char* f
 			for (offset = 0; offset < 3; offset++)
 				fileDescCluster[0 + KernelFS::FILE_EXTENSION_OFFSET + offset] = fileExtension[offset];
 			bufferedFileDescCluster[KernelFS::NOT_IN_USE_BYTE_OFFSET] = 0x00;
-			ClusterNo fileLvl1IndexClusterNo = KernelFS::allocateCluster();
-			if (fileLvl1IndexClusterNo == 0 || (fileLvl1IndexClusterNo > KernelFS::numOfClusters - 1)) return 0; // no free cluster found
+			ClusterNo fileLvl1IndexClusterNo = KernelFS::allocateClusterAtomic();
+			if (fileLvl1IndexClusterNo == 0 || (fileLvl1IndexClusterNo > KernelFS::numOfClusters - 1)) return nullptr; // no free cluster found
 			fileDescCluster[0 + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 0] = fileLvl1IndexClusterNo & 0xffUL;
 			fileDescCluster[0 + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 1] = (fileLvl1IndexClusterNo >> 8) & 0xffUL;
 			fileDescCluster[0 + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 2] = (fileLvl1IndexClusterNo >> 16) & 0xffUL;
 			fileDescCluster[0 + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 3] = (fileLvl1IndexClusterNo >> 24) & 0xffUL;
 			for (offset = 0; offset < 4; offset++) // file size takes 4 bytes
 				fileDescCluster[0 + KernelFS::FILE_SIZE_OFFSET + offset] = 0x00;
+			fileDescCluster[0 + KernelFS::FILE_FLAGS_OFFSET] = fileFlags;
 			// file descriptor formed	
 			// update root directory's level 2 index cluster entry
 			bufferedLvl2IndexCluster[freeLvl2IndexClusterEntryNo + 0] = fileDescClusterNo & 0xffUL;
@@ -454,13 +900,15 @@ char KernelFS::allocateFileDescriptor(std::string fname, char* fileName, char* f
 			bufferedLvl2IndexCluster[freeLvl2IndexClusterEntryNo + 2] = (fileDescClusterNo >> 16) & 0xffUL;
 			bufferedLvl2IndexCluster[freeLvl2IndexClusterEntryNo + 3] = (fileDescClusterNo >> 24) & 0xffUL;
 			// writing all clusters back
-			KernelFS::mountedPartition->writeCluster(fileLvl1IndexClusterNo, emptyCluster); // initialize file's level 1 index cluster
-			KernelFS::mountedPartition->writeCluster(fileDescClusterNo, fileDescCluster); // write the new file descriptor cluster
-			KernelFS::mountedPartition->writeCluster(lvl2IndexClusterNo, bufferedLvl2IndexCluster); // write back the updated level 2 index cluster
+			KernelFS::writeMetadataCluster(fileLvl1IndexClusterNo, emptyCluster); // initialize file's level 1 index cluster
+			KernelFS::writeMetadataCluster(fileDescClusterNo, fileDescCluster); // write the new file descriptor cluster
+			KernelFS::writeMetadataCluster(lvl2IndexClusterNo, bufferedLvl2IndexCluster); // write back the updated level 2 index cluster
 			// all clusters written back
 			// root directory's level 2 index cluster entry updated
-			KernelFS::files.insert(std::make_pair(fname, new FileDesc(fileDescClusterNo, 0)));
-			return 1;
+			FileDesc* fd = new FileDesc(this, fname, fileDescClusterNo, 0);
+			KernelFS::files.insert(fname, fd);
+			KernelFS::numOfFiles++;
+			return fd;
 		}
 	}
 	// no free file descriptor spot found inside of all of the allocated file descriptor clusters (for all level 2 index clusters allocated)
@@ -477,9 +925,9 @@ char KernelFS::allocateFileDescriptor(std::string fname, char* fileName, char* f
 			break;
 		}
 	}
-	if (freeLvl1IndexClusterEntryNo == -1) return 0; // no more level 2 index clusters can be allocated
-	ClusterNo lvl2IndexClusterNo = KernelFS::allocateCluster();
-	if (lvl2IndexClusterNo == 0 || (lvl2IndexClusterNo > KernelFS::numOfClusters - 1)) return 0; // no free cluster found
+	if (freeLvl1IndexClusterEntryNo == -1) return nullptr; // no more level 2 index clusters can be allocated
+	ClusterNo lvl2IndexClusterNo = KernelFS::allocateClusterAtomic();
+	if (lvl2IndexClusterNo == 0 || (lvl2IndexClusterNo > KernelFS::numOfClusters - 1)) return nullptr; // no free cluster found
 	char lvl2IndexCluster[2048]; // initially empty
 	for (int i = 0; i < 2048; i++)
 		lvl2IndexCluster[i] = emptyCluster[i];
@@ -488,8 +936,8 @@ char KernelFS::allocateFileDescriptor(std::string fname, char* fileName, char* f
 	bufferedRootDir[freeLvl1IndexClusterEntryNo + 1] = (lvl2IndexClusterNo >> 8) & 0xffUL;
 	bufferedRootDir[freeLvl1IndexClusterEntryNo + 2] = (lvl2IndexClusterNo >> 16) & 0xffUL;
 	bufferedRootDir[freeLvl1IndexClusterEntryNo + 3] = (lvl2IndexClusterNo >> 24) & 0xffUL;
-	ClusterNo fileDescClusterNo = KernelFS::allocateCluster();
-	if (fileDescClusterNo == 0 || (fileDescClusterNo > (KernelFS::numOfClusters - 1))) return 0; // no free cluster found
+	ClusterNo fileDescClusterNo = KernelFS::allocateClusterAtomic();
+	if (fileDescClusterNo == 0 || (fileDescClusterNo > (KernelFS::numOfClusters - 1))) return nullptr; // no free cluster found
 	char fileDescCluster[2048];
 	for (int i = 0; i < 2048; i++)
 		fileDescCluster[i] = 0x00;
@@ -499,14 +947,15 @@ char KernelFS::allocateFileDescriptor(std::string fname, char* fileName, char* f
 	for (offset = 0; offset < 3; offset++)
 		fileDescCluster[0 + KernelFS::FILE_EXTENSION_OFFSET + offset] = fileExtension[offset];
 	fileDescCluster[KernelFS::NOT_IN_USE_BYTE_OFFSET] = 0x00;
-	ClusterNo fileLvl1IndexClusterNo = KernelFS::allocateCluster();
-	if (fileLvl1IndexClusterNo == 0 || (fileLvl1IndexClusterNo > KernelFS::numOfClusters - 1)) return 0; // no free cluster found
+	ClusterNo fileLvl1IndexClusterNo = KernelFS::allocateClusterAtomic();
+	if (fileLvl1IndexClusterNo == 0 || (fileLvl1IndexClusterNo > KernelFS::numOfClusters - 1)) return nullptr; // no free cluster found
 	fileDescCluster[0 + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 0] = fileLvl1IndexClusterNo & 0xffUL;
 	fileDescCluster[0 + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 1] = (fileLvl1IndexClusterNo >> 8) & 0xffUL;
 	fileDescCluster[0 + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 2] = (fileLvl1IndexClusterNo >> 16) & 0xffUL;
 	fileDescCluster[0 + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 3] = (fileLvl1IndexClusterNo >> 24) & 0xffUL;
 	for (offset = 0; offset < 4; offset++) // file size takes 4 bytes
 		fileDescCluster[0 + KernelFS::FILE_SIZE_OFFSET + offset] = 0x00;
+	fileDescCluster[0 + KernelFS::FILE_FLAGS_OFFSET] = fileFlags;
 	// file descriptor formed
 	// update root directory's level 2 index cluster entry
 	lvl2IndexCluster[0 + 0] = fileDescClusterNo & 0xffUL;
@@ -514,160 +963,995 @@ char KernelFS::allocateFileDescriptor(std::string fname, char* fileName, char* f
 	lvl2IndexCluster[0 + 2] = (fileDescClusterNo >> 16) & 0xffUL;
 	lvl2IndexCluster[0 + 3] = (fileDescClusterNo >> 24) & 0xffUL;
 	// writing all clusters back
-	KernelFS::mountedPartition->writeCluster(fileLvl1IndexClusterNo, emptyCluster); // initialize file's level 1 index cluster
-	KernelFS::mountedPartition->writeCluster(fileDescClusterNo, fileDescCluster); // write the new file descriptor cluster
-	KernelFS::mountedPartition->writeCluster(lvl2IndexClusterNo, lvl2IndexCluster); // write the new level 2 index cluster
-	KernelFS::mountedPartition->writeCluster(KernelFS::rootLvl1IndexClusterNo, bufferedRootDir); // write back the updated root dir
+	KernelFS::writeMetadataCluster(fileLvl1IndexClusterNo, emptyCluster); // initialize file's level 1 index cluster
+	KernelFS::writeMetadataCluster(fileDescClusterNo, fileDescCluster); // write the new file descriptor cluster
+	KernelFS::writeMetadataCluster(lvl2IndexClusterNo, lvl2IndexCluster); // write the new level 2 index cluster
+	KernelFS::writeMetadataCluster(KernelFS::rootLvl1IndexClusterNo, bufferedRootDir); // write back the updated root dir
 	// all clusters written back
-	KernelFS::files.insert(std::make_pair(fname, new FileDesc(fileDescClusterNo, 0)));
-	return 1;
+	FileDesc* fd = new FileDesc(this, fname, fileDescClusterNo, 0);
+	KernelFS::files.insert(fname, fd);
+	KernelFS::numOfFiles++;
+	return fd;
 }
 
 
-File* KernelFS::open(char* fname, char mode) {
-	if (fname == nullptr || (mode != 'r' && mode != 'w' && mode != 'a')) return nullptr;
+File* KernelFS::open(char* fname, char mode, DWORD timeout, bool* busy, unsigned int options) {
+	if (busy != nullptr) *busy = false;
+	if (fname == nullptr || (mode != 'r' && mode != 'w' && mode != 'a' && mode != 'm' && mode != 's')) return nullptr;
 	char fileName[8];
 	char fileExtension[3];
 	if (KernelFS::format(fname, fileName, fileExtension) == 0) return nullptr;
-	AcquireSRWLockExclusive(&srwLock);
-	if (KernelFS::mountedPartition == nullptr || KernelFS::formattedPartitions[KernelFS::mountedPartition] == false) {
-		ReleaseSRWLockExclusive(&srwLock);
+	StatsRecorder::acquireShared(LOCK_PARTITION, &srwLock);
+	if (KernelFS::mountedPartition == nullptr || KernelFS::mountedPartitionState->formatted == false) {
+		ReleaseSRWLockShared(&srwLock);
 		return nullptr;
 	}
+	// only the stripe of the open-file table which the file falls into gets locked exclusively
+	StatsRecorder::acquireShared(LOCK_FILES, &filesSRWLock);
+	if (KernelFS::waitingToFormat > 0) { // the file would get erased under the handle - the opens wait no more than format does
+		ReleaseSRWLockShared(&filesSRWLock);
+		ReleaseSRWLockShared(&srwLock);
+		return nullptr;
+	}
+	KernelFS::files.lock((std::string)fname, true);
 	FileDesc* fileDescriptor = nullptr;
 	if ((fileDescriptor = KernelFS::getFileDescriptor(fname)) == nullptr) { // file does not exist
-		if (mode == 'r' || mode == 'a') { // file must exist to be opened in 'r'/'a' modes
-			ReleaseSRWLockExclusive(&srwLock);
+		if (mode == 'r' || mode == 'a' || mode == 'm' || mode == 's') { // file must exist to be opened in 'r'/'a'/'m'/'s' modes
+			KernelFS::files.unlock((std::string)fname, true);
+			ReleaseSRWLockShared(&filesSRWLock);
+			ReleaseSRWLockShared(&srwLock);
 			return nullptr;
 		}
-		if (KernelFS::allocateFileDescriptor((std::string)fname, fileName, fileExtension) == 0) {
-			ReleaseSRWLockExclusive(&srwLock);
+		StatsRecorder::acquireExclusive(LOCK_DIRECTORY, &directorySRWLock);
+		fileDescriptor = KernelFS::allocateFileDescriptor((std::string)fname, fileName, fileExtension, (options & OPEN_COMPRESSED) != 0);
+		ReleaseSRWLockExclusive(&directorySRWLock);
+		if (fileDescriptor == nullptr) {
+			KernelFS::files.unlock((std::string)fname, true);
+			ReleaseSRWLockShared(&filesSRWLock);
+			ReleaseSRWLockShared(&srwLock);
 			return nullptr; // couldn't create the file descriptor
 		}
-		fileDescriptor = KernelFS::files[(std::string)fname];
-		File* file = new File((std::string)fname, mode, 0);
-		KernelFS::numberOfOpenedFiles++;
+		InterlockedIncrement(&(KernelFS::numberOfOpenedFiles));
 		fileDescriptor->timesOpened++;
-		ReleaseSRWLockExclusive(&srwLock);
-		// acquire the file SRWLock in exclusive mode
-		AcquireSRWLockExclusive(&(fileDescriptor->fileSRWLock));
-		return file;
+		KernelFS::files.unlock((std::string)fname, true);
+		ReleaseSRWLockShared(&filesSRWLock);
+		ReleaseSRWLockShared(&srwLock);
+		// acquire the file SRWLock in exclusive mode (the new file may have already been opened by another thread)
+		if (!fileDescriptor->lockFile(true, timeout)) {
+			KernelFS::releaseFile(fileDescriptor);
+			if (busy != nullptr) *busy = true;
+			return nullptr;
+		}
+		KernelFS::startWriting(fileDescriptor);
+		KernelFS::commitMetadata();
+		return new File(this, fileDescriptor, mode, 0);
 	}
 	else {
-		KernelFS::numberOfOpenedFiles++;
+		InterlockedIncrement(&(KernelFS::numberOfOpenedFiles));
 		fileDescriptor->timesOpened++;
+		KernelFS::files.unlock((std::string)fname, true);
+		ReleaseSRWLockShared(&filesSRWLock);
+		// the file is counted as open, so the partition cannot get unmounted while the file's SRWLock is waited for
+		ReleaseSRWLockShared(&srwLock);
+		if (mode == 's') // the file's snapshot (taken by the file object) is read - the file's SRWLock is not needed
+			return new File(this, fileDescriptor, mode, 0);
+		// acquire the file SRWLock - in shared mode for 'r'/'m' ('m' handles synchronize with each other through range locks),
+		// in exclusive mode for 'w'/'a'
+		if (!fileDescriptor->lockFile(mode == 'w' || mode == 'a', timeout)) { // the file is still open in a conflicting mode
+			KernelFS::releaseFile(fileDescriptor);
+			if (busy != nullptr) *busy = true;
+			return nullptr;
+		}
+		if (mode != 'r')
+			KernelFS::startWriting(fileDescriptor);
 		char fileDescriptorCluster[2048];
 		File* file = nullptr;
 		unsigned long fileSize = 0;
 		switch (mode) {
 		case 'r':
-			ReleaseSRWLockExclusive(&srwLock);
-			// acquire the file SRWLock in shared mode
-			AcquireSRWLockShared(&(fileDescriptor->fileSRWLock));
-			KernelFS::mountedPartition->readCluster(fileDescriptor->clusterNo, fileDescriptorCluster);
+		case 'm':
+			StatsRecorder::acquireShared(LOCK_DIRECTORY, &directorySRWLock);
+			KernelFS::readMetadataCluster(fileDescriptor->clusterNo, fileDescriptorCluster);
+			ReleaseSRWLockShared(&directorySRWLock);
 			fileSize |= ((unsigned char)fileDescriptorCluster[fileDescriptor->entryStart + KernelFS::FILE_SIZE_OFFSET + 0]);
 			fileSize |= ((unsigned char)fileDescriptorCluster[fileDescriptor->entryStart + KernelFS::FILE_SIZE_OFFSET + 1]) << 8;
 			fileSize |= ((unsigned char)fileDescriptorCluster[fileDescriptor->entryStart + KernelFS::FILE_SIZE_OFFSET + 2]) << 16;
 			fileSize |= ((unsigned char)fileDescriptorCluster[fileDescriptor->entryStart + KernelFS::FILE_SIZE_OFFSET + 3]) << 24;
-			return new File((std::string)fname, mode, fileSize);
+			return new File(this, fileDescriptor, mode, fileSize);
 		case 'w':
-			ReleaseSRWLockExclusive(&srwLock);
-			// acquire the file SRWLock in exclusive mode
-			AcquireSRWLockExclusive(&(fileDescriptor->fileSRWLock));
-			KernelFS::mountedPartition->readCluster(fileDescriptor->clusterNo, fileDescriptorCluster);
-			fileSize |= ((unsigned char)fileDescriptorCluster[fileDescriptor->entryStart + KernelFS::FILE_SIZE_OFFSET + 0]);
-			fileSize |= ((unsigned char)fileDescriptorCluster[fileDescriptor->entryStart + KernelFS::FILE_SIZE_OFFSET + 1]) << 8;
-			fileSize |= ((unsigned char)fileDescriptorCluster[fileDescriptor->entryStart + KernelFS::FILE_SIZE_OFFSET + 2]) << 16;
-			fileSize |= ((unsigned char)fileDescriptorCluster[fileDescriptor->entryStart + KernelFS::FILE_SIZE_OFFSET + 3]) << 24;
-			file = new File((std::string)fname, mode, fileSize);
-			file->truncate();
-			return file;
+			// the old contents are dropped without walking them - the reaper thread deallocates their clusters later
+			KernelFS::replaceFileContents(fileDescriptor, (options & OPEN_COMPRESSED) != 0);
+			KernelFS::commitMetadata();
+			return new File(this, fileDescriptor, mode, 0);
 		case 'a':
-			ReleaseSRWLockExclusive(&srwLock);
-			// acquire the file SRWLock in exclusive mode
-			AcquireSRWLockExclusive(&(fileDescriptor->fileSRWLock));
-			KernelFS::mountedPartition->readCluster(fileDescriptor->clusterNo, fileDescriptorCluster);
+			StatsRecorder::acquireShared(LOCK_DIRECTORY, &directorySRWLock);
+			KernelFS::readMetadataCluster(fileDescriptor->clusterNo, fileDescriptorCluster);
+			ReleaseSRWLockShared(&directorySRWLock);
 			fileSize |= ((unsigned char)fileDescriptorCluster[fileDescriptor->entryStart + KernelFS::FILE_SIZE_OFFSET + 0]);
 			fileSize |= ((unsigned char)fileDescriptorCluster[fileDescriptor->entryStart + KernelFS::FILE_SIZE_OFFSET + 1]) << 8;
 			fileSize |= ((unsigned char)fileDescriptorCluster[fileDescriptor->entryStart + KernelFS::FILE_SIZE_OFFSET + 2]) << 16;
 			fileSize |= ((unsigned char)fileDescriptorCluster[fileDescriptor->entryStart + KernelFS::FILE_SIZE_OFFSET + 3]) << 24;
-			file = new File((std::string)fname, mode, fileSize);
+			file = new File(this, fileDescriptor, mode, fileSize);
 			file->seek(file->getFileSize());
 			return file;
 		default:
-			ReleaseSRWLockExclusive(&srwLock);
 			return nullptr;
 		}
 	}
 }
 
 void KernelFS::deallocateCluster(ClusterNo clusterNo) {
+	std::unordered_map<ClusterNo, unsigned int>& shared = KernelFS::mountedPartitionState->sharedClusters;
+	std::unordered_map<ClusterNo, unsigned int>::iterator sharedCluster = shared.find(clusterNo);
+	if (sharedCluster != shared.end()) {
+		if (--sharedCluster->second > 1) return; // only the reference is dropped - the cluster still belongs to other files
+		shared.erase(sharedCluster);
+		std::unordered_map<ClusterNo, unsigned long>::iterator indexed = KernelFS::mountedPartitionState->dedupFingerprints.find(clusterNo);
+		if (indexed == KernelFS::mountedPartitionState->dedupFingerprints.end())
+			return; // the cluster belongs to the one file left
+		// the reference left is the deduplication index's own - no file uses the cluster anymore
+		KernelFS::mountedPartitionState->dedupIndex.erase(indexed->second);
+		KernelFS::mountedPartitionState->dedupFingerprints.erase(indexed);
+	}
 	int clustNo = clusterNo / (ClusterSize * CHAR_SIZE_IN_BITS);
 	int bytNo = (clusterNo % (ClusterSize * CHAR_SIZE_IN_BITS)) / CHAR_SIZE_IN_BITS;
 	int bitNo = (clusterNo % (ClusterSize * CHAR_SIZE_IN_BITS)) % CHAR_SIZE_IN_BITS;
 	char bitVectorCluster[2048];
-	KernelFS::mountedPartition->readCluster(0 + clustNo, bitVectorCluster);
+	KernelFS::readBitVectorCluster(clustNo, bitVectorCluster);
+	if ((bitVectorCluster[bytNo] & (1 << bitNo)) == 0)
+		KernelFS::numOfFreeClusters++;
 	bitVectorCluster[bytNo] |= (1 << bitNo);
-	KernelFS::mountedPartition->writeCluster(0 + clustNo, bitVectorCluster);
+	KernelFS::writeBitVectorCluster(clustNo, bitVectorCluster);
+	if (KernelFS::journal != nullptr) // the cluster may get allocated as a data cluster next
+		KernelFS::journal->revoke(clusterNo);
+}
+
+void KernelFS::deallocateClusterAtomic(ClusterNo clusterNo) {
+	StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+	KernelFS::deallocateCluster(clusterNo);
+	ReleaseSRWLockExclusive(&allocatorSRWLock);
 }
 
 char KernelFS::deleteFile(char* fname) {
 	if (fname == nullptr) return 0;
-	AcquireSRWLockExclusive(&srwLock);
-	if (KernelFS::mountedPartition == nullptr || KernelFS::formattedPartitions[KernelFS::mountedPartition] == false) {
-		ReleaseSRWLockExclusive(&srwLock);
+	StatsRecorder::acquireShared(LOCK_PARTITION, &srwLock);
+	if (KernelFS::mountedPartition == nullptr || KernelFS::mountedPartitionState->formatted == false) {
+		ReleaseSRWLockShared(&srwLock);
 		return 0;
 	}
+	StatsRecorder::acquireShared(LOCK_FILES, &filesSRWLock);
+	KernelFS::files.lock((std::string)fname, true);
 	FileDesc* fd = nullptr;
 	if ((fd = KernelFS::getFileDescriptor(fname)) == nullptr) {
-		ReleaseSRWLockExclusive(&srwLock);
+		KernelFS::files.unlock((std::string)fname, true);
+		ReleaseSRWLockShared(&filesSRWLock);
+		ReleaseSRWLockShared(&srwLock);
 		return 0; // file not found
 	}
 	if (fd->timesOpened > 0) {
-		ReleaseSRWLockExclusive(&srwLock);
+		KernelFS::files.unlock((std::string)fname, true);
+		ReleaseSRWLockShared(&filesSRWLock);
+		ReleaseSRWLockShared(&srwLock);
 		return 0; // file is currently opened
 	}
+	KernelFS::removeFile((std::string)fname, fd);
+	KernelFS::files.unlock((std::string)fname, true);
+	ReleaseSRWLockShared(&filesSRWLock);
+	KernelFS::commitMetadata();
+	ReleaseSRWLockShared(&srwLock);
+	return 1;
+}
+
+void KernelFS::removeFile(std::string fname, FileDesc* fd) {
+	StatsRecorder::acquireExclusive(LOCK_DIRECTORY, &directorySRWLock);
 	char fileDescriptorCluster[2048];
-	char fileLvl1IndexCluster[2048];
-	char fileLvl2IndexCluster[2048];
-	KernelFS::mountedPartition->readCluster(fd->clusterNo, fileDescriptorCluster);
-	ClusterNo fileLvl1IndexClusterNo = 0;
-	fileLvl1IndexClusterNo |= ((unsigned char)fileDescriptorCluster[fd->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 0]);
-	fileLvl1IndexClusterNo |= ((unsigned char)fileDescriptorCluster[fd->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 1]) << 8;
-	fileLvl1IndexClusterNo |= ((unsigned char)fileDescriptorCluster[fd->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 2]) << 16;
-	fileLvl1IndexClusterNo |= ((unsigned char)fileDescriptorCluster[fd->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 3]) << 24;
-	KernelFS::mountedPartition->readCluster(fileLvl1IndexClusterNo, fileLvl1IndexCluster);
-	for (int lvl1Entry = 0; lvl1Entry < 2048; lvl1Entry += KernelFS::LVL1_ENTRY_SIZE_IN_BYTES) {
-		ClusterNo fileLvl2IndexClusterNo = 0;
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 0]);
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 1]) << 8;
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 2]) << 16;
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 3]) << 24;
-		if (fileLvl2IndexClusterNo == 0) continue; // no level 2 index cluster
-		KernelFS::mountedPartition->readCluster(fileLvl2IndexClusterNo, fileLvl2IndexCluster);
-		for (int lvl2Entry = 0; lvl2Entry < 2048; lvl2Entry += KernelFS::LVL2_ENTRY_SIZE_IN_BYTES) {
-			ClusterNo fileDataClusterNo = 0;
-			fileDataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 0]);
-			fileDataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 1]) << 8;
-			fileDataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 2]) << 16;
-			fileDataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 3]) << 24;
-			if (fileDataClusterNo == 0) continue; // no data cluster
-			KernelFS::deallocateCluster(fileDataClusterNo);
-			// KernelFS::mountedPartition->writeCluster(fileDataClusterNo, emptyCluster);
-		}
-		KernelFS::deallocateCluster(fileLvl2IndexClusterNo);
-		// KernelFS::mountedPartition->writeCluster(fileLvl2IndexClusterNo, emptyCluster);
-	}
-	KernelFS::deallocateCluster(fileLvl1IndexClusterNo);
-	// KernelFS::mountedPartition->writeCluster(fileLvl1IndexClusterNo, emptyCluster);
-	// free the file descriptor spot
+	KernelFS::readMetadataCluster(fd->clusterNo, fileDescriptorCluster);
+	ClusterNo fileLvl1IndexClusterNo = KernelFS::getEntry(fileDescriptorCluster, fd->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET);
+	unsigned char fileFlags = fileDescriptorCluster[fd->entryStart + KernelFS::FILE_FLAGS_OFFSET];
+	// the file's dirty clusters are dropped, so that the flusher thread cannot write them over the clusters once they get reallocated
+	fd->cache->invalidateAll();
+	// the file descriptor spot is freed before the file's clusters, so that no descriptor ever points to deallocated clusters
 	for (int offset = 0; offset < KernelFS::FILEDESC_ENTRY_SIZE_IN_BYTES; offset++)
 		fileDescriptorCluster[fd->entryStart + offset] = 0x00;
-	KernelFS::mountedPartition->writeCluster(fd->clusterNo, fileDescriptorCluster);
+	KernelFS::writeMetadataCluster(fd->clusterNo, fileDescriptorCluster);
+	KernelFS::numOfFiles--;
+	StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+	KernelFS::deallocateFileClusters(fileLvl1IndexClusterNo, fileFlags);
+	ReleaseSRWLockExclusive(&allocatorSRWLock);
+	ReleaseSRWLockExclusive(&directorySRWLock);
 	// file descriptor spot freed
-	// remove the file descriptor from the files map
-	delete KernelFS::files.find((std::string)fname)->second;
-	KernelFS::files.erase((std::string)fname);
+	// remove the file descriptor from the open-file table
+	KernelFS::files.erase(fname);
+	delete fd;
+}
+
+void KernelFS::releaseFile(FileDesc* fd) {
+	StatsRecorder::acquireShared(LOCK_FILES, &filesSRWLock);
+	KernelFS::files.lock(fd->fname, true);
+	fd->timesOpened--;
+	KernelFS::files.unlock(fd->fname, true);
+	// numberOfOpenedFiles is changed atomically while filesSRWLock is held in shared mode; unmount/format check it while holding it exclusively
+	LONG numberOfOpenedFiles = InterlockedDecrement(&(KernelFS::numberOfOpenedFiles));
+	if (numberOfOpenedFiles == 0 && KernelFS::waitingToUnMount > 0)
+		ReleaseSemaphore(
+			KernelFS::ok_to_unmount, // handle to semaphore
+			KernelFS::waitingToUnMount, // increase count by 1
+			NULL // not interested in previous count
+		);
+	else if (numberOfOpenedFiles == 0 && KernelFS::waitingToFormat > 0)
+		ReleaseSemaphore(
+			KernelFS::ok_to_format,
+			KernelFS::waitingToFormat,
+			NULL
+		);
+	ReleaseSRWLockShared(&filesSRWLock);
+}
+
+char KernelFS::copyFile(char* srcFname, char* dstFname, unsigned int options) {
+	if (srcFname == nullptr || dstFname == nullptr) return 0;
+	if ((std::string)srcFname == (std::string)dstFname) return 0; // a file cannot be copied onto itself
+	char fileName[8];
+	char fileExtension[3];
+	if (KernelFS::format(dstFname, fileName, fileExtension) == 0) return 0;
+	StatsRecorder::acquireShared(LOCK_PARTITION, &srwLock);
+	if (KernelFS::mountedPartition == nullptr || KernelFS::mountedPartitionState->formatted == false) {
+		ReleaseSRWLockShared(&srwLock);
+		return 0;
+	}
+	StatsRecorder::acquireExclusive(LOCK_FILES, &filesSRWLock); // both files' stripes of the open-file table are used, so the whole table is locked
+	FileDesc* srcFd = nullptr;
+	if ((srcFd = KernelFS::getFileDescriptor(srcFname)) == nullptr || srcFd->timesOpened > 0) {
+		ReleaseSRWLockExclusive(&filesSRWLock);
+		ReleaseSRWLockShared(&srwLock);
+		return 0; // source file not found or currently opened
+	}
+	// both files are kept open while being copied, so the copy runs without holding any of the file system's locks;
+	// the source file is counted as open right away, so that looking up the destination file cannot evict its descriptor
+	srcFd->timesOpened++;
+	FileDesc* dstFd = nullptr;
+	if ((dstFd = KernelFS::getFileDescriptor(dstFname)) != nullptr) {
+		if (dstFd->timesOpened > 0) {
+			srcFd->timesOpened--;
+			ReleaseSRWLockExclusive(&filesSRWLock);
+			ReleaseSRWLockShared(&srwLock);
+			return 0; // destination file is currently opened
+		}
+		KernelFS::removeFile((std::string)dstFname, dstFd); // destination file gets overwritten
+	}
+	StatsRecorder::acquireExclusive(LOCK_DIRECTORY, &directorySRWLock);
+	dstFd = KernelFS::allocateFileDescriptor((std::string)dstFname, fileName, fileExtension);
+	ReleaseSRWLockExclusive(&directorySRWLock);
+	if (dstFd == nullptr) {
+		srcFd->timesOpened--;
+		ReleaseSRWLockExclusive(&filesSRWLock);
+		ReleaseSRWLockShared(&srwLock);
+		return 0; // couldn't create the file descriptor
+	}
+	dstFd->timesOpened++;
+	KernelFS::numberOfOpenedFiles += 2;
+	ReleaseSRWLockExclusive(&filesSRWLock);
+	ReleaseSRWLockShared(&srwLock);
+	srcFd->lockFile(false, INFINITE);
+	dstFd->lockFile(true, INFINITE);
+	srcFd->cache->writeBack(); // the source file's clusters are copied straight from the partition
+	KernelFS::startWriting(dstFd);
+	char fileDescriptorCluster[2048];
+	StatsRecorder::acquireShared(LOCK_DIRECTORY, &directorySRWLock);
+	KernelFS::readMetadataCluster(srcFd->clusterNo, fileDescriptorCluster);
+	ReleaseSRWLockShared(&directorySRWLock);
+	ClusterNo srcLvl1IndexClusterNo = KernelFS::getEntry(fileDescriptorCluster, srcFd->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET);
+	BytesCnt fileSize = KernelFS::getEntry(fileDescriptorCluster, srcFd->entryStart + KernelFS::FILE_SIZE_OFFSET);
+	unsigned char fileFlags = fileDescriptorCluster[srcFd->entryStart + KernelFS::FILE_FLAGS_OFFSET];
+	// the destination file takes over the source file's layout, so that its index cluster can be filled in the same way
+	StatsRecorder::acquireExclusive(LOCK_DIRECTORY, &directorySRWLock);
+	KernelFS::readMetadataCluster(dstFd->clusterNo, fileDescriptorCluster);
+	ClusterNo dstLvl1IndexClusterNo = KernelFS::getEntry(fileDescriptorCluster, dstFd->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET);
+	fileDescriptorCluster[dstFd->entryStart + KernelFS::FILE_FLAGS_OFFSET] = fileFlags;
+	KernelFS::writeMetadataCluster(dstFd->clusterNo, fileDescriptorCluster);
+	ReleaseSRWLockExclusive(&directorySRWLock);
+	char result = KernelFS::copyFileClusters(srcLvl1IndexClusterNo, dstLvl1IndexClusterNo, fileFlags, (options & COPY_CLONE) != 0);
+	if (result == 1) {
+		StatsRecorder::acquireExclusive(LOCK_DIRECTORY, &directorySRWLock);
+		KernelFS::readMetadataCluster(dstFd->clusterNo, fileDescriptorCluster);
+		KernelFS::setEntry(fileDescriptorCluster, dstFd->entryStart + KernelFS::FILE_SIZE_OFFSET, fileSize);
+		KernelFS::writeMetadataCluster(dstFd->clusterNo, fileDescriptorCluster);
+		ReleaseSRWLockExclusive(&directorySRWLock);
+	}
+	else // no free clusters left - the partial copy is dropped, leaving an empty destination file
+		KernelFS::replaceFileContents(dstFd, (fileFlags & KernelFS::FILE_FLAG_COMPRESSED) != 0);
+	KernelFS::stopWriting(dstFd);
+	KernelFS::commitMetadata();
+	dstFd->unlockFile(true);
+	srcFd->unlockFile(false);
+	KernelFS::releaseFile(dstFd);
+	KernelFS::releaseFile(srcFd);
+	return result;
+}
+
+FileTableStats KernelFS::fileTableStats() {
+	return KernelFS::files.stats();
+}
+
+char KernelFS::copyFileClusters(ClusterNo srcLvl1IndexClusterNo, ClusterNo dstLvl1IndexClusterNo, unsigned char fileFlags, bool clone) {
+	char srcLvl1IndexCluster[2048];
+	char dstLvl1IndexCluster[2048];
+	std::vector<ClusterNo> srcDataClusterNos, dstDataClusterNos; // the batch being copied
+	KernelFS::readMetadataCluster(srcLvl1IndexClusterNo, srcLvl1IndexCluster);
+	if ((fileFlags & KernelFS::FILE_FLAG_INLINE) != 0) { // index cluster holds file's data, which is copied even when cloning
+		KernelFS::writeMetadataCluster(dstLvl1IndexClusterNo, srcLvl1IndexCluster);
+		return 1;
+	}
+	for (int i = 0; i < 2048; i++)
+		dstLvl1IndexCluster[i] = 0x00;
+	char result = 1;
+	if ((fileFlags & KernelFS::FILE_FLAG_EXTENTS) != 0) {
+		int dstExtentEntry = 0;
+		// appends an extent to the destination table, unless the table is full
+		auto appendExtent = [&](ClusterNo start, unsigned long length) {
+			if (dstExtentEntry == 2048) return false;
+			KernelFS::setEntry(dstLvl1IndexCluster, dstExtentEntry + KernelFS::EXTENT_START_OFFSET, start);
+			KernelFS::setEntry(dstLvl1IndexCluster, dstExtentEntry + KernelFS::EXTENT_LENGTH_OFFSET, length);
+			dstExtentEntry += KernelFS::EXTENT_ENTRY_SIZE_IN_BYTES;
+			return true;
+		};
+		for (int extentEntry = 0; extentEntry < 2048 && result == 1; extentEntry += KernelFS::EXTENT_ENTRY_SIZE_IN_BYTES) {
+			ClusterNo start = KernelFS::getEntry(srcLvl1IndexCluster, extentEntry + KernelFS::EXTENT_START_OFFSET);
+			unsigned long length = KernelFS::getEntry(srcLvl1IndexCluster, extentEntry + KernelFS::EXTENT_LENGTH_OFFSET);
+			if (length == 0) break; // end of the extent table
+			if (start == 0 || clone) { // holes and shared extents are mapped just as in the source file
+				if (appendExtent(start, length) == false) result = 0;
+				else if (start != 0) {
+					StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+					for (unsigned long i = 0; i < length; i++)
+						KernelFS::shareCluster(start + i);
+					ReleaseSRWLockExclusive(&allocatorSRWLock);
+				}
+				continue;
+			}
+			// the extent is copied (COPY_BATCH_SIZE clusters at a time) into runs of contiguous newly allocated clusters - a single run,
+			// unless the free space is fragmented
+			ClusterNo runStart = 0;
+			unsigned long runLength = 0;
+			for (unsigned long copied = 0; copied < length && result == 1; copied += srcDataClusterNos.size()) {
+				srcDataClusterNos.clear();
+				dstDataClusterNos.clear();
+				while (copied + srcDataClusterNos.size() < length && srcDataClusterNos.size() < COPY_BATCH_SIZE) {
+					ClusterNo previousClusterNo = dstDataClusterNos.empty() ? ((runStart != 0) ? (runStart + runLength - 1) : 0) : dstDataClusterNos.back();
+					ClusterNo dataClusterNo = KernelFS::allocateClusterAtomic((previousClusterNo != 0) ? (previousClusterNo + 1) : 0);
+					if (dataClusterNo == 0 || dataClusterNo > (KernelFS::numOfClusters - 1)) { // no free cluster found
+						result = 0;
+						break;
+					}
+					srcDataClusterNos.push_back(start + copied + srcDataClusterNos.size());
+					dstDataClusterNos.push_back(dataClusterNo);
+				}
+				if (result == 1 && KernelFS::copyDataClusters(srcDataClusterNos, dstDataClusterNos) == 0) // a source cluster does not match its checksum
+					result = 0;
+				if (result == 0) { // the batch does not get into the extent table
+					for (unsigned int i = 0; i < dstDataClusterNos.size(); i++)
+						KernelFS::deallocateClusterAtomic(dstDataClusterNos[i]);
+					break;
+				}
+				for (unsigned int i = 0; i < dstDataClusterNos.size(); i++) {
+					if (runStart != 0 && dstDataClusterNos[i] == runStart + runLength) {
+						runLength++;
+						continue;
+					}
+					if (runStart != 0 && appendExtent(runStart, runLength) == false) { // the run is deallocated below, the rest of the batch here
+						for (unsigned int j = i; j < dstDataClusterNos.size(); j++)
+							KernelFS::deallocateClusterAtomic(dstDataClusterNos[j]);
+						result = 0;
+						break;
+					}
+					runStart = dstDataClusterNos[i];
+					runLength = 1;
+				}
+			}
+			if (runStart != 0 && appendExtent(runStart, runLength) == false) { // the last run does not fit into the table - it is deallocated
+				for (unsigned long i = 0; i < runLength; i++)
+					KernelFS::deallocateClusterAtomic(runStart + i);
+				result = 0;
+			}
+		}
+	}
+	else {
+		char srcLvl2IndexCluster[2048];
+		char dstLvl2IndexCluster[2048];
+		ClusterNo previousDataClusterNo = 0;
+		for (int lvl1Entry = 0; lvl1Entry < 2048 && result == 1; lvl1Entry += KernelFS::LVL1_ENTRY_SIZE_IN_BYTES) {
+			ClusterNo srcLvl2IndexClusterNo = KernelFS::getEntry(srcLvl1IndexCluster, lvl1Entry);
+			if (srcLvl2IndexClusterNo == 0) continue; // no level 2 index cluster
+			ClusterNo dstLvl2IndexClusterNo = KernelFS::allocateClusterAtomic();
+			if (dstLvl2IndexClusterNo == 0 || dstLvl2IndexClusterNo > (KernelFS::numOfClusters - 1)) { // no free cluster found
+				result = 0;
+				break;
+			}
+			KernelFS::setEntry(dstLvl1IndexCluster, lvl1Entry, dstLvl2IndexClusterNo);
+			KernelFS::readMetadataCluster(srcLvl2IndexClusterNo, srcLvl2IndexCluster);
+			for (int i = 0; i < 2048; i++)
+				dstLvl2IndexCluster[i] = 0x00;
+			// the data clusters the level 2 index cluster maps are copied in a single batch
+			std::vector<int> dstLvl2Entries;
+			srcDataClusterNos.clear();
+			dstDataClusterNos.clear();
+			for (int lvl2Entry = 0; lvl2Entry < 2048; lvl2Entry += KernelFS::LVL2_ENTRY_SIZE_IN_BYTES) {
+				ClusterNo srcDataClusterNo = KernelFS::getEntry(srcLvl2IndexCluster, lvl2Entry);
+				if (srcDataClusterNo == 0) continue; // a hole
+				if (clone) {
+					StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+					KernelFS::shareCluster(srcDataClusterNo);
+					ReleaseSRWLockExclusive(&allocatorSRWLock);
+					KernelFS::setEntry(dstLvl2IndexCluster, lvl2Entry, srcDataClusterNo);
+					continue;
+				}
+				ClusterNo dstDataClusterNo = KernelFS::allocateClusterAtomic((previousDataClusterNo != 0) ? (previousDataClusterNo + 1) : 0);
+				if (dstDataClusterNo == 0 || dstDataClusterNo > (KernelFS::numOfClusters - 1)) { // no free cluster found
+					result = 0;
+					break;
+				}
+				srcDataClusterNos.push_back(srcDataClusterNo);
+				dstDataClusterNos.push_back(dstDataClusterNo);
+				dstLvl2Entries.push_back(lvl2Entry);
+				previousDataClusterNo = dstDataClusterNo;
+			}
+			if (result == 1 && KernelFS::copyDataClusters(srcDataClusterNos, dstDataClusterNos) == 0) // a source cluster does not match its checksum
+				result = 0;
+			for (unsigned int i = 0; i < dstDataClusterNos.size(); i++)
+				if (result == 1)
+					KernelFS::setEntry(dstLvl2IndexCluster, dstLvl2Entries[i], dstDataClusterNos[i]);
+				else // the batch does not get into the index
+					KernelFS::deallocateClusterAtomic(dstDataClusterNos[i]);
+			KernelFS::writeMetadataCluster(dstLvl2IndexClusterNo, dstLvl2IndexCluster);
+		}
+	}
+	KernelFS::writeMetadataCluster(dstLvl1IndexClusterNo, dstLvl1IndexCluster);
+	return result;
+}
+
+char KernelFS::copyDataClusters(const std::vector<ClusterNo>& srcClusterNos, const std::vector<ClusterNo>& dstClusterNos) {
+	if (srcClusterNos.empty()) return 1;
+	std::vector<char> data(srcClusterNos.size() * 2048);
+	std::vector<char*> buffers(srcClusterNos.size());
+	for (unsigned int i = 0; i < buffers.size(); i++)
+		buffers[i] = &data[i * 2048];
+	if (KernelFS::readClusters(srcClusterNos.data(), srcClusterNos.size(), buffers.data()) == 0) return 0;
+	KernelFS::writeClusters(dstClusterNos.data(), dstClusterNos.size(), buffers.data());
+	return 1;
+}
+
+void KernelFS::replaceFileContents(FileDesc* fd, bool compressed) {
+	char fileDescriptorCluster[2048];
+	StatsRecorder::acquireExclusive(LOCK_DIRECTORY, &directorySRWLock);
+	KernelFS::readMetadataCluster(fd->clusterNo, fileDescriptorCluster);
+	ClusterNo fileLvl1IndexClusterNo = KernelFS::getEntry(fileDescriptorCluster, fd->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET);
+	unsigned char fileFlags = fileDescriptorCluster[fd->entryStart + KernelFS::FILE_FLAGS_OFFSET];
+	// none of the cached clusters belong to the file anymore
+	fd->cache->invalidateAll();
+	char emptyCluster[2048];
+	for (int i = 0; i < 2048; i++)
+		emptyCluster[i] = 0x00;
+	if ((fileFlags & KernelFS::FILE_FLAG_INLINE) != 0) // the data is inside of the index cluster, which is simply cleared
+		KernelFS::writeMetadataCluster(fileLvl1IndexClusterNo, emptyCluster);
+	else {
+		StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+		ClusterNo newLvl1IndexClusterNo = KernelFS::allocateCluster();
+		if (newLvl1IndexClusterNo == 0 || newLvl1IndexClusterNo > (KernelFS::numOfClusters - 1)) {
+			// no free cluster for the new index - the old clusters are deallocated right away instead
+			KernelFS::deallocateFileClusters(fileLvl1IndexClusterNo, fileFlags);
+			newLvl1IndexClusterNo = KernelFS::allocateCluster();
+		}
+		else {
+			ReclaimRequest request = { fileLvl1IndexClusterNo, fileFlags };
+			KernelFS::reclaimQueue.push_back(request);
+			if (KernelFS::reaperThread == NULL)
+				KernelFS::reaperThread = CreateThread(NULL, 0, KernelFS::reaper, this, 0, NULL);
+			ReleaseSemaphore(
+				ok_to_reclaim, // handle to semaphore
+				1, // increase count by 1
+				NULL // not interested in previous count
+			);
+		}
+		ReleaseSRWLockExclusive(&allocatorSRWLock);
+		KernelFS::writeMetadataCluster(newLvl1IndexClusterNo, emptyCluster);
+		KernelFS::setEntry(fileDescriptorCluster, fd->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET, newLvl1IndexClusterNo);
+	}
+	fileDescriptorCluster[fd->entryStart + KernelFS::FILE_FLAGS_OFFSET] = KernelFS::newFileFlags(compressed); // an empty index is an empty inline file, too
+	KernelFS::setEntry(fileDescriptorCluster, fd->entryStart + KernelFS::FILE_SIZE_OFFSET, 0);
+	KernelFS::writeMetadataCluster(fd->clusterNo, fileDescriptorCluster);
+	ReleaseSRWLockExclusive(&directorySRWLock);
+}
+
+DWORD WINAPI KernelFS::reaper(LPVOID param) {
+	KernelFS* fs = (KernelFS*)param;
+	while (true) {
+		WaitForSingleObject(
+			fs->ok_to_reclaim, // handle to semaphore
+			INFINITE // infinite time-out interval
+		);
+		StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &fs->allocatorSRWLock);
+		if (!fs->reclaimQueue.empty()) { // the queue may have already been emptied by reclaimPendingClusters()
+			ReclaimRequest request = fs->reclaimQueue.front();
+			fs->reclaimQueue.pop_front();
+			fs->deallocateFileClusters(request.fileLvl1IndexClusterNo, request.fileFlags);
+		}
+		ReleaseSRWLockExclusive(&fs->allocatorSRWLock);
+	}
+	return 0;
+}
+
+DWORD WINAPI KernelFS::flusher(LPVOID param) {
+	KernelFS* fs = (KernelFS*)param;
+	while (true) {
+		WaitForSingleObject(
+			fs->ok_to_flush, // handle to semaphore
+			FLUSH_INTERVAL // time-out interval - the caches are gone through at least this often
+		);
+		StatsRecorder::acquireShared(LOCK_PARTITION, &fs->srwLock);
+		if (fs->mountedPartition != nullptr) {
+			ULONGLONG now = GetTickCount64();
+			ULONGLONG expiry = (now > DIRTY_EXPIRE) ? (now - DIRTY_EXPIRE) : 0;
+			AcquireSRWLockExclusive(&fs->dirtyCachesSRWLock);
+			for (std::unordered_set<ClusterCache*>::iterator it = fs->dirtyCaches.begin(); it != fs->dirtyCaches.end(); ) {
+				if ((*it)->flush(expiry) == 0) // a writer getting the cache dirty again hands it over once more
+					it = fs->dirtyCaches.erase(it);
+				else
+					it++;
+			}
+			ReleaseSRWLockExclusive(&fs->dirtyCachesSRWLock);
+			if (fs->checksums != nullptr) // the checksums of the clusters written back do not wait for the next commit
+				fs->checksums->flush();
+		}
+		ReleaseSRWLockShared(&fs->srwLock);
+	}
+	return 0;
+}
+
+void KernelFS::trackDirtyCache(ClusterCache* cache) {
+	AcquireSRWLockExclusive(&dirtyCachesSRWLock);
+	KernelFS::dirtyCaches.insert(cache);
+	if (KernelFS::flusherThread == NULL)
+		KernelFS::flusherThread = CreateThread(NULL, 0, KernelFS::flusher, this, 0, NULL);
+	ReleaseSRWLockExclusive(&dirtyCachesSRWLock);
+}
+
+void KernelFS::forgetCache(ClusterCache* cache) {
+	AcquireSRWLockExclusive(&dirtyCachesSRWLock);
+	KernelFS::dirtyCaches.erase(cache);
+	ReleaseSRWLockExclusive(&dirtyCachesSRWLock);
+}
+
+void KernelFS::wakeFlusher() {
+	ReleaseSemaphore(
+		ok_to_flush, // handle to semaphore
+		1, // increase count by 1
+		NULL // not interested in previous count
+	);
+}
+
+void KernelFS::writeBackDirtyCaches() {
+	AcquireSRWLockExclusive(&dirtyCachesSRWLock);
+	for (std::unordered_set<ClusterCache*>::iterator it = KernelFS::dirtyCaches.begin(); it != KernelFS::dirtyCaches.end(); it++)
+		(*it)->writeBack();
+	KernelFS::dirtyCaches.clear();
+	ReleaseSRWLockExclusive(&dirtyCachesSRWLock);
+}
+
+char KernelFS::check(CheckReport& report, unsigned int options) {
+	LONG defragmenterRate = KernelFS::stopDefragmenter(); // the check needs all of the drive's files closed
+	char result = KernelFS::checkPartition(report, options);
+	if (defragmenterRate != 0)
+		KernelFS::startDefragmenter(defragmenterRate);
+	return result;
+}
+
+char KernelFS::checkPartition(CheckReport& report, unsigned int options) {
+	StatsRecorder::acquireExclusive(LOCK_PARTITION, &srwLock);
+	if (KernelFS::mountedPartition == nullptr || KernelFS::mountedPartitionState->formatted == false) {
+		ReleaseSRWLockExclusive(&srwLock);
+		return 0;
+	}
+	StatsRecorder::acquireExclusive(LOCK_FILES, &filesSRWLock);
+	if (KernelFS::numberOfOpenedFiles > 0) { // the files' caches and index clusters would be changing under the checker
+		ReleaseSRWLockExclusive(&filesSRWLock);
+		ReleaseSRWLockExclusive(&srwLock);
+		return FS_BUSY;
+	}
+	KernelFS::writeBackDirtyCaches(); // the closed files' data has to be on the partition before it gets checked
+	StatsRecorder::acquireExclusive(LOCK_DIRECTORY, &directorySRWLock);
+	StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+	KernelFS::reclaimPendingClusters(); // the clusters of the closed snapshots are freed first, so they do not show up as leaked
+	FSChecker checker(this);
+	bool consistent = checker.run((options & CHECK_REPAIR) != 0, report);
+	if ((options & CHECK_REPAIR) != 0) {
+		KernelFS::commitMetadata();
+		// the descriptors (and the caches) of the closed files kept in the open-file table may no longer match the repaired partition
+		KernelFS::files.clear();
+	}
+	ReleaseSRWLockExclusive(&allocatorSRWLock);
+	ReleaseSRWLockExclusive(&directorySRWLock);
+	ReleaseSRWLockExclusive(&filesSRWLock);
 	ReleaseSRWLockExclusive(&srwLock);
+	return consistent ? 1 : FS_INCONSISTENT;
+}
+
+char KernelFS::sync() {
+	StatsRecorder::acquireShared(LOCK_PARTITION, &srwLock);
+	if (KernelFS::mountedPartition == nullptr) {
+		ReleaseSRWLockShared(&srwLock);
+		return 0;
+	}
+	KernelFS::writeBackDirtyCaches();
+	KernelFS::commitMetadata();
+	ReleaseSRWLockShared(&srwLock);
 	return 1;
+}
+
+long KernelFS::fragmentation(char* fname) {
+	File* file = KernelFS::open(fname, 'r');
+	if (file == nullptr) return -1;
+	long numOfFragments = file->myImpl->fragmentation();
+	delete file;
+	return numOfFragments;
+}
+
+long KernelFS::defragmentFile(char* fname, bool background) {
+	// an internal handle keeps the file from being deleted (and the partition from being unmounted) while it is being defragmented
+	File* file = KernelFS::open(fname, 'r', background ? 0 : INFINITE);
+	if (file == nullptr) return -1;
+	long numOfMovedClusters = file->myImpl->defragment(background);
+	delete file;
+	return numOfMovedClusters;
+}
+
+char KernelFS::startDefragmenter(unsigned long clustersPerSecond) {
+	if (clustersPerSecond == 0) {
+		KernelFS::stopDefragmenter();
+		return 1;
+	}
+	StatsRecorder::acquireShared(LOCK_PARTITION, &srwLock);
+	bool mounted = (KernelFS::mountedPartition != nullptr);
+	ReleaseSRWLockShared(&srwLock);
+	if (!mounted) return 0;
+	AcquireSRWLockExclusive(&defragmenterSRWLock);
+	InterlockedExchange(&defragmenterRate, (LONG)((clustersPerSecond > MAXLONG) ? MAXLONG : clustersPerSecond));
+	if (KernelFS::defragmenterThread == NULL)
+		KernelFS::defragmenterThread = CreateThread(NULL, 0, KernelFS::defragmenter, this, 0, NULL);
+	else // the defragmenter may be waiting with the old budget
+		ReleaseSemaphore(
+			ok_to_defragment, // handle to semaphore
+			1, // increase count by 1
+			NULL // not interested in previous count
+		);
+	ReleaseSRWLockExclusive(&defragmenterSRWLock);
+	return 1;
+}
+
+LONG KernelFS::stopDefragmenter() {
+	AcquireSRWLockExclusive(&defragmenterSRWLock);
+	LONG rate = 0;
+	if (KernelFS::defragmenterThread != NULL) {
+		rate = InterlockedExchange(&defragmenterRate, 0);
+		ReleaseSemaphore(
+			ok_to_defragment, // handle to semaphore
+			1, // increase count by 1
+			NULL // not interested in previous count
+		);
+		// the thread never acquires defragmenterSRWLock, so it can be waited for while holding it
+		WaitForSingleObject(KernelFS::defragmenterThread, INFINITE);
+		CloseHandle(KernelFS::defragmenterThread);
+		KernelFS::defragmenterThread = NULL;
+		while (WaitForSingleObject(ok_to_defragment, 0) == WAIT_OBJECT_0); // wake-ups the thread has not consumed
+	}
+	ReleaseSRWLockExclusive(&defragmenterSRWLock);
+	return rate;
+}
+
+bool KernelFS::throttleDefragmenter(unsigned long numOfMovedClusters) {
+	LONG rate = InterlockedCompareExchange(&defragmenterRate, 0, 0);
+	if (rate == 0) return false;
+	WaitForSingleObject(
+		ok_to_defragment, // handle to semaphore
+		(DWORD)((ULONGLONG)numOfMovedClusters * 1000 / rate) // time-out interval - the time the moved clusters are budgeted for
+	);
+	return InterlockedCompareExchange(&defragmenterRate, 0, 0) != 0;
+}
+
+DWORD WINAPI KernelFS::defragmenter(LPVOID param) {
+	KernelFS* fs = (KernelFS*)param;
+	while (InterlockedCompareExchange(&fs->defragmenterRate, 0, 0) != 0) {
+		bool moved = false;
+		std::vector<std::string> fnames = fs->listFiles();
+		for (unsigned int i = 0; i < fnames.size() && InterlockedCompareExchange(&fs->defragmenterRate, 0, 0) != 0; i++)
+			if (fs->defragmentFile(&fnames[i][0], true) > 0)
+				moved = true;
+		if (!moved) // every file is contiguous (or busy) - the files are gone through once more later on
+			WaitForSingleObject(
+				fs->ok_to_defragment, // handle to semaphore
+				DEFRAG_IDLE_INTERVAL // time-out interval
+			);
+	}
+	return 0;
+}
+
+void KernelFS::reclaimPendingClusters() {
+	while (!KernelFS::reclaimQueue.empty()) {
+		ReclaimRequest request = KernelFS::reclaimQueue.front();
+		KernelFS::reclaimQueue.pop_front();
+		KernelFS::deallocateFileClusters(request.fileLvl1IndexClusterNo, request.fileFlags);
+	}
+}
+
+void KernelFS::shareCluster(ClusterNo clusterNo) {
+	unsigned int& references = KernelFS::mountedPartitionState->sharedClusters[clusterNo];
+	references = (references == 0) ? 2 : (references + 1); // a cluster which is not yet shared is referenced by its original file
+}
+
+bool KernelFS::isSharedCluster(ClusterNo clusterNo) {
+	// may be called with allocatorSRWLock acquired in shared mode only - the map is searched, never modified
+	return KernelFS::mountedPartitionState->sharedClusters.find(clusterNo) != KernelFS::mountedPartitionState->sharedClusters.end();
+}
+
+ClusterNo KernelFS::findDuplicateCluster(const char* data) {
+	unsigned long fingerprint = CRC32C::checksum(data, ClusterSize);
+	ClusterNo clusterNo = 0;
+	StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+	KernelFS::mountedPartitionState->dedupClustersWritten++;
+	std::unordered_map<unsigned long, ClusterNo>::iterator indexed = KernelFS::mountedPartitionState->dedupIndex.find(fingerprint);
+	if (indexed != KernelFS::mountedPartitionState->dedupIndex.end()) {
+		clusterNo = indexed->second;
+		KernelFS::shareCluster(clusterNo); // the cluster cannot get deallocated while its contents are being compared
+	}
+	ReleaseSRWLockExclusive(&allocatorSRWLock);
+	if (clusterNo == 0) return 0;
+	// indexed clusters are never written to, so the partition holds their contents
+	char storedCluster[2048];
+	char* buffers[1] = { storedCluster };
+	if (KernelFS::readClusters(&clusterNo, 1, buffers) == 0 || std::memcmp(storedCluster, data, ClusterSize) != 0) {
+		KernelFS::deallocateClusterAtomic(clusterNo); // only the same fingerprint (or a corrupted cluster) - not a duplicate
+		return 0;
+	}
+	StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+	KernelFS::mountedPartitionState->dedupDuplicateClusters++;
+	ReleaseSRWLockExclusive(&allocatorSRWLock);
+	return clusterNo;
+}
+
+void KernelFS::indexCluster(ClusterNo clusterNo, const char* data) {
+	unsigned long fingerprint = CRC32C::checksum(data, ClusterSize);
+	StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+	if (KernelFS::mountedPartitionState->dedupIndex.find(fingerprint) == KernelFS::mountedPartitionState->dedupIndex.end()) {
+		KernelFS::mountedPartitionState->dedupIndex[fingerprint] = clusterNo;
+		KernelFS::mountedPartitionState->dedupFingerprints[clusterNo] = fingerprint;
+		KernelFS::shareCluster(clusterNo);
+	}
+	ReleaseSRWLockExclusive(&allocatorSRWLock);
+}
+
+DedupStats KernelFS::dedupStats() {
+	DedupStats stats = {};
+	stats.ratio = 1;
+	StatsRecorder::acquireShared(LOCK_PARTITION, &srwLock);
+	if (KernelFS::mountedPartition == nullptr) {
+		ReleaseSRWLockShared(&srwLock);
+		return stats;
+	}
+	StatsRecorder::acquireShared(LOCK_ALLOCATOR, &allocatorSRWLock);
+	PartitionState* state = KernelFS::mountedPartitionState;
+	stats.clustersWritten = state->dedupClustersWritten;
+	stats.duplicateClusters = state->dedupDuplicateClusters;
+	stats.indexedClusters = state->dedupFingerprints.size();
+	for (std::unordered_map<ClusterNo, unsigned long>::iterator indexed = state->dedupFingerprints.begin(); indexed != state->dedupFingerprints.end(); indexed++) {
+		std::unordered_map<ClusterNo, unsigned int>::iterator sharedCluster = state->sharedClusters.find(indexed->first);
+		if (sharedCluster == state->sharedClusters.end()) continue; // no reference counted - it adds no references
+		stats.references += sharedCluster->second - 1; // one of an indexed cluster's references is the index's own
+	}
+	ReleaseSRWLockShared(&allocatorSRWLock);
+	ReleaseSRWLockShared(&srwLock);
+	if (stats.indexedClusters > 0)
+		stats.ratio = (double)stats.references / stats.indexedClusters;
+	return stats;
+}
+
+char KernelFS::readClusters(const ClusterNo* clusterNos, unsigned int count, char** buffers) {
+	std::vector<ClusterNo> partitionClusterNos;
+	std::vector<char*> partitionBuffers;
+	if (KernelFS::journal != nullptr) {
+		for (unsigned int i = 0; i < count; i++)
+			if (!KernelFS::journal->lookup(clusterNos[i], buffers[i])) {
+				partitionClusterNos.push_back(clusterNos[i]);
+				partitionBuffers.push_back(buffers[i]);
+			}
+		clusterNos = partitionClusterNos.data();
+		buffers = partitionBuffers.data();
+		count = partitionClusterNos.size();
+	}
+	StatsRecorder::countClusters(StatsRecorder::DATA_CLUSTERS_READ, count);
+	if (KernelFS::mountedStripedPartition != nullptr && count > 1)
+		KernelFS::mountedStripedPartition->readClusters(clusterNos, count, buffers);
+	else
+		for (unsigned int i = 0; i < count; i++)
+			KernelFS::mountedPartition->readCluster(clusterNos[i], buffers[i]);
+	if (KernelFS::checksums == nullptr || !KernelFS::verifyChecksums) return 1;
+	char result = 1;
+	for (unsigned int i = 0; i < count; i++)
+		if (!KernelFS::checksums->verify(clusterNos[i], buffers[i])) {
+			KernelFS::mountedPartition->readCluster(clusterNos[i], buffers[i]);
+			if (!KernelFS::checksums->verify(clusterNos[i], buffers[i]))
+				result = 0;
+		}
+	return result;
+}
+
+void KernelFS::writeClusters(const ClusterNo* clusterNos, unsigned int count, char** buffers) {
+	LONGLONG start = StatsRecorder::start();
+	if (KernelFS::journal != nullptr)
+		for (unsigned int i = 0; i < count; i++)
+			KernelFS::journal->revoke(clusterNos[i]);
+	if (KernelFS::checksums != nullptr)
+		KernelFS::checksums->update(clusterNos, count, buffers);
+	if (KernelFS::mountedStripedPartition != nullptr && count > 1)
+		KernelFS::mountedStripedPartition->writeClusters(clusterNos, count, buffers);
+	else
+		for (unsigned int i = 0; i < count; i++)
+			KernelFS::mountedPartition->writeCluster(clusterNos[i], buffers[i]);
+	StatsRecorder::countClusters(StatsRecorder::DATA_CLUSTERS_WRITTEN, count);
+	StatsRecorder::stop(OP_WRITE_BACK, start, (BytesCnt)count * ClusterSize);
+}
+
+void KernelFS::startWriting(FileDesc* fd) {
+	AcquireSRWLockExclusive(&(fd->snapshotSRWLock));
+	if (fd->writers++ == 0 && fd->snapshotted) { // the version being closed last is pinned before it gets written to
+		if (fd->snapshot == nullptr)
+			fd->snapshot = KernelFS::pinSnapshot(fd);
+		fd->snapshot->references++;
+	}
+	ReleaseSRWLockExclusive(&(fd->snapshotSRWLock));
+}
+
+void KernelFS::stopWriting(FileDesc* fd) {
+	AcquireSRWLockExclusive(&(fd->snapshotSRWLock));
+	if (--fd->writers == 0) {
+		if (fd->snapshot != nullptr) { // a new version of the file has been closed - the snapshot stays only with the handles reading it
+			FileSnapshot* snapshot = fd->snapshot;
+			fd->snapshot = nullptr;
+			if (--snapshot->references == 0)
+				KernelFS::unpinSnapshot(snapshot);
+		}
+		WakeAllConditionVariable(&(fd->writersDone));
+	}
+	ReleaseSRWLockExclusive(&(fd->snapshotSRWLock));
+}
+
+FileSnapshot* KernelFS::openSnapshot(FileDesc* fd) {
+	AcquireSRWLockExclusive(&(fd->snapshotSRWLock));
+	fd->snapshotted = true;
+	while (fd->snapshot == nullptr && fd->writers > 0) // the writers have not pinned the file's last closed version
+		SleepConditionVariableSRW(&(fd->writersDone), &(fd->snapshotSRWLock), INFINITE, 0);
+	if (fd->snapshot == nullptr)
+		fd->snapshot = KernelFS::pinSnapshot(fd);
+	FileSnapshot* snapshot = fd->snapshot;
+	snapshot->references++;
+	ReleaseSRWLockExclusive(&(fd->snapshotSRWLock));
+	return snapshot;
+}
+
+void KernelFS::closeSnapshot(FileDesc* fd, FileSnapshot* snapshot) {
+	AcquireSRWLockExclusive(&(fd->snapshotSRWLock));
+	if (--snapshot->references == 0) {
+		if (fd->snapshot == snapshot)
+			fd->snapshot = nullptr;
+		KernelFS::unpinSnapshot(snapshot);
+	}
+	ReleaseSRWLockExclusive(&(fd->snapshotSRWLock));
+}
+
+FileSnapshot* KernelFS::pinSnapshot(FileDesc* fd) {
+	fd->cache->writeBack(); // the snapshot's clusters are read straight from the partition
+	FileSnapshot* snapshot = new FileSnapshot();
+	snapshot->references = 0;
+	char fileDescriptorCluster[2048];
+	StatsRecorder::acquireShared(LOCK_DIRECTORY, &directorySRWLock);
+	KernelFS::readMetadataCluster(fd->clusterNo, fileDescriptorCluster);
+	ReleaseSRWLockShared(&directorySRWLock);
+	ClusterNo fileLvl1IndexClusterNo = KernelFS::getEntry(fileDescriptorCluster, fd->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET);
+	snapshot->fileSize = KernelFS::getEntry(fileDescriptorCluster, fd->entryStart + KernelFS::FILE_SIZE_OFFSET);
+	unsigned char fileFlags = fileDescriptorCluster[fd->entryStart + KernelFS::FILE_FLAGS_OFFSET];
+	unsigned long numOfClusters = snapshot->fileSize / ClusterSize + ((snapshot->fileSize % ClusterSize > 0) ? 1 : 0);
+	snapshot->compressed = (fileFlags & KernelFS::FILE_FLAG_COMPRESSED) != 0;
+	if (snapshot->compressed) // the last group may be kept in more clusters than it has logical clusters
+		numOfClusters = (numOfClusters + COMPRESSION_GROUP_SIZE - 1) / COMPRESSION_GROUP_SIZE * COMPRESSION_GROUP_SIZE;
+	if (numOfClusters == 0) return snapshot;
+	char fileLvl1IndexCluster[2048];
+	KernelFS::readMetadataCluster(fileLvl1IndexClusterNo, fileLvl1IndexCluster);
+	if ((fileFlags & KernelFS::FILE_FLAG_INLINE) != 0) { // the data is copied - the index cluster gets written to in place
+		snapshot->inlineData.assign(fileLvl1IndexCluster, fileLvl1IndexCluster + snapshot->fileSize);
+		return snapshot;
+	}
+	snapshot->dataClusterNos.assign(numOfClusters, 0);
+	if ((fileFlags & KernelFS::FILE_FLAG_EXTENTS) != 0) {
+		unsigned long clusterIndex = 0;
+		for (int extentEntry = 0; extentEntry < 2048 && clusterIndex < numOfClusters; extentEntry += KernelFS::EXTENT_ENTRY_SIZE_IN_BYTES) {
+			ClusterNo start = KernelFS::getEntry(fileLvl1IndexCluster, extentEntry + KernelFS::EXTENT_START_OFFSET);
+			unsigned long length = KernelFS::getEntry(fileLvl1IndexCluster, extentEntry + KernelFS::EXTENT_LENGTH_OFFSET);
+			if (length == 0) break; // end of the extent table
+			for (unsigned long i = 0; i < length && clusterIndex < numOfClusters; i++, clusterIndex++)
+				snapshot->dataClusterNos[clusterIndex] = (start == 0) ? 0 : (start + i);
+		}
+	}
+	else {
+		char fileLvl2IndexCluster[2048];
+		for (unsigned long clusterIndex = 0; clusterIndex < numOfClusters; clusterIndex += 512) {
+			ClusterNo fileLvl2IndexClusterNo = KernelFS::getEntry(fileLvl1IndexCluster, (clusterIndex / 512) * KernelFS::LVL1_ENTRY_SIZE_IN_BYTES);
+			if (fileLvl2IndexClusterNo == 0) continue; // the whole level 2 range is a hole
+			KernelFS::readMetadataCluster(fileLvl2IndexClusterNo, fileLvl2IndexCluster);
+			for (unsigned long i = 0; i < 512 && clusterIndex + i < numOfClusters; i++)
+				snapshot->dataClusterNos[clusterIndex + i] = KernelFS::getEntry(fileLvl2IndexCluster, i * KernelFS::LVL2_ENTRY_SIZE_IN_BYTES);
+		}
+	}
+	StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+	for (unsigned long clusterIndex = 0; clusterIndex < numOfClusters; clusterIndex++)
+		if (snapshot->dataClusterNos[clusterIndex] != 0)
+			KernelFS::shareCluster(snapshot->dataClusterNos[clusterIndex]);
+	ReleaseSRWLockExclusive(&allocatorSRWLock);
+	return snapshot;
+}
+
+void KernelFS::unpinSnapshot(FileSnapshot* snapshot) {
+	StatsRecorder::acquireExclusive(LOCK_ALLOCATOR, &allocatorSRWLock);
+	for (unsigned long clusterIndex = 0; clusterIndex < snapshot->dataClusterNos.size(); clusterIndex++)
+		if (snapshot->dataClusterNos[clusterIndex] != 0)
+			KernelFS::deallocateCluster(snapshot->dataClusterNos[clusterIndex]);
+	ReleaseSRWLockExclusive(&allocatorSRWLock);
+	delete snapshot;
+}
+
+void KernelFS::deallocateFileClusters(ClusterNo fileLvl1IndexClusterNo, unsigned char fileFlags) {
+	char fileLvl1IndexCluster[2048];
+	char fileLvl2IndexCluster[2048];
+	if ((fileFlags & KernelFS::FILE_FLAG_INLINE) != 0) { // index cluster holds file's data, there is nothing else to deallocate
+		KernelFS::deallocateCluster(fileLvl1IndexClusterNo);
+		return;
+	}
+	KernelFS::readMetadataCluster(fileLvl1IndexClusterNo, fileLvl1IndexCluster);
+	if ((fileFlags & KernelFS::FILE_FLAG_EXTENTS) != 0) {
+		// index cluster holds a table of extents, terminated by the first extent of length 0
+		for (int extentEntry = 0; extentEntry < 2048; extentEntry += KernelFS::EXTENT_ENTRY_SIZE_IN_BYTES) {
+			ClusterNo start = KernelFS::getEntry(fileLvl1IndexCluster, extentEntry + KernelFS::EXTENT_START_OFFSET);
+			unsigned long length = KernelFS::getEntry(fileLvl1IndexCluster, extentEntry + KernelFS::EXTENT_LENGTH_OFFSET);
+			if (length == 0) break; // end of the extent table
+			if (start == 0) continue; // a hole
+			for (unsigned long i = 0; i < length; i++)
+				KernelFS::deallocateCluster(start + i);
+		}
+	}
+	else {
+		for (int lvl1Entry = 0; lvl1Entry < 2048; lvl1Entry += KernelFS::LVL1_ENTRY_SIZE_IN_BYTES) {
+			ClusterNo fileLvl2IndexClusterNo = KernelFS::getEntry(fileLvl1IndexCluster, lvl1Entry);
+			if (fileLvl2IndexClusterNo == 0) continue; // no level 2 index cluster
+			KernelFS::readMetadataCluster(fileLvl2IndexClusterNo, fileLvl2IndexCluster);
+			for (int lvl2Entry = 0; lvl2Entry < 2048; lvl2Entry += KernelFS::LVL2_ENTRY_SIZE_IN_BYTES) {
+				ClusterNo fileDataClusterNo = KernelFS::getEntry(fileLvl2IndexCluster, lvl2Entry);
+				if (fileDataClusterNo == 0) continue; // no data cluster
+				KernelFS::deallocateCluster(fileDataClusterNo);
+			}
+			KernelFS::deallocateCluster(fileLvl2IndexClusterNo);
+		}
+	}
+	KernelFS::deallocateCluster(fileLvl1IndexClusterNo);
+}
+
+ClusterNo KernelFS::getEntry(char* cluster, unsigned int offset) {
+	ClusterNo value = 0;
+	value |= ((unsigned char)cluster[offset + 0]);
+	value |= ((unsigned char)cluster[offset + 1]) << 8;
+	value |= ((unsigned char)cluster[offset + 2]) << 16;
+	value |= ((ClusterNo)(unsigned char)cluster[offset + 3]) << 24; // not shifted as an int - a checksum may have its top bit set
+	return value;
+}
+
+void KernelFS::setEntry(char* cluster, unsigned int offset, ClusterNo value) {
+	cluster[offset + 0] = value & 0xffUL;
+	cluster[offset + 1] = (value >> 8) & 0xffUL;
+	cluster[offset + 2] = (value >> 16) & 0xffUL;
+	cluster[offset + 3] = (value >> 24) & 0xffUL;
 }
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include "checksumtable.h"
+#include "crc32c.h"
+#include "KernelFS.h"
+
+ChecksumTable::ChecksumTable(KernelFS* fs, ClusterNo start, ClusterNo numOfClusters) {
+	this->fs = fs;
+	this->start = start;
+	this->numOfClusters = numOfClusters;
+	InitializeSRWLock(&srwLock);
+}
+
+ClusterNo ChecksumTable::sizeInClusters(ClusterNo numOfClusters) {
+	return (numOfClusters + CHECKSUMS_PER_CLUSTER - 1) / CHECKSUMS_PER_CLUSTER;
+}
+
+bool ChecksumTable::contains(ClusterNo clusterNo) const {
+	return clusterNo >= start && clusterNo < start + ChecksumTable::sizeInClusters(numOfClusters);
+}
+
+unsigned long ChecksumTable::checksumOf(const char* cluster) {
+	unsigned long checksum = CRC32C::checksum(cluster, ClusterSize);
+	return (checksum == 0) ? 1 : checksum; // a cluster whose CRC happens to be 0 is checked against 1 instead
+}
+
+char* ChecksumTable::regionCluster(ClusterNo regionClusterNo) {
+	std::unordered_map<ClusterNo, std::vector<char>>::iterator it = clusters.find(regionClusterNo);
+	if (it != clusters.end()) return it->second.data();
+	std::vector<char>& cluster = clusters[regionClusterNo];
+	cluster.resize(ClusterSize);
+	fs->readMetadataCluster(start + regionClusterNo, cluster.data());
+	unsigned int ownChecksumOffset = CHECKSUMS_PER_CLUSTER * 4;
+	if (KernelFS::getEntry(cluster.data(), ownChecksumOffset) != CRC32C::checksum(cluster.data(), ownChecksumOffset))
+		for (int i = 0; i < 2048; i++) // never written - it holds no checksums yet
+			cluster[i] = 0x00;
+	return cluster.data();
+}
+
+void ChecksumTable::update(const ClusterNo* clusterNos, unsigned int count, char** buffers) {
+	std::vector<unsigned long> checksums(count);
+	for (unsigned int i = 0; i < count; i++) // computed without holding the table
+		checksums[i] = ChecksumTable::checksumOf(buffers[i]);
+	AcquireSRWLockExclusive(&srwLock);
+	for (unsigned int i = 0; i < count; i++) {
+		if (clusterNos[i] >= numOfClusters) continue;
+		char* cluster = ChecksumTable::regionCluster(clusterNos[i] / CHECKSUMS_PER_CLUSTER);
+		KernelFS::setEntry(cluster, (clusterNos[i] % CHECKSUMS_PER_CLUSTER) * 4, checksums[i]);
+		dirty.insert(clusterNos[i] / CHECKSUMS_PER_CLUSTER);
+	}
+	ReleaseSRWLockExclusive(&srwLock);
+}
+
+void ChecksumTable::drop(ClusterNo clusterNo) {
+	if (clusterNo >= numOfClusters) return;
+	AcquireSRWLockExclusive(&srwLock);
+	char* cluster = ChecksumTable::regionCluster(clusterNo / CHECKSUMS_PER_CLUSTER);
+	unsigned int entry = (clusterNo % CHECKSUMS_PER_CLUSTER) * 4;
+	if (KernelFS::getEntry(cluster, entry) != 0) { // most metadata clusters have never had a checksum - their region cluster stays clean
+		KernelFS::setEntry(cluster, entry, 0);
+		dirty.insert(clusterNo / CHECKSUMS_PER_CLUSTER);
+	}
+	ReleaseSRWLockExclusive(&srwLock);
+}
+
+bool ChecksumTable::verify(ClusterNo clusterNo, const char* buffer) {
+	if (clusterNo >= numOfClusters) return true;
+	unsigned long checksum = ChecksumTable::checksumOf(buffer);
+	ClusterNo regionClusterNo = clusterNo / CHECKSUMS_PER_CLUSTER;
+	unsigned int entry = (clusterNo % CHECKSUMS_PER_CLUSTER) * 4;
+	ClusterNo expected;
+	AcquireSRWLockShared(&srwLock);
+	std::unordered_map<ClusterNo, std::vector<char>>::iterator it = clusters.find(regionClusterNo);
+	if (it != clusters.end()) {
+		expected = KernelFS::getEntry(it->second.data(), entry);
+		ReleaseSRWLockShared(&srwLock);
+	}
+	else { // the region cluster is read first
+		ReleaseSRWLockShared(&srwLock);
+		AcquireSRWLockExclusive(&srwLock);
+		expected = KernelFS::getEntry(ChecksumTable::regionCluster(regionClusterNo), entry);
+		ReleaseSRWLockExclusive(&srwLock);
+	}
+	return expected == 0 || expected == checksum;
+}
+
+void ChecksumTable::flush() {
+	AcquireSRWLockExclusive(&srwLock);
+	for (std::unordered_set<ClusterNo>::iterator it = dirty.begin(); it != dirty.end(); it++) {
+		char* cluster = clusters[*it].data();
+		unsigned int ownChecksumOffset = CHECKSUMS_PER_CLUSTER * 4;
+		KernelFS::setEntry(cluster, ownChecksumOffset, CRC32C::checksum(cluster, ownChecksumOffset));
+		fs->writeMetadataCluster(start + *it, cluster);
+	}
+	dirty.clear();
+	ReleaseSRWLockExclusive(&srwLock);
+}
@@ -1,16 +1,37 @@
 #include "clustercache.h"
 #include "KernelFS.h"
+#include "statsrecorder.h"
 #include <cstdlib>
+#include <vector>
 
-ClusterCache::ClusterCache() {
+ClusterCache::ClusterCache(KernelFS* fs) {
+	this->fs = fs;
 	for (int i = 0; i < CACHE_SIZE; i++) {
 		valid[i] = dirty[i] = tag[i] = 0;
 		for (int j = 0; j < ClusterSize; j++)
 			data[i][j] = 0;
 	}
+	numOfDirty = 0;
 	cacheSRWLock = SRWLOCK_INIT;
 }
 
+ClusterCache::~ClusterCache() {
+	fs->forgetCache(this);
+}
+
+void ClusterCache::markDirty(int entryNo) {
+	if (dirty[entryNo] == 1) return;
+	dirty[entryNo] = 1;
+	dirtySince[entryNo] = GetTickCount64();
+	numOfDirty++;
+}
+
+void ClusterCache::markClean(int entryNo) {
+	if (dirty[entryNo] == 0) return;
+	dirty[entryNo] = 0;
+	numOfDirty--;
+}
+
 int ClusterCache::exists(ClusterNo clusterNo) {
 	for (int entryNo = 0; entryNo < CACHE_SIZE; entryNo++)
 		if (valid[entryNo] == 1 && tag[entryNo] == clusterNo)
@@ -31,33 +52,50 @@ int ClusterCache::getNextEntry() {
 			return entryNo;
 	// all entries are dirty and invalid - write back a random one - unreachable code when it comes to threads who opened file in 'r' mode
 	entryNo = (int)(rand() % CACHE_SIZE);
-	KernelFS::mountedPartition->writeCluster(tag[entryNo], data[entryNo]);
+	char* buffer = data[entryNo];
+	fs->writeClusters(&tag[entryNo], 1, &buffer);
+	ClusterCache::markClean(entryNo);
 	return entryNo;
 }
 
-void ClusterCache::readCluster(ClusterNo clusterNo, char* buffer) {
+char ClusterCache::readCluster(ClusterNo clusterNo, char* buffer) {
 	AcquireSRWLockShared(&cacheSRWLock);
 	int entryNo;
 	if ((entryNo = exists(clusterNo)) != -1) { // cluster found
 		for (int i = 0; i < ClusterSize; i++)
 			buffer[i] = data[entryNo][i];
 		ReleaseSRWLockShared(&cacheSRWLock);
+		StatsRecorder::countClusters(StatsRecorder::CACHE_HITS, 1);
 	}
 	else {
 		ReleaseSRWLockShared(&cacheSRWLock);
 		AcquireSRWLockExclusive(&cacheSRWLock);
+		if ((entryNo = exists(clusterNo)) != -1) { // another thread has cached the cluster in the meantime
+			for (int i = 0; i < ClusterSize; i++)
+				buffer[i] = data[entryNo][i];
+			ReleaseSRWLockExclusive(&cacheSRWLock);
+			StatsRecorder::countClusters(StatsRecorder::CACHE_HITS, 1);
+			return 1;
+		}
+		StatsRecorder::countClusters(StatsRecorder::CACHE_MISSES, 1);
 		entryNo = getNextEntry();
 		valid[entryNo] = 1;
 		dirty[entryNo] = 0;
 		tag[entryNo] = clusterNo;
-		KernelFS::mountedPartition->readCluster(clusterNo, buffer);
+		if (fs->readClusters(&clusterNo, 1, &buffer) == 0) { // a corrupted cluster is not cached
+			valid[entryNo] = 0;
+			ReleaseSRWLockExclusive(&cacheSRWLock);
+			return 0;
+		}
 		for (int i = 0; i < ClusterSize; i++)
 			data[entryNo][i] = buffer[i];
 		ReleaseSRWLockExclusive(&cacheSRWLock);
 	}
+	return 1;
 }
 
 void ClusterCache::writeCluster(ClusterNo clusterNo, char* buffer) {
+	AcquireSRWLockExclusive(&cacheSRWLock); // several handles can write to the file at once (opened in 'm' mode)
 	int entryNo;
 	if ((entryNo = exists(clusterNo)) == -1) {
 		entryNo = getNextEntry();
@@ -66,23 +104,115 @@ void ClusterCache::writeCluster(ClusterNo clusterNo, char* buffer) {
 	}
 	for (int i = 0; i < ClusterSize; i++)
 		data[entryNo][i] = buffer[i];
-	if (dirty[entryNo] == 0)
-		dirty[entryNo] = 1;
+	unsigned int numOfDirtyBefore = numOfDirty;
+	ClusterCache::markDirty(entryNo);
+	bool becameDirty = (numOfDirtyBefore == 0 && numOfDirty == 1);
+	bool overRatio = (numOfDirtyBefore * 100 < DIRTY_RATIO * CACHE_SIZE && numOfDirty * 100 >= DIRTY_RATIO * CACHE_SIZE);
+	ReleaseSRWLockExclusive(&cacheSRWLock);
+	// the flusher is told about the cache without holding it
+	if (becameDirty)
+		fs->trackDirtyCache(this);
+	if (overRatio)
+		fs->wakeFlusher();
+}
+
+char ClusterCache::readClusters(const ClusterNo* clusterNos, unsigned int count, char** buffers) {
+	AcquireSRWLockExclusive(&cacheSRWLock);
+	std::vector<ClusterNo> missedClusterNos;
+	std::vector<char*> missedBuffers;
+	for (unsigned int i = 0; i < count; i++) {
+		int entryNo;
+		if ((entryNo = exists(clusterNos[i])) != -1) { // cluster found
+			for (int j = 0; j < ClusterSize; j++)
+				buffers[i][j] = data[entryNo][j];
+		}
+		else {
+			missedClusterNos.push_back(clusterNos[i]);
+			missedBuffers.push_back(buffers[i]);
+		}
+	}
+	ReleaseSRWLockExclusive(&cacheSRWLock);
+	StatsRecorder::countClusters(StatsRecorder::CACHE_HITS, count - missedClusterNos.size());
+	StatsRecorder::countClusters(StatsRecorder::CACHE_MISSES, missedClusterNos.size());
+	if (missedClusterNos.empty()) return 1;
+	// the partition is read from without holding the cache, so that the reader threads of a large read do not serialize on it
+	if (fs->readClusters(missedClusterNos.data(), missedClusterNos.size(), missedBuffers.data()) == 0)
+		return 0; // the batch holds a corrupted cluster - none of it is cached
+	AcquireSRWLockExclusive(&cacheSRWLock);
+	for (unsigned int i = 0; i < missedClusterNos.size(); i++) {
+		if (exists(missedClusterNos[i]) != -1) continue; // cached by another thread in the meantime
+		int entryNo = getNextEntry();
+		valid[entryNo] = 1;
+		dirty[entryNo] = 0;
+		tag[entryNo] = missedClusterNos[i];
+		for (int j = 0; j < ClusterSize; j++)
+			data[entryNo][j] = missedBuffers[i][j];
+	}
+	ReleaseSRWLockExclusive(&cacheSRWLock);
+	return 1;
 }
 
 void ClusterCache::invalidate(ClusterNo clusterNo) {
+	AcquireSRWLockExclusive(&cacheSRWLock);
 	int entryNo;
 	if ((entryNo = exists(clusterNo)) != -1) {
-		valid[entryNo] = dirty[entryNo] = tag[entryNo] = 0;
+		ClusterCache::markClean(entryNo);
+		valid[entryNo] = 0;
+		tag[entryNo] = 0;
 		for (int i = 0; i < ClusterSize; i++)
 			data[entryNo][i] = 0;
 	}
+	ReleaseSRWLockExclusive(&cacheSRWLock);
+}
+
+void ClusterCache::invalidateAll() {
+	AcquireSRWLockExclusive(&cacheSRWLock);
+	for (int entryNo = 0; entryNo < CACHE_SIZE; entryNo++)
+		valid[entryNo] = dirty[entryNo] = 0;
+	numOfDirty = 0;
+	ReleaseSRWLockExclusive(&cacheSRWLock);
 }
 
 void ClusterCache::writeBack() {
+	AcquireSRWLockExclusive(&cacheSRWLock);
+	ClusterNo dirtyClusterNos[CACHE_SIZE];
+	char* dirtyBuffers[CACHE_SIZE];
+	unsigned int numOfDirtyClusters = 0;
 	for (int entryNo = 0; entryNo < CACHE_SIZE; entryNo++) {
 		if (valid[entryNo] == 0 || dirty[entryNo] == 0) continue;
-		KernelFS::mountedPartition->writeCluster(tag[entryNo], data[entryNo]);
-		dirty[entryNo] = 0;
+		dirtyClusterNos[numOfDirtyClusters] = tag[entryNo];
+		dirtyBuffers[numOfDirtyClusters++] = data[entryNo];
+		ClusterCache::markClean(entryNo);
+	}
+	fs->writeClusters(dirtyClusterNos, numOfDirtyClusters, dirtyBuffers);
+	ReleaseSRWLockExclusive(&cacheSRWLock);
+}
+
+unsigned int ClusterCache::flush(ULONGLONG expiry) {
+	AcquireSRWLockExclusive(&cacheSRWLock);
+	ClusterNo dirtyClusterNos[CACHE_SIZE];
+	char* dirtyBuffers[CACHE_SIZE];
+	unsigned int numOfDirtyClusters = 0;
+	// the expired clusters first
+	for (int entryNo = 0; entryNo < CACHE_SIZE; entryNo++) {
+		if (valid[entryNo] == 0 || dirty[entryNo] == 0 || dirtySince[entryNo] > expiry) continue;
+		dirtyClusterNos[numOfDirtyClusters] = tag[entryNo];
+		dirtyBuffers[numOfDirtyClusters++] = data[entryNo];
+		ClusterCache::markClean(entryNo);
+	}
+	// then the oldest ones, while too many entries are dirty
+	while (numOfDirty * 100 > DIRTY_BACKGROUND_RATIO * CACHE_SIZE) {
+		int oldestEntryNo = -1;
+		for (int entryNo = 0; entryNo < CACHE_SIZE; entryNo++)
+			if (valid[entryNo] == 1 && dirty[entryNo] == 1 && (oldestEntryNo == -1 || dirtySince[entryNo] < dirtySince[oldestEntryNo]))
+				oldestEntryNo = entryNo;
+		dirtyClusterNos[numOfDirtyClusters] = tag[oldestEntryNo];
+		dirtyBuffers[numOfDirtyClusters++] = data[oldestEntryNo];
+		ClusterCache::markClean(oldestEntryNo);
 	}
+	if (numOfDirtyClusters > 0)
+		fs->writeClusters(dirtyClusterNos, numOfDirtyClusters, dirtyBuffers);
+	unsigned int stillDirty = numOfDirty;
+	ReleaseSRWLockExclusive(&cacheSRWLock);
+	return stillDirty;
 }
\ No newline at end of file
@@ -0,0 +1,104 @@
+#include "crc32c.h"
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CRC32C_SSE42
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC32C_TARGET
+#else
+#include <cpuid.h>
+#define CRC32C_TARGET __attribute__((target("sse4.2"))) // only the functions which use the instructions get compiled for them
+#endif
+#elif defined(_M_ARM64) || defined(__ARM_FEATURE_CRC32)
+#define CRC32C_ARM
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <arm_acle.h>
+#endif
+#define CRC32C_TARGET
+#endif
+
+static const unsigned long CRC32C_POLYNOMIAL = 0x82F63B78; // reversed Castagnoli polynomial
+
+// lookup table of the CRCs of every byte value, filled in on first use
+struct CRC32CTable {
+	unsigned long entries[256];
+	CRC32CTable() {
+		for (unsigned long byte = 0; byte < 256; byte++) {
+			unsigned long crc = byte;
+			for (int bitNo = 0; bitNo < 8; bitNo++)
+				crc = (crc & 1) ? ((crc >> 1) ^ CRC32C_POLYNOMIAL) : (crc >> 1);
+			entries[byte] = crc;
+		}
+	}
+};
+
+unsigned long CRC32C::checksum(const char* data, unsigned int length) {
+	static const bool hardware = CRC32C::hasHardwareSupport();
+	return hardware ? CRC32C::hardwareChecksum(data, length) : CRC32C::tableChecksum(data, length);
+}
+
+bool CRC32C::hasHardwareSupport() {
+#if defined(CRC32C_SSE42)
+#ifdef _MSC_VER
+	int cpuInfo[4];
+	__cpuid(cpuInfo, 1);
+	return (cpuInfo[2] & (1 << 20)) != 0; // ECX bit 20 - SSE4.2
+#else
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0) return false;
+	return (ecx & bit_SSE4_2) != 0;
+#endif
+#elif defined(CRC32C_ARM)
+	return true; // compiled for a processor which has the CRC32 extension
+#else
+	return false;
+#endif
+}
+
+CRC32C_TARGET unsigned long CRC32C::hardwareChecksum(const char* data, unsigned int length) {
+#if defined(CRC32C_SSE42) || defined(CRC32C_ARM)
+	unsigned long long crc = 0xFFFFFFFF;
+	// eight bytes at a time (four, on a 32-bit x86), the rest of them one by one
+#if defined(_M_X64) || defined(__x86_64__)
+	for (; length >= 8; data += 8, length -= 8) {
+		unsigned long long word;
+		memcpy(&word, data, 8);
+		crc = _mm_crc32_u64(crc, word);
+	}
+#elif defined(CRC32C_ARM)
+	for (; length >= 8; data += 8, length -= 8) {
+		unsigned long long word;
+		memcpy(&word, data, 8);
+		crc = __crc32cd((unsigned int)crc, word);
+	}
+#else
+	for (; length >= 4; data += 4, length -= 4) {
+		unsigned int word;
+		memcpy(&word, data, 4);
+		crc = _mm_crc32_u32((unsigned int)crc, word);
+	}
+#endif
+	for (; length > 0; data++, length--) {
+#if defined(CRC32C_ARM)
+		crc = __crc32cb((unsigned int)crc, (unsigned char)*data);
+#else
+		crc = _mm_crc32_u8((unsigned int)crc, (unsigned char)*data);
+#endif
+	}
+	return (unsigned long)(crc ^ 0xFFFFFFFF) & 0xFFFFFFFF;
+#else
+	return CRC32C::tableChecksum(data, length);
+#endif
+}
+
+unsigned long CRC32C::tableChecksum(const char* data, unsigned int length) {
+	static const CRC32CTable table;
+	unsigned long crc = 0xFFFFFFFF;
+	for (unsigned int i = 0; i < length; i++)
+		crc = table.entries[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+	return (crc ^ 0xFFFFFFFF) & 0xFFFFFFFF;
+}
@@ -1,20 +1,29 @@
 #include "file.h"
 #include "kernelfile.h"
+#include "statsrecorder.h"
 
-File::File(std::string fname, char mode, BytesCnt fileSize) {
-	myImpl = new KernelFile(fname, mode, fileSize);
+File::File(KernelFS* fs, FileDesc* fileDesc, char mode, BytesCnt fileSize) {
+	myImpl = new KernelFile(fs, fileDesc, mode, fileSize);
 }
 
 File::~File() {
+	LONGLONG start = StatsRecorder::start();
 	delete myImpl;
+	StatsRecorder::stop(OP_CLOSE, start, 0);
 }
 
 char File::write(BytesCnt bytesCnt, char* buffer) {
-	return myImpl->write(bytesCnt, buffer);
+	LONGLONG start = StatsRecorder::start();
+	char result = myImpl->write(bytesCnt, buffer);
+	StatsRecorder::stop(OP_WRITE, start, (result == 1) ? bytesCnt : 0);
+	return result;
 }
 
 BytesCnt File::read(BytesCnt bytesCnt, char* buffer) {
-	return myImpl->read(bytesCnt, buffer);
+	LONGLONG start = StatsRecorder::start();
+	BytesCnt readBytes = myImpl->read(bytesCnt, buffer);
+	StatsRecorder::stop(OP_READ, start, readBytes);
+	return readBytes;
 }
 
 char File::seek(BytesCnt position) {
@@ -35,4 +44,8 @@ BytesCnt File::getFileSize() {
 
 char File::truncate() {
 	return myImpl->truncate();
+}
+
+char File::sync() {
+	return myImpl->sync();
 }
\ No newline at end of file
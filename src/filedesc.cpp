@@ -1,14 +1,111 @@
 #include "filedesc.h"
 #include "clustercache.h"
+#include "statsrecorder.h"
 
-FileDesc::FileDesc(ClusterNo clusterNo, unsigned int entryStart) {
+FileDesc::FileDesc(KernelFS* fs, std::string fname, ClusterNo clusterNo, unsigned int entryStart) {
+	this->fname = fname;
 	this->clusterNo = clusterNo;
 	this->entryStart = entryStart;
 	this->timesOpened = 0;
-	cache = new ClusterCache();
+	this->lastUsed = 0;
+	cache = new ClusterCache(fs);
 	fileSRWLock = SRWLOCK_INIT;
+	timedWaiters = 0;
+	fileUnlocks = 0;
+	unlockSRWLock = SRWLOCK_INIT;
+	InitializeConditionVariable(&fileUnlocked);
+	rangeSRWLock = SRWLOCK_INIT;
+	InitializeConditionVariable(&rangeUnlocked);
+	fileSize = 0;
+	fileFlags = 0;
+	metadataUsers = 0;
+	metadataSRWLock = SRWLOCK_INIT;
+	snapshot = nullptr;
+	writers = 0;
+	snapshotted = false;
+	snapshotSRWLock = SRWLOCK_INIT;
+	InitializeConditionVariable(&writersDone);
 }
 
 FileDesc::~FileDesc() {
 	delete cache;
-}
\ No newline at end of file
+}
+
+void FileDesc::lockRange(unsigned long first, unsigned long last, bool exclusive) {
+	AcquireSRWLockExclusive(&rangeSRWLock);
+	bool conflicting;
+	LONGLONG waitStart = 0;
+	do {
+		conflicting = false;
+		for (unsigned int i = 0; i < lockedRanges.size() && !conflicting; i++) {
+			if (lockedRanges[i].first > last || lockedRanges[i].last < first) continue; // ranges do not overlap
+			conflicting = exclusive || lockedRanges[i].exclusive; // two shared locks do not conflict
+		}
+		if (conflicting) {
+			if (waitStart == 0)
+				waitStart = StatsRecorder::start();
+			SleepConditionVariableSRW(&rangeUnlocked, &rangeSRWLock, INFINITE, 0);
+		}
+	} while (conflicting);
+	RangeLock rangeLock = { first, last, exclusive };
+	lockedRanges.push_back(rangeLock);
+	ReleaseSRWLockExclusive(&rangeSRWLock);
+	StatsRecorder::countAcquisition(LOCK_RANGE, waitStart);
+}
+
+void FileDesc::unlockRange(unsigned long first, unsigned long last, bool exclusive) {
+	AcquireSRWLockExclusive(&rangeSRWLock);
+	for (unsigned int i = 0; i < lockedRanges.size(); i++)
+		if (lockedRanges[i].first == first && lockedRanges[i].last == last && lockedRanges[i].exclusive == exclusive) {
+			lockedRanges.erase(lockedRanges.begin() + i);
+			break;
+		}
+	ReleaseSRWLockExclusive(&rangeSRWLock);
+	WakeAllConditionVariable(&rangeUnlocked);
+}
+
+bool FileDesc::lockFile(bool exclusive, DWORD timeout) {
+	if (timeout == INFINITE) {
+		if (exclusive)
+			StatsRecorder::acquireExclusive(LOCK_FILE, &fileSRWLock);
+		else
+			StatsRecorder::acquireShared(LOCK_FILE, &fileSRWLock);
+		return true;
+	}
+	if (exclusive ? (TryAcquireSRWLockExclusive(&fileSRWLock) != 0) : (TryAcquireSRWLockShared(&fileSRWLock) != 0)) {
+		StatsRecorder::countAcquisition(LOCK_FILE, 0);
+		return true;
+	}
+	LONGLONG waitStart = StatsRecorder::start(); // a wait which times out is counted as well
+	ULONGLONG deadline = GetTickCount64() + timeout;
+	InterlockedIncrement(&timedWaiters); // from now on, every unlock of the file is signaled
+	bool locked;
+	while (true) {
+		AcquireSRWLockExclusive(&unlockSRWLock);
+		unsigned long unlocks = fileUnlocks;
+		ReleaseSRWLockExclusive(&unlockSRWLock);
+		locked = exclusive ? (TryAcquireSRWLockExclusive(&fileSRWLock) != 0) : (TryAcquireSRWLockShared(&fileSRWLock) != 0);
+		ULONGLONG now = GetTickCount64();
+		if (locked || now >= deadline) break;
+		AcquireSRWLockExclusive(&unlockSRWLock);
+		if (fileUnlocks == unlocks) // the file has not been unlocked since the attempt to lock it
+			SleepConditionVariableSRW(&fileUnlocked, &unlockSRWLock, (DWORD)(deadline - now), 0);
+		ReleaseSRWLockExclusive(&unlockSRWLock);
+	}
+	InterlockedDecrement(&timedWaiters);
+	StatsRecorder::countAcquisition(LOCK_FILE, waitStart);
+	return locked;
+}
+
+void FileDesc::unlockFile(bool exclusive) {
+	if (exclusive)
+		ReleaseSRWLockExclusive(&fileSRWLock);
+	else
+		ReleaseSRWLockShared(&fileSRWLock);
+	if (InterlockedCompareExchange(&timedWaiters, 0, 0) > 0) {
+		AcquireSRWLockExclusive(&unlockSRWLock);
+		fileUnlocks++;
+		ReleaseSRWLockExclusive(&unlockSRWLock);
+		WakeAllConditionVariable(&fileUnlocked);
+	}
+}
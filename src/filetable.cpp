@@ -0,0 +1,90 @@
+#include "filetable.h"
+#include "filedesc.h"
+#include "clustercache.h"
+
+FileTable::FileTable() : clock(0), resident(0), hits(0), misses(0), evictions(0) {
+	for (unsigned int stripeNo = 0; stripeNo < FILE_TABLE_STRIPES; stripeNo++)
+		stripes[stripeNo].srwLock = SRWLOCK_INIT;
+}
+
+FileTable::~FileTable() {
+	FileTable::clear();
+}
+
+FileTable::Stripe& FileTable::stripeOf(const std::string& fname) {
+	return stripes[std::hash<std::string>()(fname) % FILE_TABLE_STRIPES];
+}
+
+void FileTable::lock(const std::string& fname, bool exclusive) {
+	if (exclusive)
+		AcquireSRWLockExclusive(&(FileTable::stripeOf(fname).srwLock));
+	else
+		AcquireSRWLockShared(&(FileTable::stripeOf(fname).srwLock));
+}
+
+void FileTable::unlock(const std::string& fname, bool exclusive) {
+	if (exclusive)
+		ReleaseSRWLockExclusive(&(FileTable::stripeOf(fname).srwLock));
+	else
+		ReleaseSRWLockShared(&(FileTable::stripeOf(fname).srwLock));
+}
+
+FileDesc* FileTable::find(const std::string& fname) {
+	Stripe& stripe = FileTable::stripeOf(fname);
+	std::unordered_map<std::string, FileDesc*>::iterator it = stripe.files.find(fname);
+	if (it == stripe.files.end()) {
+		InterlockedIncrement(&misses);
+		return nullptr;
+	}
+	InterlockedIncrement(&hits);
+	InterlockedExchange(&(it->second->lastUsed), InterlockedIncrement(&clock));
+	return it->second;
+}
+
+void FileTable::insert(const std::string& fname, FileDesc* fd) {
+	Stripe& stripe = FileTable::stripeOf(fname);
+	if (stripe.files.size() >= FILE_TABLE_CAPACITY / FILE_TABLE_STRIPES)
+		FileTable::evict(stripe);
+	fd->lastUsed = InterlockedIncrement(&clock);
+	if (stripe.files.insert(std::make_pair(fname, fd)).second)
+		InterlockedIncrement(&resident);
+}
+
+void FileTable::evict(Stripe& stripe) {
+	std::unordered_map<std::string, FileDesc*>::iterator victim = stripe.files.end();
+	for (std::unordered_map<std::string, FileDesc*>::iterator it = stripe.files.begin(); it != stripe.files.end(); it++) {
+		if (it->second->timesOpened > 0) continue; // descriptors of open files stay
+		if (victim == stripe.files.end() || it->second->lastUsed < victim->second->lastUsed)
+			victim = it;
+	}
+	if (victim == stripe.files.end()) return; // all of the stripe's files are open
+	victim->second->cache->writeBack(); // the closed file's dirty clusters go along with its cache
+	delete victim->second;
+	stripe.files.erase(victim);
+	InterlockedDecrement(&resident);
+	InterlockedIncrement(&evictions);
+}
+
+void FileTable::erase(const std::string& fname) {
+	if (FileTable::stripeOf(fname).files.erase(fname) > 0)
+		InterlockedDecrement(&resident);
+}
+
+void FileTable::clear() {
+	for (unsigned int stripeNo = 0; stripeNo < FILE_TABLE_STRIPES; stripeNo++) {
+		for (std::unordered_map<std::string, FileDesc*>::iterator it = stripes[stripeNo].files.begin(); it != stripes[stripeNo].files.end(); it++)
+			delete it->second;
+		InterlockedExchangeAdd(&resident, -(LONG)stripes[stripeNo].files.size());
+		stripes[stripeNo].files.clear();
+	}
+}
+
+FileTableStats FileTable::stats() {
+	FileTableStats stats;
+	stats.resident = InterlockedCompareExchange(&resident, 0, 0);
+	stats.capacity = FILE_TABLE_CAPACITY;
+	stats.hits = InterlockedCompareExchange(&hits, 0, 0);
+	stats.misses = InterlockedCompareExchange(&misses, 0, 0);
+	stats.evictions = InterlockedCompareExchange(&evictions, 0, 0);
+	return stats;
+}
@@ -1,33 +1,148 @@
 #include "fs.h"
 #include "KernelFS.h"
+#include "statsrecorder.h"
 FS::~FS() {}
 
-char FS::mount(Partition* partition) {
-	return KernelFS::mount(partition);
+char FS::mount(Partition* partition, char drive, unsigned int options) {
+	KernelFS* fs = KernelFS::getDrive(drive);
+	if (fs == nullptr) return 0;
+	return fs->mount(partition, INFINITE, options);
 }
 
-char FS::unmount() {
-	return KernelFS::unmount();
+char FS::unmount(char drive) {
+	KernelFS* fs = KernelFS::getDrive(drive);
+	if (fs == nullptr) return 0;
+	return fs->unmount();
 }
 
-char FS::format() {
-	return KernelFS::format();
+char FS::format(unsigned int options, char drive) {
+	KernelFS* fs = KernelFS::getDrive(drive);
+	if (fs == nullptr) return 0;
+	return fs->format(options);
 }
 
-FileCnt FS::readRootDir() {
-	return KernelFS::readRootDir();
+FileCnt FS::readRootDir(char drive) {
+	KernelFS* fs = KernelFS::getDrive(drive);
+	if (fs == nullptr) return -1;
+	return fs->readRootDir();
 }
 
 char FS::doesExist(char* fname) {
-	return KernelFS::doesExist(fname);
+	KernelFS* fs = KernelFS::getDrive(fname);
+	if (fs == nullptr) return -1;
+	return fs->doesExist(fname);
 }
 
-File* FS::open(char* fname, char mode) {
-	return KernelFS::open(fname, mode);
+File* FS::open(char* fname, char mode, unsigned int options) {
+	KernelFS* fs = KernelFS::getDrive(fname);
+	if (fs == nullptr) return nullptr;
+	LONGLONG start = StatsRecorder::start();
+	File* file = fs->open(fname, mode, INFINITE, nullptr, options);
+	StatsRecorder::stop(OP_OPEN, start, 0);
+	return file;
 }
 
 char FS::deleteFile(char* fname) {
-	return KernelFS::deleteFile(fname);
+	KernelFS* fs = KernelFS::getDrive(fname);
+	if (fs == nullptr) return 0;
+	LONGLONG start = StatsRecorder::start();
+	char result = fs->deleteFile(fname);
+	StatsRecorder::stop(OP_DELETE, start, 0);
+	return result;
+}
+
+char FS::copyFile(char* srcFname, char* dstFname, unsigned int options) {
+	KernelFS* fs = KernelFS::getDrive(srcFname);
+	if (fs == nullptr || KernelFS::getDrive(dstFname) != fs) return 0; // files are copied within a single drive only
+	return fs->copyFile(srcFname, dstFname, options);
+}
+
+FileTableStats FS::fileTableStats(char drive) {
+	KernelFS* fs = KernelFS::getDrive(drive);
+	if (fs == nullptr) {
+		FileTableStats none = {};
+		return none;
+	}
+	return fs->fileTableStats();
+}
+
+char FS::check(CheckReport& report, unsigned int options, char drive) {
+	report = CheckReport();
+	KernelFS* fs = KernelFS::getDrive(drive);
+	if (fs == nullptr) return 0;
+	return fs->check(report, options);
+}
+
+FSStats FS::stats() {
+	return StatsRecorder::snapshot();
+}
+
+void FS::enableStats(bool enable) {
+	StatsRecorder::enable(enable);
+}
+
+DedupStats FS::dedupStats(char drive) {
+	KernelFS* fs = KernelFS::getDrive(drive);
+	if (fs == nullptr) {
+		DedupStats none = {};
+		none.ratio = 1;
+		return none;
+	}
+	return fs->dedupStats();
+}
+
+char FS::sync(char drive) {
+	KernelFS* fs = KernelFS::getDrive(drive);
+	if (fs == nullptr) return 0;
+	return fs->sync();
+}
+
+long FS::fragmentation(char* fname) {
+	KernelFS* fs = KernelFS::getDrive(fname);
+	if (fs == nullptr) return -1;
+	return fs->fragmentation(fname);
+}
+
+char FS::defragment(char* fname) {
+	KernelFS* fs = KernelFS::getDrive(fname);
+	if (fs == nullptr) return 0;
+	return (fs->defragmentFile(fname, false) >= 0) ? 1 : 0;
+}
+
+char FS::startDefragmenter(unsigned long clustersPerSecond, char drive) {
+	KernelFS* fs = KernelFS::getDrive(drive);
+	if (fs == nullptr) return 0;
+	return fs->startDefragmenter(clustersPerSecond);
+}
+
+char FS::tryMount(Partition* partition, unsigned long timeout, char drive, unsigned int options) {
+	KernelFS* fs = KernelFS::getDrive(drive);
+	if (fs == nullptr) return 0;
+	return fs->mount(partition, timeout, options);
+}
+
+char FS::tryUnmount(unsigned long timeout, char drive) {
+	KernelFS* fs = KernelFS::getDrive(drive);
+	if (fs == nullptr) return 0;
+	return fs->unmount(timeout);
+}
+
+char FS::tryFormat(unsigned int options, unsigned long timeout, char drive) {
+	KernelFS* fs = KernelFS::getDrive(drive);
+	if (fs == nullptr) return 0;
+	return fs->format(options, timeout);
+}
+
+char FS::tryOpen(char* fname, char mode, File*& file, unsigned long timeout, unsigned int options) {
+	file = nullptr;
+	KernelFS* fs = KernelFS::getDrive(fname);
+	if (fs == nullptr) return 0;
+	bool busy;
+	LONGLONG start = StatsRecorder::start();
+	file = fs->open(fname, mode, timeout, &busy, options);
+	StatsRecorder::stop(OP_OPEN, start, 0);
+	if (file != nullptr) return 1;
+	return busy ? FS_BUSY : 0;
 }
 
 FS::FS() {}
@@ -0,0 +1,277 @@
+#include "fschecker.h"
+#include "KernelFS.h"
+#include "crc32c.h"
+#include <unordered_map>
+
+FSChecker::FSChecker(KernelFS* fs) {
+	this->fs = fs;
+}
+
+bool FSChecker::run(bool repair, CheckReport& report, bool reindex) {
+	this->repair = repair;
+	this->reindex = reindex;
+	firstDataClusterNo = fs->dataStart();
+	metadataReferences.assign(fs->numOfClusters, 0);
+	dataReferences.assign(fs->numOfClusters, 0);
+	indexable.assign(reindex ? fs->numOfClusters : 0, 0);
+	files.clear();
+	nextFileNo = 0;
+	badReferences = 0;
+	badFiles = leakedClusters = lostClusters = crossLinkedClusters = wrongReferenceCounts = freeClusters = 0;
+	FSChecker::checkRootDirectory();
+	// the files are checked by one thread per processor
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+	unsigned int numOfThreads = systemInfo.dwNumberOfProcessors;
+	if (numOfThreads > CHECKER_MAX_THREADS)
+		numOfThreads = CHECKER_MAX_THREADS;
+	if (numOfThreads > files.size())
+		numOfThreads = files.size();
+	HANDLE threads[CHECKER_MAX_THREADS];
+	for (unsigned int i = 0; i < numOfThreads; i++)
+		threads[i] = CreateThread(NULL, 0, FSChecker::worker, this, 0, NULL);
+	for (unsigned int i = 0; i < numOfThreads; i++) {
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+	FSChecker::checkBitVector();
+	if (reindex)
+		FSChecker::reindexClusters(); // before the reference counts, which include the index's own references
+	FSChecker::checkReferenceCounts();
+	if (repair) {
+		fs->numOfFreeClusters = freeClusters;
+		fs->numOfFiles = files.size();
+	}
+	report.files = files.size();
+	report.referencedClusters = fs->numOfClusters - freeClusters;
+	report.leakedClusters = leakedClusters;
+	report.lostClusters = lostClusters;
+	report.crossLinkedClusters = crossLinkedClusters;
+	report.badReferences = badReferences;
+	report.badFiles = badFiles;
+	report.wrongReferenceCounts = wrongReferenceCounts;
+	report.freeClusters = freeClusters;
+	if (crossLinkedClusters > 0) return false;
+	return repair || (leakedClusters == 0 && lostClusters == 0 && badReferences == 0 && badFiles == 0 && wrongReferenceCounts == 0);
+}
+
+DWORD WINAPI FSChecker::worker(LPVOID param) {
+	FSChecker* checker = (FSChecker*)param;
+	while (true) {
+		LONG fileNo = InterlockedIncrement(&checker->nextFileNo) - 1;
+		if (fileNo >= (LONG)checker->files.size()) break;
+		checker->checkFile(checker->files[fileNo]);
+	}
+	return 0;
+}
+
+bool FSChecker::reference(ClusterNo clusterNo, bool metadata) {
+	if (clusterNo < firstDataClusterNo || clusterNo >= (ClusterNo)fs->numOfClusters) return false;
+	InterlockedIncrement(metadata ? &metadataReferences[clusterNo] : &dataReferences[clusterNo]);
+	return true;
+}
+
+bool FSChecker::collectEntries(char* indexCluster, bool metadata, std::vector<ClusterNo>* clusterNos) {
+	bool changed = false;
+	for (int entry = 0; entry < 2048; entry += KernelFS::LVL1_ENTRY_SIZE_IN_BYTES) {
+		ClusterNo clusterNo = KernelFS::getEntry(indexCluster, entry);
+		if (clusterNo == 0) continue; // no cluster
+		if (FSChecker::reference(clusterNo, metadata)) {
+			if (clusterNos != nullptr)
+				clusterNos->push_back(clusterNo);
+			continue;
+		}
+		InterlockedIncrement(&badReferences);
+		if (repair) {
+			KernelFS::setEntry(indexCluster, entry, 0);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+bool FSChecker::readClusters(const std::vector<ClusterNo>& clusterNos, std::vector<char>& buffer) {
+	buffer.resize(clusterNos.size() * ClusterSize);
+	std::vector<char*> buffers(clusterNos.size());
+	for (unsigned int i = 0; i < clusterNos.size(); i++)
+		buffers[i] = buffer.data() + i * ClusterSize;
+	if (clusterNos.empty()) return true;
+	return fs->readClusters(clusterNos.data(), clusterNos.size(), buffers.data()) != 0;
+}
+
+void FSChecker::checkRootDirectory() {
+	char rootLvl1IndexCluster[2048];
+	fs->readMetadataCluster(fs->rootLvl1IndexClusterNo, rootLvl1IndexCluster);
+	std::vector<ClusterNo> lvl2IndexClusterNos;
+	if (FSChecker::collectEntries(rootLvl1IndexCluster, true, &lvl2IndexClusterNos))
+		fs->writeMetadataCluster(fs->rootLvl1IndexClusterNo, rootLvl1IndexCluster);
+	// the level 2 index clusters are read in one batch, and then so are the file descriptor clusters
+	std::vector<char> lvl2IndexClusters;
+	FSChecker::readClusters(lvl2IndexClusterNos, lvl2IndexClusters);
+	std::vector<ClusterNo> fileDescClusterNos;
+	for (unsigned int i = 0; i < lvl2IndexClusterNos.size(); i++)
+		if (FSChecker::collectEntries(&lvl2IndexClusters[i * ClusterSize], true, &fileDescClusterNos))
+			fs->writeMetadataCluster(lvl2IndexClusterNos[i], &lvl2IndexClusters[i * ClusterSize]);
+	std::vector<char> fileDescClusters;
+	FSChecker::readClusters(fileDescClusterNos, fileDescClusters);
+	for (unsigned int i = 0; i < fileDescClusterNos.size(); i++) {
+		char* fileDescCluster = &fileDescClusters[i * ClusterSize];
+		bool changed = false;
+		for (unsigned int fileDescEntry = 0; fileDescEntry < 2048; fileDescEntry += KernelFS::FILEDESC_ENTRY_SIZE_IN_BYTES) {
+			if (fileDescCluster[fileDescEntry + KernelFS::FILE_NAME_OFFSET] == 0x00) continue; // not in use
+			FileEntry file;
+			file.fileDescClusterNo = fileDescClusterNos[i];
+			file.entryStart = fileDescEntry;
+			file.fileLvl1IndexClusterNo = KernelFS::getEntry(fileDescCluster, fileDescEntry + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET);
+			file.fileFlags = (unsigned char)fileDescCluster[fileDescEntry + KernelFS::FILE_FLAGS_OFFSET];
+			if (FSChecker::reference(file.fileLvl1IndexClusterNo, true)) {
+				files.push_back(file);
+				continue;
+			}
+			// the file's index cluster is not on the partition, so the file is lost - its descriptor gets cleared
+			badFiles++;
+			if (repair) {
+				for (unsigned int byteNo = 0; byteNo < KernelFS::FILEDESC_ENTRY_SIZE_IN_BYTES; byteNo++)
+					fileDescCluster[fileDescEntry + byteNo] = 0x00;
+				changed = true;
+			}
+		}
+		if (changed)
+			fs->writeMetadataCluster(fileDescClusterNos[i], fileDescCluster);
+	}
+}
+
+void FSChecker::checkFile(const FileEntry& file) {
+	if ((file.fileFlags & KernelFS::FILE_FLAG_INLINE) != 0) return; // the data is inside of the index cluster, already counted
+	char fileLvl1IndexCluster[2048];
+	fs->readMetadataCluster(file.fileLvl1IndexClusterNo, fileLvl1IndexCluster);
+	if ((file.fileFlags & KernelFS::FILE_FLAG_EXTENTS) != 0) {
+		bool changed = false;
+		for (unsigned int extentEntry = 0; extentEntry < 2048; extentEntry += KernelFS::EXTENT_ENTRY_SIZE_IN_BYTES) {
+			ClusterNo start = KernelFS::getEntry(fileLvl1IndexCluster, extentEntry + KernelFS::EXTENT_START_OFFSET);
+			ClusterNo length = KernelFS::getEntry(fileLvl1IndexCluster, extentEntry + KernelFS::EXTENT_LENGTH_OFFSET);
+			if (length == 0) break; // end of the table
+			if (start == 0) continue; // a hole
+			if (start >= firstDataClusterNo && start < (ClusterNo)fs->numOfClusters && length <= (ClusterNo)fs->numOfClusters - start) {
+				for (ClusterNo clusterNo = start; clusterNo < start + length; clusterNo++)
+					FSChecker::reference(clusterNo, false);
+				continue;
+			}
+			// the extent is not on the partition - it is turned into a hole
+			InterlockedIncrement(&badReferences);
+			if (repair) {
+				KernelFS::setEntry(fileLvl1IndexCluster, extentEntry + KernelFS::EXTENT_START_OFFSET, 0);
+				changed = true;
+			}
+		}
+		if (changed)
+			fs->writeMetadataCluster(file.fileLvl1IndexClusterNo, fileLvl1IndexCluster);
+		return;
+	}
+	std::vector<ClusterNo> lvl2IndexClusterNos;
+	if (FSChecker::collectEntries(fileLvl1IndexCluster, true, &lvl2IndexClusterNos))
+		fs->writeMetadataCluster(file.fileLvl1IndexClusterNo, fileLvl1IndexCluster);
+	// all of the file's level 2 index clusters are read in one batch
+	std::vector<char> lvl2IndexClusters;
+	FSChecker::readClusters(lvl2IndexClusterNos, lvl2IndexClusters);
+	// the clusters of a compressed file hold its compressed groups, never written through the deduplication index
+	bool indexed = reindex && (file.fileFlags & KernelFS::FILE_FLAG_COMPRESSED) == 0;
+	std::vector<ClusterNo> dataClusterNos;
+	for (unsigned int i = 0; i < lvl2IndexClusterNos.size(); i++)
+		if (FSChecker::collectEntries(&lvl2IndexClusters[i * ClusterSize], false, indexed ? &dataClusterNos : nullptr))
+			fs->writeMetadataCluster(lvl2IndexClusterNos[i], &lvl2IndexClusters[i * ClusterSize]);
+	for (unsigned int i = 0; i < dataClusterNos.size(); i++)
+		InterlockedExchange(&indexable[dataClusterNos[i]], 1);
+}
+
+void FSChecker::checkBitVector() {
+	char bitVectorCluster[2048];
+	for (int clusterNo = 0; clusterNo < fs->bitVectorSizeInClusters; clusterNo++) {
+		fs->readBitVectorCluster(clusterNo, bitVectorCluster);
+		bool changed = false;
+		for (int byteNo = 0; byteNo < 2048; byteNo++)
+			for (int bitNo = 0; bitNo < 8; bitNo++) {
+				ClusterNo evidentedClusterNo = clusterNo * ClusterSize * 8 + (byteNo << 3) + bitNo;
+				if (evidentedClusterNo >= (ClusterNo)fs->numOfClusters) continue; // the bits past the end of the partition stay as they are
+				bool free = (bitVectorCluster[byteNo] & (1 << bitNo)) != 0;
+				LONG metadata = metadataReferences[evidentedClusterNo], data = dataReferences[evidentedClusterNo];
+				bool inUse = evidentedClusterNo < firstDataClusterNo || metadata > 0 || data > 0;
+				// a metadata cluster belongs to a single index, while data clusters may be shared by several files (but not with an index)
+				if (metadata > 1 || (metadata > 0 && data > 0))
+					crossLinkedClusters++;
+				if (inUse == free) {
+					if (inUse)
+						lostClusters++; // in use, but could get allocated again
+					else
+						leakedClusters++; // taken, but never to be freed
+					if (repair) {
+						bitVectorCluster[byteNo] ^= (1 << bitNo);
+						changed = true;
+						free = !inUse;
+					}
+				}
+				if (free)
+					freeClusters++;
+			}
+		if (changed)
+			fs->writeBitVectorCluster(clusterNo, bitVectorCluster);
+	}
+}
+
+void FSChecker::reindexClusters() {
+	KernelFS::PartitionState* state = fs->mountedPartitionState;
+	std::vector<ClusterNo> clusterNos;
+	std::vector<char> clusters;
+	// one step past the last cluster, the clusters left get indexed as the last batch
+	for (ClusterNo clusterNo = firstDataClusterNo; clusterNo <= (ClusterNo)fs->numOfClusters; clusterNo++) {
+		if (clusterNo < (ClusterNo)fs->numOfClusters) {
+			// a cluster cross-linked with an index cluster is left out, as the index may still get written to it
+			if (indexable[clusterNo] == 0 || metadataReferences[clusterNo] > 0) continue;
+			clusterNos.push_back(clusterNo);
+			if (clusterNos.size() < CHECKER_REINDEX_BATCH) continue;
+		}
+		if (!clusterNos.empty() && FSChecker::readClusters(clusterNos, clusters))
+			for (unsigned int i = 0; i < clusterNos.size(); i++) {
+				unsigned long fingerprint = CRC32C::checksum(&clusters[i * ClusterSize], ClusterSize);
+				if (state->dedupIndex.find(fingerprint) != state->dedupIndex.end()) continue;
+				state->dedupIndex[fingerprint] = clusterNos[i];
+				state->dedupFingerprints[clusterNos[i]] = fingerprint;
+			}
+		clusterNos.clear();
+	}
+}
+
+void FSChecker::checkReferenceCounts() {
+	KernelFS::PartitionState* state = fs->mountedPartitionState;
+	// a data cluster is referenced by every file which maps it, and by the deduplication index while any file still does
+	std::unordered_map<ClusterNo, unsigned int> sharedClusters;
+	for (ClusterNo clusterNo = firstDataClusterNo; clusterNo < (ClusterNo)fs->numOfClusters; clusterNo++) {
+		if (dataReferences[clusterNo] == 0) continue;
+		unsigned int references = dataReferences[clusterNo];
+		if (!state->dedupFingerprints.empty() && state->dedupFingerprints.find(clusterNo) != state->dedupFingerprints.end())
+			references++;
+		if (references > 1)
+			sharedClusters[clusterNo] = references;
+	}
+	for (std::unordered_map<ClusterNo, unsigned int>::iterator shared = sharedClusters.begin(); shared != sharedClusters.end(); shared++) {
+		std::unordered_map<ClusterNo, unsigned int>::iterator kept = state->sharedClusters.find(shared->first);
+		if (kept == state->sharedClusters.end() || kept->second != shared->second)
+			wrongReferenceCounts++;
+	}
+	for (std::unordered_map<ClusterNo, unsigned int>::iterator kept = state->sharedClusters.begin(); kept != state->sharedClusters.end(); kept++)
+		if (sharedClusters.find(kept->first) == sharedClusters.end())
+			wrongReferenceCounts++;
+	if (!repair) return;
+	state->sharedClusters.swap(sharedClusters);
+	// the index forgets the clusters no file refers to any more (they have been freed by the bit vector's repair)
+	for (std::unordered_map<ClusterNo, unsigned long>::iterator indexed = state->dedupFingerprints.begin(); indexed != state->dedupFingerprints.end(); ) {
+		if (indexed->first < (ClusterNo)fs->numOfClusters && dataReferences[indexed->first] > 0) {
+			indexed++;
+			continue;
+		}
+		std::unordered_map<unsigned long, ClusterNo>::iterator fingerprint = state->dedupIndex.find(indexed->second);
+		if (fingerprint != state->dedupIndex.end() && fingerprint->second == indexed->first)
+			state->dedupIndex.erase(fingerprint);
+		indexed = state->dedupFingerprints.erase(indexed);
+	}
+}
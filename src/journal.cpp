@@ -0,0 +1,313 @@
+#include "journal.h"
+#include <algorithm>
+
+const unsigned int Journal::BLOCK_HEADER_SIZE = 20;
+const unsigned int Journal::BLOCK_PAYLOAD_SIZE = ClusterSize - Journal::BLOCK_HEADER_SIZE;
+const unsigned int Journal::RECORD_HEADER_SIZE = 9;
+
+const char Journal::RECORD_WRITE = 'W';
+const char Journal::RECORD_REVOKE = 'R';
+
+Journal::Journal(Partition* partition, ClusterNo start, ClusterNo numOfClusters) {
+	this->partition = partition;
+	this->start = start;
+	this->numOfClusters = numOfClusters;
+	generation = 0;
+	nextBlockNo = 0;
+	logged = durable = 0;
+	busy = false;
+	checkpointRequested = false;
+	stopping = false;
+	InitializeSRWLock(&srwLock);
+	InitializeConditionVariable(&idle);
+	ok_to_checkpoint = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	checkpointerThread = CreateThread(NULL, 0, Journal::checkpointer, this, 0, NULL);
+}
+
+Journal::~Journal() {
+	AcquireSRWLockExclusive(&srwLock);
+	stopping = true;
+	ReleaseSRWLockExclusive(&srwLock);
+	ReleaseSemaphore(
+		ok_to_checkpoint, // handle to semaphore
+		1, // increase count by 1
+		NULL // not interested in previous count
+	);
+	WaitForSingleObject(checkpointerThread, INFINITE);
+	CloseHandle(checkpointerThread);
+	CloseHandle(ok_to_checkpoint);
+	Journal::checkpoint();
+}
+
+void Journal::initialize() {
+	char header[2048];
+	partition->readCluster(start, header);
+	// the region may still hold the log of a previous format - its clusters are invalidated by moving on to a newer generation
+	generation = Journal::hasMagic(header) ? Journal::getField(header + 4, 4) + 1 : 1;
+	nextBlockNo = 0;
+	Journal::writeHeader(generation);
+}
+
+unsigned long Journal::recover() {
+	char cluster[2048];
+	partition->readCluster(start, cluster);
+	if (!Journal::hasMagic(cluster)) { // the partition has never been formatted with a journal
+		Journal::initialize();
+		return 0;
+	}
+	generation = Journal::getField(cluster + 4, 4);
+	std::unordered_map<ClusterNo, std::vector<char>> replayed;
+	std::vector<char> batch;
+	unsigned long numOfRecords = 0;
+	for (ClusterNo blockNo = 0; blockNo < numOfClusters - 1; blockNo++) {
+		partition->readCluster(start + 1 + blockNo, cluster);
+		// the log ends with the first cluster which has not been written in the current generation
+		if (!Journal::hasMagic(cluster) || Journal::getField(cluster + 4, 4) != generation || Journal::getField(cluster + 8, 4) != blockNo)
+			break;
+		unsigned long payloadSize = Journal::getField(cluster + 12, 4);
+		if (payloadSize > BLOCK_PAYLOAD_SIZE) break;
+		batch.insert(batch.end(), cluster + BLOCK_HEADER_SIZE, cluster + BLOCK_HEADER_SIZE + payloadSize);
+		if (Journal::getField(cluster + 16, 4) == 0) continue; // the batch goes on in the next cluster
+		numOfRecords += Journal::replay(batch, replayed);
+		batch.clear();
+	}
+	for (std::unordered_map<ClusterNo, std::vector<char>>::iterator replayedCluster = replayed.begin(); replayedCluster != replayed.end(); replayedCluster++)
+		partition->writeCluster(replayedCluster->first, replayedCluster->second.data());
+	generation++;
+	nextBlockNo = 0;
+	Journal::writeHeader(generation);
+	return numOfRecords;
+}
+
+void Journal::readCluster(ClusterNo clusterNo, char* buffer) {
+	if (!Journal::lookup(clusterNo, buffer))
+		partition->readCluster(clusterNo, buffer);
+}
+
+bool Journal::lookup(ClusterNo clusterNo, char* buffer) {
+	AcquireSRWLockShared(&srwLock);
+	std::unordered_map<ClusterNo, std::vector<char>>::iterator cluster = clusters.find(clusterNo);
+	bool found = (cluster != clusters.end());
+	if (!found && (cluster = checkpointed.find(clusterNo)) != checkpointed.end())
+		found = true;
+	if (found)
+		std::copy(cluster->second.begin(), cluster->second.end(), buffer);
+	ReleaseSRWLockShared(&srwLock);
+	return found;
+}
+
+void Journal::writeCluster(ClusterNo clusterNo, const char* buffer) {
+	AcquireSRWLockExclusive(&srwLock);
+	std::unordered_map<ClusterNo, std::vector<char>>::iterator cluster = clusters.find(clusterNo);
+	if (cluster == clusters.end()) { // first update since the last checkpoint - the whole cluster is logged
+		clusters[clusterNo].assign(buffer, buffer + ClusterSize);
+		Journal::logRecord(RECORD_WRITE, clusterNo, 0, ClusterSize, buffer);
+	}
+	else {
+		// only the bytes from the first to the last changed one are logged
+		char* image = cluster->second.data();
+		unsigned int first = 0, last = ClusterSize;
+		while (first < ClusterSize && image[first] == buffer[first])
+			first++;
+		if (first < ClusterSize) {
+			while (image[last - 1] == buffer[last - 1])
+				last--;
+			std::copy(buffer + first, buffer + last, image + first);
+			Journal::logRecord(RECORD_WRITE, clusterNo, first, last - first, buffer + first);
+		}
+	}
+	bool wakeCheckpointer = false;
+	if (!checkpointRequested && nextBlockNo + Journal::numOfBlocks(records.size()) > (numOfClusters - 1) / 2)
+		wakeCheckpointer = checkpointRequested = true;
+	ReleaseSRWLockExclusive(&srwLock);
+	if (wakeCheckpointer)
+		ReleaseSemaphore(
+			ok_to_checkpoint, // handle to semaphore
+			1, // increase count by 1
+			NULL // not interested in previous count
+		);
+}
+
+void Journal::revoke(ClusterNo clusterNo) {
+	// most of the clusters written to as data have never been metadata - they are checked for without blocking the others
+	AcquireSRWLockShared(&srwLock);
+	bool tracked = (clusters.find(clusterNo) != clusters.end() || checkpointed.find(clusterNo) != checkpointed.end());
+	ReleaseSRWLockShared(&srwLock);
+	if (!tracked) return;
+	AcquireSRWLockExclusive(&srwLock);
+	while (checkpointed.find(clusterNo) != checkpointed.end()) // the old contents must reach the partition before the new ones do
+		SleepConditionVariableSRW(&idle, &srwLock, INFINITE, 0);
+	if (clusters.erase(clusterNo) > 0)
+		Journal::logRecord(RECORD_REVOKE, clusterNo, 0, 0, nullptr);
+	ReleaseSRWLockExclusive(&srwLock);
+}
+
+void Journal::commit() {
+	AcquireSRWLockExclusive(&srwLock);
+	unsigned long long target = logged;
+	while (durable < target) {
+		if (busy) { // another thread is writing - its batch may already hold this thread's records
+			SleepConditionVariableSRW(&idle, &srwLock, INFINITE, 0);
+			continue;
+		}
+		// the batch holds the records of all of the threads which have logged them in the meantime
+		Journal::flush();
+	}
+	ReleaseSRWLockExclusive(&srwLock);
+}
+
+void Journal::checkpoint() {
+	AcquireSRWLockExclusive(&srwLock);
+	while (busy)
+		SleepConditionVariableSRW(&idle, &srwLock, INFINITE, 0);
+	Journal::writeInPlace();
+	ReleaseSRWLockExclusive(&srwLock);
+}
+
+DWORD WINAPI Journal::checkpointer(LPVOID param) {
+	Journal* journal = (Journal*)param;
+	while (true) {
+		WaitForSingleObject(
+			journal->ok_to_checkpoint, // handle to semaphore
+			JOURNAL_CHECKPOINT_INTERVAL // time-out interval - the journal is checkpointed periodically, even if it is not getting full
+		);
+		AcquireSRWLockShared(&journal->srwLock);
+		bool stopping = journal->stopping;
+		ReleaseSRWLockShared(&journal->srwLock);
+		if (stopping) break;
+		journal->checkpoint();
+	}
+	return 0;
+}
+
+void Journal::logRecord(char type, ClusterNo clusterNo, unsigned int offset, unsigned int length, const char* bytes) {
+	char header[9];
+	header[0] = type;
+	Journal::setField(header + 1, 4, clusterNo);
+	Journal::setField(header + 5, 2, offset);
+	Journal::setField(header + 7, 2, length);
+	records.insert(records.end(), header, header + RECORD_HEADER_SIZE);
+	if (length > 0)
+		records.insert(records.end(), bytes, bytes + length);
+	logged += RECORD_HEADER_SIZE + length;
+}
+
+void Journal::flush() {
+	ClusterNo numOfBatchBlocks = Journal::numOfBlocks(records.size());
+	if (nextBlockNo + numOfBatchBlocks > numOfClusters - 1) { // the log is full - the clusters are written in place instead
+		Journal::writeInPlace();
+		return;
+	}
+	busy = true;
+	std::vector<char> batch;
+	batch.swap(records);
+	unsigned long long target = logged;
+	ClusterNo firstBlockNo = nextBlockNo;
+	nextBlockNo += numOfBatchBlocks;
+	unsigned long batchGeneration = generation;
+	ReleaseSRWLockExclusive(&srwLock);
+	Journal::writeBlocks(batch, firstBlockNo, batchGeneration);
+	AcquireSRWLockExclusive(&srwLock);
+	durable = target;
+	busy = false;
+	WakeAllConditionVariable(&idle);
+}
+
+void Journal::writeInPlace() {
+	if (clusters.empty() && records.empty() && nextBlockNo == 0) return; // nothing has changed since the last checkpoint
+	busy = true;
+	std::vector<char> batch;
+	batch.swap(records);
+	unsigned long long target = logged;
+	ClusterNo firstBlockNo = nextBlockNo;
+	// the records are logged first if they fit, so that a checkpoint which gets interrupted is replayed up to its end
+	bool logBatch = !batch.empty() && (firstBlockNo + Journal::numOfBlocks(batch.size()) <= numOfClusters - 1);
+	unsigned long batchGeneration = generation;
+	checkpointed.swap(clusters);
+	ReleaseSRWLockExclusive(&srwLock);
+	if (logBatch)
+		Journal::writeBlocks(batch, firstBlockNo, batchGeneration);
+	for (std::unordered_map<ClusterNo, std::vector<char>>::iterator cluster = checkpointed.begin(); cluster != checkpointed.end(); cluster++)
+		partition->writeCluster(cluster->first, cluster->second.data());
+	Journal::writeHeader(batchGeneration + 1);
+	AcquireSRWLockExclusive(&srwLock);
+	checkpointed.clear();
+	generation = batchGeneration + 1;
+	nextBlockNo = 0;
+	durable = target;
+	busy = false;
+	checkpointRequested = false;
+	WakeAllConditionVariable(&idle);
+}
+
+void Journal::writeBlocks(const std::vector<char>& batch, ClusterNo firstBlockNo, unsigned long blockGeneration) {
+	ClusterNo numOfBatchBlocks = Journal::numOfBlocks(batch.size());
+	char block[2048];
+	for (ClusterNo i = 0; i < numOfBatchBlocks; i++) {
+		size_t payloadStart = i * BLOCK_PAYLOAD_SIZE;
+		size_t payloadSize = std::min((size_t)BLOCK_PAYLOAD_SIZE, batch.size() - payloadStart);
+		std::fill(block, block + ClusterSize, 0x00);
+		block[0] = 'J'; block[1] = 'R'; block[2] = 'N'; block[3] = 'L';
+		Journal::setField(block + 4, 4, blockGeneration);
+		Journal::setField(block + 8, 4, firstBlockNo + i);
+		Journal::setField(block + 12, 4, payloadSize);
+		Journal::setField(block + 16, 4, (i == numOfBatchBlocks - 1) ? 1 : 0);
+		std::copy(batch.begin() + payloadStart, batch.begin() + payloadStart + payloadSize, block + BLOCK_HEADER_SIZE);
+		partition->writeCluster(start + 1 + firstBlockNo + i, block);
+	}
+}
+
+void Journal::writeHeader(unsigned long headerGeneration) {
+	char header[2048];
+	std::fill(header, header + ClusterSize, 0x00);
+	header[0] = 'J'; header[1] = 'R'; header[2] = 'N'; header[3] = 'L';
+	Journal::setField(header + 4, 4, headerGeneration);
+	partition->writeCluster(start, header);
+}
+
+unsigned long Journal::replay(const std::vector<char>& batch, std::unordered_map<ClusterNo, std::vector<char>>& replayed) {
+	unsigned long numOfRecords = 0;
+	size_t position = 0;
+	while (position + RECORD_HEADER_SIZE <= batch.size()) {
+		char type = batch[position];
+		ClusterNo clusterNo = Journal::getField(&batch[position + 1], 4);
+		unsigned int offset = Journal::getField(&batch[position + 5], 2);
+		unsigned int length = Journal::getField(&batch[position + 7], 2);
+		position += RECORD_HEADER_SIZE;
+		if (offset + length > ClusterSize || position + length > batch.size() || clusterNo >= partition->getNumOfClusters())
+			break; // not a valid record
+		if (type == RECORD_REVOKE)
+			replayed.erase(clusterNo);
+		else {
+			std::vector<char>& image = replayed[clusterNo];
+			if (image.empty()) { // a cluster's first record since a checkpoint (or a revoke) holds the whole cluster
+				image.resize(ClusterSize);
+				partition->readCluster(clusterNo, image.data());
+			}
+			std::copy(batch.begin() + position, batch.begin() + position + length, image.begin() + offset);
+		}
+		position += length;
+		numOfRecords++;
+	}
+	return numOfRecords;
+}
+
+ClusterNo Journal::numOfBlocks(size_t size) {
+	return (ClusterNo)((size + BLOCK_PAYLOAD_SIZE - 1) / BLOCK_PAYLOAD_SIZE);
+}
+
+bool Journal::hasMagic(const char* cluster) {
+	return cluster[0] == 'J' && cluster[1] == 'R' && cluster[2] == 'N' && cluster[3] == 'L';
+}
+
+unsigned long Journal::getField(const char* field, unsigned int size) {
+	unsigned long value = 0;
+	for (unsigned int byteNo = 0; byteNo < size; byteNo++)
+		value |= ((unsigned long)(unsigned char)field[byteNo]) << (8 * byteNo);
+	return value;
+}
+
+void Journal::setField(char* field, unsigned int size, unsigned long value) {
+	for (unsigned int byteNo = 0; byteNo < size; byteNo++)
+		field[byteNo] = (value >> (8 * byteNo)) & 0xffUL;
+}
@@ -2,185 +2,868 @@
 #include "KernelFS.h"
 #include "filedesc.h"
 #include "clustercache.h"
+#include "lzcodec.h"
+#include "statsrecorder.h"
+#include <algorithm>
+#include <climits>
 
-KernelFile::KernelFile(std::string fname, char mode, BytesCnt fileSize) : cursor(0) {
-	this->fname = fname;
+KernelFile::KernelFile(KernelFS* fs, FileDesc* fileDesc, char mode, BytesCnt fileSize) : cursor(0) {
+	this->fs = fs;
+	this->fileDesc = fileDesc;
 	this->mode = mode;
 	this->fileSize = fileSize;
 	char fileDescriptorCluster[2048];
-	KernelFS::mountedPartition->readCluster(KernelFS::files[fname]->clusterNo, fileDescriptorCluster);
+	StatsRecorder::acquireShared(LOCK_DIRECTORY, &(fs->directorySRWLock));
+	fs->readMetadataCluster(fileDesc->clusterNo, fileDescriptorCluster);
+	ReleaseSRWLockShared(&(fs->directorySRWLock));
 	fileLvl1IndexClusterNo = 0;
-	fileLvl1IndexClusterNo |= ((unsigned char)fileDescriptorCluster[KernelFS::files[fname]->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 0]);
-	fileLvl1IndexClusterNo |= ((unsigned char)fileDescriptorCluster[KernelFS::files[fname]->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 1]) << 8;
-	fileLvl1IndexClusterNo |= ((unsigned char)fileDescriptorCluster[KernelFS::files[fname]->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 2]) << 16;
-	fileLvl1IndexClusterNo |= ((unsigned char)fileDescriptorCluster[KernelFS::files[fname]->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 3]) << 24;
+	fileLvl1IndexClusterNo |= ((unsigned char)fileDescriptorCluster[fileDesc->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 0]);
+	fileLvl1IndexClusterNo |= ((unsigned char)fileDescriptorCluster[fileDesc->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 1]) << 8;
+	fileLvl1IndexClusterNo |= ((unsigned char)fileDescriptorCluster[fileDesc->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 2]) << 16;
+	fileLvl1IndexClusterNo |= ((unsigned char)fileDescriptorCluster[fileDesc->entryStart + KernelFS::LVL1_INDEX_CLUSTER_NUMBER_OFFSET + 3]) << 24;
+	fileFlags = fileDescriptorCluster[fileDesc->entryStart + KernelFS::FILE_FLAGS_OFFSET];
+	lvl1Buffer.clusterNo = lvl2Buffer.clusterNo = 0;
+	lvl1Buffer.dirty = lvl2Buffer.dirty = false;
+	snapshot = nullptr;
+	group.groupNo = ULONG_MAX;
+	group.dirty = false;
+	group.length = 0;
+	if (mode == 's') {
+		snapshot = fs->openSnapshot(fileDesc);
+		this->fileSize = snapshot->fileSize;
+	}
+	if (mode == 'r' || mode == 'm') {
+		AcquireSRWLockExclusive(&(fileDesc->metadataSRWLock));
+		if (fileDesc->metadataUsers++ == 0) { // the first of the handles which share the file publishes its metadata
+			fileDesc->fileSize = this->fileSize;
+			fileDesc->fileFlags = fileFlags;
+		}
+		ReleaseSRWLockExclusive(&(fileDesc->metadataSRWLock));
+	}
 }
 
 KernelFile::~KernelFile() {
-	AcquireSRWLockExclusive(&(KernelFS::srwLock));
-	KernelFS::files[fname]->timesOpened--;
-	KernelFS::numberOfOpenedFiles--;
-	KernelFile::updateFileSize(KernelFS::files[fname]);
-	// unblock threads waiting to unmount/format the mounted partition... to be implemented
-	if (KernelFS::numberOfOpenedFiles == 0 && KernelFS::waitingToUnMount > 0)
-		ReleaseSemaphore(
-			KernelFS::ok_to_unmount, // handle to semaphore
-			KernelFS::waitingToUnMount, // increase count by 1
-			NULL // not interested in previous count
-		);
-	else if (KernelFS::numberOfOpenedFiles == 0 && KernelFS::waitingToFormat > 0)
-		ReleaseSemaphore(
-			KernelFS::ok_to_format,
-			KernelFS::waitingToFormat,
-			NULL
-		);
-	if (mode == 'w' || mode == 'a')
-		KernelFS::files[fname]->cache->writeBack();
-	ReleaseSRWLockExclusive(&(KernelFS::srwLock));
-	if (mode == 'r')
-		ReleaseSRWLockShared(&(KernelFS::files[fname]->fileSRWLock));
+	// the file's dirty clusters stay in its cache, for the flusher thread (or File::sync/FS::sync) to write back
+	if (mode == 'w' || mode == 'a' || mode == 'm') {
+		if (group.dirty) // the group is lost if no free clusters are left for it
+			KernelFile::storeGroup();
+		KernelFile::lockMetadata(false);
+		KernelFile::updateFileSize();
+		KernelFile::unlockMetadata(false);
+		fs->stopWriting(fileDesc);
+	}
+	if (mode == 'r' || mode == 'm') {
+		AcquireSRWLockExclusive(&(fileDesc->metadataSRWLock));
+		fileDesc->metadataUsers--;
+		ReleaseSRWLockExclusive(&(fileDesc->metadataSRWLock));
+		fileDesc->unlockFile(false);
+	}
 	else if (mode == 'w' || mode == 'a')
-		ReleaseSRWLockExclusive(&(KernelFS::files[fname]->fileSRWLock));
+		fileDesc->unlockFile(true);
+	if (mode == 's')
+		fs->closeSnapshot(fileDesc, snapshot);
+	// the file stays counted as open up to here, so it cannot get deleted (nor the partition unmounted) while it is being closed
+	fs->releaseFile(fileDesc);
+}
+
+char KernelFile::sync() {
+	if (mode != 'w' && mode != 'a' && mode != 'm') return 1; // nothing has been written through the handle
+	char result = 1;
+	if (group.dirty && KernelFile::storeGroup() == 0) // no free clusters left for the buffered group of a compressed file
+		result = 0;
+	fileDesc->cache->writeBack();
+	KernelFile::lockMetadata(false);
+	KernelFile::updateFileSize();
+	KernelFile::unlockMetadata(false);
+	fs->commitMetadata();
+	return result;
+}
+
+void KernelFile::lockMetadata(bool exclusive) {
+	if (mode != 'r' && mode != 'm') return; // 'w'/'a' handle is the only one the file has
+	if (exclusive)
+		AcquireSRWLockExclusive(&(fileDesc->metadataSRWLock));
+	else
+		AcquireSRWLockShared(&(fileDesc->metadataSRWLock));
+	fileSize = fileDesc->fileSize;
+	fileFlags = fileDesc->fileFlags;
 }
 
-ClusterNo KernelFile::allocateClusterAtomic() {
-	AcquireSRWLockExclusive(&(KernelFS::srwLock));
-	ClusterNo allocatedClusterNo = KernelFS::allocateCluster();
-	ReleaseSRWLockExclusive(&(KernelFS::srwLock));
-	return allocatedClusterNo;
+void KernelFile::unlockMetadata(bool exclusive) {
+	if (mode != 'r' && mode != 'm') return;
+	if (exclusive) {
+		fileDesc->fileSize = fileSize;
+		fileDesc->fileFlags = fileFlags;
+		ReleaseSRWLockExclusive(&(fileDesc->metadataSRWLock));
+	}
+	else
+		ReleaseSRWLockShared(&(fileDesc->metadataSRWLock));
 }
 
-void KernelFile::updateFileSize(FileDesc* fileDesc) {
+void KernelFile::updateFileSize() {
+	// other files' descriptors share the cluster - their size updates lock its stripe, while the rest of the writers lock the directory exclusively
+	SRWLOCK* descriptorSRWLock = &(fs->descriptorSRWLocks[fileDesc->clusterNo % DESCRIPTOR_LOCK_STRIPES]);
+	StatsRecorder::acquireShared(LOCK_DIRECTORY, &(fs->directorySRWLock));
+	AcquireSRWLockExclusive(descriptorSRWLock);
 	char fileDescriptorCluster[2048];
-	KernelFS::mountedPartition->readCluster(fileDesc->clusterNo, fileDescriptorCluster);
+	fs->readMetadataCluster(fileDesc->clusterNo, fileDescriptorCluster);
 	fileDescriptorCluster[fileDesc->entryStart + KernelFS::FILE_SIZE_OFFSET + 0] = fileSize & 0xffUL;
 	fileDescriptorCluster[fileDesc->entryStart + KernelFS::FILE_SIZE_OFFSET + 1] = (fileSize >> 8) & 0xffUL;
 	fileDescriptorCluster[fileDesc->entryStart + KernelFS::FILE_SIZE_OFFSET + 2] = (fileSize >> 16) & 0xffUL;
 	fileDescriptorCluster[fileDesc->entryStart + KernelFS::FILE_SIZE_OFFSET + 3] = (fileSize >> 24) & 0xffUL;
-	KernelFS::mountedPartition->writeCluster(fileDesc->clusterNo, fileDescriptorCluster);
+	fileDescriptorCluster[fileDesc->entryStart + KernelFS::FILE_FLAGS_OFFSET] = fileFlags;
+	fs->writeMetadataCluster(fileDesc->clusterNo, fileDescriptorCluster);
+	ReleaseSRWLockExclusive(descriptorSRWLock);
+	ReleaseSRWLockShared(&(fs->directorySRWLock));
 }
 
-char KernelFile::write(BytesCnt bytesCnt, char* buffer) {
-	if (mode == 'r') return 0; // if the file is opened in read-only mode, no writing is allowed
-	if (bytesCnt == 0) return 0; // nothing to write
+void KernelFile::loadLvl1IndexCluster() {
+	if (lvl1Buffer.clusterNo != 0) return; // already buffered
+	fs->readMetadataCluster(fileLvl1IndexClusterNo, lvl1Buffer.data);
+	lvl1Buffer.clusterNo = fileLvl1IndexClusterNo;
+	lvl1Buffer.dirty = false;
+	if ((fileFlags & KernelFS::FILE_FLAG_EXTENTS) == 0) return;
+	// decode the extent table - it ends with the first extent of length 0 (or with the end of the cluster)
+	extents.clear();
+	unsigned long logicalStart = 0;
+	for (int extentEntry = 0; extentEntry < 2048; extentEntry += KernelFS::EXTENT_ENTRY_SIZE_IN_BYTES) {
+		Extent extent;
+		extent.start = KernelFS::getEntry(lvl1Buffer.data, extentEntry + KernelFS::EXTENT_START_OFFSET);
+		extent.length = KernelFS::getEntry(lvl1Buffer.data, extentEntry + KernelFS::EXTENT_LENGTH_OFFSET);
+		if (extent.length == 0) break;
+		extent.logicalStart = logicalStart;
+		logicalStart += extent.length;
+		extents.push_back(extent);
+	}
+}
+
+void KernelFile::flushIndexClusters() {
+	// level 2 index cluster is written before the level 1 index cluster which points to it
+	if (lvl2Buffer.clusterNo != 0 && lvl2Buffer.dirty)
+		fs->writeMetadataCluster(lvl2Buffer.clusterNo, lvl2Buffer.data);
+	if (lvl1Buffer.clusterNo != 0 && lvl1Buffer.dirty)
+		fs->writeMetadataCluster(lvl1Buffer.clusterNo, lvl1Buffer.data);
+	lvl1Buffer.clusterNo = lvl2Buffer.clusterNo = 0;
+	lvl1Buffer.dirty = lvl2Buffer.dirty = false;
+}
+
+bool KernelFile::promoteInlineData() {
+	ClusterCache* cache = fileDesc->cache;
+	char inlineData[2048];
+	cache->readCluster(fileLvl1IndexClusterNo, inlineData);
+	cache->invalidate(fileLvl1IndexClusterNo);
 	char emptyCluster[2048];
 	for (int i = 0; i < 2048; i++)
 		emptyCluster[i] = 0x00;
-	char fileLvl1IndexCluster[2048];
-	KernelFS::mountedPartition->readCluster(fileLvl1IndexClusterNo, fileLvl1IndexCluster);
-	int startingLvl1EntryNo = cursor / (512 * ClusterSize); // one level 2 entry can have 512 data clusters (each with 2048B in it)
-	int startingLvl2EntryNo = (cursor % (512 * ClusterSize)) / ClusterSize;
-	int startingByteNo = (cursor % (512 * ClusterSize)) % ClusterSize;
-	BytesCnt nextByteToWrite = 0;
-	for (int lvl1Entry = startingLvl1EntryNo * KernelFS::LVL1_ENTRY_SIZE_IN_BYTES; lvl1Entry < 2048; lvl1Entry += KernelFS::LVL1_ENTRY_SIZE_IN_BYTES) {
-		ClusterNo fileLvl2IndexClusterNo = 0;
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 0]);
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 1]) << 8;
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 2]) << 16;
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 3]) << 24;
-		if (fileLvl2IndexClusterNo == 0) {
-			fileLvl2IndexClusterNo = KernelFile::allocateClusterAtomic();
-			if (fileLvl2IndexClusterNo == 0 || fileLvl2IndexClusterNo > (KernelFS::numOfClusters - 1)) return 0; // no free cluster found
-			KernelFS::mountedPartition->writeCluster(fileLvl2IndexClusterNo, emptyCluster);
-			fileLvl1IndexCluster[lvl1Entry + 0] = fileLvl2IndexClusterNo & 0xffUL;
-			fileLvl1IndexCluster[lvl1Entry + 1] = (fileLvl2IndexClusterNo >> 8) & 0xffUL;
-			fileLvl1IndexCluster[lvl1Entry + 2] = (fileLvl2IndexClusterNo >> 16) & 0xffUL;
-			fileLvl1IndexCluster[lvl1Entry + 3] = (fileLvl2IndexClusterNo >> 24) & 0xffUL;
-			startingLvl2EntryNo = startingByteNo = 0; // if a new cluster has been allocated writing should start from beggining
+	fs->writeMetadataCluster(fileLvl1IndexClusterNo, emptyCluster); // index cluster becomes an empty index
+	fileFlags &= ~KernelFS::FILE_FLAG_INLINE;
+	ClusterNo dataClusterNo = KernelFile::getDataCluster(0, true);
+	if (dataClusterNo == 0) { // no free cluster found - keep the data inline
+		KernelFile::deallocateDataClusters(0);
+		KernelFile::flushIndexClusters();
+		fileFlags |= KernelFS::FILE_FLAG_INLINE;
+		cache->writeCluster(fileLvl1IndexClusterNo, inlineData);
+		return false;
+	}
+	cache->writeCluster(dataClusterNo, inlineData);
+	return true;
+}
+
+ClusterNo KernelFile::getDataCluster(unsigned long clusterIndex, bool allocate) {
+	if ((fileFlags & KernelFS::FILE_FLAG_INLINE) != 0) // the only logical cluster of an inline file is its index cluster
+		return (clusterIndex == 0) ? fileLvl1IndexClusterNo : 0;
+	if ((fileFlags & KernelFS::FILE_FLAG_EXTENTS) != 0)
+		return KernelFile::getExtentDataCluster(clusterIndex, allocate);
+	if (clusterIndex >= 512 * 512) return 0; // beyond the maximum file size
+	if (KernelFile::loadLvl2IndexCluster(clusterIndex, allocate) == false) return 0; // no level 2 index cluster (or no free cluster found)
+	int lvl2Entry = (clusterIndex % 512) * KernelFS::LVL2_ENTRY_SIZE_IN_BYTES;
+	ClusterNo dataClusterNo = KernelFS::getEntry(lvl2Buffer.data, lvl2Entry);
+	if (dataClusterNo == 0 && allocate) {
+		dataClusterNo = fs->allocateClusterAtomic();
+		if (dataClusterNo == 0 || dataClusterNo > (fs->numOfClusters - 1)) return 0; // no free cluster found
+		char emptyCluster[2048];
+		for (int i = 0; i < 2048; i++)
+			emptyCluster[i] = 0x00;
+		fileDesc->cache->writeCluster(dataClusterNo, emptyCluster);
+		KernelFS::setEntry(lvl2Buffer.data, lvl2Entry, dataClusterNo);
+		lvl2Buffer.dirty = true;
+	}
+	return dataClusterNo;
+}
+
+bool KernelFile::loadLvl2IndexCluster(unsigned long clusterIndex, bool allocate) {
+	KernelFile::loadLvl1IndexCluster();
+	int lvl1Entry = (clusterIndex / 512) * KernelFS::LVL1_ENTRY_SIZE_IN_BYTES; // one level 2 entry can have 512 data clusters (each with 2048B in it)
+	ClusterNo fileLvl2IndexClusterNo = KernelFS::getEntry(lvl1Buffer.data, lvl1Entry);
+	if (fileLvl2IndexClusterNo == 0) {
+		if (!allocate) return false;
+		fileLvl2IndexClusterNo = fs->allocateClusterAtomic();
+		if (fileLvl2IndexClusterNo == 0 || fileLvl2IndexClusterNo > (fs->numOfClusters - 1)) return false; // no free cluster found
+		if (lvl2Buffer.clusterNo != 0 && lvl2Buffer.dirty)
+			fs->writeMetadataCluster(lvl2Buffer.clusterNo, lvl2Buffer.data);
+		for (int i = 0; i < 2048; i++)
+			lvl2Buffer.data[i] = 0x00;
+		lvl2Buffer.clusterNo = fileLvl2IndexClusterNo;
+		lvl2Buffer.dirty = true;
+		KernelFS::setEntry(lvl1Buffer.data, lvl1Entry, fileLvl2IndexClusterNo);
+		lvl1Buffer.dirty = true;
+	}
+	else if (lvl2Buffer.clusterNo != fileLvl2IndexClusterNo) {
+		if (lvl2Buffer.clusterNo != 0 && lvl2Buffer.dirty)
+			fs->writeMetadataCluster(lvl2Buffer.clusterNo, lvl2Buffer.data);
+		fs->readMetadataCluster(fileLvl2IndexClusterNo, lvl2Buffer.data);
+		lvl2Buffer.clusterNo = fileLvl2IndexClusterNo;
+		lvl2Buffer.dirty = false;
+	}
+	return true;
+}
+
+bool KernelFile::writeDedupCluster(unsigned long clusterIndex, const char* data) {
+	ClusterNo dataClusterNo = fs->findDuplicateCluster(data);
+	if (dataClusterNo == 0) {
+		// the new cluster is placed right after the data cluster of the preceding logical cluster, if possible
+		KernelFile::lockMetadata(false);
+		ClusterNo goal = (clusterIndex > 0) ? KernelFile::getDataCluster(clusterIndex - 1, false) : 0;
+		KernelFile::flushIndexClusters();
+		KernelFile::unlockMetadata(false);
+		dataClusterNo = fs->allocateClusterAtomic((goal != 0) ? (goal + 1) : 0);
+		if (dataClusterNo == 0 || dataClusterNo > (fs->numOfClusters - 1)) return false; // no free cluster found
+		// written through, so that the partition holds the contents of every indexed cluster
+		fileDesc->cache->invalidate(dataClusterNo);
+		char* buffers[1] = { (char*)data };
+		fs->writeClusters(&dataClusterNo, 1, buffers);
+		fs->indexCluster(dataClusterNo, data);
+	}
+	KernelFile::lockMetadata(true);
+	ClusterNo oldDataClusterNo = 0;
+	bool mapped = KernelFile::loadLvl2IndexCluster(clusterIndex, true);
+	if (mapped) {
+		int lvl2Entry = (clusterIndex % 512) * KernelFS::LVL2_ENTRY_SIZE_IN_BYTES;
+		oldDataClusterNo = KernelFS::getEntry(lvl2Buffer.data, lvl2Entry);
+		KernelFS::setEntry(lvl2Buffer.data, lvl2Entry, dataClusterNo);
+		lvl2Buffer.dirty = true;
+	}
+	KernelFile::flushIndexClusters();
+	KernelFile::unlockMetadata(true);
+	if (!mapped) { // no free cluster found for the level 2 index cluster
+		fs->deallocateClusterAtomic(dataClusterNo);
+		return false;
+	}
+	if (oldDataClusterNo != 0) {
+		fileDesc->cache->invalidate(oldDataClusterNo);
+		fs->deallocateClusterAtomic(oldDataClusterNo); // drops only the file's reference, if the cluster is shared
+	}
+	return true;
+}
+
+ClusterNo KernelFile::getExtentDataCluster(unsigned long clusterIndex, bool allocate) {
+	KernelFile::loadLvl1IndexCluster();
+	int extentNo = KernelFile::findExtent(clusterIndex);
+	if (extentNo != -1) {
+		Extent& extent = extents[extentNo];
+		if (clusterIndex < extent.logicalStart + extent.length && extent.start != 0)
+			return extent.start + (clusterIndex - extent.logicalStart);
+	}
+	if (!allocate) return 0; // logical cluster falls into a hole or lies past the last extent
+	std::vector<Extent> previousExtents = extents;
+	unsigned long numOfMappedClusters = extents.empty() ? 0 : (extents.back().logicalStart + extents.back().length);
+	if (clusterIndex >= numOfMappedClusters) { // everything up to the logical cluster is mapped as a hole first
+		Extent hole = { numOfMappedClusters, 0, clusterIndex + 1 - numOfMappedClusters };
+		extents.push_back(hole);
+	}
+	// the logical cluster is now covered by a hole, which gets split around the newly allocated data cluster
+	unsigned int holeNo = KernelFile::findExtent(clusterIndex);
+	Extent hole = extents[holeNo];
+	// try to continue the preceding extent or to precede the following one, so that the file stays contiguous
+	ClusterNo goal = 0;
+	if (clusterIndex == hole.logicalStart && holeNo > 0)
+		goal = extents[holeNo - 1].start + extents[holeNo - 1].length;
+	else if (clusterIndex == hole.logicalStart + hole.length - 1 && holeNo + 1 < extents.size())
+		goal = extents[holeNo + 1].start - 1;
+	ClusterNo dataClusterNo = fs->allocateClusterAtomic(goal);
+	if (dataClusterNo == 0 || dataClusterNo > (fs->numOfClusters - 1)) { // no free cluster found
+		extents = previousExtents;
+		return 0;
+	}
+	if (KernelFile::mapExtentCluster(holeNo, clusterIndex, dataClusterNo) == false) { // extent table is full
+		extents = previousExtents;
+		fs->deallocateClusterAtomic(dataClusterNo);
+		return 0;
+	}
+	char emptyCluster[2048];
+	for (int i = 0; i < 2048; i++)
+		emptyCluster[i] = 0x00;
+	fileDesc->cache->writeCluster(dataClusterNo, emptyCluster);
+	return dataClusterNo;
+}
+
+int KernelFile::findExtent(unsigned long clusterIndex) {
+	// binary search for the first extent which starts after the logical cluster
+	std::vector<Extent>::iterator it = std::upper_bound(extents.begin(), extents.end(), clusterIndex,
+		[](unsigned long index, const Extent& extent) { return index < extent.logicalStart; });
+	return (int)(it - extents.begin()) - 1;
+}
+
+bool KernelFile::mapExtentCluster(unsigned int extentNo, unsigned long clusterIndex, ClusterNo dataClusterNo) {
+	Extent extent = extents[extentNo];
+	unsigned long offset = clusterIndex - extent.logicalStart;
+	std::vector<Extent> split;
+	if (offset > 0) {
+		Extent before = { extent.logicalStart, extent.start, offset };
+		split.push_back(before);
+	}
+	Extent mapped = { clusterIndex, dataClusterNo, 1 };
+	split.push_back(mapped);
+	if (offset + 1 < extent.length) {
+		Extent after = { clusterIndex + 1, (extent.start == 0) ? 0 : (extent.start + offset + 1), extent.length - offset - 1 };
+		split.push_back(after);
+	}
+	extents.erase(extents.begin() + extentNo);
+	extents.insert(extents.begin() + extentNo, split.begin(), split.end());
+	KernelFile::mergeExtents();
+	if (extents.size() > 2048 / KernelFS::EXTENT_ENTRY_SIZE_IN_BYTES) return false;
+	KernelFile::encodeExtents();
+	return true;
+}
+
+ClusterNo KernelFile::unshareDataCluster(unsigned long clusterIndex, ClusterNo dataClusterNo) {
+	StatsRecorder::acquireShared(LOCK_ALLOCATOR, &(fs->allocatorSRWLock));
+	bool shared = fs->isSharedCluster(dataClusterNo);
+	ReleaseSRWLockShared(&(fs->allocatorSRWLock));
+	if (!shared) return dataClusterNo;
+	// the copy is placed right after the data cluster of the preceding logical cluster, if possible
+	ClusterNo goal = (clusterIndex > 0) ? KernelFile::getDataCluster(clusterIndex - 1, false) : 0;
+	ClusterNo copyClusterNo = fs->allocateClusterAtomic((goal != 0) ? (goal + 1) : 0);
+	if (copyClusterNo == 0 || copyClusterNo > (fs->numOfClusters - 1)) return 0; // no free cluster found
+	if ((fileFlags & KernelFS::FILE_FLAG_EXTENTS) != 0) {
+		std::vector<Extent> previousExtents = extents;
+		if (KernelFile::mapExtentCluster(KernelFile::findExtent(clusterIndex), clusterIndex, copyClusterNo) == false) { // extent table is full
+			extents = previousExtents;
+			fs->deallocateClusterAtomic(copyClusterNo);
+			return 0;
 		}
-		char fileLvl2IndexCluster[2048];
-		KernelFS::mountedPartition->readCluster(fileLvl2IndexClusterNo, fileLvl2IndexCluster);
-		for (int lvl2Entry = startingLvl2EntryNo * KernelFS::LVL2_ENTRY_SIZE_IN_BYTES; lvl2Entry < 2048; lvl2Entry += KernelFS::LVL2_ENTRY_SIZE_IN_BYTES) {
-			ClusterNo dataClusterNo = 0;
-			dataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 0]);
-			dataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 1]) << 8;
-			dataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 2]) << 16;
-			dataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 3]) << 24;
-			if (dataClusterNo == 0) {
-				dataClusterNo = KernelFile::allocateClusterAtomic();
-				if (dataClusterNo == 0 || dataClusterNo > (KernelFS::numOfClusters - 1)) return 0; // no free cluster found
-				KernelFS::files[fname]->cache->writeCluster(dataClusterNo, emptyCluster);
-				fileLvl2IndexCluster[lvl2Entry + 0] = dataClusterNo & 0xffUL;
-				fileLvl2IndexCluster[lvl2Entry + 1] = (dataClusterNo >> 8) & 0xffUL;
-				fileLvl2IndexCluster[lvl2Entry + 2] = (dataClusterNo >> 16) & 0xffUL;
-				fileLvl2IndexCluster[lvl2Entry + 3] = (dataClusterNo >> 24) & 0xffUL;
-				startingByteNo = 0;
+	}
+	else {
+		KernelFile::getDataCluster(clusterIndex, false); // buffers the level 2 index cluster which maps the logical cluster
+		KernelFS::setEntry(lvl2Buffer.data, (clusterIndex % 512) * KernelFS::LVL2_ENTRY_SIZE_IN_BYTES, copyClusterNo);
+		lvl2Buffer.dirty = true;
+	}
+	ClusterCache* cache = fileDesc->cache;
+	char dataCluster[2048];
+	cache->readCluster(dataClusterNo, dataCluster);
+	cache->invalidate(dataClusterNo);
+	cache->writeCluster(copyClusterNo, dataCluster);
+	fs->deallocateClusterAtomic(dataClusterNo); // drops the file's reference to the shared data cluster
+	return copyClusterNo;
+}
+
+void KernelFile::mergeExtents() {
+	std::vector<Extent> merged;
+	for (unsigned int extentNo = 0; extentNo < extents.size(); extentNo++) {
+		if (!merged.empty()) {
+			Extent& last = merged.back();
+			bool bothHoles = (last.start == 0 && extents[extentNo].start == 0);
+			bool contiguous = (last.start != 0 && extents[extentNo].start == last.start + last.length);
+			if (bothHoles || contiguous) {
+				last.length += extents[extentNo].length;
+				continue;
 			}
-			char dataCluster[2048];
-			KernelFS::files[fname]->cache->readCluster(dataClusterNo, dataCluster);
+		}
+		merged.push_back(extents[extentNo]);
+	}
+	unsigned long logicalStart = 0;
+	for (unsigned int extentNo = 0; extentNo < merged.size(); extentNo++) {
+		merged[extentNo].logicalStart = logicalStart;
+		logicalStart += merged[extentNo].length;
+	}
+	extents.swap(merged);
+}
+
+void KernelFile::encodeExtents() {
+	unsigned int extentEntry = 0;
+	for (unsigned int extentNo = 0; extentNo < extents.size(); extentNo++, extentEntry += KernelFS::EXTENT_ENTRY_SIZE_IN_BYTES) {
+		KernelFS::setEntry(lvl1Buffer.data, extentEntry + KernelFS::EXTENT_START_OFFSET, extents[extentNo].start);
+		KernelFS::setEntry(lvl1Buffer.data, extentEntry + KernelFS::EXTENT_LENGTH_OFFSET, extents[extentNo].length);
+	}
+	for (; extentEntry < 2048; extentEntry++) // the rest of the table is empty
+		lvl1Buffer.data[extentEntry] = 0x00;
+	lvl1Buffer.dirty = true;
+}
+
+char KernelFile::write(BytesCnt bytesCnt, char* buffer) {
+	if (mode == 'r' || mode == 's') return 0; // if the file is opened in read-only mode, no writing is allowed
+	if (bytesCnt == 0) return 0; // nothing to write
+	if ((fileFlags & KernelFS::FILE_FLAG_COMPRESSED) != 0) // the flag never changes while the file is open
+		return KernelFile::writeCompressed(bytesCnt, buffer);
+	unsigned long firstClusterIndex = cursor / ClusterSize, lastClusterIndex = (cursor + bytesCnt - 1) / ClusterSize;
+	if (mode == 'm') { // other handles may write to the file at the same time - lock the logical clusters being written to
+		fileDesc->lockRange(firstClusterIndex, lastClusterIndex, true);
+		KernelFile::lockMetadata(false);
+		bool isInline = (fileFlags & KernelFS::FILE_FLAG_INLINE) != 0;
+		KernelFile::unlockMetadata(false);
+		if (isInline && firstClusterIndex != 0) { // inline data (logical cluster 0) gets moved out if the file grows
+			fileDesc->unlockRange(firstClusterIndex, lastClusterIndex, true);
+			firstClusterIndex = 0;
+			fileDesc->lockRange(firstClusterIndex, lastClusterIndex, true);
+		}
+	}
+	ClusterCache* cache = fileDesc->cache;
+	bool dedup = (fs->mountedPartitionState->formatOptions & FORMAT_DEDUP) != 0 && (fileFlags & KernelFS::FILE_FLAG_EXTENTS) == 0;
+	BytesCnt nextByteToWrite = 0;
+	bool outOfSpace = false, corrupted = false;
+	while (nextByteToWrite < bytesCnt && !outOfSpace && !corrupted) {
+		// data clusters are mapped (allocated if needed) a batch at a time while the metadata is locked, and filled in after it is unlocked
+		unsigned long clusterIndex = (cursor + nextByteToWrite) / ClusterSize;
+		ClusterNo dataClusterNos[CLUSTERS_PER_MAPPING];
+		unsigned int numOfMappedClusters = 0;
+		KernelFile::lockMetadata(true);
+		if ((fileFlags & KernelFS::FILE_FLAG_INLINE) != 0 && cursor + bytesCnt > ClusterSize)
+			outOfSpace = !KernelFile::promoteInlineData(); // file outgrows its index cluster
+		while (!outOfSpace && numOfMappedClusters < CLUSTERS_PER_MAPPING && clusterIndex + numOfMappedClusters <= lastClusterIndex) {
+			unsigned long mappedClusterIndex = clusterIndex + numOfMappedClusters;
+			if (dedup && (fileFlags & KernelFS::FILE_FLAG_INLINE) == 0 && mappedClusterIndex * ClusterSize >= cursor
+				&& (mappedClusterIndex + 1) * ClusterSize <= cursor + bytesCnt) { // whole cluster - mapped once it is written
+				dataClusterNos[numOfMappedClusters++] = 0;
+				continue;
+			}
+			ClusterNo dataClusterNo = KernelFile::getDataCluster(clusterIndex + numOfMappedClusters, true);
+			if (dataClusterNo != 0)
+				dataClusterNo = KernelFile::unshareDataCluster(clusterIndex + numOfMappedClusters, dataClusterNo);
+			if (dataClusterNo == 0) // no free cluster found
+				outOfSpace = true;
+			else
+				dataClusterNos[numOfMappedClusters++] = dataClusterNo;
+		}
+		KernelFile::flushIndexClusters();
+		BytesCnt mappedEnd = (clusterIndex + numOfMappedClusters) * ClusterSize;
+		if (mappedEnd > cursor + bytesCnt)
+			mappedEnd = cursor + bytesCnt;
+		if (numOfMappedClusters > 0 && mappedEnd > fileSize)
+			fileSize = mappedEnd;
+		KernelFile::unlockMetadata(true);
+		for (unsigned int i = 0; i < numOfMappedClusters; i++) {
+			int startingByteNo = (cursor + nextByteToWrite) % ClusterSize;
 			int numOfBytesToWrite = ((ClusterSize - startingByteNo) > (bytesCnt - nextByteToWrite)) ? (bytesCnt - nextByteToWrite)
 				: (ClusterSize - startingByteNo);
+			if (dataClusterNos[i] == 0) { // whole cluster of a file on a partition with deduplication
+				if (KernelFile::writeDedupCluster((cursor + nextByteToWrite) / ClusterSize, buffer + nextByteToWrite) == false) {
+					outOfSpace = true;
+					break;
+				}
+				nextByteToWrite += ClusterSize;
+				continue;
+			}
+			char dataCluster[2048];
+			if (numOfBytesToWrite < ClusterSize && cache->readCluster(dataClusterNos[i], dataCluster) == 0) { // only partially overwritten
+				corrupted = true; // the rest of the cluster does not match its checksum
+				break;
+			}
 			for (int byteNo = 0; byteNo < numOfBytesToWrite; byteNo++)
 				dataCluster[startingByteNo + byteNo] = buffer[nextByteToWrite++];
-			KernelFS::files[fname]->cache->writeCluster(dataClusterNo, dataCluster);
-			if (nextByteToWrite == bytesCnt) { // writing finished successfully
-				fileSize += bytesCnt;
-				cursor += bytesCnt;
-				KernelFS::mountedPartition->writeCluster(fileLvl2IndexClusterNo, fileLvl2IndexCluster);
-				KernelFS::mountedPartition->writeCluster(fileLvl1IndexClusterNo, fileLvl1IndexCluster);
-				return 1;
-			}
-			if (startingByteNo != 0)
-				startingByteNo = 0;
+			cache->writeCluster(dataClusterNos[i], dataCluster);
 		}
-		if (startingLvl2EntryNo != 0) 
-			startingLvl2EntryNo = 0;
-		KernelFS::mountedPartition->writeCluster(fileLvl2IndexClusterNo, fileLvl2IndexCluster);
 	}
-	return 0;
+	cursor += nextByteToWrite;
+	if (mode == 'm')
+		fileDesc->unlockRange(firstClusterIndex, lastClusterIndex, true);
+	return (nextByteToWrite == bytesCnt) ? 1 : 0;
 }
 
 BytesCnt KernelFile::read(BytesCnt bytesCnt, char* buffer) {
 	if (bytesCnt == 0) return 0; // nothing to read
-	if (cursor == fileSize) return 0; // cursor is at the eof
+	if (mode == 's')
+		return KernelFile::readSnapshot(bytesCnt, buffer);
+	if ((fileFlags & KernelFS::FILE_FLAG_COMPRESSED) != 0)
+		return KernelFile::readCompressed(bytesCnt, buffer);
+	KernelFile::lockMetadata(false);
+	KernelFile::unlockMetadata(false);
+	if (cursor >= fileSize) return 0; // cursor is at (or past) the eof
 	if (bytesCnt > (fileSize - cursor)) // up to how many bytes can be read 
 		bytesCnt = fileSize - cursor;
-	char fileLvl1IndexCluster[2048];
-	KernelFS::mountedPartition->readCluster(fileLvl1IndexClusterNo, fileLvl1IndexCluster);
-	int startingLvl1EntryNo = cursor / (512 * ClusterSize); // one level 2 entry can have 512 data clusters (each with 2048B in it)
-	int startingLvl2EntryNo = (cursor % (512 * ClusterSize)) / ClusterSize;
-	int startingByteNo = (cursor % (512 * ClusterSize)) % ClusterSize;
+	// handles which share the file (opened in 'r'/'m' mode) lock the logical clusters being read, so they are not written to in the meantime
+	bool rangeLocked = (mode == 'r' || mode == 'm');
+	unsigned long firstClusterIndex = cursor / ClusterSize, lastClusterIndex = (cursor + bytesCnt - 1) / ClusterSize;
+	if (rangeLocked)
+		fileDesc->lockRange(firstClusterIndex, lastClusterIndex, false);
+	ClusterCache* cache = fileDesc->cache;
+	// the data clusters of a batch are read all at once - a striped partition reads them from all of its members in parallel;
+	// a large read hands its batches over to the drive's reader threads, and goes on mapping the next ones in the meantime
+	bool parallel = (bytesCnt >= PARALLEL_READ_THRESHOLD);
+	ReadPool::Batch readBatch;
+	unsigned long numOfBatchClusters = lastClusterIndex - firstClusterIndex + 1;
+	if (numOfBatchClusters > CLUSTERS_PER_MAPPING)
+		numOfBatchClusters = CLUSTERS_PER_MAPPING;
+	char* batchBuffer = parallel ? nullptr : new char[numOfBatchClusters * ClusterSize];
 	BytesCnt numOfBytesRead = 0;
-	for (int lvl1Entry = startingLvl1EntryNo * KernelFS::LVL1_ENTRY_SIZE_IN_BYTES; lvl1Entry < 2048; lvl1Entry += KernelFS::LVL1_ENTRY_SIZE_IN_BYTES) {
-		ClusterNo fileLvl2IndexClusterNo = 0;
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 0]);
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 1]) << 8;
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 2]) << 16;
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 3]) << 24;
-		char fileLvl2IndexCluster[2048];
-		KernelFS::mountedPartition->readCluster(fileLvl2IndexClusterNo, fileLvl2IndexCluster);
-		for (int lvl2Entry = startingLvl2EntryNo * KernelFS::LVL2_ENTRY_SIZE_IN_BYTES; lvl2Entry < 2048; lvl2Entry += KernelFS::LVL2_ENTRY_SIZE_IN_BYTES) {
-			ClusterNo dataClusterNo = 0;
-			dataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 0]);
-			dataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 1]) << 8;
-			dataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 2]) << 16;
-			dataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 3]) << 24;
-			char dataCluster[2048];
-			KernelFS::files[fname]->cache->readCluster(dataClusterNo, dataCluster);
+	char result = 1;
+	while (numOfBytesRead < bytesCnt && result == 1) {
+		// data clusters are mapped a batch at a time while the metadata is locked, and read from after it is unlocked
+		unsigned long clusterIndex = (cursor + numOfBytesRead) / ClusterSize;
+		ClusterNo dataClusterNos[CLUSTERS_PER_MAPPING];
+		unsigned int numOfMappedClusters = 0;
+		KernelFile::lockMetadata(false);
+		if (cursor + bytesCnt > fileSize) // the file has been truncated (by another handle) before the range got locked
+			bytesCnt = (cursor + numOfBytesRead < fileSize) ? fileSize - cursor : numOfBytesRead;
+		while (numOfBytesRead < bytesCnt && numOfMappedClusters < CLUSTERS_PER_MAPPING
+			&& clusterIndex + numOfMappedClusters <= (cursor + bytesCnt - 1) / ClusterSize) {
+			dataClusterNos[numOfMappedClusters] = KernelFile::getDataCluster(clusterIndex + numOfMappedClusters, false);
+			numOfMappedClusters++;
+		}
+		KernelFile::flushIndexClusters();
+		KernelFile::unlockMetadata(false);
+		if (numOfMappedClusters == 0) break; // the file has been truncated to where the read got so far
+		ReadPool::Task* task = new ReadPool::Task;
+		task->cache = cache;
+		task->dataClusterNos.assign(dataClusterNos, dataClusterNos + numOfMappedClusters);
+		task->startingByteNo = (cursor + numOfBytesRead) % ClusterSize;
+		task->numOfBytes = numOfMappedClusters * ClusterSize - task->startingByteNo;
+		if (task->numOfBytes > bytesCnt - numOfBytesRead)
+			task->numOfBytes = bytesCnt - numOfBytesRead;
+		task->buffer = buffer + numOfBytesRead;
+		numOfBytesRead += task->numOfBytes;
+		if (parallel)
+			fs->readPool.submit(task, readBatch);
+		else {
+			result = ReadPool::execute(*task, batchBuffer);
+			delete task;
+		}
+	}
+	if (readBatch.wait() == 0)
+		result = 0;
+	delete[] batchBuffer;
+	if (rangeLocked)
+		fileDesc->unlockRange(firstClusterIndex, lastClusterIndex, false);
+	if (result == 0) return 0; // a data cluster does not match its checksum - the cursor stays where it was
+	cursor += numOfBytesRead;
+	return numOfBytesRead;
+}
+
+BytesCnt KernelFile::readSnapshot(BytesCnt bytesCnt, char* buffer) {
+	if (cursor >= fileSize) return 0; // cursor is at (or past) the eof
+	if (bytesCnt > (fileSize - cursor)) // up to how many bytes can be read
+		bytesCnt = fileSize - cursor;
+	if (!snapshot->inlineData.empty()) {
+		std::copy(snapshot->inlineData.begin() + cursor, snapshot->inlineData.begin() + cursor + bytesCnt, buffer);
+		cursor += bytesCnt;
+		return bytesCnt;
+	}
+	if (snapshot->compressed) { // decompressed a group at a time (its entries are pinned as a whole)
+		std::vector<char> groupData(COMPRESSION_GROUP_SIZE_IN_BYTES);
+		BytesCnt numOfBytesRead = 0;
+		while (numOfBytesRead < bytesCnt) {
+			unsigned long groupNo = (cursor + numOfBytesRead) / COMPRESSION_GROUP_SIZE_IN_BYTES;
+			BytesCnt startingByteNo = (cursor + numOfBytesRead) % COMPRESSION_GROUP_SIZE_IN_BYTES;
+			BytesCnt numOfBytesToRead = std::min(COMPRESSION_GROUP_SIZE_IN_BYTES - startingByteNo, bytesCnt - numOfBytesRead);
+			if (KernelFile::decodeGroup(&snapshot->dataClusterNos[groupNo * COMPRESSION_GROUP_SIZE], groupData.data(), false) == 0)
+				return 0;
+			std::copy(groupData.begin() + startingByteNo, groupData.begin() + startingByteNo + numOfBytesToRead, buffer + numOfBytesRead);
+			numOfBytesRead += numOfBytesToRead;
+		}
+		cursor += numOfBytesRead;
+		return numOfBytesRead;
+	}
+	// the snapshot's data clusters are never written to, so they are read straight from the partition, a batch at a time
+	unsigned long firstClusterIndex = cursor / ClusterSize, lastClusterIndex = (cursor + bytesCnt - 1) / ClusterSize;
+	unsigned long numOfBatchClusters = lastClusterIndex - firstClusterIndex + 1;
+	if (numOfBatchClusters > CLUSTERS_PER_MAPPING)
+		numOfBatchClusters = CLUSTERS_PER_MAPPING;
+	char* batchBuffer = new char[numOfBatchClusters * ClusterSize];
+	BytesCnt numOfBytesRead = 0;
+	for (unsigned long clusterIndex = firstClusterIndex; clusterIndex <= lastClusterIndex; clusterIndex += numOfBatchClusters) {
+		unsigned int numOfClusters = (lastClusterIndex - clusterIndex + 1 < numOfBatchClusters) ? (lastClusterIndex - clusterIndex + 1) : numOfBatchClusters;
+		ClusterNo readClusterNos[CLUSTERS_PER_MAPPING];
+		char* readBuffers[CLUSTERS_PER_MAPPING];
+		unsigned int numOfReadClusters = 0;
+		for (unsigned int i = 0; i < numOfClusters; i++) {
+			char* dataCluster = batchBuffer + i * ClusterSize;
+			ClusterNo dataClusterNo = snapshot->dataClusterNos[clusterIndex + i];
+			if (dataClusterNo == 0) // a hole - it reads as zeros, without any disk access
+				for (int byteNo = 0; byteNo < 2048; byteNo++)
+					dataCluster[byteNo] = 0x00;
+			else {
+				readClusterNos[numOfReadClusters] = dataClusterNo;
+				readBuffers[numOfReadClusters++] = dataCluster;
+			}
+		}
+		if (fs->readClusters(readClusterNos, numOfReadClusters, readBuffers) == 0) { // a data cluster does not match its checksum
+			delete[] batchBuffer;
+			return 0;
+		}
+		for (unsigned int i = 0; i < numOfClusters; i++) {
+			int startingByteNo = (cursor + numOfBytesRead) % ClusterSize;
 			int numOfBytesToRead = ((ClusterSize - startingByteNo) > (bytesCnt - numOfBytesRead)) ? (bytesCnt - numOfBytesRead)
 				: (ClusterSize - startingByteNo);
-			for (int byteNo = 0; byteNo < numOfBytesToRead; byteNo++)
-				buffer[numOfBytesRead++] = dataCluster[startingByteNo + byteNo];
-			if (numOfBytesRead == bytesCnt) { // reading done 
-				cursor += numOfBytesRead;
-				return numOfBytesRead;
+			std::copy(batchBuffer + i * ClusterSize + startingByteNo, batchBuffer + i * ClusterSize + startingByteNo + numOfBytesToRead,
+				buffer + numOfBytesRead);
+			numOfBytesRead += numOfBytesToRead;
+		}
+	}
+	delete[] batchBuffer;
+	cursor += numOfBytesRead;
+	return numOfBytesRead;
+}
+
+char KernelFile::writeCompressed(BytesCnt bytesCnt, char* buffer) {
+	unsigned long firstGroupNo = cursor / COMPRESSION_GROUP_SIZE_IN_BYTES, lastGroupNo = (cursor + bytesCnt - 1) / COMPRESSION_GROUP_SIZE_IN_BYTES;
+	// groups are rewritten as a whole - other handles may not access any of their logical clusters in the meantime
+	unsigned long firstClusterIndex = firstGroupNo * COMPRESSION_GROUP_SIZE, lastClusterIndex = lastGroupNo * COMPRESSION_GROUP_SIZE + COMPRESSION_GROUP_SIZE - 1;
+	if (mode == 'm')
+		fileDesc->lockRange(firstClusterIndex, lastClusterIndex, true);
+	BytesCnt nextByteToWrite = 0;
+	char result = 1;
+	while (nextByteToWrite < bytesCnt) {
+		unsigned long groupNo = (cursor + nextByteToWrite) / COMPRESSION_GROUP_SIZE_IN_BYTES;
+		BytesCnt startingByteNo = (cursor + nextByteToWrite) % COMPRESSION_GROUP_SIZE_IN_BYTES;
+		BytesCnt numOfBytesToWrite = std::min(COMPRESSION_GROUP_SIZE_IN_BYTES - startingByteNo, bytesCnt - nextByteToWrite);
+		if (group.groupNo != groupNo) {
+			if (group.dirty && KernelFile::storeGroup() == 0) { // no free clusters left for the previously written group
+				result = 0;
+				break;
+			}
+			if (numOfBytesToWrite < COMPRESSION_GROUP_SIZE_IN_BYTES && KernelFile::loadGroup(groupNo) == 0) { // only partially overwritten
+				result = 0; // the rest of the group cannot be read
+				break;
+			}
+			if (numOfBytesToWrite == COMPRESSION_GROUP_SIZE_IN_BYTES) { // overwritten as a whole - the old contents are not needed
+				group.data.resize(COMPRESSION_GROUP_SIZE_IN_BYTES);
+				group.groupNo = groupNo;
+				group.length = 0;
+			}
+		}
+		std::copy(buffer + nextByteToWrite, buffer + nextByteToWrite + numOfBytesToWrite, group.data.begin() + startingByteNo);
+		if (startingByteNo + numOfBytesToWrite > group.length)
+			group.length = startingByteNo + numOfBytesToWrite;
+		group.dirty = true;
+		if (mode != 'm' && groupNo * COMPRESSION_GROUP_SIZE_IN_BYTES + group.length > fileSize) // 'w'/'a' handle is the only one the file has
+			fileSize = groupNo * COMPRESSION_GROUP_SIZE_IN_BYTES + group.length;
+		// 'w'/'a' handle keeps the group buffered until it is filled up (a sequential writer compresses every group once)
+		if ((mode == 'm' || startingByteNo + numOfBytesToWrite == COMPRESSION_GROUP_SIZE_IN_BYTES) && KernelFile::storeGroup() == 0) {
+			result = 0; // 'w'/'a' handle keeps the group buffered (storing it is retried later), 'm' handle drops it
+			break;
+		}
+		nextByteToWrite += numOfBytesToWrite;
+	}
+	if (mode == 'm') { // the group is not kept buffered - other handles write to the file as well
+		group.groupNo = ULONG_MAX;
+		group.dirty = false;
+		fileDesc->unlockRange(firstClusterIndex, lastClusterIndex, true);
+	}
+	cursor += nextByteToWrite;
+	return result;
+}
+
+BytesCnt KernelFile::readCompressed(BytesCnt bytesCnt, char* buffer) {
+	KernelFile::lockMetadata(false);
+	KernelFile::unlockMetadata(false);
+	if (cursor >= fileSize) return 0; // cursor is at (or past) the eof
+	if (bytesCnt > (fileSize - cursor)) // up to how many bytes can be read
+		bytesCnt = fileSize - cursor;
+	bool rangeLocked = (mode == 'r' || mode == 'm');
+	unsigned long firstClusterIndex = cursor / ClusterSize, lastClusterIndex = (cursor + bytesCnt - 1) / ClusterSize;
+	if (rangeLocked) {
+		fileDesc->lockRange(firstClusterIndex, lastClusterIndex, false);
+		KernelFile::lockMetadata(false);
+		KernelFile::unlockMetadata(false);
+		if (cursor + bytesCnt > fileSize) // the file has been truncated (by another handle) before the range got locked
+			bytesCnt = (cursor < fileSize) ? fileSize - cursor : 0;
+	}
+	BytesCnt numOfBytesRead = 0;
+	char result = 1;
+	while (numOfBytesRead < bytesCnt) {
+		unsigned long groupNo = (cursor + numOfBytesRead) / COMPRESSION_GROUP_SIZE_IN_BYTES;
+		BytesCnt startingByteNo = (cursor + numOfBytesRead) % COMPRESSION_GROUP_SIZE_IN_BYTES;
+		BytesCnt numOfBytesToRead = std::min(COMPRESSION_GROUP_SIZE_IN_BYTES - startingByteNo, bytesCnt - numOfBytesRead);
+		if (group.groupNo != groupNo) {
+			if (group.dirty && KernelFile::storeGroup() == 0) { // no free clusters left for the previously written group
+				result = 0;
+				break;
+			}
+			if (KernelFile::loadGroup(groupNo) == 0) { // a data cluster does not match its checksum
+				result = 0;
+				break;
 			}
-			if (startingByteNo != 0)
-				startingByteNo = 0;
 		}
-		if (startingLvl2EntryNo != 0)
-			startingLvl2EntryNo = 0;
+		std::copy(group.data.begin() + startingByteNo, group.data.begin() + startingByteNo + numOfBytesToRead, buffer + numOfBytesRead);
+		numOfBytesRead += numOfBytesToRead;
 	}
-	return 0;
+	if (rangeLocked) { // the group is not kept buffered - other handles may write to the file
+		group.groupNo = ULONG_MAX;
+		fileDesc->unlockRange(firstClusterIndex, lastClusterIndex, false);
+	}
+	if (result == 0) return 0; // the cursor stays where it was
+	cursor += numOfBytesRead;
+	return numOfBytesRead;
 }
 
-char KernelFile::seek(BytesCnt position) {
-	if (position > fileSize) // seeking not possible
-		return 0;
+char KernelFile::truncateCompressed() {
+	unsigned long groupNo = cursor / COMPRESSION_GROUP_SIZE_IN_BYTES;
+	if (mode == 'm') // the group the cursor points into gets rewritten, everything after it is removed
+		fileDesc->lockRange(groupNo * COMPRESSION_GROUP_SIZE, ULONG_MAX, true);
+	KernelFile::lockMetadata(false);
+	KernelFile::unlockMetadata(false);
+	char result = 1;
+	if (cursor >= fileSize) // cursor is at (or past) the eof
+		result = 0;
 	else {
-		cursor = position;
+		unsigned long firstRemovedGroupNo = (cursor + COMPRESSION_GROUP_SIZE_IN_BYTES - 1) / COMPRESSION_GROUP_SIZE_IN_BYTES;
+		if (group.groupNo != ULONG_MAX && group.groupNo >= firstRemovedGroupNo) { // the buffered group is removed as a whole
+			group.groupNo = ULONG_MAX;
+			group.dirty = false;
+		}
+		// the group the cursor points into stays if the cursor is not at its very beginning; its truncated bytes are cleared,
+		// so that they read as zeros if the file is later extended past them
+		BytesCnt keptBytes = cursor % COMPRESSION_GROUP_SIZE_IN_BYTES;
+		if (keptBytes != 0) {
+			if (group.groupNo != groupNo)
+				if ((group.dirty && KernelFile::storeGroup() == 0) || KernelFile::loadGroup(groupNo) == 0)
+					result = 0;
+			if (result == 1) {
+				std::fill(group.data.begin() + keptBytes, group.data.end(), 0x00);
+				if (group.length > keptBytes)
+					group.length = keptBytes;
+				group.dirty = true;
+				if (KernelFile::storeGroup() == 0)
+					result = 0;
+			}
+		}
+		if (result == 1) {
+			KernelFile::lockMetadata(true);
+			KernelFile::deallocateDataClusters(firstRemovedGroupNo * COMPRESSION_GROUP_SIZE);
+			KernelFile::flushIndexClusters();
+			fileSize = cursor;
+			KernelFile::unlockMetadata(true);
+		}
+	}
+	if (mode == 'm') {
+		group.groupNo = ULONG_MAX;
+		group.dirty = false;
+		fileDesc->unlockRange(groupNo * COMPRESSION_GROUP_SIZE, ULONG_MAX, true);
+	}
+	return result;
+}
+
+char KernelFile::loadGroup(unsigned long groupNo) {
+	group.data.resize(COMPRESSION_GROUP_SIZE_IN_BYTES);
+	group.groupNo = ULONG_MAX;
+	group.dirty = false;
+	BytesCnt groupStart = groupNo * COMPRESSION_GROUP_SIZE_IN_BYTES;
+	ClusterNo clusterNos[COMPRESSION_GROUP_SIZE];
+	KernelFile::lockMetadata(false);
+	group.length = (fileSize > groupStart) ? (unsigned int)std::min(fileSize - groupStart, COMPRESSION_GROUP_SIZE_IN_BYTES) : 0;
+	for (unsigned int i = 0; i < COMPRESSION_GROUP_SIZE; i++)
+		clusterNos[i] = (group.length > 0) ? KernelFile::getDataCluster(groupNo * COMPRESSION_GROUP_SIZE + i, false) : 0;
+	KernelFile::flushIndexClusters();
+	KernelFile::unlockMetadata(false);
+	if (KernelFile::decodeGroup(clusterNos, group.data.data(), true) == 0) return 0;
+	group.groupNo = groupNo;
+	return 1;
+}
+
+char KernelFile::decodeGroup(const ClusterNo* clusterNos, char* data, bool throughCache) {
+	unsigned int numOfClusters = 0;
+	while (numOfClusters < COMPRESSION_GROUP_SIZE && clusterNos[numOfClusters] != 0)
+		numOfClusters++;
+	if (numOfClusters == 0) { // a hole - it reads as zeros, without any disk access
+		std::fill(data, data + COMPRESSION_GROUP_SIZE_IN_BYTES, 0x00);
+		return 1;
+	}
+	char storedGroup[COMPRESSION_GROUP_SIZE * 2048];
+	char* buffers[COMPRESSION_GROUP_SIZE];
+	for (unsigned int i = 0; i < numOfClusters; i++)
+		buffers[i] = storedGroup + i * ClusterSize;
+	char result = throughCache ? fileDesc->cache->readClusters(clusterNos, numOfClusters, buffers)
+		: fs->readClusters(clusterNos, numOfClusters, buffers);
+	if (result == 0) return 0; // a data cluster does not match its checksum
+	if (numOfClusters == COMPRESSION_GROUP_SIZE) { // the group has not compressed
+		std::copy(storedGroup, storedGroup + COMPRESSION_GROUP_SIZE_IN_BYTES, data);
 		return 1;
 	}
+	// the compressed group is preceded by its length
+	unsigned int compressedLength = KernelFS::getEntry(storedGroup, 0);
+	if (compressedLength > numOfClusters * ClusterSize - 4) return 0;
+	unsigned int length = LZCodec::decompress(storedGroup + 4, compressedLength, data, COMPRESSION_GROUP_SIZE_IN_BYTES);
+	if (length == 0) return 0; // the group is damaged
+	std::fill(data + length, data + COMPRESSION_GROUP_SIZE_IN_BYTES, 0x00);
+	return 1;
+}
+
+char KernelFile::storeGroup() {
+	unsigned long firstClusterIndex = group.groupNo * COMPRESSION_GROUP_SIZE;
+	if (firstClusterIndex + COMPRESSION_GROUP_SIZE > 512 * 512) return 0; // beyond the maximum file size
+	char storedGroup[COMPRESSION_GROUP_SIZE * 2048];
+	unsigned int numOfClusters = 0;
+	bool zeros = true;
+	for (unsigned int byteNo = 0; byteNo < group.length && zeros; byteNo++)
+		zeros = (group.data[byteNo] == 0x00);
+	if (!zeros) {
+		// the group is stored as it is, unless it compresses into fewer clusters
+		unsigned int compressedLength = LZCodec::compress(group.data.data(), group.length, storedGroup + 4,
+			(COMPRESSION_GROUP_SIZE - 1) * ClusterSize - 4);
+		if (compressedLength > 0) {
+			KernelFS::setEntry(storedGroup, 0, compressedLength);
+			numOfClusters = (compressedLength + 4 + ClusterSize - 1) / ClusterSize;
+			std::fill(storedGroup + 4 + compressedLength, storedGroup + numOfClusters * ClusterSize, 0x00);
+		}
+		else {
+			std::copy(group.data.begin(), group.data.end(), storedGroup);
+			numOfClusters = COMPRESSION_GROUP_SIZE;
+		}
+	}
+	// the group is placed right after the data clusters of the preceding group, if possible, so that a file written sequentially stays contiguous
+	ClusterNo goal = 0;
+	KernelFile::lockMetadata(false);
+	for (unsigned long clusterIndex = firstClusterIndex; goal == 0 && clusterIndex > 0 && clusterIndex + COMPRESSION_GROUP_SIZE > firstClusterIndex; )
+		goal = KernelFile::getDataCluster(--clusterIndex, false);
+	KernelFile::flushIndexClusters();
+	KernelFile::unlockMetadata(false);
+	ClusterNo newClusterNos[COMPRESSION_GROUP_SIZE] = { 0 };
+	ClusterCache* cache = fileDesc->cache;
+	for (unsigned int i = 0; i < numOfClusters; i++) {
+		newClusterNos[i] = fs->allocateClusterAtomic((i > 0) ? (newClusterNos[i - 1] + 1) : ((goal != 0) ? (goal + 1) : 0));
+		if (newClusterNos[i] == 0 || newClusterNos[i] > (fs->numOfClusters - 1)) { // no free cluster found
+			while (i > 0)
+				fs->deallocateClusterAtomic(newClusterNos[--i]);
+			return 0;
+		}
+	}
+	for (unsigned int i = 0; i < numOfClusters; i++)
+		cache->writeCluster(newClusterNos[i], storedGroup + i * ClusterSize);
+	// the group's level 2 index entries are switched over to the new clusters all at once
+	ClusterNo oldClusterNos[COMPRESSION_GROUP_SIZE] = { 0 };
+	KernelFile::lockMetadata(true);
+	bool mapped = KernelFile::loadLvl2IndexCluster(firstClusterIndex, numOfClusters > 0);
+	if (mapped) {
+		for (unsigned int i = 0; i < COMPRESSION_GROUP_SIZE; i++) {
+			int lvl2Entry = ((firstClusterIndex + i) % 512) * KernelFS::LVL2_ENTRY_SIZE_IN_BYTES;
+			oldClusterNos[i] = KernelFS::getEntry(lvl2Buffer.data, lvl2Entry);
+			KernelFS::setEntry(lvl2Buffer.data, lvl2Entry, newClusterNos[i]);
+		}
+		lvl2Buffer.dirty = true;
+	}
+	if ((mapped || numOfClusters == 0) && group.groupNo * COMPRESSION_GROUP_SIZE_IN_BYTES + group.length > fileSize)
+		fileSize = group.groupNo * COMPRESSION_GROUP_SIZE_IN_BYTES + group.length;
+	KernelFile::flushIndexClusters();
+	KernelFile::unlockMetadata(true);
+	if (!mapped && numOfClusters > 0) { // no free cluster found for the level 2 index cluster
+		for (unsigned int i = 0; i < numOfClusters; i++) {
+			cache->invalidate(newClusterNos[i]);
+			fs->deallocateClusterAtomic(newClusterNos[i]);
+		}
+		return 0;
+	}
+	for (unsigned int i = 0; i < COMPRESSION_GROUP_SIZE; i++)
+		if (oldClusterNos[i] != 0) {
+			cache->invalidate(oldClusterNos[i]);
+			fs->deallocateClusterAtomic(oldClusterNos[i]); // drops only the file's reference, if the cluster is shared
+		}
+	group.dirty = false;
+	return 1;
+}
+
+char KernelFile::seek(BytesCnt position) {
+	// seeking past the eof is allowed - writing there leaves a hole (clusters which are never allocated) in between
+	cursor = position;
+	return 1;
 }
 
 BytesCnt KernelFile::filePos() {
@@ -188,22 +871,20 @@ BytesCnt KernelFile::filePos() {
 }
 
 char KernelFile::eof() {
-	if (cursor == fileSize)
+	KernelFile::lockMetadata(false);
+	KernelFile::unlockMetadata(false);
+	if (cursor >= fileSize)
 		return 2;
 	else
 		return 0;
 }
 
 BytesCnt KernelFile::getFileSize() {
+	KernelFile::lockMetadata(false);
+	KernelFile::unlockMetadata(false);
 	return fileSize;
 }
 
-void KernelFile::deallocateClusterAtomic(ClusterNo clusterNo) {
-	AcquireSRWLockExclusive(&(KernelFS::srwLock));
-	KernelFS::deallocateCluster(clusterNo);
-	ReleaseSRWLockExclusive(&(KernelFS::srwLock));
-}
-
 bool KernelFile::okToDeallocate(char* fileLvl2IndexCluster) {
 	bool okToDeallocate = true;
 	for (int lvl2Entry = 0; lvl2Entry < 2048; lvl2Entry += KernelFS::LVL2_ENTRY_SIZE_IN_BYTES) {
@@ -220,72 +901,254 @@ bool KernelFile::okToDeallocate(char* fileLvl2IndexCluster) {
 	return okToDeallocate;
 }
 
-char KernelFile::truncate() {
-	if (mode == 'r') return 0; // if the file is opened in read-only mode, truncation is not allowed
-	if (cursor == fileSize) return 0; // cursor is at the eof
-	char fileLvl1IndexCluster[2048];
-	KernelFS::mountedPartition->readCluster(fileLvl1IndexClusterNo, fileLvl1IndexCluster);
-	int startingLvl1EntryNo = cursor / (512 * ClusterSize); // one level 2 entry can have 512 data clusters (each with 2048B in it)
-	int startingLvl2EntryNo = (cursor % (512 * ClusterSize)) / ClusterSize;
-	int startingByteNo = (cursor % (512 * ClusterSize)) % ClusterSize;
-	long numOfBytesToTruncate = fileSize - cursor;
-	long numOfBytesLeftToTruncate = numOfBytesToTruncate;
-	for (int lvl1Entry = startingLvl1EntryNo * KernelFS::LVL1_ENTRY_SIZE_IN_BYTES; lvl1Entry < 2048; lvl1Entry += KernelFS::LVL1_ENTRY_SIZE_IN_BYTES) {
-		ClusterNo fileLvl2IndexClusterNo = 0;
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 0]);
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 1]) << 8;
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 2]) << 16;
-		fileLvl2IndexClusterNo |= ((unsigned char)fileLvl1IndexCluster[lvl1Entry + 3]) << 24;
+void KernelFile::deallocateDataClusters(unsigned long firstClusterIndex) {
+	if ((fileFlags & KernelFS::FILE_FLAG_INLINE) != 0) return; // index cluster holds the data, nothing to deallocate
+	if ((fileFlags & KernelFS::FILE_FLAG_EXTENTS) != 0) {
+		KernelFile::deallocateExtentDataClusters(firstClusterIndex);
+		return;
+	}
+	KernelFile::loadLvl1IndexCluster();
+	ClusterCache* cache = fileDesc->cache;
+	int startingLvl1Entry = (firstClusterIndex / 512) * KernelFS::LVL1_ENTRY_SIZE_IN_BYTES; // one level 2 entry can have 512 data clusters
+	for (int lvl1Entry = startingLvl1Entry; lvl1Entry < 2048; lvl1Entry += KernelFS::LVL1_ENTRY_SIZE_IN_BYTES) {
+		ClusterNo fileLvl2IndexClusterNo = KernelFS::getEntry(lvl1Buffer.data, lvl1Entry);
+		if (fileLvl2IndexClusterNo == 0) continue; // no level 2 index cluster
 		char fileLvl2IndexCluster[2048];
-		KernelFS::mountedPartition->readCluster(fileLvl2IndexClusterNo, fileLvl2IndexCluster);
-		for (int lvl2Entry = startingLvl2EntryNo * KernelFS::LVL2_ENTRY_SIZE_IN_BYTES; lvl2Entry < 2048; lvl2Entry += KernelFS::LVL2_ENTRY_SIZE_IN_BYTES) {
-			ClusterNo dataClusterNo = 0;
-			dataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 0]);
-			dataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 1]) << 8;
-			dataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 2]) << 16;
-			dataClusterNo |= ((unsigned char)fileLvl2IndexCluster[lvl2Entry + 3]) << 24;
-			if (startingByteNo == 0) { // whole data cluster needs to be deallocated
-				KernelFile::deallocateClusterAtomic(dataClusterNo);
-				KernelFS::files[fname]->cache->invalidate(dataClusterNo);
-				// update file's level 2 index cluster
-				fileLvl2IndexCluster[lvl2Entry + 0] = 0x00;
-				fileLvl2IndexCluster[lvl2Entry + 1] = 0x00;
-				fileLvl2IndexCluster[lvl2Entry + 2] = 0x00;
-				fileLvl2IndexCluster[lvl2Entry + 3] = 0x00;
-				numOfBytesLeftToTruncate -= ClusterSize;
-			}
-			else 
-				numOfBytesLeftToTruncate -= (ClusterSize - startingByteNo);
-			if (numOfBytesLeftToTruncate <= 0) { // truncation completed
-				if (okToDeallocate(fileLvl2IndexCluster) == false)
-					KernelFS::mountedPartition->writeCluster(fileLvl2IndexClusterNo, fileLvl2IndexCluster);
-				else {
-					KernelFile::deallocateClusterAtomic(fileLvl2IndexClusterNo);
-					// update file level 1 index cluster
-					fileLvl1IndexCluster[lvl1Entry + 0] = 0x00;
-					fileLvl1IndexCluster[lvl1Entry + 1] = 0x00;
-					fileLvl1IndexCluster[lvl1Entry + 2] = 0x00;
-					fileLvl1IndexCluster[lvl1Entry + 3] = 0x00;
-				}
-				KernelFS::mountedPartition->writeCluster(fileLvl1IndexClusterNo, fileLvl1IndexCluster);
-				fileSize -= numOfBytesToTruncate;
-				return 1;
-			}
-			if (startingByteNo != 0)
-				startingByteNo = 0;
+		fs->readMetadataCluster(fileLvl2IndexClusterNo, fileLvl2IndexCluster);
+		int startingLvl2Entry = (lvl1Entry == startingLvl1Entry) ? (firstClusterIndex % 512) * KernelFS::LVL2_ENTRY_SIZE_IN_BYTES : 0;
+		for (int lvl2Entry = startingLvl2Entry; lvl2Entry < 2048; lvl2Entry += KernelFS::LVL2_ENTRY_SIZE_IN_BYTES) {
+			ClusterNo dataClusterNo = KernelFS::getEntry(fileLvl2IndexCluster, lvl2Entry);
+			if (dataClusterNo == 0) continue; // no data cluster
+			fs->deallocateClusterAtomic(dataClusterNo);
+			cache->invalidate(dataClusterNo);
+			KernelFS::setEntry(fileLvl2IndexCluster, lvl2Entry, 0);
 		}
 		if (okToDeallocate(fileLvl2IndexCluster) == false)
-			KernelFS::mountedPartition->writeCluster(fileLvl2IndexClusterNo, fileLvl2IndexCluster);
+			fs->writeMetadataCluster(fileLvl2IndexClusterNo, fileLvl2IndexCluster);
 		else {
-			KernelFile::deallocateClusterAtomic(fileLvl2IndexClusterNo);
+			fs->deallocateClusterAtomic(fileLvl2IndexClusterNo);
 			// update file level 1 index cluster
-			fileLvl1IndexCluster[lvl1Entry + 0] = 0x00;
-			fileLvl1IndexCluster[lvl1Entry + 1] = 0x00;
-			fileLvl1IndexCluster[lvl1Entry + 2] = 0x00;
-			fileLvl1IndexCluster[lvl1Entry + 3] = 0x00;
+			KernelFS::setEntry(lvl1Buffer.data, lvl1Entry, 0);
+			lvl1Buffer.dirty = true;
+		}
+	}
+}
+
+void KernelFile::deallocateExtentDataClusters(unsigned long firstClusterIndex) {
+	KernelFile::loadLvl1IndexCluster();
+	ClusterCache* cache = fileDesc->cache;
+	// extents are cut from the back of the table
+	while (!extents.empty()) {
+		Extent& extent = extents.back();
+		if (extent.logicalStart + extent.length <= firstClusterIndex) break; // extent stays whole
+		unsigned long numOfKeptClusters = (firstClusterIndex > extent.logicalStart) ? (firstClusterIndex - extent.logicalStart) : 0;
+		if (extent.start != 0) // holes have no data clusters
+			for (unsigned long i = numOfKeptClusters; i < extent.length; i++) {
+				fs->deallocateClusterAtomic(extent.start + i);
+				cache->invalidate(extent.start + i);
+			}
+		if (numOfKeptClusters > 0) { // extent is shortened
+			extent.length = numOfKeptClusters;
+			break;
 		}
-		if (startingLvl2EntryNo != 0)
-			startingLvl2EntryNo = 0;
+		extents.pop_back();
+	}
+	// a hole at the end of the table maps nothing
+	while (!extents.empty() && extents.back().start == 0)
+		extents.pop_back();
+	KernelFile::encodeExtents();
+}
+
+char KernelFile::truncate() {
+	if (mode == 'r' || mode == 's') return 0; // if the file is opened in read-only mode, truncation is not allowed
+	if ((fileFlags & KernelFS::FILE_FLAG_COMPRESSED) != 0)
+		return KernelFile::truncateCompressed();
+	if (mode == 'm') // everything from the cursor on is removed - no other handle may access it in the meantime
+		fileDesc->lockRange(cursor / ClusterSize, ULONG_MAX, true);
+	KernelFile::lockMetadata(true);
+	char result = 1;
+	if (cursor >= fileSize) // cursor is at (or past) the eof
+		result = 0;
+	else if ((fileFlags & KernelFS::FILE_FLAG_INLINE) != 0) {
+		// clear the truncated bytes, so that they don't reappear if the file grows again
+		char inlineData[2048];
+		fileDesc->cache->readCluster(fileLvl1IndexClusterNo, inlineData);
+		for (BytesCnt byteNo = cursor; byteNo < ClusterSize; byteNo++)
+			inlineData[byteNo] = 0x00;
+		fileDesc->cache->writeCluster(fileLvl1IndexClusterNo, inlineData);
+		fileSize = cursor;
 	}
-	return 0;
-}
\ No newline at end of file
+	else {
+		// the data cluster the cursor points into stays if the cursor is not at its very beginning;
+		// its truncated bytes are cleared, so that they read as zeros if the file is later extended past them
+		if (cursor % ClusterSize != 0) {
+			ClusterNo dataClusterNo = KernelFile::getDataCluster(cursor / ClusterSize, false);
+			if (dataClusterNo != 0)
+				dataClusterNo = KernelFile::unshareDataCluster(cursor / ClusterSize, dataClusterNo);
+			if (dataClusterNo != 0) {
+				char dataCluster[2048];
+				fileDesc->cache->readCluster(dataClusterNo, dataCluster);
+				for (int byteNo = cursor % ClusterSize; byteNo < 2048; byteNo++)
+					dataCluster[byteNo] = 0x00;
+				fileDesc->cache->writeCluster(dataClusterNo, dataCluster);
+			}
+		}
+		KernelFile::deallocateDataClusters((cursor + ClusterSize - 1) / ClusterSize);
+		KernelFile::flushIndexClusters();
+		fileSize = cursor;
+		if (fileSize == 0) // index is left empty (all zeros) - the file can keep its data inline again
+			fileFlags |= KernelFS::FILE_FLAG_INLINE;
+	}
+	KernelFile::unlockMetadata(true);
+	if (mode == 'm')
+		fileDesc->unlockRange(cursor / ClusterSize, ULONG_MAX, true);
+	return result;
+}
+
+unsigned long KernelFile::countFragments(std::vector<unsigned long>* clusterIndexes) {
+	if ((fileFlags & KernelFS::FILE_FLAG_INLINE) != 0) return 0; // the data is kept inside of the index cluster
+	unsigned long numOfFragments = 0;
+	ClusterNo previousClusterNo = 0;
+	unsigned long numOfClusters = fileSize / ClusterSize + ((fileSize % ClusterSize > 0) ? 1 : 0);
+	for (unsigned long clusterIndex = 0; clusterIndex < numOfClusters; clusterIndex++) {
+		ClusterNo dataClusterNo = KernelFile::getDataCluster(clusterIndex, false);
+		if (dataClusterNo == 0) continue; // a hole
+		if (previousClusterNo == 0 || dataClusterNo != previousClusterNo + 1)
+			numOfFragments++;
+		previousClusterNo = dataClusterNo;
+		if (clusterIndexes != nullptr)
+			clusterIndexes->push_back(clusterIndex);
+	}
+	KernelFile::flushIndexClusters();
+	return numOfFragments;
+}
+
+long KernelFile::fragmentation() {
+	KernelFile::lockMetadata(false);
+	long numOfFragments = KernelFile::countFragments(nullptr);
+	KernelFile::unlockMetadata(false);
+	return numOfFragments;
+}
+
+long KernelFile::defragment(bool background) {
+	std::vector<unsigned long> clusterIndexes; // logical clusters which have data clusters, in their order
+	unsigned int numOfIndexClusters = 0;
+	KernelFile::lockMetadata(false);
+	unsigned long numOfFragments = KernelFile::countFragments(&clusterIndexes);
+	if (numOfFragments > 0 && (fileFlags & KernelFS::FILE_FLAG_EXTENTS) == 0) {
+		KernelFile::loadLvl1IndexCluster();
+		for (int lvl1Entry = 0; lvl1Entry < 2048; lvl1Entry += KernelFS::LVL1_ENTRY_SIZE_IN_BYTES)
+			if (KernelFS::getEntry(lvl1Buffer.data, lvl1Entry) != 0)
+				numOfIndexClusters++;
+		KernelFile::flushIndexClusters();
+	}
+	KernelFile::unlockMetadata(false);
+	if (numOfFragments == 0 || (background && numOfFragments == 1)) return 0;
+	// the run holds the level 2 index clusters first, followed by the data clusters in their logical order
+	ClusterNo runStart = fs->allocateRun(numOfIndexClusters + clusterIndexes.size());
+	if (runStart == 0) return -1; // no run of free clusters is long enough
+	std::vector<bool> usedRunClusters(numOfIndexClusters + clusterIndexes.size(), false);
+	// a snapshot (pinned from the partition as it is) must not be taken while the clusters are being moved
+	AcquireSRWLockShared(&(fileDesc->snapshotSRWLock));
+	KernelFile::lockMetadata(true);
+	std::vector<ClusterNo> oldIndexClusterNos;
+	if ((fileFlags & KernelFS::FILE_FLAG_INLINE) == 0 && (fileFlags & KernelFS::FILE_FLAG_EXTENTS) == 0) {
+		KernelFile::loadLvl1IndexCluster();
+		for (int lvl1Entry = 0; lvl1Entry < 2048 && oldIndexClusterNos.size() < numOfIndexClusters; lvl1Entry += KernelFS::LVL1_ENTRY_SIZE_IN_BYTES) {
+			ClusterNo fileLvl2IndexClusterNo = KernelFS::getEntry(lvl1Buffer.data, lvl1Entry);
+			if (fileLvl2IndexClusterNo == 0) continue; // no level 2 index cluster
+			ClusterNo newClusterNo = runStart + oldIndexClusterNos.size();
+			char fileLvl2IndexCluster[2048];
+			fs->readMetadataCluster(fileLvl2IndexClusterNo, fileLvl2IndexCluster);
+			fs->writeMetadataCluster(newClusterNo, fileLvl2IndexCluster);
+			KernelFS::setEntry(lvl1Buffer.data, lvl1Entry, newClusterNo);
+			lvl1Buffer.dirty = true;
+			usedRunClusters[oldIndexClusterNos.size()] = true;
+			oldIndexClusterNos.push_back(fileLvl2IndexClusterNo);
+		}
+		KernelFile::flushIndexClusters();
+	}
+	KernelFile::unlockMetadata(true);
+	ReleaseSRWLockShared(&(fileDesc->snapshotSRWLock));
+	// the old clusters are freed only once the file is mapped through the new ones durably, so they cannot be overwritten before
+	fs->commitMetadata();
+	for (unsigned int i = 0; i < oldIndexClusterNos.size(); i++)
+		fs->deallocateClusterAtomic(oldIndexClusterNos[i]);
+	ClusterCache* cache = fileDesc->cache;
+	std::vector<char> batchBuffer(CLUSTERS_PER_MAPPING * ClusterSize);
+	long numOfMovedClusters = 0;
+	bool corrupted = false, stopped = false;
+	for (unsigned int first = 0; first < clusterIndexes.size() && !corrupted && !stopped; first += CLUSTERS_PER_MAPPING) {
+		unsigned int last = (first + CLUSTERS_PER_MAPPING < clusterIndexes.size()) ? (first + CLUSTERS_PER_MAPPING - 1) : (clusterIndexes.size() - 1);
+		// the batch's logical clusters are neither read nor written to by the other handles while they are being moved
+		AcquireSRWLockShared(&(fileDesc->snapshotSRWLock));
+		fileDesc->lockRange(clusterIndexes[first], clusterIndexes[last], true);
+		unsigned long batchClusterIndexes[CLUSTERS_PER_MAPPING];
+		ClusterNo oldClusterNos[CLUSTERS_PER_MAPPING], newClusterNos[CLUSTERS_PER_MAPPING];
+		char* buffers[CLUSTERS_PER_MAPPING];
+		unsigned int numOfBatchClusters = 0;
+		KernelFile::lockMetadata(false);
+		for (unsigned int i = first; i <= last && (fileFlags & KernelFS::FILE_FLAG_INLINE) == 0; i++) { // the file may have been emptied
+			ClusterNo dataClusterNo = KernelFile::getDataCluster(clusterIndexes[i], false);
+			if (dataClusterNo == 0) continue; // truncated in the meantime
+			StatsRecorder::acquireShared(LOCK_ALLOCATOR, &(fs->allocatorSRWLock));
+			bool shared = fs->isSharedCluster(dataClusterNo);
+			ReleaseSRWLockShared(&(fs->allocatorSRWLock));
+			if (shared) continue; // the other files keep referencing it where it is
+			batchClusterIndexes[numOfBatchClusters] = clusterIndexes[i];
+			oldClusterNos[numOfBatchClusters] = dataClusterNo;
+			newClusterNos[numOfBatchClusters] = runStart + numOfIndexClusters + i;
+			buffers[numOfBatchClusters] = batchBuffer.data() + numOfBatchClusters * ClusterSize;
+			numOfBatchClusters++;
+		}
+		KernelFile::flushIndexClusters();
+		KernelFile::unlockMetadata(false);
+		// the clusters are read through the cache (which may hold them dirty) and written to their new place as a single batch
+		if (numOfBatchClusters > 0 && cache->readClusters(oldClusterNos, numOfBatchClusters, buffers) == 0)
+			corrupted = true;
+		else if (numOfBatchClusters > 0) {
+			fs->writeClusters(newClusterNos, numOfBatchClusters, buffers);
+			bool moved[CLUSTERS_PER_MAPPING];
+			KernelFile::lockMetadata(true);
+			for (unsigned int i = 0; i < numOfBatchClusters; i++) {
+				moved[i] = true;
+				if ((fileFlags & KernelFS::FILE_FLAG_EXTENTS) != 0) {
+					KernelFile::loadLvl1IndexCluster();
+					std::vector<Extent> previousExtents = extents;
+					if (KernelFile::mapExtentCluster(KernelFile::findExtent(batchClusterIndexes[i]), batchClusterIndexes[i], newClusterNos[i]) == false) {
+						extents = previousExtents; // extent table is full - the cluster stays where it is
+						moved[i] = false;
+						continue;
+					}
+				}
+				else {
+					KernelFile::getDataCluster(batchClusterIndexes[i], false); // buffers the level 2 index cluster which maps the logical cluster
+					KernelFS::setEntry(lvl2Buffer.data, (batchClusterIndexes[i] % 512) * KernelFS::LVL2_ENTRY_SIZE_IN_BYTES, newClusterNos[i]);
+					lvl2Buffer.dirty = true;
+				}
+				// neither of the clusters may stay cached: the old one is about to be deallocated, the new one has been written past the cache
+				cache->invalidate(oldClusterNos[i]);
+				cache->invalidate(newClusterNos[i]);
+				usedRunClusters[newClusterNos[i] - runStart] = true;
+			}
+			KernelFile::flushIndexClusters();
+			KernelFile::unlockMetadata(true);
+			fs->commitMetadata();
+			for (unsigned int i = 0; i < numOfBatchClusters; i++)
+				if (moved[i]) {
+					fs->deallocateClusterAtomic(oldClusterNos[i]);
+					numOfMovedClusters++;
+				}
+		}
+		fileDesc->unlockRange(clusterIndexes[first], clusterIndexes[last], true);
+		ReleaseSRWLockShared(&(fileDesc->snapshotSRWLock));
+		if (background && !fs->throttleDefragmenter(numOfBatchClusters))
+			stopped = true;
+	}
+	// the run's clusters which have not been moved into (shared, truncated, ...) are given back
+	for (unsigned int i = 0; i < usedRunClusters.size(); i++)
+		if (!usedRunClusters[i])
+			fs->deallocateClusterAtomic(runStart + i);
+	fs->commitMetadata();
+	return corrupted ? -1 : numOfMovedClusters;
+}
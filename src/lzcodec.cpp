@@ -0,0 +1,121 @@
+#include "lzcodec.h"
+#include <cstring>
+
+const unsigned int LZCodec::LZ_MIN_MATCH = 4;
+const unsigned int LZCodec::LZ_LAST_LITERALS = 5;
+const unsigned int LZCodec::LZ_MATCH_GUARD = 12;
+const unsigned int LZCodec::LZ_MAX_OFFSET = 65535;
+const unsigned int LZCodec::LZ_HASH_BITS = 12;
+
+unsigned int LZCodec::hash(const unsigned char* position) {
+	unsigned long prefix;
+	std::memcpy(&prefix, position, 4);
+	prefix &= 0xFFFFFFFFUL;
+	return (unsigned int)((prefix * 2654435761UL) & 0xFFFFFFFFUL) >> (32 - LZ_HASH_BITS);
+}
+
+bool LZCodec::writeLength(unsigned int length, unsigned char*& output, const unsigned char* outputEnd) {
+	// the first 15 are kept in the token itself
+	for (length -= 15; length >= 255; length -= 255) {
+		if (output == outputEnd) return false;
+		*output++ = 255;
+	}
+	if (output == outputEnd) return false;
+	*output++ = (unsigned char)length;
+	return true;
+}
+
+unsigned int LZCodec::compress(const char* data, unsigned int length, char* output, unsigned int capacity) {
+	const unsigned char* input = (const unsigned char*)data;
+	const unsigned char* inputEnd = input + length;
+	unsigned char* out = (unsigned char*)output;
+	const unsigned char* outEnd = out + capacity;
+	unsigned int table[1 << LZ_HASH_BITS]; // positions (+ 1) of the last 4-byte prefixes with the given hash (0 - none)
+	std::memset(table, 0, sizeof(table));
+	const unsigned char* literals = input; // first byte which has not been encoded yet
+	const unsigned char* position = input;
+	const unsigned char* matchLimit = (length > LZ_MATCH_GUARD) ? (inputEnd - LZ_MATCH_GUARD) : input;
+	while (position < matchLimit) {
+		unsigned int h = LZCodec::hash(position);
+		const unsigned char* candidate = (table[h] == 0) ? nullptr : (input + table[h] - 1);
+		table[h] = (unsigned int)(position - input) + 1;
+		if (candidate == nullptr || (unsigned int)(position - candidate) > LZ_MAX_OFFSET || std::memcmp(candidate, position, LZ_MIN_MATCH) != 0) {
+			position++;
+			continue;
+		}
+		// the match is extended as far as it goes, stopping short of the last literals
+		unsigned int matchLength = LZ_MIN_MATCH;
+		while (position + matchLength < inputEnd - LZ_LAST_LITERALS && candidate[matchLength] == position[matchLength])
+			matchLength++;
+		unsigned int numOfLiterals = (unsigned int)(position - literals);
+		if (out == outEnd) return 0;
+		unsigned char* token = out++;
+		*token = (unsigned char)(((numOfLiterals >= 15) ? 15 : numOfLiterals) << 4);
+		if (numOfLiterals >= 15 && !LZCodec::writeLength(numOfLiterals, out, outEnd)) return 0;
+		if ((unsigned int)(outEnd - out) < numOfLiterals + 2) return 0;
+		std::memcpy(out, literals, numOfLiterals);
+		out += numOfLiterals;
+		unsigned int offset = (unsigned int)(position - candidate);
+		*out++ = (unsigned char)(offset & 0xFF);
+		*out++ = (unsigned char)(offset >> 8);
+		*token |= (unsigned char)((matchLength - LZ_MIN_MATCH >= 15) ? 15 : (matchLength - LZ_MIN_MATCH));
+		if (matchLength - LZ_MIN_MATCH >= 15 && !LZCodec::writeLength(matchLength - LZ_MIN_MATCH, out, outEnd)) return 0;
+		position += matchLength;
+		literals = position;
+	}
+	// the last sequence holds just the remaining literals
+	unsigned int numOfLiterals = (unsigned int)(inputEnd - literals);
+	if (out == outEnd) return 0;
+	unsigned char* token = out++;
+	*token = (unsigned char)(((numOfLiterals >= 15) ? 15 : numOfLiterals) << 4);
+	if (numOfLiterals >= 15 && !LZCodec::writeLength(numOfLiterals, out, outEnd)) return 0;
+	if ((unsigned int)(outEnd - out) < numOfLiterals) return 0;
+	std::memcpy(out, literals, numOfLiterals);
+	out += numOfLiterals;
+	return (unsigned int)(out - (unsigned char*)output);
+}
+
+unsigned int LZCodec::decompress(const char* data, unsigned int length, char* output, unsigned int capacity) {
+	const unsigned char* input = (const unsigned char*)data;
+	const unsigned char* inputEnd = input + length;
+	unsigned char* out = (unsigned char*)output;
+	unsigned char* outEnd = out + capacity;
+	while (input < inputEnd) {
+		unsigned char token = *input++;
+		unsigned int numOfLiterals = token >> 4;
+		if (numOfLiterals == 15) {
+			unsigned char more;
+			do {
+				if (input == inputEnd) return 0;
+				more = *input++;
+				numOfLiterals += more;
+			} while (more == 255);
+		}
+		if ((unsigned int)(inputEnd - input) < numOfLiterals || (unsigned int)(outEnd - out) < numOfLiterals) return 0;
+		std::memcpy(out, input, numOfLiterals);
+		input += numOfLiterals;
+		out += numOfLiterals;
+		if (input == inputEnd) break; // the last sequence has no match
+		if (inputEnd - input < 2) return 0;
+		unsigned int offset = input[0] | (input[1] << 8);
+		input += 2;
+		if (offset == 0 || offset > (unsigned int)(out - (unsigned char*)output)) return 0;
+		unsigned int matchLength = (token & 0x0F);
+		if (matchLength == 15) {
+			unsigned char more;
+			do {
+				if (input == inputEnd) return 0;
+				more = *input++;
+				matchLength += more;
+			} while (more == 255);
+		}
+		matchLength += LZ_MIN_MATCH;
+		if ((unsigned int)(outEnd - out) < matchLength) return 0;
+		// the match may overlap the bytes it produces (a repeated pattern) - it is copied offset bytes at a time, which never overlap
+		const unsigned char* match = out - offset;
+		for (unsigned int copied = 0; copied < matchLength; copied += offset)
+			std::memcpy(out + copied, match + copied, (matchLength - copied < offset) ? (matchLength - copied) : offset);
+		out += matchLength;
+	}
+	return (unsigned int)(out - (unsigned char*)output);
+}
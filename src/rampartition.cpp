@@ -0,0 +1,24 @@
+#include "rampartition.h"
+#include <algorithm>
+
+RamPartition::RamPartition(char* ini, ClusterNo numOfClusters) : Partition(ini) {
+	this->numOfClusters = numOfClusters;
+	clusters.assign((size_t)numOfClusters * ClusterSize, 0x00);
+}
+
+ClusterNo RamPartition::getNumOfClusters() const {
+	return numOfClusters;
+}
+
+int RamPartition::readCluster(ClusterNo clusterNo, char* buffer) {
+	if (clusterNo >= numOfClusters) return 0;
+	const char* cluster = clusters.data() + (size_t)clusterNo * ClusterSize;
+	std::copy(cluster, cluster + ClusterSize, buffer);
+	return 1;
+}
+
+int RamPartition::writeCluster(ClusterNo clusterNo, const char* buffer) {
+	if (clusterNo >= numOfClusters) return 0;
+	std::copy(buffer, buffer + ClusterSize, clusters.data() + (size_t)clusterNo * ClusterSize);
+	return 1;
+}
@@ -0,0 +1,97 @@
+#include "readpool.h"
+#include "clustercache.h"
+#include <algorithm>
+
+ReadPool::Batch::Batch() {
+	pending = 0;
+	failed = false;
+	srwLock = SRWLOCK_INIT;
+	InitializeConditionVariable(&done);
+}
+
+char ReadPool::Batch::wait() {
+	AcquireSRWLockExclusive(&srwLock);
+	while (pending > 0)
+		SleepConditionVariableSRW(&done, &srwLock, INFINITE, 0);
+	char result = failed ? 0 : 1;
+	ReleaseSRWLockExclusive(&srwLock);
+	return result;
+}
+
+ReadPool::ReadPool() {
+	queueSRWLock = SRWLOCK_INIT;
+	ok_to_read = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	numOfThreads = 0;
+}
+
+void ReadPool::submit(Task* task, Batch& batch) {
+	AcquireSRWLockExclusive(&batch.srwLock);
+	batch.pending++;
+	ReleaseSRWLockExclusive(&batch.srwLock);
+	Request request = { task, &batch };
+	AcquireSRWLockExclusive(&queueSRWLock);
+	if (numOfThreads == 0) { // one thread per processor
+		SYSTEM_INFO systemInfo;
+		GetSystemInfo(&systemInfo);
+		numOfThreads = systemInfo.dwNumberOfProcessors;
+		if (numOfThreads > READ_POOL_MAX_THREADS)
+			numOfThreads = READ_POOL_MAX_THREADS;
+		if (numOfThreads < 2) // the caller keeps mapping the clusters while a thread reads them
+			numOfThreads = 2;
+		for (unsigned int i = 0; i < numOfThreads; i++)
+			CreateThread(NULL, 0, ReadPool::serve, this, 0, NULL);
+	}
+	queue.push_back(request);
+	ReleaseSRWLockExclusive(&queueSRWLock);
+	ReleaseSemaphore(
+		ok_to_read, // handle to semaphore
+		1, // increase count by 1
+		NULL // not interested in previous count
+	);
+}
+
+char ReadPool::execute(Task& task, char* clusterBuffer) {
+	std::vector<ClusterNo> readClusterNos;
+	std::vector<char*> readBuffers;
+	for (unsigned int i = 0; i < task.dataClusterNos.size(); i++) {
+		char* dataCluster = clusterBuffer + i * ClusterSize;
+		if (task.dataClusterNos[i] == 0) { // a hole - it reads as zeros, without any disk access
+			for (int byteNo = 0; byteNo < 2048; byteNo++)
+				dataCluster[byteNo] = 0x00;
+			continue;
+		}
+		readClusterNos.push_back(task.dataClusterNos[i]);
+		readBuffers.push_back(dataCluster);
+	}
+	if (task.cache->readClusters(readClusterNos.data(), readClusterNos.size(), readBuffers.data()) == 0)
+		return 0;
+	std::copy(clusterBuffer + task.startingByteNo, clusterBuffer + task.startingByteNo + task.numOfBytes, task.buffer);
+	return 1;
+}
+
+DWORD WINAPI ReadPool::serve(LPVOID param) {
+	ReadPool* pool = (ReadPool*)param;
+	std::vector<char> clusterBuffer;
+	while (true) {
+		WaitForSingleObject(
+			pool->ok_to_read, // handle to semaphore
+			INFINITE // infinite time-out interval
+		);
+		AcquireSRWLockExclusive(&pool->queueSRWLock);
+		Request request = pool->queue.front();
+		pool->queue.pop_front();
+		ReleaseSRWLockExclusive(&pool->queueSRWLock);
+		if (clusterBuffer.size() < request.task->dataClusterNos.size() * ClusterSize)
+			clusterBuffer.resize(request.task->dataClusterNos.size() * ClusterSize);
+		char result = ReadPool::execute(*request.task, clusterBuffer.data());
+		delete request.task;
+		Batch* batch = request.batch;
+		AcquireSRWLockExclusive(&batch->srwLock);
+		if (result == 0)
+			batch->failed = true;
+		if (--batch->pending == 0)
+			WakeAllConditionVariable(&batch->done);
+		ReleaseSRWLockExclusive(&batch->srwLock);
+	}
+	return 0;
+}
@@ -0,0 +1,196 @@
+#include "statsrecorder.h"
+#include <algorithm>
+
+std::vector<StatsRecorder::Counters*>* StatsRecorder::allCounters = new std::vector<StatsRecorder::Counters*>();
+StatsRecorder::Counters StatsRecorder::retiredCounters = StatsRecorder::Counters();
+SRWLOCK StatsRecorder::countersSRWLock = SRWLOCK_INIT;
+thread_local StatsRecorder::CountersOwner StatsRecorder::ownCounters;
+LONG StatsRecorder::enabled = 1;
+
+#ifndef FS_NO_STATS
+LONGLONG StatsRecorder::start() {
+	if (InterlockedCompareExchange(&enabled, 0, 0) == 0) return 0;
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+void StatsRecorder::stop(unsigned int op, LONGLONG start, BytesCnt bytes) {
+	if (start == 0) return; // started while the statistics were disabled
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	LONGLONG ticks = now.QuadPart - start;
+	Counters* counters = StatsRecorder::threadCounters();
+	InterlockedExchangeAdd64(&counters->count[op], 1);
+	InterlockedExchangeAdd64(&counters->bytes[op], bytes);
+	InterlockedExchangeAdd64(&counters->totalTicks[op], ticks);
+	if (ticks > InterlockedCompareExchange64(&counters->maxTicks[op], 0, 0)) // no other thread changes it
+		InterlockedExchange64(&counters->maxTicks[op], ticks);
+	InterlockedExchangeAdd64(&counters->histogram[op][StatsRecorder::bucketOf(ticks)], 1);
+}
+
+void StatsRecorder::countClusters(unsigned int counter, unsigned long numOfClusters) {
+	if (InterlockedCompareExchange(&enabled, 0, 0) == 0) return;
+	InterlockedExchangeAdd64(&StatsRecorder::threadCounters()->clusters[counter], numOfClusters);
+}
+
+void StatsRecorder::acquireExclusive(unsigned int lock, SRWLOCK* srwLock) {
+	if (TryAcquireSRWLockExclusive(srwLock) != 0) {
+		StatsRecorder::countAcquisition(lock, 0);
+		return;
+	}
+	LONGLONG waitStart = StatsRecorder::start();
+	AcquireSRWLockExclusive(srwLock);
+	StatsRecorder::countAcquisition(lock, waitStart);
+}
+
+void StatsRecorder::acquireShared(unsigned int lock, SRWLOCK* srwLock) {
+	if (TryAcquireSRWLockShared(srwLock) != 0) {
+		StatsRecorder::countAcquisition(lock, 0);
+		return;
+	}
+	LONGLONG waitStart = StatsRecorder::start();
+	AcquireSRWLockShared(srwLock);
+	StatsRecorder::countAcquisition(lock, waitStart);
+}
+
+void StatsRecorder::countAcquisition(unsigned int lock, LONGLONG waitStart) {
+	if (InterlockedCompareExchange(&enabled, 0, 0) == 0) return;
+	Counters* counters = StatsRecorder::threadCounters();
+	InterlockedExchangeAdd64(&counters->acquisitions[lock], 1);
+	if (waitStart == 0) return;
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	LONGLONG ticks = now.QuadPart - waitStart;
+	InterlockedExchangeAdd64(&counters->waits[lock], 1);
+	InterlockedExchangeAdd64(&counters->waitTicks[lock], ticks);
+	if (ticks > InterlockedCompareExchange64(&counters->maxWaitTicks[lock], 0, 0)) // no other thread changes it
+		InterlockedExchange64(&counters->maxWaitTicks[lock], ticks);
+}
+#endif
+
+StatsRecorder::Counters* StatsRecorder::threadCounters() {
+	if (ownCounters.counters == nullptr) {
+		ownCounters.counters = new Counters(); // all zeros
+		AcquireSRWLockExclusive(&countersSRWLock);
+		allCounters->push_back(ownCounters.counters);
+		ReleaseSRWLockExclusive(&countersSRWLock);
+	}
+	return ownCounters.counters;
+}
+
+StatsRecorder::CountersOwner::~CountersOwner() {
+	if (counters == nullptr) return;
+	AcquireSRWLockExclusive(&countersSRWLock);
+	StatsRecorder::addCounters(&retiredCounters, counters);
+	allCounters->erase(std::find(allCounters->begin(), allCounters->end(), counters));
+	ReleaseSRWLockExclusive(&countersSRWLock);
+	delete counters;
+	counters = nullptr;
+}
+
+void StatsRecorder::addCounters(Counters* total, Counters* counters) {
+	for (unsigned int op = 0; op < NUM_OF_OPS; op++) {
+		total->count[op] += InterlockedCompareExchange64(&counters->count[op], 0, 0);
+		total->bytes[op] += InterlockedCompareExchange64(&counters->bytes[op], 0, 0);
+		total->totalTicks[op] += InterlockedCompareExchange64(&counters->totalTicks[op], 0, 0);
+		total->maxTicks[op] = std::max(total->maxTicks[op], InterlockedCompareExchange64(&counters->maxTicks[op], 0, 0));
+		for (unsigned int bucket = 0; bucket < STATS_NUM_OF_BUCKETS; bucket++)
+			total->histogram[op][bucket] += InterlockedCompareExchange64(&counters->histogram[op][bucket], 0, 0);
+	}
+	for (unsigned int counter = 0; counter < NUM_OF_CLUSTER_COUNTERS; counter++)
+		total->clusters[counter] += InterlockedCompareExchange64(&counters->clusters[counter], 0, 0);
+	for (unsigned int lock = 0; lock < NUM_OF_LOCKS; lock++) {
+		total->acquisitions[lock] += InterlockedCompareExchange64(&counters->acquisitions[lock], 0, 0);
+		total->waits[lock] += InterlockedCompareExchange64(&counters->waits[lock], 0, 0);
+		total->waitTicks[lock] += InterlockedCompareExchange64(&counters->waitTicks[lock], 0, 0);
+		total->maxWaitTicks[lock] = std::max(total->maxWaitTicks[lock], InterlockedCompareExchange64(&counters->maxWaitTicks[lock], 0, 0));
+	}
+}
+
+unsigned int StatsRecorder::bucketOf(LONGLONG ticks) {
+	if (ticks < (1 << STATS_SUB_BUCKET_BITS))
+		return (ticks < 0) ? 0 : (unsigned int)ticks;
+	unsigned int highestBit = STATS_SUB_BUCKET_BITS;
+	while (highestBit < STATS_MAX_BITS && (ticks >> (highestBit + 1)) != 0)
+		highestBit++;
+	if (highestBit >= STATS_MAX_BITS)
+		return STATS_NUM_OF_BUCKETS - 1;
+	// the latency's highest STATS_SUB_BUCKET_BITS bits pick the bucket among the ones of its power of 2
+	unsigned int shift = highestBit - (STATS_SUB_BUCKET_BITS - 1);
+	return (1 << STATS_SUB_BUCKET_BITS) + (shift - 1) * (1 << (STATS_SUB_BUCKET_BITS - 1))
+		+ (unsigned int)(ticks >> shift) - (1 << (STATS_SUB_BUCKET_BITS - 1));
+}
+
+LONGLONG StatsRecorder::highestTicksOf(unsigned int bucket) {
+	if (bucket < (1u << STATS_SUB_BUCKET_BITS))
+		return bucket;
+	unsigned int shift = (bucket - (1 << STATS_SUB_BUCKET_BITS)) / (1 << (STATS_SUB_BUCKET_BITS - 1)) + 1;
+	LONGLONG top = (bucket - (1 << STATS_SUB_BUCKET_BITS)) % (1 << (STATS_SUB_BUCKET_BITS - 1)) + (1 << (STATS_SUB_BUCKET_BITS - 1));
+	return ((top + 1) << shift) - 1;
+}
+
+double StatsRecorder::percentile(const LONG64* histogram, double fraction, double ticksPerMicrosecond) {
+	// the buckets are counted up once more, since a snapshot may catch a thread between updating the count and the histogram
+	LONG64 count = 0;
+	for (unsigned int bucket = 0; bucket < STATS_NUM_OF_BUCKETS; bucket++)
+		count += histogram[bucket];
+	LONG64 rank = (LONG64)(fraction * count); // number of the latencies below the one looked for
+	if (rank >= count)
+		rank = count - 1;
+	LONG64 counted = 0;
+	for (unsigned int bucket = 0; bucket < STATS_NUM_OF_BUCKETS; bucket++) {
+		counted += histogram[bucket];
+		if (counted > rank)
+			return StatsRecorder::highestTicksOf(bucket) / ticksPerMicrosecond;
+	}
+	return 0;
+}
+
+FSStats StatsRecorder::snapshot() {
+	FSStats stats = FSStats();
+#ifndef FS_NO_STATS
+	stats.enabled = InterlockedCompareExchange(&enabled, 0, 0) != 0;
+#endif
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	double ticksPerMicrosecond = frequency.QuadPart / 1000000.0;
+	Counters* total = new Counters(); // too big for the stack
+	AcquireSRWLockShared(&countersSRWLock);
+	*total = retiredCounters;
+	for (unsigned int i = 0; i < allCounters->size(); i++)
+		StatsRecorder::addCounters(total, (*allCounters)[i]);
+	ReleaseSRWLockShared(&countersSRWLock);
+	for (unsigned int op = 0; op < NUM_OF_OPS; op++) {
+		OperationStats& opStats = stats.ops[op];
+		opStats.count = total->count[op];
+		opStats.bytes = total->bytes[op];
+		if (opStats.count == 0) continue;
+		opStats.mean = total->totalTicks[op] / ticksPerMicrosecond / opStats.count;
+		opStats.max = total->maxTicks[op] / ticksPerMicrosecond;
+		const LONG64* opHistogram = total->histogram[op];
+		// a bucket's highest latency may be past the highest one recorded
+		opStats.p50 = std::min(StatsRecorder::percentile(opHistogram, 0.50, ticksPerMicrosecond), opStats.max);
+		opStats.p90 = std::min(StatsRecorder::percentile(opHistogram, 0.90, ticksPerMicrosecond), opStats.max);
+		opStats.p99 = std::min(StatsRecorder::percentile(opHistogram, 0.99, ticksPerMicrosecond), opStats.max);
+		opStats.p999 = std::min(StatsRecorder::percentile(opHistogram, 0.999, ticksPerMicrosecond), opStats.max);
+	}
+	stats.dataClustersRead = total->clusters[DATA_CLUSTERS_READ];
+	stats.dataClustersWritten = total->clusters[DATA_CLUSTERS_WRITTEN];
+	stats.metadataClustersRead = total->clusters[METADATA_CLUSTERS_READ];
+	stats.metadataClustersWritten = total->clusters[METADATA_CLUSTERS_WRITTEN];
+	stats.cacheHits = total->clusters[CACHE_HITS];
+	stats.cacheMisses = total->clusters[CACHE_MISSES];
+	for (unsigned int lock = 0; lock < NUM_OF_LOCKS; lock++) {
+		stats.locks[lock].acquisitions = total->acquisitions[lock];
+		stats.locks[lock].waits = total->waits[lock];
+		stats.locks[lock].waitTotal = total->waitTicks[lock] / ticksPerMicrosecond;
+		stats.locks[lock].waitMax = total->maxWaitTicks[lock] / ticksPerMicrosecond;
+	}
+	delete total;
+	return stats;
+}
+
+void StatsRecorder::enable(bool enable) {
+	InterlockedExchange(&enabled, enable ? 1 : 0);
+}
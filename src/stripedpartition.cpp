@@ -0,0 +1,139 @@
+#include "stripedpartition.h"
+
+StripedPartition::StripedPartition(char* ini, Partition** members, unsigned int numOfMembers, ClusterNo stripeWidth) : Partition(ini) {
+	this->numOfMembers = numOfMembers;
+	this->stripeWidth = (stripeWidth == 0) ? 1 : stripeWidth;
+	this->members = new Member[numOfMembers];
+	ClusterNo memberClusters = 0;
+	for (unsigned int memberNo = 0; memberNo < numOfMembers; memberNo++) {
+		ClusterNo clusters = members[memberNo]->getNumOfClusters();
+		if (memberNo == 0 || clusters < memberClusters)
+			memberClusters = clusters;
+	}
+	numOfClusters = (memberClusters / this->stripeWidth) * this->stripeWidth * numOfMembers;
+	for (unsigned int memberNo = 0; memberNo < numOfMembers; memberNo++) {
+		Member& member = this->members[memberNo];
+		member.partition = members[memberNo];
+		member.stopping = false;
+		InitializeSRWLock(&member.queueSRWLock);
+		member.ok_to_serve = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+		member.worker = CreateThread(NULL, 0, StripedPartition::serve, &member, 0, NULL);
+	}
+}
+
+StripedPartition::~StripedPartition() {
+	for (unsigned int memberNo = 0; memberNo < numOfMembers; memberNo++) {
+		AcquireSRWLockExclusive(&members[memberNo].queueSRWLock);
+		members[memberNo].stopping = true;
+		ReleaseSRWLockExclusive(&members[memberNo].queueSRWLock);
+		ReleaseSemaphore(
+			members[memberNo].ok_to_serve, // handle to semaphore
+			1, // increase count by 1
+			NULL // not interested in previous count
+		);
+	}
+	for (unsigned int memberNo = 0; memberNo < numOfMembers; memberNo++) {
+		WaitForSingleObject(members[memberNo].worker, INFINITE);
+		CloseHandle(members[memberNo].worker);
+		CloseHandle(members[memberNo].ok_to_serve);
+	}
+	delete[] members;
+}
+
+ClusterNo StripedPartition::getNumOfClusters() const {
+	return numOfClusters;
+}
+
+void StripedPartition::locate(ClusterNo clusterNo, unsigned int& memberNo, ClusterNo& memberClusterNo) const {
+	ClusterNo stripeNo = clusterNo / stripeWidth;
+	memberNo = stripeNo % numOfMembers;
+	memberClusterNo = (stripeNo / numOfMembers) * stripeWidth + clusterNo % stripeWidth;
+}
+
+int StripedPartition::readCluster(ClusterNo clusterNo, char* buffer) {
+	if (clusterNo >= numOfClusters) return 0;
+	unsigned int memberNo;
+	ClusterNo memberClusterNo;
+	StripedPartition::locate(clusterNo, memberNo, memberClusterNo);
+	return members[memberNo].partition->readCluster(memberClusterNo, buffer);
+}
+
+int StripedPartition::writeCluster(ClusterNo clusterNo, const char* buffer) {
+	if (clusterNo >= numOfClusters) return 0;
+	unsigned int memberNo;
+	ClusterNo memberClusterNo;
+	StripedPartition::locate(clusterNo, memberNo, memberClusterNo);
+	return members[memberNo].partition->writeCluster(memberClusterNo, buffer);
+}
+
+int StripedPartition::readClusters(const ClusterNo* clusterNos, unsigned int count, char** buffers) {
+	return StripedPartition::transfer(clusterNos, count, buffers, false);
+}
+
+int StripedPartition::writeClusters(const ClusterNo* clusterNos, unsigned int count, char** buffers) {
+	return StripedPartition::transfer(clusterNos, count, buffers, true);
+}
+
+int StripedPartition::transfer(const ClusterNo* clusterNos, unsigned int count, char** buffers, bool write) {
+	for (unsigned int i = 0; i < count; i++)
+		if (clusterNos[i] >= numOfClusters) return 0;
+	if (count == 1) // nothing to do in parallel
+		return write ? StripedPartition::writeCluster(clusterNos[0], buffers[0]) : StripedPartition::readCluster(clusterNos[0], buffers[0]);
+	Batch batch;
+	batch.pending = count;
+	batch.result = 1;
+	InitializeSRWLock(&batch.srwLock);
+	InitializeConditionVariable(&batch.done);
+	for (unsigned int i = 0; i < count; i++) {
+		Request request;
+		unsigned int memberNo;
+		StripedPartition::locate(clusterNos[i], memberNo, request.clusterNo);
+		request.buffer = buffers[i];
+		request.write = write;
+		request.batch = &batch;
+		AcquireSRWLockExclusive(&members[memberNo].queueSRWLock);
+		members[memberNo].queue.push_back(request);
+		ReleaseSRWLockExclusive(&members[memberNo].queueSRWLock);
+		ReleaseSemaphore(
+			members[memberNo].ok_to_serve, // handle to semaphore
+			1, // increase count by 1
+			NULL // not interested in previous count
+		);
+	}
+	AcquireSRWLockExclusive(&batch.srwLock);
+	while (batch.pending > 0)
+		SleepConditionVariableSRW(&batch.done, &batch.srwLock, INFINITE, 0);
+	int result = batch.result;
+	ReleaseSRWLockExclusive(&batch.srwLock);
+	return result;
+}
+
+DWORD WINAPI StripedPartition::serve(LPVOID param) {
+	Member* member = (Member*)param;
+	while (true) {
+		WaitForSingleObject(
+			member->ok_to_serve, // handle to semaphore
+			INFINITE // infinite time-out interval
+		);
+		AcquireSRWLockExclusive(&member->queueSRWLock);
+		if (member->queue.empty()) { // released without a request - the striped partition is being destroyed
+			bool stopping = member->stopping;
+			ReleaseSRWLockExclusive(&member->queueSRWLock);
+			if (stopping) break;
+			continue;
+		}
+		Request request = member->queue.front();
+		member->queue.pop_front();
+		ReleaseSRWLockExclusive(&member->queueSRWLock);
+		int result = request.write ? member->partition->writeCluster(request.clusterNo, request.buffer)
+			: member->partition->readCluster(request.clusterNo, request.buffer);
+		Batch* batch = request.batch;
+		AcquireSRWLockExclusive(&batch->srwLock);
+		if (result == 0)
+			batch->result = 0;
+		if (--batch->pending == 0)
+			WakeAllConditionVariable(&batch->done);
+		ReleaseSRWLockExclusive(&batch->srwLock);
+	}
+	return 0;
+}